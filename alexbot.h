@@ -1,7 +1,17 @@
+#include "memory_monitor.h"
 #include "encoder_driver.h"
 #include "teleop_controller.h"
+#include "setpoint_generator.h"
 #include "motor_velocity_controller.h"
+#include "motor_position_controller.h"
 #include "zombie_mode.h"
+#include "param_registry.h"
+#include "safety_supervisor.h"
+#include "battery_monitor.h"
+#include "udp_teleop.h"
+#include "command_mux.h"
+#include "serial_dispatch.h"
+#include "profiler.h"
 
 /***************************** STATE DEFINITIONS **************************************/
 // These are the names of the states that the car can be in:
@@ -15,8 +25,7 @@
 // Main computer can be either ON or OFF
 #define HALT_STATE              1
 
-// BLUETOOTH_COMMAND_STATE: For use with Bluetooth Joystick android app
-// (https://play.google.com/store/apps/details?id=org.projectproto.btjoystick)
+// BLUETOOTH_TELEOP_STATE: Driven by a joystick over Wi-Fi (see udp_teleop.h), the radio is only on in this state
 // Main computer can be either ON or OFF
 // Assisted teleop can be either ON or OFF
 #define BLUETOOTH_TELEOP_STATE  2
@@ -33,134 +42,418 @@
 // Can also adjust config parameters ON the Microcontroller
 #define SERIAL_COMMAND_STATE    4
 
-/**************************** ARDUINO PIN DEFINITIONS ********************************/
-#define FAILSAFE_PIN       10   // To emergency stop switch
-#define FAILSAFE_LED_PIN   13   // OUTPUT TO LED ON THE ARDUINO BOARD
-
-// Motor driver Pins (UART Serial)
-#define MOTOR_CONTROLLER_TX 2   // S1 on the sabertooth 2x25A goes to pin 2
+// Each state has its own power profile (CPU frequency, loop rates, sleep)
+#include "power_manager.h"
 
-#define LEFT_ENCODER_CS_PIN  3
-#define RIGHT_ENCODER_CS_PIN 4
+/**************************** ARDUINO PIN DEFINITIONS ********************************/
+// Pins and motor IDs, shared with the host tools
+#include "alexbot_hardware.h"
 
 
 /************************************** CONFIG *************************************/
 
-// Maximum allowable power to the motors
-#define DRIVE_MOTORS_MAX_POWER 60
-
 // FIXME: Wheel and encoder parameters
 #define ENCODER_COUNTS_PER_REV 22000
 #define WHEEL_RADIUS 7
 
+// Wheel velocity PID gains
+#define MOTOR_VELOCITY_KP 0.5
+#define MOTOR_VELOCITY_KI 0.0
+#define MOTOR_VELOCITY_KD 0.0
+#define MOTOR_VELOCITY_KFF 0.0
+
+// Open loop step test of the drive motors (#R), for tools/pid_tuner
+#define STEP_TEST_MAX_DURATION 10000 // ms
+
+// Onboard position manoeuvres (#A advance, #T turn in place), see motor_position_controller.h
+#define MANOEUVRE_MAX_VEL        0.3  // m/s, at the wheel
+#define MANOEUVRE_TOLERANCE      50   // encoder counts, both wheels must be this close for the manoeuvre to finish
+#define MANOEUVRE_SETTLE_TIMEOUT 1000 // ms after the profile ends to get within MANOEUVRE_TOLERANCE
+
+// Go home to recharge (ZOMBIE_STATE) below this state of charge, if homing instincts have been enabled
+#define HOMING_SOC_THRESHOLD 0.2
+
 /************************************ SERIAL SETUP **********************************/
 
 // invoke the serials in ESP32
-HardwareSerial Serial1(1); // pin 12=RX, pin 13=TX
-#define SERIAL1_RXPIN 12
-#define SERIAL1_TXPIN 13
+HardwareSerial Serial1(1); // TX only, on MOTOR_CONTROLLER_TX
 
-HardwareSerial Serial2(2); // pin 16=RX, pin 17=TX
+HardwareSerial Serial2(2); // RX only, on GPS_RX_PIN
+#define GPS_RX_PIN 16
 
 // what's the name of the hardware serial port for the GPS?
 #define GPSSerial Serial2
 
 // what's the name of the hardware serial port for the Sabertooth?
 #define MotorSerial Serial1
+#define SABERTOOTH_BAUD 9600 // as set on the Sabertooth's DIP switches
 
-/***********************************************************************************/
+// check_failsafes() writes the LED every cycle, on the motor TX line it would garble the Sabertooth's packets
+static_assert(MOTOR_CONTROLLER_TX != FAILSAFE_LED_PIN, "MOTOR_CONTROLLER_TX is the failsafe LED's");
+
+/*************************** COMMAND SOURCES PER STATE ****************************/
 
+// Velocity command sources (see command_mux.h) allowed to drive in each state, indexed by state ID
+// Zombie mode can be taken over from the serial port, e.g. from a laptop when it has got stuck
+const uint8_t state_command_sources[] = {
+    0,                                                                       // SLEEP_STATE
+    0,                                                                       // HALT_STATE
+    MUX_SOURCE_BIT(MUX_SOURCE_JOYSTICK) | MUX_SOURCE_BIT(MUX_SOURCE_SERIAL), // BLUETOOTH_TELEOP_STATE
+    MUX_SOURCE_BIT(MUX_SOURCE_SERIAL) | MUX_SOURCE_BIT(MUX_SOURCE_ZOMBIE),   // ZOMBIE_STATE
+    MUX_SOURCE_BIT(MUX_SOURCE_SERIAL),                                       // SERIAL_COMMAND_STATE
+};
 
-#define LEFT_MOTOR_ID  0
-#define RIGHT_MOTOR_ID 1
+/***********************************************************************************/
 
 // If a command from the RC or AI has not been recieved within WATCHDOG_TIMEOUT ms, will be switched to HALT state.
 #define WATCHDOG_TIMEOUT 250
 
+// Changing into a state that drives (#S, or the dashboard) arms the watchdog, and its command source has this much
+// longer for the first command: the joystick has to join the teleop access point, ROS to notice the change
+#define STATE_ENTRY_GRACE 5000 // ms
+
+/******************************** RUNTIME PARAMETERS ********************************/
+// These can be changed over serial while in SERIAL_COMMAND_STATE, see param_registry.h
+// The #defines above are only the defaults
+
+struct AlexbotParams
+{
+    float velocity_kp;
+    float velocity_ki;
+    float velocity_kd;
+    int32_t max_power;
+    float teleop_max_lin_vel;
+    float teleop_max_ang_vel;
+    float zombie_max_speed;
+    int32_t watchdog_timeout;
+    float wheel_radius;
+    int32_t encoder_counts_per_rev;
+    float wheel_track;
+    float max_accel;
+    float max_decel;
+    float max_jerk;
+    float position_kp;
+    float position_kff;
+    float manoeuvre_max_vel;
+    int32_t homing_instincts;
+    float homing_soc;
+    float velocity_kff;
+};
+
+// The parameter ID is the row number, so only ever append to this table
+const ParamInfo alexbot_param_table[] = {
+    // name          type               min    max        default                  offset
+    {"vel_kp",       PARAM_TYPE_FLOAT, 0.0,   1000.0,    MOTOR_VELOCITY_KP,       offsetof(AlexbotParams, velocity_kp)},
+    {"vel_ki",       PARAM_TYPE_FLOAT, 0.0,   1000.0,    MOTOR_VELOCITY_KI,       offsetof(AlexbotParams, velocity_ki)},
+    {"vel_kd",       PARAM_TYPE_FLOAT, 0.0,   1000.0,    MOTOR_VELOCITY_KD,       offsetof(AlexbotParams, velocity_kd)},
+    {"max_power",    PARAM_TYPE_INT,   0.0,   127.0,     DRIVE_MOTORS_MAX_POWER,  offsetof(AlexbotParams, max_power)},
+    {"teleop_lin",   PARAM_TYPE_FLOAT, 0.0,   2.0,       TELEOP_MAX_LIN_VEL,      offsetof(AlexbotParams, teleop_max_lin_vel)},
+    {"teleop_ang",   PARAM_TYPE_FLOAT, 0.0,   5.0,       TELEOP_MAX_ANG_VEL,      offsetof(AlexbotParams, teleop_max_ang_vel)},
+    {"zombie_speed", PARAM_TYPE_FLOAT, 0.0,   1.0,       ZOMBIE_MAX_SPEED,        offsetof(AlexbotParams, zombie_max_speed)},
+    {"watchdog_ms",  PARAM_TYPE_INT,   20.0,  5000.0,    WATCHDOG_TIMEOUT,        offsetof(AlexbotParams, watchdog_timeout)},
+    {"wheel_radius", PARAM_TYPE_FLOAT, 0.001, 100.0,     WHEEL_RADIUS,            offsetof(AlexbotParams, wheel_radius)},
+    {"enc_cpr",      PARAM_TYPE_INT,   1.0,   1000000.0, ENCODER_COUNTS_PER_REV,  offsetof(AlexbotParams, encoder_counts_per_rev)},
+    {"wheel_track",  PARAM_TYPE_FLOAT, 0.1,   2.0,       WHEEL_TRACK,             offsetof(AlexbotParams, wheel_track)},
+    {"max_accel",    PARAM_TYPE_FLOAT, 0.01,  5.0,       ROBOT_MAX_ACCEL_RATE,    offsetof(AlexbotParams, max_accel)},
+    {"max_decel",    PARAM_TYPE_FLOAT, 0.01,  5.0,       ROBOT_MAX_DECEL_RATE,    offsetof(AlexbotParams, max_decel)},
+    {"max_jerk",     PARAM_TYPE_FLOAT, 0.01,  50.0,      ROBOT_MAX_JERK,          offsetof(AlexbotParams, max_jerk)},
+    {"pos_kp",       PARAM_TYPE_FLOAT, 0.0,   10000.0,   MOTOR_POSITION_KP,       offsetof(AlexbotParams, position_kp)},
+    {"pos_kff",      PARAM_TYPE_FLOAT, 0.0,   1000.0,    MOTOR_POSITION_KFF,      offsetof(AlexbotParams, position_kff)},
+    {"manoeuvre_vel",PARAM_TYPE_FLOAT, 0.01,  1.0,       MANOEUVRE_MAX_VEL,       offsetof(AlexbotParams, manoeuvre_max_vel)},
+    {"homing",       PARAM_TYPE_INT,   0.0,   1.0,       0,                       offsetof(AlexbotParams, homing_instincts)},
+    {"homing_soc",   PARAM_TYPE_FLOAT, 0.0,   1.0,       HOMING_SOC_THRESHOLD,    offsetof(AlexbotParams, homing_soc)},
+    {"vel_kff",      PARAM_TYPE_FLOAT, 0.0,   1000.0,    MOTOR_VELOCITY_KFF,      offsetof(AlexbotParams, velocity_kff)},
+};
+
+#define ALEXBOT_NUM_PARAMS (sizeof(alexbot_param_table) / sizeof(ParamInfo))
+
+ParamRegistry<AlexbotParams> params(alexbot_param_table, ALEXBOT_NUM_PARAMS);
+
 Adafruit_GPS GPS(&GPSSerial);
 
 class AlexbotController
 {
   public:
-    AlexbotController()
+    AlexbotController() : serial_dispatch_(this)
     {
         // Initialise pins
         pinMode(FAILSAFE_LED_PIN, OUTPUT);
         pinMode(FAILSAFE_PIN, INPUT);
+
+        manoeuvre_active_ = false;
+        step_test_active_ = false;
+
+        // No state until the first set_current_state_ID()
+        current_state_id = -1;
     }
 
-    void init() {
+    void init_safety() {
 
-        // Seperate function for initialising objects
-        // In Arduino, these init calls do not work from the class constructor
+        // The first thing setup() does (see boot_sequence.h): after a brown-out the Sabertooth may still be
+        // driving the motors on its last command, so stop them before anything else
+
+        // Objects are constructed into static storage rather than with "new",
+        // this keeps the heap unfragmented (https://arduino.stackexchange.com/a/17966)
+        // The Sabertooth only listens (simplified serial), so there is no RX pin
+        MotorSerial.begin(SABERTOOTH_BAUD, SERIAL_8N1, -1, MOTOR_CONTROLLER_TX);
+        sabertooth = sabertooth_storage_.create(MotorSerial);
+        sabertooth->stop();
 
-        // TODO: MOVE ALL OF THESE "new" (dynamic creation) to global variables to prevent "strange things happening"
-        // this keeps the heap unfragmented
-        // https://arduino.stackexchange.com/a/17966
-        sabertooth = new SabertoothSimplified(MotorSerial);
+        // Enforces the watchdog and failsafe switch from interrupts, independently of the tasks
+        safety_supervisor.init(sabertooth, FAILSAFE_PIN, WATCHDOG_TIMEOUT);
 
         // Initialise Wheel Encoders
-        left_encoder = new WheelEncoderLS7366(LEFT_MOTOR_ID, LEFT_ENCODER_CS_PIN, ENCODER_COUNTS_PER_REV, WHEEL_RADIUS);
-        right_encoder = new WheelEncoderLS7366(RIGHT_MOTOR_ID, RIGHT_ENCODER_CS_PIN, ENCODER_COUNTS_PER_REV, WHEEL_RADIUS);
+        left_encoder = left_encoder_storage_.create(LEFT_MOTOR_ID, LEFT_ENCODER_CS_PIN, ENCODER_COUNTS_PER_REV, WHEEL_RADIUS);
+        right_encoder = right_encoder_storage_.create(RIGHT_MOTOR_ID, RIGHT_ENCODER_CS_PIN, ENCODER_COUNTS_PER_REV, WHEEL_RADIUS);
+    }
+
+    void init() {
+
+        // Seperate function for initialising objects, after init_safety()
+        // In Arduino, these init calls do not work from the class constructor
+
+        // Load the runtime parameters (defaults, overridden by anything saved in NVS)
+        params.init();
 
         // Initialise Motor Controllers
-        left_motor = new MotorVelocityController(
+        left_motor = left_motor_storage_.create(
             "Left motor", sabertooth, LEFT_MOTOR_ID, left_encoder, DRIVE_MOTORS_MAX_POWER);
 
-        right_motor = new MotorVelocityController(
+        right_motor = right_motor_storage_.create(
             "Right motor", sabertooth, RIGHT_MOTOR_ID, right_encoder, DRIVE_MOTORS_MAX_POWER);
 
-        // init 9600 baud comms with GPS reciever
-        GPS.begin(9600);
+        left_position = left_position_storage_.create(
+            "Left motor", sabertooth, LEFT_MOTOR_ID, left_encoder, DRIVE_MOTORS_MAX_POWER);
+
+        right_position = right_position_storage_.create(
+            "Right motor", sabertooth, RIGHT_MOTOR_ID, right_encoder, DRIVE_MOTORS_MAX_POWER);
+
+        // The GPS serial port is opened later, by init_gps()
+        zombie_controller = zombie_controller_storage_.create(&GPS);
 
-        // Request updates on antenna status, comment out to keep quiet
-        GPS.sendCommand(PGCMD_ANTENNA);
+        // Battery voltage, current and state of charge, sampled in the background
+        // After deep sleep, carry on from the charge we went to sleep with
+        uint8_t restored_state;
+        float charge_used = -1.0;
+        power_manager.restore(restored_state, charge_used);
+        battery_monitor.init(charge_used);
 
-        zombie_controller = new ZombieController(&GPS);
+        // Wi-Fi joystick, the radio is turned on in BLUETOOTH_TELEOP_STATE
+        udp_teleop.init();
+
+        // Push the loaded parameters to everything we just created
+        params_version_ = params.get_version() - 1;
+        apply_params_();
     }
 
-    void process_velocity_command(double cmd_x_velocity = 0.0, double cmd_theta = 0.0)
+    void init_gps() {
+
+        // Deferred until the control loop is running (see boot_sequence.h), call holding the baton
+
+        // init 9600 baud comms with GPS reciever
+        // Its default sentences are all we need, so nothing is sent to it and its TX pad is free for other things
+        GPSSerial.begin(9600, SERIAL_8N1, GPS_RX_PIN, -1);
+    }
+
+    void log_params()
     {
-        // This function gets called repeatedly
+        // Logs the whole parameter table to the black box on the next cycle, e.g. once it has started recording
+        params_version_ = params.get_version() - 1;
+    }
+
+    void process_velocity_command(double cmd_x_velocity = 0.0, double cmd_theta = 0.0, uint8_t source = MUX_SOURCE_SERIAL)
+    {
+        // This function gets called whenever a velocity command arrives
+        // update() picks which source to follow (see command_mux.h), and drives the wheels towards it gradually
 
         last_command_timestamp = millis();
+        safety_supervisor.feed();
         Serial.println("Processing command");
 
+        // A velocity command takes over from any manoeuvre or step test in progress
+        if (manoeuvre_active_)
+        {
+            Serial.println("Manoeuvre cancelled");
+            manoeuvre_active_ = false;
+        }
+
+        if (step_test_active_)
+        {
+            Serial.println("Step test cancelled");
+            sabertooth->stop();
+            step_test_active_ = false;
+        }
+
+        Velocity command;
+        command.linear = cmd_x_velocity;
+        command.angular = cmd_theta;
+        mux_.publish(source, command, last_command_timestamp);
+    }
+
+    void process_teleop_link()
+    {
+        // Called every control cycle, takes the newest joystick command from the Wi-Fi link (older ones were overwritten)
+        if (current_state_id != BLUETOOTH_TELEOP_STATE)
+        {
+            return;
+        }
+
+        unsigned long now = millis();
+        UdpTeleopCommand joystick;
+
+        if (udp_teleop.take(joystick, now))
+        {
+            blackbox.record_serial('J', joystick.linear, joystick.angular);
+            Velocity velocity = teleop_.process_command(joystick.linear, joystick.angular);
+            process_velocity_command(velocity.linear, velocity.angular, MUX_SOURCE_JOYSTICK);
+        }
+    }
+
+    bool hold_command_source(int source)
+    {
+        // Keeps one command source in charge whatever its priority (a negative source releases it)
+        if (source < 0)
+        {
+            mux_.release();
+            Serial.println("Command source released");
+            return true;
+        }
+
+        return mux_.hold(uint8_t(source));
+    }
+
+    void print_command_mux_stats()
+    {
+        mux_.print_stats(millis());
+    }
+
+    void print_zombie_stats()
+    {
+        zombie_controller->print_stats();
+    }
+
+    bool dispatch_serial_command(int message_type, double data1, double data2, unsigned long message_start)
+    {
+        // Motion commands, the schedule and the clock sync (#V, #A, #T, #R, #Q and #C, see serial_dispatch.h)
+        // Returns false if the message is for something else
+        return serial_dispatch_.dispatch(message_type, data1, data2, message_start);
+    }
+
+    void keep_link_alive()
+    {
+        // A command was scheduled rather than run, the link is alive as for an immediate one
+        last_command_timestamp = millis();
+        safety_supervisor.feed();
+    }
+
+    void update()
+    {
+        // This function gets called every cycle of the control loop, whether or not a command has arrived
+
+        // Pick up any parameter changes since the last cycle
+        apply_params_();
+
         // Will be changed into the HALT state if it is not safe to drive.
         check_failsafes();
 
+        // Go home to recharge if the battery is getting low
+        check_battery_();
+
+        // Scheduled commands whose time has come, as if they had just arrived
+        // Nothing scheduled may run once the robot has stopped, it would have to be sent again anyway
+        if (current_state_id == SERIAL_COMMAND_STATE || current_state_id == BLUETOOTH_TELEOP_STATE ||
+            current_state_id == ZOMBIE_STATE)
+        {
+            serial_dispatch_.run_schedule();
+        }
+        else
+        {
+            serial_dispatch_.clear_schedule();
+        }
+
+        // One timestamp for the whole cycle, so the black box can replay it exactly
+        unsigned long now = micros();
+        Velocity command;
+
         // State Machine
         switch (current_state_id)
         {
+            case SLEEP_STATE:
             case HALT_STATE:
-                // We are in HALT_STATE
+                // We are in HALT_STATE (or SLEEP_STATE, the power manager does the sleeping)
+                // The motors have been stopped, so the wheels start again from standstill
+                blackbox.record_tick(now, current_state_id, BLACKBOX_TICK_IDLE, 0.0, 0.0);
+                reset_velocity_loops_();
+                manoeuvre_active_ = false;
+                step_test_active_ = false;
+                return;
+
+            case BLUETOOTH_TELEOP_STATE:
+            case SERIAL_COMMAND_STATE:
+                if (manoeuvre_active_)
+                {
+                    blackbox.record_tick(now, current_state_id, BLACKBOX_TICK_MANOEUVRE, 0.0, 0.0);
+                    update_manoeuvre_();
+                    return;
+                }
+
+                if (step_test_active_)
+                {
+                    blackbox.record_tick(now, current_state_id, BLACKBOX_TICK_STEP, 0.0, 0.0);
+                    update_step_test_();
+                    return;
+                }
 
                 break;
 
-            case BLUETOOTH_TELEOP_STATE:
+            case ZOMBIE_STATE:
             {
-                // We are in RC_TELEOP_STATE
-                // Lets act according to the PWM input commands from the RC reciever
+                // Zombie mode navigates by itself, unless another source takes over
+                // Its sensors publish to its state machine, then the states that depend on them are evaluated
+                // Only an evaluation is a new command, if its sensors go quiet the watchdog is left to starve
+                PROFILE_SCOPE(PROFILE_STAGE_ZOMBIE);
+                zombie_controller->poll();
+
+                Velocity zombie_command;
+                if (zombie_controller->run(zombie_command))
+                {
+                    mux_.publish(MUX_SOURCE_ZOMBIE, zombie_command, millis());
+                }
+                break;
+            }
+
+            default:
+                return;
+        }
+
+        // Drive according to the command source in charge (a stop if none is)
+        MuxSelection selection = mux_.select(millis(), state_command_sources[current_state_id]);
+        command = selection.velocity;
 
-                double left_vel_desired = 0.0;
-                double right_vel_desired = 0.0;
+        // Whoever is in charge is still alive, this is what keeps the watchdog fed in Zombie mode
+        if (selection.is_new)
+        {
+            safety_supervisor.feed();
+        }
 
-                Serial.print(", desired_left=");
-                Serial.print(left_vel_desired);
+        blackbox.record_tick(now, current_state_id, BLACKBOX_TICK_VELOCITY, command.linear, command.angular);
+        setpoint_generator_.set_command(command);
 
-                Serial.print(", desired_right=");
-                Serial.print(right_vel_desired);
+        // Acceleration and jerk limited wheel velocities for this cycle
+        WheelTargets targets = setpoint_generator_.update(now);
 
-                // FIXME: Change from velocity control to position control
-                // Send command to the brake motor controller
-                left_motor->SetTargetVelocity(left_vel_desired);
-                right_motor->SetTargetVelocity(right_vel_desired);
+        Serial.print("desired_left=");
+        Serial.print(targets.left);
 
-                Serial.println("");
-                break;
-            }
-        }
+        Serial.print(", desired_right=");
+        Serial.print(targets.right);
+
+        // FIXME: Change from velocity control to position control
+        // Send command to the brake motor controller
+        left_motor->SetTargetVelocity(targets.left);
+        right_motor->SetTargetVelocity(targets.right);
 
+        Serial.println("");
     }
 
     bool set_current_state_ID(uint8_t new_state_id)
@@ -168,23 +461,63 @@ class AlexbotController
         // This function gets called when a change state is requested
         // Returns true on a successful transition
 
+        if (new_state_id > SERIAL_COMMAND_STATE)
+        {
+            return false;
+        }
+
         // Code blocks within this switch statement are only called on change transient
         switch (new_state_id)
         {
+            case SLEEP_STATE:
             case HALT_STATE:
-                // Do nothing on transition into HALT_STATE
+                // Stop the motors on transition into HALT_STATE (or SLEEP_STATE), rather than leaving them at their last output
+                if (current_state_id != HALT_STATE && current_state_id != SLEEP_STATE)
+                {
+                    sabertooth->stop();
+                }
                 break;
             case BLUETOOTH_TELEOP_STATE:
-                // Do nothing on transition into BLUETOOTH_TELEOP_STATE
+                // Turn the radio on for the joystick on transition into BLUETOOTH_TELEOP_STATE
+                udp_teleop.start();
                 break;
             case SERIAL_COMMAND_STATE:
                 // Do nothing on transition into SERIAL_COMMAND_STATE
                 break;
+            case ZOMBIE_STATE:
+                // Start homing on transition into ZOMBIE_STATE
+                if (current_state_id != ZOMBIE_STATE)
+                {
+                    zombie_controller->set_target(DOCK_LATITUDE, DOCK_LONGITUDE, anchors);
+                }
+                break;
+        }
+
+        if (current_state_id == ZOMBIE_STATE && new_state_id != ZOMBIE_STATE)
+        {
+            zombie_controller->stop();
+        }
+
+        if (current_state_id == BLUETOOTH_TELEOP_STATE && new_state_id != BLUETOOTH_TELEOP_STATE)
+        {
+            udp_teleop.stop();
         }
 
         Serial.print("Changing state to: ");
         Serial.println(new_state_id);
 
+        if (current_state_id != new_state_id)
+        {
+            power_manager.enter_state(new_state_id);
+
+            // Otherwise the watchdog, still tripped from before (or from boot), would put us straight back into
+            // HALT_STATE on the next check_failsafes()
+            if (new_state_id != HALT_STATE && new_state_id != SLEEP_STATE)
+            {
+                safety_supervisor.arm(STATE_ENTRY_GRACE);
+            }
+        }
+
         current_state_id = new_state_id;
         return true;
     }
@@ -212,10 +545,12 @@ class AlexbotController
 
         // The failsafes include: a watchdog timer (i.e. an automatic shutdown if a command hasn't been recieved within 250ms)
         // Also included is a hardware switch.
+        // Both are enforced by the safety supervisor (which has already stopped the motors), this just follows it.
 
         Serial.println("Checking failsafes!");
-        bool watchdog_valid = ((millis() - last_command_timestamp) < WATCHDOG_TIMEOUT);
-        bool failsafe_switch_engaged = digitalRead(FAILSAFE_PIN);
+        uint8_t trip_reasons = safety_supervisor.get_trip_reasons();
+        bool watchdog_valid = !(trip_reasons & SAFETY_TRIP_WATCHDOG);
+        bool failsafe_switch_engaged = !(trip_reasons & SAFETY_TRIP_SWITCH);
 
         Serial.print("failsafe_switch_engaged=");
         Serial.print(failsafe_switch_engaged);
@@ -236,17 +571,340 @@ class AlexbotController
     }
 
 
+    void process_param_command(int message_type, double data1, double data2)
+    {
+        // Parameters can only be read and changed over the serial link in SERIAL_COMMAND_STATE
+        // #P,<id>,<value>!  set a parameter
+        // #G,<id>,0!        print a parameter (id -1 prints them all)
+        // #N,0,0!           save all parameters to NVS
+        if (current_state_id != SERIAL_COMMAND_STATE)
+        {
+            Serial.println("Parameters can only be accessed in SERIAL_COMMAND_STATE");
+            return;
+        }
+
+        switch (message_type)
+        {
+            case 'P':
+                if (params.set(uint8_t(data1), float(data2)))
+                {
+                    params.print(uint8_t(data1));
+                }
+                break;
+
+            case 'G':
+                if (data1 < 0)
+                {
+                    for (uint8_t i = 0; i < params.get_num_params(); i++)
+                    {
+                        params.print(i);
+                    }
+                }
+                else
+                {
+                    params.print(uint8_t(data1));
+                }
+                break;
+
+            case 'N':
+                Serial.println(params.save() ? "Parameters saved" : "ERROR: Parameters not saved");
+                break;
+        }
+    }
+
+    void process_motion_command(int message_type, double data1, double data2)
+    {
+        // Manoeuvres run onboard, with no further messages needed until they finish
+        // #A,<metres>,0!   advance (negative to reverse)
+        // #T,<degrees>,0!  turn in place (positive is anticlockwise)
+        // #R,<power>,<ms>! open loop step test, both motors at <power> for <ms> then zero for <ms>
+        switch (message_type)
+        {
+            case 'A':
+                start_manoeuvre(data1, data1);
+                break;
+
+            case 'T':
+            {
+                double wheel_distance = radians(data1) * params_.wheel_track * 0.5;
+                start_manoeuvre(-wheel_distance, wheel_distance);
+                break;
+            }
+
+            case 'R':
+                start_step_test(int(data1), (unsigned long)(data2));
+                break;
+        }
+    }
+
+    bool start_manoeuvre(double left_distance, double right_distance)
+    {
+        // Moves each wheel by the given distance (metres), following one trapezoidal profile so they start and finish together
+        // Returns false if the robot is not in a state that can drive
+        if (current_state_id != SERIAL_COMMAND_STATE && current_state_id != BLUETOOTH_TELEOP_STATE)
+        {
+            Serial.println("Manoeuvres can only be run in SERIAL_COMMAND_STATE or BLUETOOTH_TELEOP_STATE");
+            return false;
+        }
+
+        // The profile is planned for the wheel that has furthest to go, the other is scaled to match
+        double longest = max(fabs(left_distance), fabs(right_distance));
+        manoeuvre_profile_.plan(longest, params_.manoeuvre_max_vel, params_.max_accel);
+        manoeuvre_scale_[LEFT_MOTOR_ID] = (longest > 0.0) ? left_distance / longest : 0.0;
+        manoeuvre_scale_[RIGHT_MOTOR_ID] = (longest > 0.0) ? right_distance / longest : 0.0;
+
+        manoeuvre_start_count_[LEFT_MOTOR_ID] = left_encoder->get_update().raw_count;
+        manoeuvre_start_count_[RIGHT_MOTOR_ID] = right_encoder->get_update().raw_count;
+        manoeuvre_start_time_ = micros();
+        manoeuvre_active_ = true;
+
+        // Anything left over from velocity control is discarded
+        mux_.discard();
+        reset_velocity_loops_();
+        step_test_active_ = false;
+
+        Serial.print("Starting manoeuvre, duration=");
+        Serial.println(manoeuvre_profile_.get_duration());
+        return true;
+    }
+
+    bool is_manoeuvre_active()
+    {
+        return manoeuvre_active_;
+    }
+
+    bool start_step_test(int power, unsigned long duration)
+    {
+        // Drives both motors open loop at a fixed power, then lets them coast down, printing the encoder counts
+        // every cycle so the response can be captured over the serial link (and it is in the black box too).
+        // Put the robot on blocks first. tools/pid_tuner fits a motor model to the capture and tunes the velocity loop.
+        if (current_state_id != SERIAL_COMMAND_STATE)
+        {
+            Serial.println("Step tests can only be run in SERIAL_COMMAND_STATE");
+            return false;
+        }
+
+        if (abs(power) > params_.max_power || duration == 0 || duration > STEP_TEST_MAX_DURATION)
+        {
+            Serial.println("ERROR: Step test power or duration out of range");
+            return false;
+        }
+
+        step_test_power_ = power;
+        step_test_duration_ = duration;
+        step_test_start_ = millis();
+        step_test_active_ = true;
+
+        manoeuvre_active_ = false;
+        mux_.discard();
+        reset_velocity_loops_();
+
+        // Distance per count, so the capture stands on its own
+        Serial.print("STEP_CONFIG,");
+        Serial.println(left_encoder->get_counts_per_metre());
+        return true;
+    }
+
 private:
+    void check_battery_()
+    {
+        // The SoC is filtered and coulomb counted (see battery_monitor.h), so a plain threshold doesn't chatter
+        if (!params_.homing_instincts || current_state_id == HALT_STATE || current_state_id == ZOMBIE_STATE)
+        {
+            return;
+        }
+
+        BatteryState battery = battery_monitor.get_state();
+
+        if (battery.valid && battery.soc < params_.homing_soc)
+        {
+            Serial.print("Battery low (SoC=");
+            Serial.print(battery.soc);
+            Serial.println("), going home");
+            set_current_state_ID(ZOMBIE_STATE);
+        }
+    }
+
+    void update_manoeuvre_()
+    {
+        // The manoeuvre is bounded in time and distance, so it is allowed to run without commands arriving.
+        // If this loop stalls the supervisor still trips.
+        safety_supervisor.feed();
+
+        double t = (micros() - manoeuvre_start_time_) * 1e-6;
+        double position, velocity;
+        manoeuvre_profile_.sample(t, position, velocity);
+
+        long left_target = manoeuvre_start_count_[LEFT_MOTOR_ID] +
+                           lround(manoeuvre_scale_[LEFT_MOTOR_ID] * position * left_encoder->get_counts_per_metre());
+        long right_target = manoeuvre_start_count_[RIGHT_MOTOR_ID] +
+                            lround(manoeuvre_scale_[RIGHT_MOTOR_ID] * position * right_encoder->get_counts_per_metre());
+
+        left_position->SetTargetPosition(left_target, manoeuvre_scale_[LEFT_MOTOR_ID] * velocity);
+        right_position->SetTargetPosition(right_target, manoeuvre_scale_[RIGHT_MOTOR_ID] * velocity);
+        Serial.println("");
+
+        double duration = manoeuvre_profile_.get_duration();
+        if (t < duration)
+        {
+            return;
+        }
+
+        bool settled = (labs(left_position->GetPositionError()) <= MANOEUVRE_TOLERANCE &&
+                        labs(right_position->GetPositionError()) <= MANOEUVRE_TOLERANCE);
+        bool timed_out = (t > duration + MANOEUVRE_SETTLE_TIMEOUT / 1000.0);
+
+        if (settled || timed_out)
+        {
+            sabertooth->stop();
+            manoeuvre_active_ = false;
+            Serial.println(settled ? "Manoeuvre complete" : "ERROR: Manoeuvre did not settle");
+        }
+    }
+
+    void update_step_test_()
+    {
+        // Bounded in time like a manoeuvre, so it is allowed to run without commands arriving
+        safety_supervisor.feed();
+
+        WheelEncoderFeedback left = left_encoder->get_update();
+        WheelEncoderFeedback right = right_encoder->get_update();
+
+        unsigned long t = left.stamp - step_test_start_;
+        int power = (t < step_test_duration_) ? step_test_power_ : 0;
+
+        sabertooth->motor(LEFT_MOTOR_ID, power);
+        sabertooth->motor(RIGHT_MOTOR_ID, power);
+        blackbox.record_motor(LEFT_MOTOR_ID, power);
+        blackbox.record_motor(RIGHT_MOTOR_ID, power);
+
+        // STEP,<ms>,<power from now on>,<left count>,<right count>
+        Serial.print("STEP,");
+        Serial.print(t);
+        Serial.print(",");
+        Serial.print(power);
+        Serial.print(",");
+        Serial.print(left.raw_count);
+        Serial.print(",");
+        Serial.println(right.raw_count);
+
+        if (t >= 2 * step_test_duration_)
+        {
+            sabertooth->stop();
+            step_test_active_ = false;
+            Serial.println("Step test complete");
+        }
+    }
+
+    void reset_velocity_loops_()
+    {
+        // The wheels start again from wherever they are, with nothing carried over
+        setpoint_generator_.reset();
+        left_motor->reset();
+        right_motor->reset();
+    }
+
+    void apply_params_()
+    {
+        // Lock-free check, the snapshot is only copied when something has actually changed
+        uint32_t version = params.get_version();
+        if (version == params_version_)
+        {
+            return;
+        }
+
+        params_ = params.read();
+        params_version_ = version;
+
+        left_motor->set_gains(params_.velocity_kp, params_.velocity_ki, params_.velocity_kd);
+        right_motor->set_gains(params_.velocity_kp, params_.velocity_ki, params_.velocity_kd);
+        left_motor->set_feedforward(params_.velocity_kff);
+        right_motor->set_feedforward(params_.velocity_kff);
+        left_motor->set_max_power(params_.max_power);
+        right_motor->set_max_power(params_.max_power);
+
+        left_position->set_gains(params_.position_kp, params_.position_kff);
+        right_position->set_gains(params_.position_kp, params_.position_kff);
+        left_position->set_max_power(params_.max_power);
+        right_position->set_max_power(params_.max_power);
+
+        left_encoder->set_geometry(params_.encoder_counts_per_rev, params_.wheel_radius);
+        right_encoder->set_geometry(params_.encoder_counts_per_rev, params_.wheel_radius);
+
+        zombie_controller->set_max_speed(params_.zombie_max_speed);
+
+        // Full deflection of the joystick is the teleop speed limit
+        teleop_.set_limits(params_.teleop_max_lin_vel, params_.teleop_max_ang_vel);
+        teleop_.set_input_sensitivity(params_.teleop_max_lin_vel / UDP_TELEOP_FULL_SCALE,
+                                      params_.teleop_max_ang_vel / UDP_TELEOP_FULL_SCALE);
+
+        setpoint_generator_.set_track(params_.wheel_track);
+        setpoint_generator_.set_limits(SETPOINT_MAX_WHEEL_VEL, params_.max_accel, params_.max_decel, params_.max_jerk);
+
+        safety_supervisor.set_watchdog_timeout(params_.watchdog_timeout);
+        mux_.set_timeout(MUX_SOURCE_SERIAL, params_.watchdog_timeout);
+
+        // The whole table is logged, so a replay can start from any change
+        for (uint8_t i = 0; i < params.get_num_params(); i++)
+        {
+            float value;
+            if (params.get(i, value))
+            {
+                blackbox.record_param(i, alexbot_param_table[i].name, value);
+            }
+        }
+    }
+
     int current_state_id;
     long last_command_timestamp;
 
+    // Latest velocity command from each source, and the profile that gets the wheels there smoothly
+    CommandMux mux_;
+    SetpointGenerator setpoint_generator_;
+
+    // Motion commands from the serial port, and those waiting for their time (#Q)
+    SerialDispatch<AlexbotController> serial_dispatch_;
+
+    // Scales the Wi-Fi joystick to velocities
+    TeleopController teleop_;
+
+    // Onboard position manoeuvre, indexed by motor ID
+    bool manoeuvre_active_;
+    TrapezoidalProfile manoeuvre_profile_;
+    double manoeuvre_scale_[2];
+    long manoeuvre_start_count_[2];
+    unsigned long manoeuvre_start_time_;
+
+    // Open loop step test (#R)
+    bool step_test_active_;
+    int step_test_power_;
+    unsigned long step_test_duration_; // ms
+    unsigned long step_test_start_;
+
+    // Parameters in use this cycle
+    AlexbotParams params_;
+    uint32_t params_version_;
+
     SabertoothSimplified *sabertooth;
 
     MotorVelocityController *left_motor;
     MotorVelocityController *right_motor;
 
+    MotorPositionController *left_position;
+    MotorPositionController *right_position;
+
     WheelEncoderLS7366 *left_encoder;
     WheelEncoderLS7366 *right_encoder;
 
     ZombieController *zombie_controller;
+
+    // Static storage for the objects above
+    StaticInstance<SabertoothSimplified> sabertooth_storage_;
+    StaticInstance<MotorVelocityController> left_motor_storage_;
+    StaticInstance<MotorVelocityController> right_motor_storage_;
+    StaticInstance<MotorPositionController> left_position_storage_;
+    StaticInstance<MotorPositionController> right_position_storage_;
+    StaticInstance<WheelEncoderLS7366> left_encoder_storage_;
+    StaticInstance<WheelEncoderLS7366> right_encoder_storage_;
+    StaticInstance<ZombieController> zombie_controller_storage_;
 };
@@ -1,17 +1,45 @@
 #include <Wire.h>
 
-// // FIXME!
-// #define BUFFER_LENGTH	32
-// #include <Pozyx.h>
-// #include <Pozyx_definitions.h>
 #include <Adafruit_GPS.h>
 #include <RPLidar.h>
 //#include <SoftwareSerial.h>
 #include <SabertoothSimplified.h>
 
-#include "lcd_controller.h"
 #include "serial_command.h"
 #include "alexbot.h"
+#include "lcd_controller.h"
+#include "task_monitor.h"
+#include "boot_sequence.h"
+#include "scan_streamer.h"
+
+// Every pin the firmware drives or listens on, each may only be used once. The IR receivers, the failsafe switch
+// and the touch panel take an interrupt on an edge, so a shared pin would flood them with fake edges and lose
+// whatever else it was for. 6 - 11 are the SPI flash's, and 35 is the HUZZAH32's battery divider (A13, not broken out)
+constexpr uint8_t used_pins[] = {
+  FAILSAFE_PIN, FAILSAFE_LED_PIN, MOTOR_CONTROLLER_TX, MOTOR_ESTOP_PIN, LEFT_ENCODER_CS_PIN, RIGHT_ENCODER_CS_PIN,
+  GPS_RX_PIN, STMPE_CS, STMPE_IRQ_PIN, TFT_CS, TFT_DC, SD_CS, SLEEP_WAKE_PIN, HOMING_SENSOR_PIN,
+  IR_PIN_FRONT_LEFT, IR_PIN_FRONT_CENTRE, IR_PIN_FRONT_RIGHT, IR_PIN_REAR_CENTRE,
+  5, 18, 19, // the Feather's SPI bus
+  34, 39,    // BATTERY_VOLTAGE_CHANNEL and MOTOR_CURRENT_CHANNEL (battery_monitor.h)
+};
+
+constexpr uint8_t pin_uses(uint8_t pin, size_t i = 0)
+{
+  return (i == sizeof(used_pins)) ? 0 : (used_pins[i] == pin) + pin_uses(pin, i + 1);
+}
+
+constexpr bool pin_is_free(uint8_t pin)
+{
+  return pin_uses(pin) == 1 && (pin < 6 || pin > 11) && pin != 35;
+}
+
+static_assert(pin_is_free(IR_PIN_FRONT_LEFT), "IR_PIN_FRONT_LEFT is already in use");
+static_assert(pin_is_free(IR_PIN_FRONT_CENTRE), "IR_PIN_FRONT_CENTRE is already in use");
+static_assert(pin_is_free(IR_PIN_FRONT_RIGHT), "IR_PIN_FRONT_RIGHT is already in use");
+static_assert(pin_is_free(IR_PIN_REAR_CENTRE), "IR_PIN_REAR_CENTRE is already in use");
+static_assert(pin_is_free(FAILSAFE_PIN), "FAILSAFE_PIN is already in use");
+static_assert(pin_is_free(HOMING_SENSOR_PIN), "HOMING_SENSOR_PIN is already in use");
+static_assert(pin_is_free(STMPE_IRQ_PIN), "STMPE_IRQ_PIN is already in use (e.g. the wake button's)");
 
 // This Sketch is intended to support ESP32 only (curently the only Dual-Core ESP on the market)!
 TaskHandle_t Task1, Task2;
@@ -20,61 +48,287 @@ SemaphoreHandle_t baton;
 #define LCD_REFRESH_INTERVAL 1000 //ms
 #define RPLIDAR_MOTOR_PIN 3
 
+// Tasks and the baton are statically allocated, so they never touch the heap
+// Cores, priorities and stack sizes are in task_table.h, tune the stacks using the high-water marks printed by MemoryMonitor
+StackType_t control_task_stack[task_table[TASK_CONTROL_LOOP].stack_size];
+StackType_t aux_task_stack[task_table[TASK_AUX_LOOP].stack_size];
+StaticTask_t control_task_buffer;
+StaticTask_t aux_task_buffer;
+StaticSemaphore_t baton_buffer;
+
 AlexbotController alexbot;
 SerialCommand sc;
 TFTController touchscreen;
 RPLidar lidar;
+MemoryMonitor memory_monitor;
 
 double measured_loop_rate;
 
 /**
- * @brief main_task runs on ESP32 Core 0
+ * @brief Registers one of the tasks in task_table.h with the memory and task monitors
+ */
+void add_task(uint8_t task_id, TaskHandle_t handle)
+{
+  memory_monitor.add_task(handle, task_table[task_id].name, task_table[task_id].stack_size);
+  task_monitor.add_task(task_id, handle);
+}
+
+/**
+ * @brief Does what the serial command a dashboard control stands for would (dashboard_buttons[] in lcd_controller.h)
+ */
+void process_dashboard_command(int message_type, double data1)
+{
+  // In the black box as 't', with the command it stood for and its value
+  blackbox.record_serial('t', message_type, data1);
+
+  // As #S: a state that drives arms the watchdog, so its command source has the grace period to take over
+  if (message_type == 'S')
+  {
+    if (!alexbot.set_current_state_ID(uint8_t(data1)))
+    {
+      Serial.println("ERROR: Unknown state");
+    }
+  }
+  else if (message_type == 'D')
+  {
+    touchscreen.set_page(uint8_t(data1));
+  }
+}
+
+/**
+ * @brief The deferred boot phases, run by the auxillary task before its first cycle, each holding the baton
+ */
+void finish_boot()
+{
+    // Black box recorder on the TFT FeatherWing's SD card
+    // The card shares the SPI bus with the encoders and the TFT, so it writes under the baton
+    xSemaphoreTake(baton, portMAX_DELAY);
+    boot_sequence.begin_phase(BOOT_PHASE_BLACKBOX);
+    bool recording = blackbox.init(SD_CS, baton);
+#if ALEXBOT_BLACKBOX
+    if (recording)
+    {
+      add_task(TASK_BLACKBOX, blackbox.get_task());
+
+      // The parameters were loaded before it started
+      alexbot.log_params();
+    }
+#endif
+    boot_sequence.end_phase(BOOT_PHASE_BLACKBOX, recording);
+    xSemaphoreGive(baton);
+
+    xSemaphoreTake(baton, portMAX_DELAY);
+    boot_sequence.begin_phase(BOOT_PHASE_GPS);
+    alexbot.init_gps();
+    boot_sequence.end_phase(BOOT_PHASE_GPS);
+    xSemaphoreGive(baton);
+
+    xSemaphoreTake(baton, portMAX_DELAY);
+    boot_sequence.begin_phase(BOOT_PHASE_TFT);
+    touchscreen.init();
+    // Its touch controller, on the same bus, read by its own task when it interrupts
+    if (touch_panel.init(STMPE_CS, STMPE_IRQ_PIN, baton))
+    {
+      add_task(TASK_TOUCH, touch_panel.get_task());
+    }
+    boot_sequence.end_phase(BOOT_PHASE_TFT);
+    xSemaphoreGive(baton);
+
+    boot_sequence.print_report();
+
+    // Everything long-lived has been created, from now on the heap is off limits (fatal in ALEXBOT_ZERO_HEAP builds)
+    heap_lock();
+}
+
+/**
+ * @brief main_task runs on the core given in task_table.h (Core 1)
  * 
  * @param parameter, pointer is passed 
  */
 void main_task_func(void *parameter)
 {
-  String taskMessage = "main_task running on core ";
-  taskMessage = taskMessage + xPortGetCoreID();
-  Serial.println(taskMessage);
+  Serial.print("main_task running on core ");
+  Serial.println(xPortGetCoreID());
 
-  // This loop runs continuously on core 0
+  // This loop runs continuously on core 1
   while (true)
   {
     unsigned long loop_start = millis();
+    task_monitor.begin_cycle(TASK_CONTROL_LOOP);
+    boot_sequence.mark_controllable();
     Serial.println("main_task at beginning of loop");
 
-    // Take the Sephamore "baton" (defined globally)
-    xSemaphoreTake(baton, portMAX_DELAY);
+    // Take the Sephamore "baton" (defined globally), the task monitor times how long we wait for it
+    task_monitor.take_baton(TASK_CONTROL_LOOP, baton);
 
     // If Serial mode is used, we read commands from the serial port
-    sc.ReadData();
+    {
+      PROFILE_SCOPE(PROFILE_STAGE_PARSE);
+      sc.ReadData();
+    }
 
-    if (sc.message_type != -1)
+    if (sc.message_type != NO_MESSAGE)
     {
       Serial.print("valid message:");
-      Serial.print(sc.message_type);
+      Serial.print((char)sc.message_type);
       Serial.print(",");
       Serial.print(sc.message_data1);
       Serial.print(",");
       Serial.println(sc.message_data2);
+
+      blackbox.record_serial(sc.message_type, sc.message_data1, sc.message_data2);
+
+      // Motion commands, the schedule and the clock sync (#V, #A, #T, #R, #Q and #C, see serial_dispatch.h)
+      if (alexbot.dispatch_serial_command(sc.message_type, sc.message_data1, sc.message_data2, sc.message_start))
+      {
+        Serial.print("Processed motion command from serial port on core: ");
+        Serial.println(xPortGetCoreID());
+      }
+      // Set / get / save runtime parameters
+      else if (sc.message_type == 'P' || sc.message_type == 'G' || sc.message_type == 'N')
+      {
+        alexbot.process_param_command(sc.message_type, sc.message_data1, sc.message_data2);
+      }
+#if ALEXBOT_PROFILING
+      // Dump (#H,0,0!) or reset (#H,1,0!) the hot-path profiler histograms
+      else if (sc.message_type == 'H')
+      {
+        if (sc.message_data1 > 0)
+        {
+          profiler.reset();
+        }
+        else
+        {
+          profiler.print();
+        }
+      }
+#endif
+      // Safety supervisor stats (#E,0,0!), or rearm after the failsafe switch has been released (#E,1,0!)
+      else if (sc.message_type == 'E')
+      {
+        if (sc.message_data1 > 0)
+        {
+          Serial.println(safety_supervisor.rearm() ? "Failsafe rearmed" : "ERROR: Failsafe switch still open");
+        }
+        safety_supervisor.print_stats();
+      }
+      // Change state (#S,<state ID>,0!)
+      else if (sc.message_type == 'S')
+      {
+        if (!alexbot.set_current_state_ID(uint8_t(sc.message_data1)))
+        {
+          Serial.println("ERROR: Unknown state");
+        }
+      }
+      // Time and energy used in each state (#W,0,0!)
+      else if (sc.message_type == 'W')
+      {
+        power_manager.print_stats();
+      }
+      // Black box recorder stats (#B,0,0!)
+      else if (sc.message_type == 'B')
+      {
+        blackbox.print_stats();
+      }
+      // Wi-Fi teleop link stats, packets lost, reordered and stale, and the command age (#U,0,0!)
+      else if (sc.message_type == 'U')
+      {
+        udp_teleop.print_stats();
+      }
+      // Which velocity command source is in charge, and how old its command is (#M,0,0!)
+      else if (sc.message_type == 'M')
+      {
+        alexbot.print_command_mux_stats();
+      }
+      // Hold a velocity command source in charge whatever its priority (#O,<source ID>,0!), or release it (#O,-1,0!)
+      else if (sc.message_type == 'O')
+      {
+        if (!alexbot.hold_command_source(int(sc.message_data1)))
+        {
+          Serial.println("ERROR: Unknown command source");
+        }
+      }
+      // CPU load, preemptions, baton waits and start jitter of each task (#L,0,0!), or reset them (#L,1,0!)
+      else if (sc.message_type == 'L')
+      {
+        if (sc.message_data1 > 0)
+        {
+          task_monitor.reset();
+        }
+        else
+        {
+          task_monitor.print_stats();
+        }
+      }
+      // Stress benchmark, busy tasks on both cores for <seconds> at <load> % (#K,<seconds>,<load>!)
+      else if (sc.message_type == 'K')
+      {
+        task_monitor.start_stress((unsigned long)max(sc.message_data1, 0.0), uint8_t(constrain(sc.message_data2, 0.0, 100.0)));
+      }
+      // Zombie mode transitions and time in each state, and the LIDAR dock detector (#Z,0,0!)
+      else if (sc.message_type == 'Z')
+      {
+        alexbot.print_zombie_stats();
+        dock_detector.print_stats();
+      }
+      // How long each phase of the boot took, and when the robot became controllable (#Y,0,0!)
+      else if (sc.message_type == 'Y')
+      {
+        boot_sequence.print_report();
+      }
+      // Select the TFT page (#D,<page>,0!)
+      else if (sc.message_type == 'D')
+      {
+        touchscreen.set_page(uint8_t(sc.message_data1));
+      }
+      // Touch panel interrupts, bursts and gestures (#I,0,0!)
+      else if (sc.message_type == 'I')
+      {
+        touch_panel.print_stats();
+      }
+      // LIDAR scans to ROS: stats (#F,0,0!), stream at <mm> resolution (#F,1,<mm>!), every beam next (#F,2,0!), stop (#F,-1,0!)
+      else if (sc.message_type == 'F')
+      {
+        scan_streamer.command(int(sc.message_data1), sc.message_data2);
+      }
+
       sc.reset();
     }
 
-    // Set Velocity
-    if (sc.message_type == 'V')
+    // Dashboard controls touched on the TFT, each does what its serial command would
+    TouchGesture gesture;
+    while (touch_panel.take_gesture(gesture))
     {
-      Serial.print("Processing Velocity command from serial port on core: ");
-      Serial.println(xPortGetCoreID());
-      alexbot.process_velocity_command(sc.message_data1, sc.message_data2);
+      int message_type;
+      double data1;
+      if (touchscreen.dashboard_command(gesture, message_type, data1))
+      {
+        process_dashboard_command(message_type, data1);
+      }
     }
 
+    // Joystick over Wi-Fi, in BLUETOOTH_TELEOP_STATE
+    alexbot.process_teleop_link();
+
+    // Motor control, runs every cycle so the wheels follow the velocity profile between commands
+    alexbot.update();
+
     // Let go of the baton (so the other core can do some stuff)
     xSemaphoreGive(baton);
     Serial.println("main_task Done");
 
+    // Energy accounting, and in SLEEP_STATE this is where we sleep. The wake-up button brings us out of SLEEP_STATE
+    if (power_manager.update(alexbot.get_current_state_ID()))
+    {
+      task_monitor.take_baton(TASK_CONTROL_LOOP, baton);
+      alexbot.set_current_state_ID(HALT_STATE);
+      xSemaphoreGive(baton);
+    }
+
     // Give the other core some time to do its thing... 
-    delay(50);
+    uint16_t control_period = power_manager.get_control_period();
+    task_monitor.end_cycle(TASK_CONTROL_LOOP, control_period);
+    delay(control_period);
 
     // Can adjust global variables from the loop
 
@@ -83,24 +337,29 @@ void main_task_func(void *parameter)
 }
 
 /**
- * @brief auxillary_task runs on ESP32 Core 1
+ * @brief auxillary_task runs on the core given in task_table.h (Core 0)
  * 
  * @param parameter, pointer is passed 
  */
 void auxillary_task_func(void *parameter)
 {
-  String taskMessage = "auxillary_task running on core ";
-  taskMessage = taskMessage + xPortGetCoreID();
-  Serial.println(taskMessage);
+  Serial.print("auxillary_task running on core ");
+  Serial.println(xPortGetCoreID());
+
+  unsigned long last_lcd_refresh = 0;
+
+  // The slow peripherals come up here, while the control loop is already running (see boot_sequence.h)
+  finish_boot();
 
   // This loop runs continuously on core 0
   while (true)
   {
     unsigned long loop_start = millis();
+    task_monitor.begin_cycle(TASK_AUX_LOOP);
     Serial.println("auxillary_task at beginning of loop");
 
     // Take the Sephamore "baton" (defined globally)
-    xSemaphoreTake(baton, portMAX_DELAY);
+    task_monitor.take_baton(TASK_AUX_LOOP, baton);
 
     // Read from the LIDAR
     // if (IS_OK(lidar.waitPoint()))
@@ -109,8 +368,13 @@ void auxillary_task_func(void *parameter)
     //   float angle = lidar.getCurrentPoint().angle;       //anglue value in degree
     //   bool startBit = lidar.getCurrentPoint().startBit;  //whether this point is belong to a new scan
     //   byte quality = lidar.getCurrentPoint().quality;    //quality of the current measurement
+    //   blackbox.record_lidar(distance, angle, quality, startBit);
 
-    //   //perform data processing here...
+    //   // Dock outline matching, for the final approach in Zombie mode (on its own task, see dock_detector.h)
+    //   dock_detector.add_point(distance, angle, quality, startBit);
+
+    //   // Compressed revolutions to ROS, when it has asked for them (see scan_streamer.h)
+    //   scan_streamer.add_point(distance, angle, quality, startBit);
     // }
     // else
     // {
@@ -129,22 +393,42 @@ void auxillary_task_func(void *parameter)
     //   }
     // }
 
-    // Do Some Stuff
-    if (millis() % LCD_REFRESH_INTERVAL == 0)
+    // Do Some Stuff, every cycle during the stress benchmark so the control loop has to fight for the baton
+    // A page changed from the dashboard is drawn straight away
+    if (millis() - last_lcd_refresh >= LCD_REFRESH_INTERVAL || task_monitor.is_stressed() || touchscreen.needs_redraw())
     {
+      last_lcd_refresh = millis();
       Serial.println("auxillary_task: Updating LCD");
-      String current_state_id_str = String(alexbot.get_current_state_ID());
+      char current_state_id_str[4];
+      snprintf(current_state_id_str, sizeof(current_state_id_str), "%d", alexbot.get_current_state_ID());
 
       int8_t serial_comms_status = 1;
-      touchscreen.update(current_state_id_str, serial_comms_status, alexbot.check_failsafes(), measured_loop_rate, -1.0, -1.0, -1.0);
+      BatteryState battery = battery_monitor.get_state();
+      PROFILE_SCOPE(PROFILE_STAGE_LCD);
+      touchscreen.update(current_state_id_str, serial_comms_status, alexbot.check_failsafes(), measured_loop_rate, -1.0, -1.0,
+                         battery.valid ? battery.voltage : -1.0);
     }
 
     // Let go of the baton (so the other core can do some stuff)
     xSemaphoreGive(baton);
     Serial.println("auxillary_task Done");
 
+    // The rest of the last LIDAR revolution's frames, as the link's share allows (add_point() sends them too)
+    scan_streamer.update();
+
+    // Stack high-water marks and heap trend, every MEMORY_REPORT_INTERVAL
+    memory_monitor.update();
+
+    // Stress benchmark report, once it has finished
+    task_monitor.update();
+
+    // Waits here (holding nothing) while the state doesn't need this task, e.g. SLEEP_STATE
+    power_manager.aux_checkpoint();
+
     // Give the other core some time to do its thing...
-    delay(50);
+    uint16_t aux_period = power_manager.get_aux_period();
+    task_monitor.end_cycle(TASK_AUX_LOOP, aux_period);
+    delay(aux_period);
 
     // Can adjust global variables from the loop
 
@@ -153,53 +437,87 @@ void auxillary_task_func(void *parameter)
 
 void setup()
 {
+    // Only what the control loop needs happens here, safety first, the rest is deferred (see boot_sequence.h)
+    boot_sequence.begin_phase(BOOT_PHASE_SAFETY);
     Serial.begin(115200);
-
-    
     Serial.println("Initialising!");
 
+    // Motors stopped, failsafe switch and watchdog armed, encoders
+    alexbot.init_safety();
+    boot_sequence.end_phase(BOOT_PHASE_SAFETY);
+
+    boot_sequence.begin_phase(BOOT_PHASE_CONTROL);
+
+    // Find out whether we are waking from deep sleep
+    power_manager.init();
+
     // Mutex ("baton") to be passed between cores to syncronise
-    baton = xSemaphoreCreateMutex();
+    baton = xSemaphoreCreateMutexStatic(&baton_buffer);
 
     alexbot.init();
-    alexbot.set_current_state_ID(HALT_STATE);
 
-    touchscreen.init();
+    // Back to sleep if the deep sleep timer woke us, otherwise start halted
+    uint8_t boot_state = HALT_STATE;
+    float charge_used;
+    power_manager.restore(boot_state, charge_used);
+    alexbot.set_current_state_ID(boot_state);
+    boot_sequence.end_phase(BOOT_PHASE_CONTROL);
 
-    // mainControlLoop handles higher priority functions, including the motor control loop
-    xTaskCreatePinnedToCore(
-        main_task_func, /* Task function. */
-        "Control Loop", /* String with name of task. */
-        5000,           /* Stack size in words. */
-        NULL,           /* Parameter passed as input of the task */
-        10,             /* Priority of the task. */
-        &Task1,         /* Task handle. */
-        0);             /* Core ID to execute on. */
+    boot_sequence.begin_phase(BOOT_PHASE_TASKS);
 
-    Serial.print("Setup: created Task2 with priority = ");
-    Serial.println(uxTaskPriorityGet(Task1));
+    // CPU load sampling, and the stress benchmark tasks (which sleep until #K)
+    task_monitor.init();
+
+    add_task(TASK_SAFETY_STOP, safety_supervisor.get_task());
+    add_task(TASK_BATTERY, battery_monitor.get_task());
+#if ALEXBOT_UDP_TELEOP
+    if (udp_teleop.get_task() != NULL)
+    {
+      add_task(TASK_UDP_TELEOP, udp_teleop.get_task());
+    }
+#endif
 
-    delay(500); // needed to start-up task1
+    // Matches each LIDAR revolution against the dock's outline, idle until Zombie mode sees the IR beacons
+    dock_detector.init();
+    add_task(TASK_DOCK_DETECTOR, dock_detector.get_task());
+
+    // mainControlLoop handles higher priority functions, including the motor control loop
+    const TaskPlacement &control = task_table[TASK_CONTROL_LOOP];
+    Task1 = xTaskCreateStaticPinnedToCore(
+        main_task_func,          /* Task function. */
+        control.name,            /* String with name of task. */
+        control.stack_size,      /* Stack size in words. */
+        NULL,                    /* Parameter passed as input of the task */
+        control.priority,        /* Priority of the task. */
+        control_task_stack,      /* Stack. */
+        &control_task_buffer,    /* Task control block. */
+        control.core);           /* Core ID to execute on. */
+    add_task(TASK_CONTROL_LOOP, Task1);
+
+    Serial.print("Setup: created Task1 with priority = ");
+    Serial.println(uxTaskPriorityGet(Task1));
 
     // mainControlLoop handles lower priority functions, including reading from the LIDAR, updating the TFT LCD and parsing GPS
-    xTaskCreatePinnedToCore(
+    const TaskPlacement &aux = task_table[TASK_AUX_LOOP];
+    Task2 = xTaskCreateStaticPinnedToCore(
         auxillary_task_func, /* Task function. */
-        "Auxillary Loop",    /* String with name of task. */
-        5000,                /* Stack size in words. */
+        aux.name,            /* String with name of task. */
+        aux.stack_size,      /* Stack size in words. */
         NULL,                /* Parameter passed as input of the task */
-        50,                  /* Priority of the task. */
-        &Task2,              /* Task handle. */
-        1);                  /* Core ID to execute on. */
+        aux.priority,        /* Priority of the task. */
+        aux_task_stack,      /* Stack. */
+        &aux_task_buffer,    /* Task control block. */
+        aux.core);           /* Core ID to execute on. */
+    add_task(TASK_AUX_LOOP, Task2);
+    power_manager.add_aux_task(Task2);
 
     Serial.print("Setup: created Task2 with priority = ");
     Serial.println(uxTaskPriorityGet(Task2));
-
-    Serial.println(F("Boot time benchmark                Time (microseconds)"));
+    boot_sequence.end_phase(BOOT_PHASE_TASKS);
 }
 
 void loop()
 {
-  Serial.print("Main Loop: priority = ");
-  Serial.println(uxTaskPriorityGet(NULL));
-  delay(5);
+  // Everything runs in the tasks created in setup(), the Arduino loop task would only wake the CPU for nothing
+  vTaskDelete(NULL);
 }
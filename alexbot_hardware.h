@@ -0,0 +1,29 @@
+#ifndef ALEXBOT_HARDWARE_H
+#define ALEXBOT_HARDWARE_H
+
+/*
+How alexbot is wired: the pins alexbot.h drives, and which Sabertooth output is which wheel
+
+Shared by alexbot.h and the host tools (tools/sim, tools/pid_tuner, tools/blackbox_replay, tools/serial_latency),
+so a tool drives the same pins and motors as the robot. Pins that belong to one peripheral stay in its own header.
+*/
+
+/**************************** ARDUINO PIN DEFINITIONS ********************************/
+#define FAILSAFE_PIN       23   // To emergency stop switch (the Feather's SDA pad, Wire is never started)
+#define FAILSAFE_LED_PIN   13   // OUTPUT TO LED ON THE ARDUINO BOARD
+
+// Motor driver Pins (UART Serial)
+#define MOTOR_CONTROLLER_TX 2   // S1 on the sabertooth 2x25A goes to pin 2
+
+#define LEFT_ENCODER_CS_PIN  3
+#define RIGHT_ENCODER_CS_PIN 4
+
+/************************************** MOTORS *************************************/
+
+#define LEFT_MOTOR_ID  0
+#define RIGHT_MOTOR_ID 1
+
+// Maximum allowable power to the motors
+#define DRIVE_MOTORS_MAX_POWER 60
+
+#endif
@@ -0,0 +1,415 @@
+#ifndef BATTERY_MONITOR_H
+#define BATTERY_MONITOR_H
+
+#include <driver/i2s.h>
+#include <driver/adc.h>
+#include <soc/syscon_struct.h>
+
+#include "snapshot_buffer.h"
+#include "task_table.h"
+
+/*
+Battery monitor
+
+The battery voltage and motor current are sampled continuously in the background: the I2S peripheral clocks ADC1
+and DMAs the samples into a ring of buffers, so no task ever calls analogRead().
+
+A sampling task wakes whenever a DMA buffer is full and, for each channel:
+  - low-pass filters and decimates with a fixed-point FIR (BATTERY_FIR_TAPS taps, Q15), which also oversamples
+    the 12 bit ADC by a further BATTERY_FIR_EXTRA_BITS bits
+  - converts to volts / amps
+The current is integrated into the charge used (coulomb counting), giving the state of charge (SoC). The outputs of
+one DMA buffer come out in a burst, so each is integrated over the nominal output period rather than over the time
+between them. micros() is only used to spot the samples lost when the ring overflows, which are integrated at the
+last current.
+
+Voltage, current and SoC are published as one lock-free snapshot (see snapshot_buffer.h), get_state() can be
+called from any task.
+
+The SoC starts from a rough estimate from the resting voltage, and is reset to full whenever the voltage reaches
+BATTERY_FULL_VOLTAGE while charging has tailed off.
+*/
+
+/******************* CONFIG **********************/
+
+// ADC1 channels (ADC2 can't be used with I2S, or while Wi-Fi is on)
+#define BATTERY_VOLTAGE_CHANNEL ADC1_CHANNEL_6 // GPIO34
+#define MOTOR_CURRENT_CHANNEL   ADC1_CHANNEL_3 // GPIO39
+
+// FIXME: calibrate these against a multimeter
+#define BATTERY_VOLTAGE_SCALE 0.00894 // volts per ADC count (voltage divider and 11 dB attenuation)
+#define MOTOR_CURRENT_ZERO    1862    // ADC counts at zero current
+#define MOTOR_CURRENT_SCALE   0.0305  // amps per ADC count, positive is discharging
+
+// FIXME: battery specs
+#define BATTERY_CAPACITY       20.0 // Ah
+#define BATTERY_FULL_VOLTAGE   27.2 // V
+#define BATTERY_EMPTY_VOLTAGE  22.0 // V
+#define BATTERY_FULL_CURRENT   -0.5 // A, charging current below which the battery is considered full
+
+// Both channels are scanned in turn, so each is sampled at half this rate
+#define BATTERY_ADC_SAMPLE_RATE 8000 // Hz
+
+// DMA ring, each buffer holds BATTERY_DMA_BUFFER_LEN samples (the sampling task wakes once per buffer)
+#define BATTERY_DMA_BUFFER_COUNT 4
+#define BATTERY_DMA_BUFFER_LEN   256
+
+// One filtered sample out per BATTERY_FIR_DECIMATION samples in, per channel (4 kHz / 32 = 125 Hz)
+#define BATTERY_FIR_DECIMATION 32
+#define BATTERY_FIR_TAPS       64
+#define BATTERY_FIR_EXTRA_BITS 4
+
+/*************************************************/
+
+#define BATTERY_NUM_CHANNELS 2
+
+// Time between filtered outputs of one channel, and the time the whole DMA ring holds
+#define BATTERY_OUTPUT_PERIOD (1000000UL * BATTERY_FIR_DECIMATION * BATTERY_NUM_CHANNELS / BATTERY_ADC_SAMPLE_RATE) // us
+#define BATTERY_RING_PERIOD   (1000000UL * BATTERY_DMA_BUFFER_COUNT * BATTERY_DMA_BUFFER_LEN / BATTERY_ADC_SAMPLE_RATE) // us
+
+struct BatteryState
+{
+    float voltage;     // V
+    float current;     // A, positive is discharging
+    float soc;         // state of charge, 0 to 1
+    float charge_used; // Ah since the last full charge (or boot)
+    bool valid;
+};
+
+// Hamming windowed sinc, cut-off 50 Hz at 4 kHz, Q15 (sums to 32768)
+const int16_t battery_fir_taps[BATTERY_FIR_TAPS] = {
+       23,    26,    32,    40,    50,    64,    82,   103,
+      129,   158,   192,   231,   273,   320,   370,   423,
+      479,   536,   595,   655,   714,   772,   828,   882,
+      932,   977,  1018,  1053,  1081,  1103,  1118,  1125,
+     1125,  1118,  1103,  1081,  1053,  1018,   977,   932,
+      882,   828,   772,   714,   655,   595,   536,   479,
+      423,   370,   320,   273,   231,   192,   158,   129,
+      103,    82,    64,    50,    40,    32,    26,    23,
+};
+
+/**
+ * @brief Fixed-point decimating FIR filter, one per ADC channel
+ */
+class FirDecimator
+{
+    public:
+        FirDecimator();
+        bool push(uint16_t sample);
+        int32_t get_output();
+        bool is_primed();
+
+    private:
+        uint16_t history_[BATTERY_FIR_TAPS];
+        uint8_t next_;
+        uint8_t phase_;
+        uint16_t pushed_;
+        int32_t output_;
+};
+
+FirDecimator::FirDecimator()
+{
+    for (uint8_t i = 0; i < BATTERY_FIR_TAPS; i++)
+    {
+        history_[i] = 0;
+    }
+
+    next_   = 0;
+    phase_  = 0;
+    pushed_ = 0;
+    output_ = 0;
+}
+
+/**
+ * @brief Adds a raw 12 bit sample
+ *
+ * @return true when a new filtered output is ready
+ */
+bool FirDecimator::push(uint16_t sample)
+{
+    history_[next_] = sample;
+    next_ = (next_ + 1) % BATTERY_FIR_TAPS;
+
+    if (pushed_ < BATTERY_FIR_TAPS)
+    {
+        pushed_++;
+    }
+
+    if (++phase_ < BATTERY_FIR_DECIMATION)
+    {
+        return false;
+    }
+    phase_ = 0;
+
+    // The filter is symmetric, so the order of the history doesn't matter
+    // 12 bit samples * Q15 taps summing to 1.0 fits comfortably in 32 bits
+    int32_t acc = 0;
+    for (uint8_t i = 0; i < BATTERY_FIR_TAPS; i++)
+    {
+        acc += int32_t(history_[(next_ + i) % BATTERY_FIR_TAPS]) * battery_fir_taps[i];
+    }
+
+    output_ = acc >> (15 - BATTERY_FIR_EXTRA_BITS);
+    return true;
+}
+
+/**
+ * @return int32_t, ADC counts * 2^BATTERY_FIR_EXTRA_BITS
+ */
+int32_t FirDecimator::get_output()
+{
+    return output_;
+}
+
+/**
+ * @brief The history is full of real samples, so the output has settled
+ */
+bool FirDecimator::is_primed()
+{
+    return pushed_ >= BATTERY_FIR_TAPS;
+}
+
+class BatteryMonitor
+{
+    public:
+        BatteryMonitor();
+        bool init(float charge_used = -1.0);
+        BatteryState get_state() const;
+        TaskHandle_t get_task();
+        void sample_task_loop_();
+
+    private:
+        void process_voltage_(int32_t filtered);
+        void process_current_(int32_t filtered);
+        void check_dropped_(size_t samples);
+        void count_charge_(unsigned long period);
+
+        FirDecimator filters_[BATTERY_NUM_CHANNELS];
+        uint8_t channel_ids_[BATTERY_NUM_CHANNELS];
+
+        // Only the sampling task touches these
+        BatteryState state_;
+        unsigned long last_block_stamp_;
+        long block_lag_; // us the reads are behind the ADC
+        bool soc_initialised_;
+
+        SnapshotBuffer<BatteryState> published_;
+
+        uint16_t dma_block_[BATTERY_DMA_BUFFER_LEN];
+        TaskHandle_t sample_task_;
+        StackType_t sample_task_stack_[task_table[TASK_BATTERY].stack_size];
+        StaticTask_t sample_task_buffer_;
+};
+
+void battery_sample_task_func_(void *parameter)
+{
+    ((BatteryMonitor *)parameter)->sample_task_loop_();
+}
+
+BatteryMonitor::BatteryMonitor()
+{
+    this->channel_ids_[0]     = BATTERY_VOLTAGE_CHANNEL;
+    this->channel_ids_[1]     = MOTOR_CURRENT_CHANNEL;
+    this->state_.voltage      = 0.0;
+    this->state_.current      = 0.0;
+    this->state_.soc          = 0.0;
+    this->state_.charge_used  = 0.0;
+    this->state_.valid        = false;
+    this->last_block_stamp_   = 0;
+    this->block_lag_          = 0;
+    this->soc_initialised_    = false;
+    this->sample_task_        = NULL;
+}
+
+/**
+ * @brief Starts the I2S ADC DMA and the sampling task
+ * Call from setup(), the DMA buffers come from the heap
+ *
+ * @param charge_used Ah, to carry on counting from (e.g. after deep sleep), or negative to estimate it from the voltage
+ */
+bool BatteryMonitor::init(float charge_used)
+{
+    if (charge_used >= 0.0)
+    {
+        state_.charge_used = charge_used;
+        state_.soc = 1.0 - charge_used / BATTERY_CAPACITY;
+        soc_initialised_ = true;
+    }
+
+    i2s_config_t config = {};
+    config.mode                 = (i2s_mode_t)(I2S_MODE_MASTER | I2S_MODE_RX | I2S_MODE_ADC_BUILT_IN);
+    config.sample_rate          = BATTERY_ADC_SAMPLE_RATE;
+    config.bits_per_sample      = I2S_BITS_PER_SAMPLE_16BIT;
+    config.channel_format       = I2S_CHANNEL_FMT_ONLY_RIGHT;
+    config.communication_format = I2S_COMM_FORMAT_I2S_MSB;
+    config.intr_alloc_flags     = ESP_INTR_FLAG_LEVEL1;
+    config.dma_buf_count        = BATTERY_DMA_BUFFER_COUNT;
+    config.dma_buf_len          = BATTERY_DMA_BUFFER_LEN;
+    config.use_apll             = false;
+
+    if (i2s_driver_install(I2S_NUM_0, &config, 0, NULL) != ESP_OK)
+    {
+        Serial.println("ERROR: Battery monitor I2S ADC failed to start");
+        return false;
+    }
+
+    adc1_config_width(ADC_WIDTH_BIT_12);
+    adc1_config_channel_atten(BATTERY_VOLTAGE_CHANNEL, ADC_ATTEN_DB_11);
+    adc1_config_channel_atten(MOTOR_CURRENT_CHANNEL, ADC_ATTEN_DB_11);
+    i2s_set_adc_mode(ADC_UNIT_1, BATTERY_VOLTAGE_CHANNEL);
+
+    // The I2S driver only sets up one channel, so scan both by putting two entries in the SAR1 pattern table
+    // Each entry is: channel (4 bits), bit width (2 bits, 3 = 12 bit), attenuation (2 bits, 3 = 11 dB)
+    SYSCON.saradc_ctrl.sar1_patt_len = BATTERY_NUM_CHANNELS - 1;
+    SYSCON.saradc_sar1_patt_tab[0] = ((uint32_t)((BATTERY_VOLTAGE_CHANNEL << 4) | 0x0F) << 24) |
+                                     ((uint32_t)((MOTOR_CURRENT_CHANNEL << 4) | 0x0F) << 16);
+
+    i2s_adc_enable(I2S_NUM_0);
+
+    // Spends almost all its time blocked on the DMA, so a high priority costs little and keeps the ring from overflowing
+    const TaskPlacement &placement = task_table[TASK_BATTERY];
+    sample_task_ = xTaskCreateStaticPinnedToCore(
+        battery_sample_task_func_, /* Task function. */
+        placement.name,            /* String with name of task. */
+        placement.stack_size,      /* Stack size in words. */
+        this,                      /* Parameter passed as input of the task */
+        placement.priority,        /* Priority of the task. */
+        sample_task_stack_,        /* Stack. */
+        &sample_task_buffer_,      /* Task control block. */
+        placement.core);           /* Core ID to execute on. */
+
+    return true;
+}
+
+/**
+ * @brief Lock-free copy of the latest voltage, current and SoC, safe to call from any task
+ */
+BatteryState BatteryMonitor::get_state() const
+{
+    return published_.read();
+}
+
+TaskHandle_t BatteryMonitor::get_task()
+{
+    return sample_task_;
+}
+
+/**
+ * @brief Body of the sampling task
+ */
+void BatteryMonitor::sample_task_loop_()
+{
+    while (true)
+    {
+        size_t bytes_read = 0;
+        i2s_read(I2S_NUM_0, dma_block_, sizeof(dma_block_), &bytes_read, portMAX_DELAY);
+        check_dropped_(bytes_read / sizeof(uint16_t));
+
+        bool updated = false;
+
+        for (size_t i = 0; i < bytes_read / sizeof(uint16_t); i++)
+        {
+            // The top 4 bits say which channel the sample came from
+            uint8_t channel = dma_block_[i] >> 12;
+            uint16_t sample = dma_block_[i] & 0x0FFF;
+
+            for (uint8_t c = 0; c < BATTERY_NUM_CHANNELS; c++)
+            {
+                if (channel != channel_ids_[c] || !filters_[c].push(sample) || !filters_[c].is_primed())
+                {
+                    continue;
+                }
+
+                if (c == 0)
+                {
+                    process_voltage_(filters_[c].get_output());
+                }
+                else
+                {
+                    process_current_(filters_[c].get_output());
+                }
+                updated = true;
+            }
+        }
+
+        if (updated)
+        {
+            state_.valid = soc_initialised_;
+            published_.write(state_);
+        }
+    }
+}
+
+void BatteryMonitor::process_voltage_(int32_t filtered)
+{
+    state_.voltage = filtered * (BATTERY_VOLTAGE_SCALE / (1 << BATTERY_FIR_EXTRA_BITS));
+
+    if (!soc_initialised_)
+    {
+        // Rough starting point from the voltage, the coulomb counter takes over from here
+        state_.soc = constrain((state_.voltage - BATTERY_EMPTY_VOLTAGE) / (BATTERY_FULL_VOLTAGE - BATTERY_EMPTY_VOLTAGE), 0.0f, 1.0f);
+        state_.charge_used = (1.0 - state_.soc) * BATTERY_CAPACITY;
+        soc_initialised_ = true;
+    }
+    else if (state_.voltage >= BATTERY_FULL_VOLTAGE && state_.current > BATTERY_FULL_CURRENT && state_.current <= 0.0)
+    {
+        // Charged and the charging current has tailed off
+        state_.charge_used = 0.0;
+        state_.soc = 1.0;
+    }
+}
+
+void BatteryMonitor::process_current_(int32_t filtered)
+{
+    state_.current = (filtered - (MOTOR_CURRENT_ZERO << BATTERY_FIR_EXTRA_BITS)) * (MOTOR_CURRENT_SCALE / (1 << BATTERY_FIR_EXTRA_BITS));
+
+    // Each output stands for BATTERY_FIR_DECIMATION samples of this channel, however late the task got to them
+    count_charge_(BATTERY_OUTPUT_PERIOD);
+}
+
+/**
+ * @brief Counts the charge for the samples the DMA overwrote before they were read, at the last current
+ * Call after each i2s_read()
+ *
+ * @param samples read, of both channels
+ */
+void BatteryMonitor::check_dropped_(size_t samples)
+{
+    unsigned long now = micros();
+
+    if (last_block_stamp_ != 0)
+    {
+        // A late task catches up by reading the ring back to back, only lag beyond a full ring means lost samples
+        block_lag_ += long(now - last_block_stamp_) - long(samples * 1000000UL / BATTERY_ADC_SAMPLE_RATE);
+        block_lag_ = max(block_lag_, 0L);
+
+        if (block_lag_ > long(BATTERY_RING_PERIOD))
+        {
+            count_charge_(block_lag_ - BATTERY_RING_PERIOD);
+            block_lag_ = BATTERY_RING_PERIOD;
+        }
+    }
+
+    last_block_stamp_ = now;
+}
+
+/**
+ * @brief Coulomb counting, adds the current over period to the charge used
+ *
+ * @param period us
+ */
+void BatteryMonitor::count_charge_(unsigned long period)
+{
+    if (!soc_initialised_)
+    {
+        return;
+    }
+
+    double hours = period / 3.6e9;
+    state_.charge_used = constrain(state_.charge_used + state_.current * hours, 0.0, BATTERY_CAPACITY);
+    state_.soc = 1.0 - state_.charge_used / BATTERY_CAPACITY;
+}
+
+BatteryMonitor battery_monitor;
+
+#endif
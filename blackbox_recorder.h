@@ -0,0 +1,541 @@
+#ifndef BLACKBOX_RECORDER_H
+#define BLACKBOX_RECORDER_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "task_table.h"
+
+/*
+Black-box recorder
+
+Logs the raw inputs to the controllers (encoder counts, GPS fixes, LIDAR points, serial frames, failsafe edges),
+the parameters and the start of every control cycle to the SD card on the TFT FeatherWing, so a run can be replayed
+through the same controller code on a PC (see tools/blackbox_replay).
+
+Records are small timestamped binary structs. Any task can record (not ISRs): the record is copied into one of two
+BLACKBOX_BUFFER_SIZE buffers under a spinlock, which takes a few us. When the buffer fills, the buffers are swapped and
+a low-priority writer task writes the full one to the card a sector at a time, taking the SPI bus lock (the baton)
+for each sector so the control loop never waits for more than one sector write. If the writer falls a whole buffer
+behind, records are dropped (and counted) rather than blocking the caller.
+
+A part-filled buffer is written anyway after BLACKBOX_FLUSH_INTERVAL, so at most that much is lost if the robot
+browns out. The rest of the block is padded with zeros (BLACKBOX_RECORD_PAD), which keeps every block sector aligned.
+
+Each boot writes a new file, /BB0000.BIN, /BB0001.BIN, ...
+
+File format (little endian, packed):
+  Blocks of BLACKBOX_BUFFER_SIZE bytes, each holding whole records:
+    BlackboxRecordHeader (type, payload length, micros() stamp), then the payload
+  A record of type BLACKBOX_RECORD_PAD means the rest of the block is empty.
+  The first record in the file is a BLACKBOX_RECORD_HEADER.
+
+With ALEXBOT_BLACKBOX set to 0 (or when building on the host) the recorder compiles down to empty calls,
+the record formats stay available for the replay tool.
+*/
+
+/******************* CONFIG **********************/
+
+#ifndef ALEXBOT_BLACKBOX
+#define ALEXBOT_BLACKBOX 1
+#endif
+
+// Must be a multiple of the 512 byte SD sector
+#define BLACKBOX_BUFFER_SIZE 4096
+
+// A part-filled buffer is written after this long
+#define BLACKBOX_FLUSH_INTERVAL 2000 // ms
+
+#define BLACKBOX_MAX_FILES 10000
+
+/*************************************************/
+
+#define BLACKBOX_SECTOR_SIZE 512
+#define BLACKBOX_MAGIC       0x58424241 // "ABBX"
+#define BLACKBOX_VERSION     1
+
+// Record types
+#define BLACKBOX_RECORD_PAD      0x00 // rest of the block is padding
+#define BLACKBOX_RECORD_HEADER   0x01 // BlackboxFileHeader
+#define BLACKBOX_RECORD_PARAM    0x02 // BlackboxParam, every parameter is logged at boot and whenever any changes
+#define BLACKBOX_RECORD_TICK     0x03 // BlackboxTick, a control cycle
+#define BLACKBOX_RECORD_ENCODER  0x04 // BlackboxEncoder
+#define BLACKBOX_RECORD_GPS      0x05 // BlackboxGps
+#define BLACKBOX_RECORD_LIDAR    0x06 // BlackboxLidar
+#define BLACKBOX_RECORD_SERIAL   0x07 // BlackboxSerial, a valid command frame
+#define BLACKBOX_RECORD_FAILSAFE 0x08 // BlackboxFailsafe, the supervisor tripped or released
+#define BLACKBOX_RECORD_MOTOR    0x09 // BlackboxMotor, output to the Sabertooth (so replays can be checked)
+
+// What a control cycle did, see BlackboxTick
+#define BLACKBOX_TICK_IDLE      0 // HALT or SLEEP, the velocity profile was reset
+#define BLACKBOX_TICK_VELOCITY  1 // the wheels followed the velocity profile
+#define BLACKBOX_TICK_MANOEUVRE 2 // an onboard position manoeuvre ran instead
+#define BLACKBOX_TICK_STEP      3 // an open loop step test ran instead (#R)
+
+#define BLACKBOX_PARAM_NAME_LENGTH 16
+
+struct __attribute__((packed)) BlackboxRecordHeader
+{
+    uint8_t type;
+    uint8_t length;     // of the payload that follows
+    uint32_t stamp;     // micros()
+};
+
+struct __attribute__((packed)) BlackboxFileHeader
+{
+    uint32_t magic;
+    uint8_t version;
+    uint16_t block_size;
+};
+
+struct __attribute__((packed)) BlackboxParam
+{
+    uint8_t id;
+    float value;
+    char name[BLACKBOX_PARAM_NAME_LENGTH];
+};
+
+struct __attribute__((packed)) BlackboxTick
+{
+    uint8_t state_id;
+    uint8_t mode;       // BLACKBOX_TICK_x
+    double linear;      // command given to the setpoint generator, m/s
+    double angular;     // rad/s
+};
+
+struct __attribute__((packed)) BlackboxEncoder
+{
+    uint8_t encoder_id;
+    int32_t raw_count;
+    uint32_t stamp_ms;  // millis() the encoder used for its velocity
+};
+
+struct __attribute__((packed)) BlackboxGps
+{
+    float latitude;     // degrees
+    float longitude;
+    uint8_t fix_quality;
+    uint8_t satellites;
+    float hdop;
+};
+
+struct __attribute__((packed)) BlackboxLidar
+{
+    float distance;     // mm
+    float angle;        // degrees
+    uint8_t quality;
+    uint8_t start_bit;
+};
+
+struct __attribute__((packed)) BlackboxSerial
+{
+    uint8_t message_type;
+    double data1;
+    double data2;
+};
+
+struct __attribute__((packed)) BlackboxFailsafe
+{
+    uint8_t trip_reasons; // SAFETY_TRIP_x bitmask, after the edge
+};
+
+struct __attribute__((packed)) BlackboxMotor
+{
+    uint8_t motor_id;
+    int8_t power;
+};
+
+#if ALEXBOT_BLACKBOX && defined(ESP32)
+
+#include <SD.h>
+
+class BlackboxRecorder
+{
+    public:
+        BlackboxRecorder();
+        bool init(uint8_t chip_select_pin, SemaphoreHandle_t spi_lock);
+        void record(uint8_t type, const void *payload, uint8_t length, uint32_t stamp);
+        void record_tick(uint32_t stamp, uint8_t state_id, uint8_t mode, double linear, double angular);
+        void record_param(uint8_t id, const char *name, float value);
+        void record_encoder(uint8_t encoder_id, long raw_count, unsigned long stamp_ms);
+        void record_gps(float latitude, float longitude, uint8_t fix_quality, uint8_t satellites, float hdop);
+        void record_lidar(float distance, float angle, uint8_t quality, bool start_bit);
+        void record_serial(int message_type, double data1, double data2);
+        void record_failsafe(uint8_t trip_reasons, uint32_t stamp);
+        void record_motor(uint8_t motor_id, int power);
+        bool is_recording();
+        TaskHandle_t get_task();
+        void print_stats();
+
+        // Called from the writer task below, not for general use
+        void writer_task_loop_();
+
+    private:
+        bool swap_();
+        void write_block_(uint8_t index);
+
+        bool recording_;
+        File file_;
+        SemaphoreHandle_t spi_lock_;
+
+        // Records go into buffers_[active_], buffers_[full_] is waiting for the writer (-1 if none).
+        // Only touched under mux_
+        uint8_t buffers_[2][BLACKBOX_BUFFER_SIZE];
+        uint16_t fill_[2];
+        uint8_t active_;
+        int8_t full_;
+        portMUX_TYPE mux_;
+
+        // Stats
+        uint32_t records_;
+        uint32_t dropped_;
+        uint32_t blocks_written_;
+        uint32_t max_write_us_;
+
+        TaskHandle_t writer_task_;
+        StackType_t writer_task_stack_[task_table[TASK_BLACKBOX].stack_size];
+        StaticTask_t writer_task_buffer_;
+};
+
+void blackbox_writer_task_func_(void *parameter)
+{
+    ((BlackboxRecorder *)parameter)->writer_task_loop_();
+}
+
+BlackboxRecorder::BlackboxRecorder()
+{
+    this->recording_      = false;
+    this->spi_lock_       = NULL;
+    this->fill_[0]        = 0;
+    this->fill_[1]        = 0;
+    this->active_         = 0;
+    this->full_           = -1;
+    this->records_        = 0;
+    this->dropped_        = 0;
+    this->blocks_written_ = 0;
+    this->max_write_us_   = 0;
+    this->writer_task_    = NULL;
+
+    portMUX_TYPE unlocked = portMUX_INITIALIZER_UNLOCKED;
+    this->mux_ = unlocked;
+}
+
+/**
+ * @brief Mounts the SD card, opens a new log file and starts the writer task. Call from setup(), before the
+ * tasks that use the SPI bus have been started
+ *
+ * @param spi_lock taken around every SD access, as the card shares the SPI bus with the encoders and the TFT
+ * @return false if there is no card (nothing gets recorded)
+ */
+bool BlackboxRecorder::init(uint8_t chip_select_pin, SemaphoreHandle_t spi_lock)
+{
+    spi_lock_ = spi_lock;
+
+    if (!SD.begin(chip_select_pin))
+    {
+        Serial.println("Blackbox: no SD card, not recording");
+        return false;
+    }
+
+    char path[16];
+    for (uint16_t i = 0; i < BLACKBOX_MAX_FILES; i++)
+    {
+        snprintf(path, sizeof(path), "/BB%04u.BIN", i);
+        if (!SD.exists(path))
+        {
+            file_ = SD.open(path, FILE_WRITE);
+            break;
+        }
+    }
+
+    if (!file_)
+    {
+        Serial.println("Blackbox: could not create a log file, not recording");
+        return false;
+    }
+
+    Serial.print("Blackbox: recording to ");
+    Serial.println(path);
+
+    const TaskPlacement &placement = task_table[TASK_BLACKBOX];
+    writer_task_ = xTaskCreateStaticPinnedToCore(
+        blackbox_writer_task_func_, /* Task function. */
+        placement.name,             /* String with name of task. */
+        placement.stack_size,       /* Stack size in words. */
+        this,                       /* Parameter passed as input of the task */
+        placement.priority,         /* Priority of the task. */
+        writer_task_stack_,         /* Stack. */
+        &writer_task_buffer_,       /* Task control block. */
+        placement.core);            /* Core ID to execute on. */
+
+    recording_ = true;
+
+    BlackboxFileHeader header;
+    header.magic = BLACKBOX_MAGIC;
+    header.version = BLACKBOX_VERSION;
+    header.block_size = BLACKBOX_BUFFER_SIZE;
+    record(BLACKBOX_RECORD_HEADER, &header, sizeof(header), micros());
+    return true;
+}
+
+/**
+ * @brief Appends a record, never blocks. Not safe to call from an ISR
+ */
+void BlackboxRecorder::record(uint8_t type, const void *payload, uint8_t length, uint32_t stamp)
+{
+    if (!recording_)
+    {
+        return;
+    }
+
+    BlackboxRecordHeader header;
+    header.type = type;
+    header.length = length;
+    header.stamp = stamp;
+
+    uint16_t size = sizeof(header) + length;
+    bool swapped = false;
+
+    portENTER_CRITICAL(&mux_);
+    if (fill_[active_] + size > BLACKBOX_BUFFER_SIZE)
+    {
+        swapped = swap_();
+    }
+
+    if (fill_[active_] + size <= BLACKBOX_BUFFER_SIZE)
+    {
+        uint8_t *dest = &buffers_[active_][fill_[active_]];
+        memcpy(dest, &header, sizeof(header));
+        memcpy(dest + sizeof(header), payload, length);
+        fill_[active_] += size;
+        records_++;
+    }
+    else
+    {
+        dropped_++;
+    }
+    portEXIT_CRITICAL(&mux_);
+
+    if (swapped)
+    {
+        xTaskNotifyGive(writer_task_);
+    }
+}
+
+/**
+ * @brief Start of a control cycle, with the command given to the setpoint generator
+ *
+ * @param stamp the micros() the cycle used for its velocity profile
+ */
+void BlackboxRecorder::record_tick(uint32_t stamp, uint8_t state_id, uint8_t mode, double linear, double angular)
+{
+    BlackboxTick tick;
+    tick.state_id = state_id;
+    tick.mode = mode;
+    tick.linear = linear;
+    tick.angular = angular;
+    record(BLACKBOX_RECORD_TICK, &tick, sizeof(tick), stamp);
+}
+
+void BlackboxRecorder::record_param(uint8_t id, const char *name, float value)
+{
+    BlackboxParam param;
+    param.id = id;
+    param.value = value;
+    strncpy(param.name, name, BLACKBOX_PARAM_NAME_LENGTH);
+    record(BLACKBOX_RECORD_PARAM, &param, sizeof(param), micros());
+}
+
+void BlackboxRecorder::record_encoder(uint8_t encoder_id, long raw_count, unsigned long stamp_ms)
+{
+    BlackboxEncoder encoder;
+    encoder.encoder_id = encoder_id;
+    encoder.raw_count = raw_count;
+    encoder.stamp_ms = stamp_ms;
+    record(BLACKBOX_RECORD_ENCODER, &encoder, sizeof(encoder), micros());
+}
+
+void BlackboxRecorder::record_gps(float latitude, float longitude, uint8_t fix_quality, uint8_t satellites, float hdop)
+{
+    BlackboxGps gps;
+    gps.latitude = latitude;
+    gps.longitude = longitude;
+    gps.fix_quality = fix_quality;
+    gps.satellites = satellites;
+    gps.hdop = hdop;
+    record(BLACKBOX_RECORD_GPS, &gps, sizeof(gps), micros());
+}
+
+void BlackboxRecorder::record_lidar(float distance, float angle, uint8_t quality, bool start_bit)
+{
+    BlackboxLidar lidar;
+    lidar.distance = distance;
+    lidar.angle = angle;
+    lidar.quality = quality;
+    lidar.start_bit = start_bit;
+    record(BLACKBOX_RECORD_LIDAR, &lidar, sizeof(lidar), micros());
+}
+
+void BlackboxRecorder::record_serial(int message_type, double data1, double data2)
+{
+    BlackboxSerial serial;
+    serial.message_type = message_type;
+    serial.data1 = data1;
+    serial.data2 = data2;
+    record(BLACKBOX_RECORD_SERIAL, &serial, sizeof(serial), micros());
+}
+
+/**
+ * @param stamp micros() of the edge
+ */
+void BlackboxRecorder::record_failsafe(uint8_t trip_reasons, uint32_t stamp)
+{
+    BlackboxFailsafe failsafe;
+    failsafe.trip_reasons = trip_reasons;
+    record(BLACKBOX_RECORD_FAILSAFE, &failsafe, sizeof(failsafe), stamp);
+}
+
+void BlackboxRecorder::record_motor(uint8_t motor_id, int power)
+{
+    BlackboxMotor motor;
+    motor.motor_id = motor_id;
+    motor.power = power;
+    record(BLACKBOX_RECORD_MOTOR, &motor, sizeof(motor), micros());
+}
+
+bool BlackboxRecorder::is_recording()
+{
+    return recording_;
+}
+
+TaskHandle_t BlackboxRecorder::get_task()
+{
+    return writer_task_;
+}
+
+void BlackboxRecorder::print_stats()
+{
+    Serial.print("Blackbox: recording=");
+    Serial.print(recording_);
+    Serial.print(", records=");
+    Serial.print(records_);
+    Serial.print(", dropped=");
+    Serial.print(dropped_);
+    Serial.print(", blocks=");
+    Serial.print(blocks_written_);
+    Serial.print(", max_block_write_us=");
+    Serial.println(max_write_us_);
+}
+
+/**
+ * @brief Hands the active buffer to the writer, call under mux_
+ *
+ * @return false if the writer still hasn't finished with the other buffer
+ */
+bool BlackboxRecorder::swap_()
+{
+    if (full_ >= 0)
+    {
+        return false;
+    }
+
+    full_ = active_;
+    active_ ^= 1;
+    fill_[active_] = 0;
+    return true;
+}
+
+/**
+ * @brief Pads the block out and writes it a sector at a time
+ */
+void BlackboxRecorder::write_block_(uint8_t index)
+{
+    // Only this task touches a full buffer, so no lock is needed to pad it
+    memset(&buffers_[index][fill_[index]], BLACKBOX_RECORD_PAD, BLACKBOX_BUFFER_SIZE - fill_[index]);
+
+    unsigned long start = micros();
+    bool ok = true;
+
+    for (uint16_t offset = 0; offset < BLACKBOX_BUFFER_SIZE && ok; offset += BLACKBOX_SECTOR_SIZE)
+    {
+        xSemaphoreTake(spi_lock_, portMAX_DELAY);
+        ok = (file_.write(&buffers_[index][offset], BLACKBOX_SECTOR_SIZE) == BLACKBOX_SECTOR_SIZE);
+        xSemaphoreGive(spi_lock_);
+    }
+
+    // Commits the directory entry, so the file is readable even if we never get to close it
+    xSemaphoreTake(spi_lock_, portMAX_DELAY);
+    file_.flush();
+    xSemaphoreGive(spi_lock_);
+
+    uint32_t write_us = micros() - start;
+    if (write_us > max_write_us_)
+    {
+        max_write_us_ = write_us;
+    }
+
+    if (!ok)
+    {
+        Serial.println("ERROR: Blackbox SD write failed, recording stopped");
+        recording_ = false;
+        return;
+    }
+
+    blocks_written_++;
+}
+
+/**
+ * @brief Body of the writer task, writes each buffer as it fills (or every BLACKBOX_FLUSH_INTERVAL)
+ */
+void BlackboxRecorder::writer_task_loop_()
+{
+    while (true)
+    {
+        bool notified = ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(BLACKBOX_FLUSH_INTERVAL));
+
+        portENTER_CRITICAL(&mux_);
+        if (!notified && fill_[active_] > 0)
+        {
+            swap_();
+        }
+        int8_t full = full_;
+        portEXIT_CRITICAL(&mux_);
+
+        if (full < 0)
+        {
+            continue;
+        }
+
+        write_block_(full);
+
+        portENTER_CRITICAL(&mux_);
+        full_ = -1;
+        portEXIT_CRITICAL(&mux_);
+    }
+}
+
+#else
+
+// Recording disabled, or a host build (tools/blackbox_replay), every call is a no-op
+class BlackboxRecorder
+{
+    public:
+        bool init(uint8_t, void *) { return false; }
+        void record_tick(uint32_t, uint8_t, uint8_t, double, double) {}
+        void record_param(uint8_t, const char *, float) {}
+        void record_encoder(uint8_t, long, unsigned long) {}
+        void record_gps(float, float, uint8_t, uint8_t, float) {}
+        void record_lidar(float, float, uint8_t, bool) {}
+        void record_serial(int, double, double) {}
+        void record_failsafe(uint8_t, uint32_t) {}
+        void record_motor(uint8_t, int) {}
+        bool is_recording() { return false; }
+        void *get_task() { return NULL; }
+        void print_stats() {}
+};
+
+#endif
+
+BlackboxRecorder blackbox;
+
+#endif
@@ -0,0 +1,148 @@
+#ifndef BOOT_SEQUENCE_H
+#define BOOT_SEQUENCE_H
+
+/*
+Boot sequence, times each phase of startup and brings the slow peripherals up after the control loop is running
+
+After a reset (a brown-out in particular, with the robot possibly moving) it has to be back under control as soon as
+possible, so setup() only does what the control loop needs, safety first:
+  Safety     the Sabertooth told to stop, the failsafe switch and watchdog, the encoders
+  Control    parameters, motor controllers, Zombie mode and the battery monitor
+  Tasks      the background tasks, then the control and auxillary loops
+The control loop's first cycle marks the robot as controllable. The slow peripherals come up after that, on the
+auxillary loop's task (core 0, low priority) before its first cycle, one deferred phase after another:
+  Blackbox   SD card mount and log file (the parameters are logged again once it is recording)
+  GPS        serial port and receiver configuration
+  TFT        display reset and diagnostics
+They share the SPI bus and the control loop's data, so each holds the baton while it runs; the control loop waits
+for them as it does for a TFT refresh. Until a phase has finished is_ready() is false for it, and whatever uses that
+peripheral leaves it alone. The LIDAR spin-up and the IMU calibration belong here too, once they are wired up.
+
+Times are micros() since reset, so they include the bootloader. print_report() (#Y,0,0!, and automatically once
+the deferred phases are done) lists each phase and when the robot became controllable.
+*/
+
+#define BOOT_PHASE_SAFETY   0
+#define BOOT_PHASE_CONTROL  1
+#define BOOT_PHASE_TASKS    2
+#define BOOT_PHASE_BLACKBOX 3
+#define BOOT_PHASE_GPS      4
+#define BOOT_PHASE_TFT      5
+#define BOOT_NUM_PHASES     6
+
+// The phases from here on are run by the auxillary loop's task, in order
+#define BOOT_FIRST_DEFERRED BOOT_PHASE_BLACKBOX
+
+// Indexed by BOOT_PHASE_x
+const char *const boot_phase_names[BOOT_NUM_PHASES] = {"Safety", "Control", "Tasks", "Blackbox", "GPS", "TFT"};
+
+class BootSequence
+{
+    public:
+        BootSequence();
+        void begin_phase(uint8_t phase);
+        void end_phase(uint8_t phase, bool ok = true);
+        void mark_controllable();
+        bool is_ready(uint8_t phase);
+        bool is_complete();
+        void print_report();
+
+    private:
+        uint32_t start_us_[BOOT_NUM_PHASES];
+        uint32_t end_us_[BOOT_NUM_PHASES];
+        volatile uint8_t finished_; // bit per phase
+        volatile uint8_t failed_;
+        volatile uint32_t controllable_us_;
+};
+
+BootSequence boot_sequence;
+
+BootSequence::BootSequence()
+{
+    for (uint8_t i = 0; i < BOOT_NUM_PHASES; i++)
+    {
+        start_us_[i] = 0;
+        end_us_[i] = 0;
+    }
+
+    this->finished_        = 0;
+    this->failed_          = 0;
+    this->controllable_us_ = 0;
+}
+
+void BootSequence::begin_phase(uint8_t phase)
+{
+    if (phase < BOOT_NUM_PHASES)
+    {
+        start_us_[phase] = micros();
+    }
+}
+
+/**
+ * @param ok false if the peripheral didn't come up (e.g. no SD card), it then never becomes ready
+ */
+void BootSequence::end_phase(uint8_t phase, bool ok)
+{
+    if (phase >= BOOT_NUM_PHASES)
+    {
+        return;
+    }
+
+    end_us_[phase] = micros();
+    failed_ |= ok ? 0 : (1 << phase);
+    finished_ |= (1 << phase);
+}
+
+/**
+ * @brief Call from the control loop's first cycle
+ */
+void BootSequence::mark_controllable()
+{
+    if (controllable_us_ == 0)
+    {
+        controllable_us_ = micros();
+    }
+}
+
+bool BootSequence::is_ready(uint8_t phase)
+{
+    return phase < BOOT_NUM_PHASES && (finished_ & ~failed_ & (1 << phase));
+}
+
+/**
+ * @brief Every phase has finished, deferred ones included (whether or not their peripheral came up)
+ */
+bool BootSequence::is_complete()
+{
+    return finished_ == (1 << BOOT_NUM_PHASES) - 1;
+}
+
+void BootSequence::print_report()
+{
+    Serial.println(F("Boot time benchmark                Time (microseconds)"));
+
+    for (uint8_t i = 0; i < BOOT_NUM_PHASES; i++)
+    {
+        Serial.print("  ");
+        Serial.print(boot_phase_names[i]);
+        Serial.print(i >= BOOT_FIRST_DEFERRED ? " (deferred): " : ": ");
+
+        if (!(finished_ & (1 << i)))
+        {
+            Serial.println("not finished");
+            continue;
+        }
+
+        Serial.print(start_us_[i]);
+        Serial.print(" - ");
+        Serial.print(end_us_[i]);
+        Serial.print(", took ");
+        Serial.print(end_us_[i] - start_us_[i]);
+        Serial.println((failed_ & (1 << i)) ? ", not ready" : "");
+    }
+
+    Serial.print("  Controllable at: ");
+    Serial.println(controllable_us_);
+}
+
+#endif
@@ -0,0 +1,315 @@
+#ifndef CLOCK_SYNC_H
+#define CLOCK_SYNC_H
+
+/*
+Clock sync, estimates the host's (ROS) clock from pings over the serial link
+
+Commands from the host can then say when they are to run (see command_schedule.h), and the black box can be lined
+up with the host's logs. The exchange is NTP's, with the host as the client:
+  #C,<t1>,<t4 of the last reply>!    t1 is the host's time as it sends the ping (0 for t4 if no reply came back)
+  CLOCK_SYNC,<t1>,<t2>,<t3>          the reply, t2 when the ping's '#' was read and t3 as the reply goes, millis()
+Each ping also completes the exchange before it. With t4, when the host read that reply:
+  offset (robot - host) = ((t2 - t1) + (t3 - t4)) / 2
+  round trip            = (t4 - t1) - (t3 - t2)
+The offset is only right if the ping and the reply took as long as each other, and the longer the round trip the
+more it can be out (by up to half of it). So, as NTP's clock filter does, only samples whose round trip is within
+CLOCK_SYNC_DELAY_MARGIN of the shortest of the last CLOCK_SYNC_FILTER_LEN are used, the rest spent their extra time
+queueing somewhere. A link that stays slower (e.g. the parser busy with a stream of commands) is followed after a few
+pings, with the estimate that much less certain.
+
+Host times are ms on any clock that keeps going forwards, e.g. since the ROS node started. They have to fit in a
+field of the message, whole ms up to 999999999 (11 days).
+
+The two crystals don't run at quite the same rate, so the offset drifts. The estimate is an offset and a drift
+(like NTP's clock discipline, much simplified): each sample's error against the prediction moves the offset by
+CLOCK_SYNC_OFFSET_GAIN of it. A few ms of noise in each sample swamps the drift over a few seconds, so the drift is
+measured from how far the offset estimate has moved over at least CLOCK_SYNC_DRIFT_BASELINE, and filtered. Between
+samples, and for up to CLOCK_SYNC_HOLDOVER after the pings stop, the drift carries the offset on.
+
+Pings once a second are plenty. Only the control loop's task may use it.
+*/
+
+/******************* CONFIG **********************/
+
+// Samples before the estimate is used
+#define CLOCK_SYNC_MIN_SAMPLES 3
+
+// How long the estimate is trusted after the last sample
+#define CLOCK_SYNC_HOLDOVER 60000 // ms
+
+// A sample's round trip may be this much longer than the shortest recent one
+#define CLOCK_SYNC_DELAY_MARGIN 20 // ms
+
+// Exchanges the shortest round trip is taken from
+#define CLOCK_SYNC_FILTER_LEN 8
+
+// Anything longer is an exchange that got mixed up (the reply went missing and t4 is another one's)
+#define CLOCK_SYNC_MAX_DELAY 5000 // ms
+
+// Fraction of each sample's error taken up by the offset
+#define CLOCK_SYNC_OFFSET_GAIN 0.3
+
+// The drift is measured over at least this long, and each measurement moves it by this fraction of the difference
+#define CLOCK_SYNC_DRIFT_BASELINE 120000 // ms
+#define CLOCK_SYNC_DRIFT_GAIN     0.3
+
+// Crystals are good to 50 ppm or so, a larger drift is noise
+#define CLOCK_SYNC_MAX_DRIFT 200e-6
+
+/*************************************************/
+
+class ClockSync
+{
+    public:
+        ClockSync();
+        bool ping(double host_sent, double host_last_reply, unsigned long received);
+        bool is_synced(unsigned long now);
+        bool to_local(double host_time, unsigned long now, unsigned long &local_time);
+        double to_host(unsigned long local_time);
+        double get_offset(unsigned long now);
+        double get_drift();
+        void print_stats(unsigned long now);
+
+    private:
+        bool add_sample_(double host_sent, unsigned long received, unsigned long replied, double host_received);
+        double get_min_delay_();
+
+        // The last reply, waiting for its t4
+        bool pending_;
+        double pending_t1_;
+        unsigned long pending_t2_;
+        unsigned long pending_t3_;
+
+        // Estimate, robot - host in ms at last_sample_, and its rate of change
+        double offset_;
+        double drift_;
+        unsigned long last_sample_;
+
+        // Where the drift was last measured from, and how many times it has been
+        double drift_from_offset_;
+        unsigned long drift_from_;
+        uint32_t drift_measurements_;
+
+        // Round trips of the last CLOCK_SYNC_FILTER_LEN exchanges
+        double delays_[CLOCK_SYNC_FILTER_LEN];
+        uint8_t delays_next_;
+        double last_delay_;
+
+        uint32_t pings_;
+        uint32_t samples_;
+        uint32_t rejected_;
+};
+
+ClockSync::ClockSync()
+{
+    for (uint8_t i = 0; i < CLOCK_SYNC_FILTER_LEN; i++)
+    {
+        delays_[i] = CLOCK_SYNC_MAX_DELAY;
+    }
+
+    this->pending_            = false;
+    this->pending_t1_         = 0.0;
+    this->pending_t2_         = 0;
+    this->pending_t3_         = 0;
+    this->offset_             = 0.0;
+    this->drift_              = 0.0;
+    this->last_sample_        = 0;
+    this->drift_from_offset_  = 0.0;
+    this->drift_from_         = 0;
+    this->drift_measurements_ = 0;
+    this->delays_next_        = 0;
+    this->last_delay_         = 0.0;
+    this->pings_              = 0;
+    this->samples_            = 0;
+    this->rejected_           = 0;
+}
+
+/**
+ * @brief Handles a ping from the host and replies to it, call as soon as the message has been parsed
+ *
+ * @param host_sent t1, host ms
+ * @param host_last_reply t4 of the previous exchange, host ms, 0 if its reply didn't arrive
+ * @param received t2, millis() when the ping's first byte was read
+ * @return true if the previous exchange made a sample that was used
+ */
+bool ClockSync::ping(double host_sent, double host_last_reply, unsigned long received)
+{
+    bool used = false;
+    pings_++;
+
+    if (pending_ && host_last_reply > 0.0)
+    {
+        used = add_sample_(pending_t1_, pending_t2_, pending_t3_, host_last_reply);
+    }
+
+    unsigned long replied = millis();
+    Serial.print("CLOCK_SYNC,");
+    Serial.print(host_sent);
+    Serial.print(",");
+    Serial.print(received);
+    Serial.print(",");
+    Serial.println(replied);
+
+    pending_    = true;
+    pending_t1_ = host_sent;
+    pending_t2_ = received;
+    pending_t3_ = replied;
+    return used;
+}
+
+/**
+ * @brief Enough samples, and recent enough, to convert between the clocks
+ *
+ * @param now millis()
+ */
+bool ClockSync::is_synced(unsigned long now)
+{
+    return samples_ >= CLOCK_SYNC_MIN_SAMPLES && now - last_sample_ <= CLOCK_SYNC_HOLDOVER;
+}
+
+/**
+ * @param host_time host ms
+ * @param now millis()
+ * @param local_time millis() at host_time
+ * @return false if not synced
+ */
+bool ClockSync::to_local(double host_time, unsigned long now, unsigned long &local_time)
+{
+    if (!is_synced(now))
+    {
+        return false;
+    }
+
+    // millis() wraps, and so does this
+    local_time = (unsigned long)(int64_t(llround(host_time + get_offset(now))));
+    return true;
+}
+
+/**
+ * @brief The host's time at a millis(), for lining up logs (whether or not synced)
+ */
+double ClockSync::to_host(unsigned long local_time)
+{
+    return double(local_time) - get_offset(local_time);
+}
+
+/**
+ * @return ms, robot - host, at now
+ */
+double ClockSync::get_offset(unsigned long now)
+{
+    return offset_ + drift_ * double(long(now - last_sample_));
+}
+
+/**
+ * @return ms per ms, positive if the robot's clock runs fast
+ */
+double ClockSync::get_drift()
+{
+    return drift_;
+}
+
+void ClockSync::print_stats(unsigned long now)
+{
+    Serial.print("Clock sync: synced=");
+    Serial.print(is_synced(now));
+    Serial.print(", offset_ms=");
+    Serial.print(get_offset(now));
+    Serial.print(", drift_ppm=");
+    Serial.print(drift_ * 1e6);
+    Serial.print(", last_delay_ms=");
+    Serial.print(last_delay_);
+    Serial.print(", min_delay_ms=");
+    Serial.print(get_min_delay_());
+    Serial.print(", pings=");
+    Serial.print(pings_);
+    Serial.print(", samples=");
+    Serial.print(samples_);
+    Serial.print(", rejected=");
+    Serial.print(rejected_);
+    Serial.print(", last_sample_age_ms=");
+    if (samples_ > 0)
+    {
+        Serial.println(now - last_sample_);
+    }
+    else
+    {
+        Serial.println("-");
+    }
+}
+
+/**
+ * @return true if the sample was used
+ */
+bool ClockSync::add_sample_(double host_sent, unsigned long received, unsigned long replied, double host_received)
+{
+    double turnaround = double(replied - received);
+    double delay = (host_received - host_sent) - turnaround;
+
+    if (delay < 0.0 || delay > CLOCK_SYNC_MAX_DELAY)
+    {
+        rejected_++;
+        return false;
+    }
+
+    last_delay_ = delay;
+    delays_[delays_next_] = delay;
+    delays_next_ = (delays_next_ + 1) % CLOCK_SYNC_FILTER_LEN;
+
+    if (delay > get_min_delay_() + CLOCK_SYNC_DELAY_MARGIN)
+    {
+        rejected_++;
+        return false;
+    }
+
+    // Taken as at the middle of the exchange on the robot's clock, which is when the estimate is for
+    double offset = ((double(received) - host_sent) + (double(replied) - host_received)) * 0.5;
+    unsigned long at = received + (replied - received) / 2;
+
+    if (samples_ == 0)
+    {
+        offset_ = offset;
+        drift_  = 0.0;
+    }
+    else
+    {
+        double predicted = get_offset(at);
+        offset_ = predicted + CLOCK_SYNC_OFFSET_GAIN * (offset - predicted);
+    }
+
+    last_sample_ = at;
+    samples_++;
+
+    // The drift over the baseline, from the estimate once it has settled (it follows the true offset, drift or not)
+    if (samples_ == CLOCK_SYNC_MIN_SAMPLES)
+    {
+        drift_from_offset_ = offset_;
+        drift_from_ = at;
+    }
+    else if (samples_ > CLOCK_SYNC_MIN_SAMPLES && at - drift_from_ >= CLOCK_SYNC_DRIFT_BASELINE)
+    {
+        double measured = (offset_ - drift_from_offset_) / double(at - drift_from_);
+        drift_ = (drift_measurements_ == 0) ? measured : drift_ + CLOCK_SYNC_DRIFT_GAIN * (measured - drift_);
+        drift_ = constrain(drift_, -CLOCK_SYNC_MAX_DRIFT, CLOCK_SYNC_MAX_DRIFT);
+        drift_measurements_++;
+
+        drift_from_offset_ = offset_;
+        drift_from_ = at;
+    }
+
+    return true;
+}
+
+double ClockSync::get_min_delay_()
+{
+    double shortest = delays_[0];
+    for (uint8_t i = 1; i < CLOCK_SYNC_FILTER_LEN; i++)
+    {
+        shortest = min(shortest, delays_[i]);
+    }
+    return shortest;
+}
+
+ClockSync clock_sync;
+
+#endif
@@ -0,0 +1,288 @@
+#ifndef COMMAND_MUX_H
+#define COMMAND_MUX_H
+
+#include "snapshot_buffer.h"
+
+/*
+Velocity command mux
+
+Velocity commands can come from several sources at once: ROS over the serial port, the Wi-Fi joystick
+(udp_teleop.h) and Zombie mode's own navigation. Each source publishes into its own single-slot mailbox
+(a SnapshotBuffer, so a newer command simply replaces an older one), stamped with the time it was published.
+
+Once per control cycle select() picks the command to drive with:
+  - A source's command counts only while it is younger than that source's timeout, and only if the current
+    state allows that source (see alexbot.h).
+  - Of those, the source with the highest priority wins. Priorities are static, lower ID wins: the person on
+    the joystick beats ROS, which beats Zombie mode.
+  - A source can be held in charge (hold()) whatever its priority, until it is released or its command
+    times out.
+  - If no source has a current command the robot is commanded to stop.
+There are only MUX_NUM_SOURCES mailboxes to look at, so the selection takes the same time every cycle, nothing ever
+waits for a producer, and when a source times out the next one takes over on the very next cycle.
+
+Who is in charge, how old its command is, and how often it changed hands are reported by print_stats()
+(#M,0,0!).
+*/
+
+/******************* CONFIG **********************/
+
+// Highest priority first
+#define MUX_SOURCE_JOYSTICK 0
+#define MUX_SOURCE_SERIAL   1
+#define MUX_SOURCE_ZOMBIE   2
+
+/*************************************************/
+
+#define MUX_NUM_SOURCES 3
+#define MUX_NO_SOURCE   0xFF
+
+#define MUX_SOURCE_BIT(source) (1 << (source))
+
+struct CommandSourceInfo
+{
+    const char *name;
+    uint16_t timeout; // ms, default
+};
+
+// Indexed by source ID
+const CommandSourceInfo command_sources[MUX_NUM_SOURCES] = {
+    // name        timeout
+    {"joystick",   200}, // UDP_TELEOP_LINK_TIMEOUT
+    {"serial",     250}, // WATCHDOG_TIMEOUT, follows the watchdog_ms parameter
+    {"zombie",     150}, // three Zombie control periods
+};
+
+struct MuxCommand
+{
+    Velocity velocity;
+    unsigned long stamp; // ms
+    uint32_t number;     // commands published by this source so far, 0 means none yet
+};
+
+struct MuxSelection
+{
+    Velocity velocity;
+    uint8_t source;      // MUX_NO_SOURCE if nothing is current
+    unsigned long age;   // ms
+    bool is_new;         // not selected before
+};
+
+class CommandMux
+{
+    public:
+        CommandMux();
+        void publish(uint8_t source, Velocity velocity, unsigned long now);
+        MuxSelection select(unsigned long now, uint8_t allowed_sources);
+        bool hold(uint8_t source);
+        void release();
+        void discard();
+        void set_timeout(uint8_t source, unsigned long timeout);
+        uint8_t get_active_source();
+        void print_stats(unsigned long now);
+
+    private:
+        SnapshotBuffer<MuxCommand> mailboxes_[MUX_NUM_SOURCES];
+
+        // Only touched by publish(), one writer per source
+        uint32_t published_[MUX_NUM_SOURCES];
+
+        // Only touched by the control loop
+        unsigned long timeouts_[MUX_NUM_SOURCES];
+        uint32_t used_[MUX_NUM_SOURCES];      // number of the last command selected
+        uint32_t discarded_[MUX_NUM_SOURCES]; // commands up to this number are ignored
+        uint32_t selections_[MUX_NUM_SOURCES];
+        uint8_t held_;
+        uint8_t active_;
+        unsigned long active_age_;
+        uint32_t switches_;
+};
+
+CommandMux::CommandMux()
+{
+    for (uint8_t i = 0; i < MUX_NUM_SOURCES; i++)
+    {
+        this->published_[i]  = 0;
+        this->timeouts_[i]   = command_sources[i].timeout;
+        this->used_[i]       = 0;
+        this->discarded_[i]  = 0;
+        this->selections_[i] = 0;
+    }
+
+    this->held_       = MUX_NO_SOURCE;
+    this->active_     = MUX_NO_SOURCE;
+    this->active_age_ = 0;
+    this->switches_   = 0;
+}
+
+/**
+ * @brief Replaces the source's command, each source must only ever be published from one task
+ *
+ * @param now ms
+ */
+void CommandMux::publish(uint8_t source, Velocity velocity, unsigned long now)
+{
+    if (source >= MUX_NUM_SOURCES)
+    {
+        return;
+    }
+
+    MuxCommand command;
+    command.velocity = velocity;
+    command.stamp    = now;
+    command.number   = ++published_[source];
+    mailboxes_[source].write(command);
+}
+
+/**
+ * @brief Picks the command to drive with this cycle, call once per control cycle
+ *
+ * @param now ms
+ * @param allowed_sources MUX_SOURCE_BIT() of each source the current state allows
+ */
+MuxSelection CommandMux::select(unsigned long now, uint8_t allowed_sources)
+{
+    MuxCommand commands[MUX_NUM_SOURCES];
+    bool current[MUX_NUM_SOURCES];
+
+    for (uint8_t i = 0; i < MUX_NUM_SOURCES; i++)
+    {
+        commands[i] = mailboxes_[i].read();
+        current[i] = ((allowed_sources & MUX_SOURCE_BIT(i)) && commands[i].number > discarded_[i] &&
+                      now - commands[i].stamp <= timeouts_[i]);
+    }
+
+    // A held source stays in charge only while its commands keep coming
+    if (held_ != MUX_NO_SOURCE && !current[held_])
+    {
+        Serial.print("Command source released: ");
+        Serial.println(command_sources[held_].name);
+        held_ = MUX_NO_SOURCE;
+    }
+
+    uint8_t source = held_;
+    for (uint8_t i = 0; i < MUX_NUM_SOURCES && source == MUX_NO_SOURCE; i++)
+    {
+        if (current[i])
+        {
+            source = i;
+        }
+    }
+
+    if (source != active_)
+    {
+        switches_++;
+        active_ = source;
+        Serial.print("Command source: ");
+        Serial.println(source == MUX_NO_SOURCE ? "none" : command_sources[source].name);
+    }
+
+    MuxSelection selection;
+    selection.source = source;
+
+    if (source == MUX_NO_SOURCE)
+    {
+        selection.velocity.linear  = 0.0;
+        selection.velocity.angular = 0.0;
+        selection.age    = 0;
+        selection.is_new = false;
+        active_age_ = 0;
+        return selection;
+    }
+
+    selection.velocity = commands[source].velocity;
+    selection.age      = now - commands[source].stamp;
+    selection.is_new   = (commands[source].number != used_[source]);
+
+    used_[source] = commands[source].number;
+    selections_[source]++;
+    active_age_ = selection.age;
+    return selection;
+}
+
+/**
+ * @brief Keeps a source in charge whatever its priority, until release() or its command times out
+ *
+ * @return false if there is no such source
+ */
+bool CommandMux::hold(uint8_t source)
+{
+    if (source >= MUX_NUM_SOURCES)
+    {
+        return false;
+    }
+
+    held_ = source;
+    Serial.print("Command source held: ");
+    Serial.println(command_sources[source].name);
+    return true;
+}
+
+void CommandMux::release()
+{
+    held_ = MUX_NO_SOURCE;
+}
+
+/**
+ * @brief Forgets every command published so far, so only new ones are selected (e.g. after a manoeuvre)
+ */
+void CommandMux::discard()
+{
+    for (uint8_t i = 0; i < MUX_NUM_SOURCES; i++)
+    {
+        discarded_[i] = mailboxes_[i].read().number;
+    }
+}
+
+/**
+ * @param timeout ms, a command older than this is ignored
+ */
+void CommandMux::set_timeout(uint8_t source, unsigned long timeout)
+{
+    if (source < MUX_NUM_SOURCES)
+    {
+        timeouts_[source] = timeout;
+    }
+}
+
+uint8_t CommandMux::get_active_source()
+{
+    return active_;
+}
+
+void CommandMux::print_stats(unsigned long now)
+{
+    Serial.print("Command mux: active=");
+    Serial.print(active_ == MUX_NO_SOURCE ? "none" : command_sources[active_].name);
+    Serial.print(", age_ms=");
+    Serial.print(active_age_);
+    Serial.print(", held=");
+    Serial.print(held_ == MUX_NO_SOURCE ? "none" : command_sources[held_].name);
+    Serial.print(", switches=");
+    Serial.println(switches_);
+
+    for (uint8_t i = 0; i < MUX_NUM_SOURCES; i++)
+    {
+        MuxCommand command = mailboxes_[i].read();
+
+        Serial.print("  ");
+        Serial.print(command_sources[i].name);
+        Serial.print(": published=");
+        Serial.print(command.number);
+        Serial.print(", selected=");
+        Serial.print(selections_[i]);
+        Serial.print(", timeout_ms=");
+        Serial.print(timeouts_[i]);
+        Serial.print(", last_age_ms=");
+        if (command.number != 0)
+        {
+            Serial.println(now - command.stamp);
+        }
+        else
+        {
+            Serial.println("-");
+        }
+    }
+}
+
+#endif
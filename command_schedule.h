@@ -0,0 +1,195 @@
+#ifndef COMMAND_SCHEDULE_H
+#define COMMAND_SCHEDULE_H
+
+/*
+Command schedule, motion commands from the host held back until the time they are stamped with
+
+Whatever delay a command picks up on the serial link and in the parser turns straight into control lag, and it
+varies from one command to the next. Instead the host can stamp a command with when it is to run, on its own clock
+(see clock_sync.h):
+  #Q,<host ms>,0!   the next message runs at that time (#V velocity, #A advance or #T turn, anything else is refused)
+  #Q,0,0!           forget everything scheduled
+A trajectory is then streamed ahead of time, each point stamped further ahead than the link's worst delay, and the
+points run when they were meant to however long each took to arrive. An immediate #V, #A, #T or #R, leaving
+SERIAL_COMMAND_STATE, BLUETOOTH_TELEOP_STATE or ZOMBIE_STATE, or a failsafe, clears the schedule.
+
+The queue holds up to SCHEDULE_CAPACITY commands sorted by time, soonest first, and is checked at the start of every
+control cycle: each command whose time has come runs (so they run at most a control period late, in the order of
+their times), then the cycle carries on as if it had just arrived.
+
+A command arriving more than SCHEDULE_LATE_TOLERANCE after its time is dropped, it would be out of step with the
+rest of the trajectory. One stamped more than SCHEDULE_MAX_LEAD ahead is refused, the clocks are probably not synced
+properly. How late the commands ran and how close to their time they arrived are reported by #C,0,0!.
+
+Only the control loop's task may use it.
+*/
+
+/******************* CONFIG **********************/
+
+// Commands waiting at once, a trajectory streamed SCHEDULE_CAPACITY points ahead at most
+#define SCHEDULE_CAPACITY 16
+
+// A command arriving up to this long after its time still runs, straight away
+#define SCHEDULE_LATE_TOLERANCE 100 // ms
+
+// Furthest ahead a command may be scheduled
+#define SCHEDULE_MAX_LEAD 10000 // ms
+
+/*************************************************/
+
+struct ScheduledCommand
+{
+    unsigned long time; // millis() to run at
+    int message_type;   // 'V', 'A' or 'T'
+    double data1;
+    double data2;
+};
+
+class CommandSchedule
+{
+    public:
+        CommandSchedule();
+        bool add(unsigned long time, int message_type, double data1, double data2, unsigned long now);
+        bool take(unsigned long now, ScheduledCommand &command);
+        void clear();
+        uint8_t get_count();
+        void print_stats();
+
+    private:
+        ScheduledCommand queue_[SCHEDULE_CAPACITY]; // soonest first
+        uint8_t count_;
+
+        uint32_t added_;
+        uint32_t run_;
+        uint32_t late_;
+        uint32_t full_;
+        uint32_t too_far_;
+        uint32_t cleared_;
+        unsigned long max_lateness_;     // ms, of the commands run
+        unsigned long total_lateness_;
+        long min_lead_;                  // ms, how close to its time a command arrived (negative if late)
+};
+
+CommandSchedule::CommandSchedule()
+{
+    this->count_          = 0;
+    this->added_          = 0;
+    this->run_            = 0;
+    this->late_           = 0;
+    this->full_           = 0;
+    this->too_far_        = 0;
+    this->cleared_        = 0;
+    this->max_lateness_   = 0;
+    this->total_lateness_ = 0;
+    this->min_lead_       = SCHEDULE_MAX_LEAD;
+}
+
+/**
+ * @param time millis() to run at
+ * @param now millis()
+ * @return false if it was dropped (late, too far ahead, or the schedule is full)
+ */
+bool CommandSchedule::add(unsigned long time, int message_type, double data1, double data2, unsigned long now)
+{
+    long lead = long(time - now);
+    min_lead_ = min(min_lead_, lead);
+
+    if (lead < -SCHEDULE_LATE_TOLERANCE)
+    {
+        late_++;
+        return false;
+    }
+
+    if (lead > SCHEDULE_MAX_LEAD)
+    {
+        too_far_++;
+        return false;
+    }
+
+    if (count_ >= SCHEDULE_CAPACITY)
+    {
+        full_++;
+        return false;
+    }
+
+    // Insertion sort, after any already scheduled for the same time so those run in the order they arrived
+    uint8_t i = count_;
+    while (i > 0 && long(queue_[i - 1].time - time) > 0)
+    {
+        queue_[i] = queue_[i - 1];
+        i--;
+    }
+
+    queue_[i].time         = time;
+    queue_[i].message_type = message_type;
+    queue_[i].data1        = data1;
+    queue_[i].data2        = data2;
+    count_++;
+    added_++;
+    return true;
+}
+
+/**
+ * @brief Removes the soonest command if its time has come, call until it returns false each control cycle
+ *
+ * @param now millis()
+ */
+bool CommandSchedule::take(unsigned long now, ScheduledCommand &command)
+{
+    if (count_ == 0 || long(now - queue_[0].time) < 0)
+    {
+        return false;
+    }
+
+    command = queue_[0];
+    count_--;
+    for (uint8_t i = 0; i < count_; i++)
+    {
+        queue_[i] = queue_[i + 1];
+    }
+
+    // A command added late is run straight away, after its time
+    unsigned long lateness = (long(now - command.time) > 0) ? now - command.time : 0;
+    max_lateness_ = max(max_lateness_, lateness);
+    total_lateness_ += lateness;
+    run_++;
+    return true;
+}
+
+void CommandSchedule::clear()
+{
+    cleared_ += count_;
+    count_ = 0;
+}
+
+uint8_t CommandSchedule::get_count()
+{
+    return count_;
+}
+
+void CommandSchedule::print_stats()
+{
+    Serial.print("Command schedule: waiting=");
+    Serial.print(count_);
+    Serial.print(", added=");
+    Serial.print(added_);
+    Serial.print(", run=");
+    Serial.print(run_);
+    Serial.print(", late=");
+    Serial.print(late_);
+    Serial.print(", full=");
+    Serial.print(full_);
+    Serial.print(", too_far_ahead=");
+    Serial.print(too_far_);
+    Serial.print(", cleared=");
+    Serial.println(cleared_);
+
+    Serial.print("  lateness_ms: mean=");
+    Serial.print(run_ ? double(total_lateness_) / run_ : 0.0);
+    Serial.print(", max=");
+    Serial.print(max_lateness_);
+    Serial.print(", min_lead_ms=");
+    Serial.println(min_lead_);
+}
+
+#endif
@@ -0,0 +1,679 @@
+#ifndef DOCK_DETECTOR_H
+#define DOCK_DETECTOR_H
+
+#include "fast_math.h"
+#include "snapshot_buffer.h"
+#include "task_table.h"
+
+/*
+Dock detector, finds the docking station in each LIDAR revolution for the final (IR) approach
+
+The IR beacons only give a bearing. The dock's outline (the back wall and the two wings of its funnel, as the
+LIDAR sees them from in front) is matched against each completed scan, which also gives its range and which way
+it faces, i.e. how far off the dock axis the robot is.
+
+Matching is a correlation of the outline against a likelihood field of the scan:
+  - The scan's points are blurred into a grid (each point stamps a small cone), so a cell holds how close it is
+    to something the LIDAR saw. The grid is in the "sector frame", centred on the bearing the IR beacons point at.
+  - A candidate dock pose (position of the contacts, direction the dock opens towards) scores the mean grid value
+    under the outline's points, i.e. 1.0 when every part of the outline lies on a scan point.
+  - Coarse: every position in the IR sector (DOCK_SECTOR_HALF_WIDTH either side, DOCK_MIN_RANGE to
+    DOCK_MAX_RANGE) at DOCK_COARSE_RANGE_STEP / DOCK_COARSE_BEARING_STEP, facing us within DOCK_MAX_OBLIQUE, on a
+    coarse grid with every other outline point.
+  - Fine: around the best DOCK_FINE_CANDIDATES of those, on a fine grid around each, in DOCK_FINE_STEP steps.
+The number of candidates is fixed by the config, so every scan takes the same time whatever is in it, and nothing
+is searched without an IR bearing (in DOCK_SECTOR_TIMEOUT).
+
+The aux loop hands in the points as the LIDAR sends them (add_point()). Each completed revolution is matched by
+the detector task (on the control loop's core, below it, see task_table.h) while the next one fills. A
+revolution that completes while the last is still being matched is dropped. Host builds (tools/sim) match it
+straight away, in add_point().
+
+Results (get_pose()) are in the robot frame: anticlockwise from the heading, the LIDAR at the origin.
+print_stats() (#Z,0,0!) reports the scans matched and dropped, and how long matching takes.
+*/
+
+/******************* CONFIG **********************/
+
+// FIXME: measure the real dock. Its outline as the LIDAR sees it from in front, in the dock frame (mm):
+// the charging contacts are at the origin and the dock opens towards +x (along its axis, out towards the robot)
+#define DOCK_OUTLINE_VERTICES 4
+const float dock_outline[DOCK_OUTLINE_VERTICES][2] = {
+    {350.0, 400.0},   // left wing tip
+    {0.0,   175.0},   // back wall, left end
+    {0.0,  -175.0},   // back wall, right end
+    {350.0, -400.0},  // right wing tip
+};
+
+// Spacing of the points sampled along the outline
+#define DOCK_TEMPLATE_SPACING 25.0 // mm
+
+// Search space
+#define DOCK_SECTOR_HALF_WIDTH 30.0 // degrees either side of the IR bearing
+#define DOCK_MIN_RANGE         300  // mm
+#define DOCK_MAX_RANGE         3500 // mm
+#define DOCK_MAX_OBLIQUE       60.0 // degrees, furthest off the dock axis we could be looking from
+
+// Coarse search steps
+#define DOCK_COARSE_RANGE_STEP       100  // mm
+#define DOCK_COARSE_BEARING_STEP     3.0  // degrees
+#define DOCK_COARSE_ORIENTATION_STEP 10.0 // degrees
+
+// Fine search, around each of the best coarse candidates
+#define DOCK_FINE_CANDIDATES      2
+#define DOCK_FINE_STEP            20   // mm
+#define DOCK_FINE_SPAN            100  // mm either side
+#define DOCK_FINE_ANGLE_STEP      2.0  // degrees
+#define DOCK_FINE_ANGLE_SPAN      6.0  // degrees either side
+
+// Likelihood field grids (cell size, and extent in cells)
+#define DOCK_COARSE_CELL   80 // mm
+#define DOCK_COARSE_WIDTH  57 // cells, along the IR bearing from 500 mm behind the LIDAR
+#define DOCK_COARSE_HEIGHT 57 // cells, across it
+#define DOCK_FINE_CELL     20 // mm
+#define DOCK_FINE_SIZE     70 // cells each way, centred on the candidate
+
+// A pose is only reported when at least this fraction of the outline was found
+#define DOCK_MIN_CONFIDENCE 0.55
+
+// LIDAR points per revolution (the RPLidar A1 sends about 360)
+#define DOCK_MAX_SCAN_POINTS 800
+#define DOCK_MIN_SCAN_POINTS 50
+
+// The IR bearing is only used this long
+#define DOCK_SECTOR_TIMEOUT 500 // ms
+
+/*************************************************/
+
+#define DOCK_TEMPLATE_MAX_POINTS 128
+
+// Kernel each scan point stamps into a grid, 255 * (1 - distance / 2.5 cells)
+#define DOCK_KERNEL_RADIUS 2
+const uint8_t dock_kernel[2 * DOCK_KERNEL_RADIUS + 1][2 * DOCK_KERNEL_RADIUS + 1] = {
+    {0,   26,  51,  26,  0},
+    {26,  111, 153, 111, 26},
+    {51,  153, 255, 153, 51},
+    {26,  111, 153, 111, 26},
+    {0,   26,  51,  26,  0},
+};
+
+struct DockPose
+{
+    float range;         // m, LIDAR to the dock contacts
+    float bearing;       // rad, of the contacts, anticlockwise from the robot heading
+    float orientation;   // rad, direction into the dock relative to the robot heading (0: facing straight in)
+    float confidence;    // fraction of the outline found in the scan, 0 - 1
+    uint32_t scan;       // revolution number
+    unsigned long stamp; // ms, when the revolution completed
+    bool valid;
+};
+
+struct DockSearchSector
+{
+    float bearing;       // rad, anticlockwise from the robot heading
+    unsigned long stamp; // ms
+    bool valid;
+};
+
+inline float dock_wrap_angle(float angle)
+{
+    while (angle > FAST_PI)
+    {
+        angle -= 2.0f * FAST_PI;
+    }
+    while (angle < -FAST_PI)
+    {
+        angle += 2.0f * FAST_PI;
+    }
+    return angle;
+}
+
+/**
+ * @brief A likelihood field, WIDTH x HEIGHT cells of cell_size mm
+ */
+template <uint16_t WIDTH, uint16_t HEIGHT>
+class DockGrid
+{
+    public:
+        /**
+         * @param origin_x, origin_y mm, position of the corner of cell (0, 0)
+         */
+        void clear(float origin_x, float origin_y, float cell_size)
+        {
+            origin_x_ = origin_x;
+            origin_y_ = origin_y;
+            inv_cell_ = 1.0f / cell_size;
+            memset(cells_, 0, sizeof(cells_));
+        }
+
+        void add_points(const float *x, const float *y, uint16_t count)
+        {
+            for (uint16_t i = 0; i < count; i++)
+            {
+                int32_t cx = int32_t((x[i] - origin_x_) * inv_cell_);
+                int32_t cy = int32_t((y[i] - origin_y_) * inv_cell_);
+
+                if (cx < DOCK_KERNEL_RADIUS || cy < DOCK_KERNEL_RADIUS ||
+                    cx >= WIDTH - DOCK_KERNEL_RADIUS || cy >= HEIGHT - DOCK_KERNEL_RADIUS)
+                {
+                    continue;
+                }
+
+                for (int8_t ky = -DOCK_KERNEL_RADIUS; ky <= DOCK_KERNEL_RADIUS; ky++)
+                {
+                    uint8_t *row = &cells_[(cy + ky) * WIDTH + cx];
+                    const uint8_t *kernel = dock_kernel[ky + DOCK_KERNEL_RADIUS];
+
+                    for (int8_t kx = -DOCK_KERNEL_RADIUS; kx <= DOCK_KERNEL_RADIUS; kx++)
+                    {
+                        row[kx] = max(row[kx], kernel[kx + DOCK_KERNEL_RADIUS]);
+                    }
+                }
+            }
+        }
+
+        /**
+         * @brief Sum of the grid under every stride'th outline point, with the dock contacts at (x, y) and its
+         * +x axis at (cos_a, sin_a)
+         */
+        uint32_t score(const float *template_x, const float *template_y, uint16_t count, uint8_t stride,
+                       float x, float y, float cos_a, float sin_a) const
+        {
+            uint32_t sum = 0;
+            float offset_x = (x - origin_x_) * inv_cell_;
+            float offset_y = (y - origin_y_) * inv_cell_;
+            float c = cos_a * inv_cell_;
+            float s = sin_a * inv_cell_;
+
+            for (uint16_t i = 0; i < count; i += stride)
+            {
+                float px = offset_x + c * template_x[i] - s * template_y[i];
+                float py = offset_y + s * template_x[i] + c * template_y[i];
+
+                // Off the grid counts as nothing seen
+                if (px >= 0.0f && py >= 0.0f && px < WIDTH && py < HEIGHT)
+                {
+                    sum += cells_[int32_t(py) * WIDTH + int32_t(px)];
+                }
+            }
+
+            return sum;
+        }
+
+    private:
+        float origin_x_;
+        float origin_y_;
+        float inv_cell_;
+        uint8_t cells_[WIDTH * HEIGHT];
+};
+
+/**
+ * @brief The matching itself, no tasks or buffering (runs on the host too)
+ */
+class DockMatcher
+{
+    public:
+        DockMatcher();
+        DockPose match(const float *distance, const float *angle, uint16_t count, float sector_bearing);
+        uint16_t get_template_points();
+
+    private:
+        struct Candidate
+        {
+            float x;     // mm, sector frame
+            float y;
+            float axis;  // rad, direction of the dock's +x, sector frame
+            uint32_t score;
+        };
+
+        void keep_best_(Candidate *best, uint8_t size, const Candidate &candidate);
+
+        float template_x_[DOCK_TEMPLATE_MAX_POINTS];
+        float template_y_[DOCK_TEMPLATE_MAX_POINTS];
+        uint16_t template_points_;
+
+        // The scan in the sector frame
+        float angle_[DOCK_MAX_SCAN_POINTS];
+        float x_[DOCK_MAX_SCAN_POINTS];
+        float y_[DOCK_MAX_SCAN_POINTS];
+
+        DockGrid<DOCK_COARSE_WIDTH, DOCK_COARSE_HEIGHT> coarse_grid_;
+        DockGrid<DOCK_FINE_SIZE, DOCK_FINE_SIZE> fine_grid_;
+};
+
+DockMatcher::DockMatcher()
+{
+    // Sample the outline every DOCK_TEMPLATE_SPACING, once
+    template_points_ = 0;
+
+    for (uint8_t v = 0; v + 1 < DOCK_OUTLINE_VERTICES; v++)
+    {
+        float start_x = dock_outline[v][0], start_y = dock_outline[v][1];
+        float dx = dock_outline[v + 1][0] - start_x, dy = dock_outline[v + 1][1] - start_y;
+        uint16_t steps = max(uint16_t(1), uint16_t(sqrtf(dx * dx + dy * dy) / DOCK_TEMPLATE_SPACING + 0.5f));
+
+        // Each segment's last point is the next one's first, the final vertex is added after the loop
+        for (uint16_t i = 0; i < steps && template_points_ < DOCK_TEMPLATE_MAX_POINTS - 1; i++)
+        {
+            template_x_[template_points_] = start_x + dx * i / steps;
+            template_y_[template_points_] = start_y + dy * i / steps;
+            template_points_++;
+        }
+    }
+
+    template_x_[template_points_] = dock_outline[DOCK_OUTLINE_VERTICES - 1][0];
+    template_y_[template_points_] = dock_outline[DOCK_OUTLINE_VERTICES - 1][1];
+    template_points_++;
+}
+
+uint16_t DockMatcher::get_template_points()
+{
+    return template_points_;
+}
+
+/**
+ * @brief Finds the dock in one revolution
+ *
+ * @param distance mm, as the RPLidar reports them (0 for no return)
+ * @param angle degrees, clockwise, as the RPLidar reports them
+ * @param sector_bearing rad, anticlockwise from the robot heading, where the IR beacons say the dock is
+ */
+DockPose DockMatcher::match(const float *distance, const float *angle, uint16_t count, float sector_bearing)
+{
+    DockPose pose;
+    pose.valid = false;
+    pose.range = 0.0;
+    pose.bearing = 0.0;
+    pose.orientation = 0.0;
+    pose.confidence = 0.0;
+    pose.scan = 0;
+    pose.stamp = 0;
+
+    count = min(count, uint16_t(DOCK_MAX_SCAN_POINTS));
+
+    // Into the sector frame (x along the IR bearing) in one pass: clockwise degrees + the bearing, then to x, y
+    float sector_degrees = sector_bearing / FAST_DEG_TO_RAD;
+    for (uint16_t i = 0; i < count; i++)
+    {
+        angle_[i] = angle[i] + sector_degrees;
+    }
+    fast_polar_to_cartesian(distance, angle_, x_, y_, count, -FAST_DEG_TO_RAD);
+
+    // Coarse, over the whole sector
+    coarse_grid_.clear(-500.0f, -0.5f * DOCK_COARSE_HEIGHT * DOCK_COARSE_CELL, DOCK_COARSE_CELL);
+    coarse_grid_.add_points(x_, y_, count);
+
+    Candidate best[DOCK_FINE_CANDIDATES];
+    for (uint8_t i = 0; i < DOCK_FINE_CANDIDATES; i++)
+    {
+        best[i].score = 0;
+    }
+
+    const float half_width = DOCK_SECTOR_HALF_WIDTH * FAST_DEG_TO_RAD;
+    const float max_oblique = DOCK_MAX_OBLIQUE * FAST_DEG_TO_RAD;
+
+    for (float b = -half_width; b <= half_width + 1e-4f; b += DOCK_COARSE_BEARING_STEP * FAST_DEG_TO_RAD)
+    {
+        float sin_b, cos_b;
+        fast_sincos(b, sin_b, cos_b);
+
+        for (float r = DOCK_MIN_RANGE; r <= DOCK_MAX_RANGE; r += DOCK_COARSE_RANGE_STEP)
+        {
+            Candidate candidate;
+            candidate.x = r * cos_b;
+            candidate.y = r * sin_b;
+
+            // The dock opens back towards us, give or take how far off its axis we are
+            for (float o = -max_oblique; o <= max_oblique + 1e-4f; o += DOCK_COARSE_ORIENTATION_STEP * FAST_DEG_TO_RAD)
+            {
+                float sin_a, cos_a;
+                candidate.axis = b + FAST_PI + o;
+                fast_sincos(candidate.axis, sin_a, cos_a);
+
+                candidate.score = coarse_grid_.score(template_x_, template_y_, template_points_, 2,
+                                                     candidate.x, candidate.y, cos_a, sin_a);
+                keep_best_(best, DOCK_FINE_CANDIDATES, candidate);
+            }
+        }
+    }
+
+    // Fine, around each of the best
+    Candidate refined;
+    refined.score = 0;
+
+    for (uint8_t i = 0; i < DOCK_FINE_CANDIDATES; i++)
+    {
+        if (best[i].score == 0)
+        {
+            continue;
+        }
+
+        fine_grid_.clear(best[i].x - 0.5f * DOCK_FINE_SIZE * DOCK_FINE_CELL,
+                         best[i].y - 0.5f * DOCK_FINE_SIZE * DOCK_FINE_CELL, DOCK_FINE_CELL);
+        fine_grid_.add_points(x_, y_, count);
+
+        for (float a = -DOCK_FINE_ANGLE_SPAN; a <= DOCK_FINE_ANGLE_SPAN + 1e-4f; a += DOCK_FINE_ANGLE_STEP)
+        {
+            float sin_a, cos_a;
+            float axis = best[i].axis + a * FAST_DEG_TO_RAD;
+            fast_sincos(axis, sin_a, cos_a);
+
+            for (int16_t dy = -DOCK_FINE_SPAN; dy <= DOCK_FINE_SPAN; dy += DOCK_FINE_STEP)
+            {
+                for (int16_t dx = -DOCK_FINE_SPAN; dx <= DOCK_FINE_SPAN; dx += DOCK_FINE_STEP)
+                {
+                    Candidate candidate;
+                    candidate.x = best[i].x + dx;
+                    candidate.y = best[i].y + dy;
+                    candidate.axis = axis;
+                    candidate.score = fine_grid_.score(template_x_, template_y_, template_points_, 1,
+                                                       candidate.x, candidate.y, cos_a, sin_a);
+                    keep_best_(&refined, 1, candidate);
+                }
+            }
+        }
+    }
+
+    pose.confidence = float(refined.score) / (255.0f * template_points_);
+    if (refined.score == 0 || pose.confidence < DOCK_MIN_CONFIDENCE)
+    {
+        return pose;
+    }
+
+    // Back to the robot frame
+    pose.range = fast_hypot(refined.x, refined.y) / 1000.0f;
+    pose.bearing = dock_wrap_angle(fast_atan2(refined.y, refined.x) + sector_bearing);
+    pose.orientation = dock_wrap_angle(refined.axis + sector_bearing + FAST_PI);
+    pose.valid = true;
+    return pose;
+}
+
+/**
+ * @brief Inserts the candidate into best[] (highest score first) if it beats any of them
+ */
+void DockMatcher::keep_best_(Candidate *best, uint8_t size, const Candidate &candidate)
+{
+    if (candidate.score <= best[size - 1].score)
+    {
+        return;
+    }
+
+    int8_t i = size - 1;
+    while (i > 0 && best[i - 1].score < candidate.score)
+    {
+        best[i] = best[i - 1];
+        i--;
+    }
+    best[i] = candidate;
+}
+
+class DockDetector
+{
+    public:
+        DockDetector();
+        void init();
+        void add_point(float distance, float angle, uint8_t quality, bool start_bit);
+        void set_search_sector(float bearing, bool valid, unsigned long now);
+        DockPose get_pose();
+        uint32_t get_version();
+#if defined(ESP32)
+        TaskHandle_t get_task();
+#else
+        void *get_task() { return NULL; }
+#endif
+        void print_stats();
+
+        // Called from the detector task below, not for general use
+        void detector_task_loop_();
+
+    private:
+        void complete_scan_();
+        void match_scan_(uint8_t index);
+
+        DockMatcher matcher_;
+
+        // The aux loop fills scans_[filling_], scans_[ready_] is being matched while busy_
+        float distance_[2][DOCK_MAX_SCAN_POINTS];
+        float angle_[2][DOCK_MAX_SCAN_POINTS];
+        uint16_t count_[2];
+        uint8_t filling_;
+        uint8_t ready_;
+        volatile bool busy_;
+        unsigned long completed_; // ms, when scans_[ready_] completed
+
+        SnapshotBuffer<DockSearchSector> sector_;
+        SnapshotBuffer<DockPose> pose_;
+
+        // Stats
+        uint32_t scans_;
+        uint32_t dropped_;
+        uint32_t matched_;
+        uint32_t found_;
+        uint32_t last_match_us_;
+        uint32_t max_match_us_;
+
+#if defined(ESP32)
+        TaskHandle_t task_;
+        StackType_t task_stack_[task_table[TASK_DOCK_DETECTOR].stack_size];
+        StaticTask_t task_buffer_;
+#endif
+};
+
+DockDetector dock_detector;
+
+#if defined(ESP32)
+void dock_detector_task_func_(void *parameter)
+{
+    ((DockDetector *)parameter)->detector_task_loop_();
+}
+#endif
+
+DockDetector::DockDetector()
+{
+    this->count_[0]      = 0;
+    this->count_[1]      = 0;
+    this->filling_       = 0;
+    this->ready_         = 1;
+    this->busy_          = false;
+    this->completed_     = 0;
+    this->scans_         = 0;
+    this->dropped_       = 0;
+    this->matched_       = 0;
+    this->found_         = 0;
+    this->last_match_us_ = 0;
+    this->max_match_us_  = 0;
+#if defined(ESP32)
+    this->task_          = NULL;
+#endif
+}
+
+/**
+ * @brief Starts the detector task, call from setup()
+ */
+void DockDetector::init()
+{
+#if defined(ESP32)
+    const TaskPlacement &placement = task_table[TASK_DOCK_DETECTOR];
+    task_ = xTaskCreateStaticPinnedToCore(
+        dock_detector_task_func_, /* Task function. */
+        placement.name,           /* String with name of task. */
+        placement.stack_size,     /* Stack size in words. */
+        this,                     /* Parameter passed as input of the task */
+        placement.priority,       /* Priority of the task. */
+        task_stack_,              /* Stack. */
+        &task_buffer_,            /* Task control block. */
+        placement.core);          /* Core ID to execute on. */
+#endif
+}
+
+/**
+ * @brief Call for each LIDAR point as it arrives, from one task only (the aux loop)
+ *
+ * @param distance mm
+ * @param angle degrees, clockwise
+ * @param start_bit the first point of a new revolution
+ */
+void DockDetector::add_point(float distance, float angle, uint8_t quality, bool start_bit)
+{
+    if (start_bit)
+    {
+        complete_scan_();
+    }
+
+    // No return
+    if (quality == 0 || distance <= 0.0f || count_[filling_] >= DOCK_MAX_SCAN_POINTS)
+    {
+        return;
+    }
+
+    distance_[filling_][count_[filling_]] = distance;
+    angle_[filling_][count_[filling_]] = angle;
+    count_[filling_]++;
+}
+
+/**
+ * @brief Where to look, call from the control loop whenever the IR estimate changes
+ *
+ * @param bearing rad, anticlockwise from the robot heading
+ */
+void DockDetector::set_search_sector(float bearing, bool valid, unsigned long now)
+{
+    DockSearchSector sector;
+    sector.bearing = bearing;
+    sector.valid = valid;
+    sector.stamp = now;
+    sector_.write(sector);
+}
+
+/**
+ * @brief Latest result, valid only if the dock was found in the last revolution matched
+ */
+DockPose DockDetector::get_pose()
+{
+    return pose_.read();
+}
+
+/**
+ * @brief Changes each time a revolution has been matched
+ */
+uint32_t DockDetector::get_version()
+{
+    return pose_.get_version();
+}
+
+#if defined(ESP32)
+TaskHandle_t DockDetector::get_task()
+{
+    return task_;
+}
+#endif
+
+void DockDetector::print_stats()
+{
+    Serial.print("Dock detector: scans=");
+    Serial.print(scans_);
+    Serial.print(", dropped (still matching)=");
+    Serial.print(dropped_);
+    Serial.print(", matched=");
+    Serial.print(matched_);
+    Serial.print(", dock found=");
+    Serial.print(found_);
+    Serial.print(", match_us last=");
+    Serial.print(last_match_us_);
+    Serial.print(" max=");
+    Serial.println(max_match_us_);
+
+    DockPose pose = get_pose();
+    if (pose.valid)
+    {
+        Serial.print("  Dock: range=");
+        Serial.print(pose.range);
+        Serial.print(" m, bearing=");
+        Serial.print(pose.bearing);
+        Serial.print(" rad, orientation=");
+        Serial.print(pose.orientation);
+        Serial.print(" rad, confidence=");
+        Serial.println(pose.confidence);
+    }
+}
+
+/**
+ * @brief A revolution has completed, hand it over to be matched (unless the last one still is)
+ */
+void DockDetector::complete_scan_()
+{
+    if (count_[filling_] < DOCK_MIN_SCAN_POINTS)
+    {
+        count_[filling_] = 0;
+        return;
+    }
+
+    scans_++;
+
+    if (busy_)
+    {
+        dropped_++;
+        count_[filling_] = 0;
+        return;
+    }
+
+    ready_ = filling_;
+    filling_ ^= 1;
+    count_[filling_] = 0;
+    completed_ = millis();
+    busy_ = true;
+
+#if defined(ESP32)
+    xTaskNotifyGive(task_);
+#else
+    match_scan_(ready_);
+#endif
+}
+
+/**
+ * @brief Matches scans_[index] if there is a recent IR bearing to search around, publishes the result
+ */
+void DockDetector::match_scan_(uint8_t index)
+{
+    DockSearchSector sector = sector_.read();
+    DockPose pose;
+
+    if (sector.valid && long(completed_ - sector.stamp) <= DOCK_SECTOR_TIMEOUT)
+    {
+        uint32_t start = micros();
+        pose = matcher_.match(distance_[index], angle_[index], count_[index], sector.bearing);
+        last_match_us_ = micros() - start;
+        max_match_us_ = max(max_match_us_, last_match_us_);
+        matched_++;
+        found_ += pose.valid ? 1 : 0;
+    }
+    else
+    {
+        pose.valid = false;
+        pose.range = 0.0;
+        pose.bearing = 0.0;
+        pose.orientation = 0.0;
+        pose.confidence = 0.0;
+    }
+
+    pose.scan = scans_;
+    pose.stamp = completed_;
+    pose_.write(pose);
+    busy_ = false;
+}
+
+/**
+ * @brief Body of the detector task, matches each revolution as it is handed over
+ */
+void DockDetector::detector_task_loop_()
+{
+#if defined(ESP32)
+    while (true)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        match_scan_(ready_);
+    }
+#endif
+}
+
+#endif
@@ -2,6 +2,9 @@
 
 #include <SPI.h>
 
+#include "profiler.h"
+#include "blackbox_recorder.h"
+
 // Weighting Constant for velocity exponentially weighted moving average
 #define EWMA_ALPHA 1.0
 
@@ -29,6 +32,7 @@ struct WheelEncoderFeedback
     double distance_travelled;
     double velocity;
     bool velocity_is_valid;
+    unsigned long stamp; // millis() of the read
 };
 
 class WheelEncoderLS7366
@@ -37,6 +41,8 @@ class WheelEncoderLS7366
         WheelEncoderLS7366(uint8_t encoder_id, uint8_t chip_select_pin, double counts_per_rev, double wheel_radius);
         WheelEncoderFeedback get_update();
         void reset_encoder();
+        void set_geometry(double counts_per_rev, double wheel_radius);
+        double get_counts_per_metre();
 
     private:
         long request_encoder_position_();
@@ -74,7 +80,12 @@ WheelEncoderLS7366::WheelEncoderLS7366(uint8_t encoder_id, uint8_t chip_select_p
 WheelEncoderFeedback WheelEncoderLS7366::get_update()
 {
     WheelEncoderFeedback feedback;
-    feedback.raw_count = request_encoder_position_();
+
+    {
+        PROFILE_SCOPE(PROFILE_STAGE_ENCODER);
+        feedback.raw_count = request_encoder_position_();
+    }
+    feedback.stamp = latest_stamp_;
 
     feedback.distance_travelled = (double(feedback.raw_count) / counts_per_rev_) * TAU * wheel_radius_;
     double distance_travelled_prev = (double(prev_count_) / counts_per_rev_) * TAU * wheel_radius_;
@@ -82,8 +93,12 @@ WheelEncoderFeedback WheelEncoderLS7366::get_update()
     double t_delta = double(latest_stamp_ - prev_stamp_);
     double x_delta = feedback.distance_travelled - distance_travelled_prev;
 
-    feedback.velocity_is_valid = (t_delta <= VELOCITY_CALCULATION_TIMEOUT);
-    filtered_vel_ = EWMA_ALPHA * (x_delta / t_delta) + (1.0 - EWMA_ALPHA) * filtered_vel_;
+    // Velocity in m/s, to match the setpoints
+    feedback.velocity_is_valid = (t_delta > 0 && t_delta <= VELOCITY_CALCULATION_TIMEOUT);
+    if (feedback.velocity_is_valid)
+    {
+        filtered_vel_ = EWMA_ALPHA * (x_delta / (t_delta / 1000.0)) + (1.0 - EWMA_ALPHA) * filtered_vel_;
+    }
     feedback.velocity = filtered_vel_;
 
     Serial.print("Encoder ");
@@ -121,6 +136,8 @@ long WheelEncoderLS7366::request_encoder_position_()
 
     prev_count_ = latest_count_;
     latest_count_ = ((long)count1_val << 24) + ((long)count2_val << 16) + ((long)count3_val << 8) + (long)count4_val;
+
+    blackbox.record_encoder(encoder_id_, latest_count_, latest_stamp_);
     return latest_count_;
 }
 
@@ -129,4 +146,18 @@ void WheelEncoderLS7366::reset_encoder()
     digitalWrite(chip_select_pin_, HIGH);
     SPI.transfer(CLR | CNTR);
     digitalWrite(chip_select_pin_, LOW);
-}
\ No newline at end of file
+}
+
+void WheelEncoderLS7366::set_geometry(double counts_per_rev, double wheel_radius)
+{
+    counts_per_rev_ = counts_per_rev;
+    wheel_radius_   = wheel_radius;
+}
+
+/**
+ * @return double, encoder counts per metre travelled by the wheel
+ */
+double WheelEncoderLS7366::get_counts_per_metre()
+{
+    return counts_per_rev_ / (TAU * wheel_radius_);
+}
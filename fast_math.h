@@ -0,0 +1,183 @@
+#ifndef FAST_MATH_H
+#define FAST_MATH_H
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+Fast float math for the geometry in the control loops (GPS bearings, docking, LIDAR points)
+
+The ESP32's FPU only does single precision, every double operation and every libm call (sinf and atan2f included,
+which take care of every corner of the float range) is done in software. These are short polynomials in float,
+good to about the precision of a float over the ranges the robot actually uses, with no tables and no branches
+in the trig beyond the quadrant.
+
+Maximum errors, measured against double precision libm over every float in the domain (tools/fast_math_bench), about
+a float's rounding error (6e-8 relative) or a few times it:
+    fast_sincos(x)      |x| <= FAST_TRIG_MAX_ARG   absolute 1.0e-7 (sin and cos)
+    fast_atan2(y, x)    any finite y, x             absolute 3.2e-7 rad, result in [-pi, pi], fast_atan2(0, 0) = 0
+    fast_inv_sqrt(x)    normal x > 0                relative 2.0e-7
+    fast_sqrt(x)        normal x > 0, or 0          relative 2.5e-7
+    fast_hypot(x, y)    x^2 + y^2 normal, or 0      relative 2.5e-7 (from random pairs, not every float)
+
+Batch versions work on whole arrays in one pass, e.g. a LIDAR scan kept as separate distance and angle arrays
+(struct of arrays): each loop streams through memory once with no calls and no branches, so it pipelines on the
+ESP32 and vectorises on a PC.
+*/
+
+/******************* CONFIG **********************/
+
+// Largest argument fast_sincos() is accurate for (rad), the range reduction needs k * pi / 2 exact
+#define FAST_TRIG_MAX_ARG 8192.0f
+
+/*************************************************/
+
+#define FAST_PI         3.14159265358979f
+#define FAST_HALF_PI    1.57079632679490f
+#define FAST_TWO_OVER_PI 0.636619772367581f
+#define FAST_DEG_TO_RAD 0.0174532925199433f
+
+// pi / 2 in three parts, the first two with few enough bits that k times them is exact
+#define FAST_PIO2_1 1.5703125f
+#define FAST_PIO2_2 4.837512969970703125e-4f
+#define FAST_PIO2_3 7.54978995489188216e-8f
+
+/**
+ * @brief sin and cos of the same angle
+ *
+ * @param x rad, |x| <= FAST_TRIG_MAX_ARG
+ */
+inline void fast_sincos(float x, float &sin_x, float &cos_x)
+{
+    // Nearest multiple of pi / 2, r is what's left over, in [-pi / 4, pi / 4]
+    int32_t k = int32_t(x * FAST_TWO_OVER_PI + ((x >= 0.0f) ? 0.5f : -0.5f));
+    float kf = float(k);
+    float r = ((x - kf * FAST_PIO2_1) - kf * FAST_PIO2_2) - kf * FAST_PIO2_3;
+
+    // Minimax polynomials on [-pi / 4, pi / 4] (Cephes sinf and cosf)
+    float z = r * r;
+    float s = r + r * z * (-1.6666654611e-1f + z * (8.3321608736e-3f + z * -1.9515295891e-4f));
+    float c = 1.0f - 0.5f * z + z * z * (4.166664568298827e-2f + z * (-1.388731625493765e-3f + z * 2.443315711809948e-5f));
+
+    // Back to the quadrant we started in
+    uint32_t quadrant = uint32_t(k);
+    float sin_q = (quadrant & 1) ? c : s;
+    float cos_q = (quadrant & 1) ? s : c;
+    sin_x = (quadrant & 2) ? -sin_q : sin_q;
+    cos_x = ((quadrant + 1) & 2) ? -cos_q : cos_q;
+}
+
+/**
+ * @return rad, in [-pi, pi]
+ */
+inline float fast_atan2(float y, float x)
+{
+    float abs_x = fabsf(x);
+    float abs_y = fabsf(y);
+    float larger = (abs_x > abs_y) ? abs_x : abs_y;
+    float smaller = (abs_x > abs_y) ? abs_y : abs_x;
+
+    if (larger == 0.0f)
+    {
+        return 0.0f;
+    }
+
+    // atan on [0, 1] (Abramowitz and Stegun 4.4.49), then unfolded into the right octant
+    float a = smaller / larger;
+    float s = a * a;
+    float r = a * (0.9999993329f + s * (-0.3332985605f + s * (0.1994653599f + s * (-0.1390853351f +
+              s * (0.0964200441f + s * (-0.0559098861f + s * (0.0218612288f + s * -0.0040540580f)))))));
+
+    // Most of the error is rounding these to a float, rather than in the polynomial (2e-8)
+    r = (abs_y > abs_x) ? FAST_HALF_PI - r : r;
+    r = (x < 0.0f) ? FAST_PI - r : r;
+    return (y < 0.0f) ? -r : r;
+}
+
+/**
+ * @brief 1 / sqrt(x)
+ *
+ * @param x normal and > 0
+ */
+inline float fast_inv_sqrt(float x)
+{
+    // First guess from halving the exponent (3.4 % out), then three Newton steps (1.8e-3, 4.7e-6, then rounding)
+    uint32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    bits = 0x5F375A86 - (bits >> 1);
+
+    float y;
+    memcpy(&y, &bits, sizeof(y));
+
+    float half_x = 0.5f * x;
+    y = y * (1.5f - half_x * y * y);
+    y = y * (1.5f - half_x * y * y);
+    y = y * (1.5f - half_x * y * y);
+    return y;
+}
+
+/**
+ * @param x normal and > 0, or 0
+ */
+inline float fast_sqrt(float x)
+{
+    return (x > 0.0f) ? x * fast_inv_sqrt(x) : 0.0f;
+}
+
+/**
+ * @brief sqrt(x^2 + y^2), without the care libm takes about overflow (|x| and |y| up to about 1e19)
+ */
+inline float fast_hypot(float x, float y)
+{
+    return fast_sqrt(x * x + y * y);
+}
+
+/**
+ * @brief fast_sincos() of every angle in the array
+ *
+ * @param angle rad
+ */
+inline void fast_sincos_batch(const float *angle, float *sin_out, float *cos_out, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        fast_sincos(angle[i], sin_out[i], cos_out[i]);
+    }
+}
+
+/**
+ * @brief Polar to cartesian, for a whole scan
+ * x = range cos(angle * angle_scale), y = range sin(angle * angle_scale)
+ *
+ * @param angle_scale rad per unit of angle, e.g. -FAST_DEG_TO_RAD for the RPLidar's clockwise degrees
+ *                    (x ahead, y to the left)
+ */
+inline void fast_polar_to_cartesian(const float *range, const float *angle, float *x, float *y, size_t count,
+                                    float angle_scale = 1.0f)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        float sin_a, cos_a;
+        fast_sincos(angle[i] * angle_scale, sin_a, cos_a);
+        x[i] = range[i] * cos_a;
+        y[i] = range[i] * sin_a;
+    }
+}
+
+/**
+ * @brief Cartesian to polar, for a whole set of points
+ *
+ * @param bearing rad, in [-pi, pi], anticlockwise from x
+ */
+inline void fast_cartesian_to_polar(const float *x, const float *y, float *range, float *bearing, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        range[i] = fast_hypot(x[i], y[i]);
+        bearing[i] = fast_atan2(y[i], x[i]);
+    }
+}
+
+#endif
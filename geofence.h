@@ -0,0 +1,645 @@
+#ifndef GEOFENCE_H
+#define GEOFENCE_H
+
+#include "fast_math.h"
+#include "gps_utils.h"
+
+/*
+Geofence, keep-out and keep-in zones for Zombie mode's GPS navigation
+
+Zombie mode drives from waypoint to waypoint with nothing else to stop it crossing a road, a pond or a flowerbed.
+Zones are polygons of lat/lon vertices in flash (geofence_zones[] in zombie_mode.h). A keep-out zone (the
+flowerbed) must not be entered, a keep-in zone (the yard) must not be left.
+
+build() projects the vertices once, into metres east (x) and north (y) of an origin near them (the dock), and
+buckets the zones' edges into a uniform grid over them (GEOFENCE_MARGIN beyond their bounding box):
+  - Each cell lists the edges that pass within GEOFENCE_MARGIN of it, so whatever boundary is near a point in the
+    cell is in that list. Lists are packed one after another (cell_start_[] indexes them), so the whole index is a
+    few kB and there is no heap.
+  - Each cell records which zones its centre is inside.
+The cells start at GEOFENCE_CELL_SIZE and double until the grid fits in GEOFENCE_MAX_CELLS and its lists in
+GEOFENCE_MAX_REFS, so a bigger area gets coarser cells, not a failed build.
+
+check() then only looks at the edges of one cell: a point is inside a zone if the centre is, and an even number
+of that zone's edges cross the line from the centre to the point (or outside, if an odd number do). The same
+edges give the distance to the nearest boundary and which way the allowed side is. A check costs the few edges
+in a cell however many zones and vertices there are. Points outside the grid (outside every zone, and further
+than GEOFENCE_MARGIN from them) are checked against every edge.
+
+The projection is equirectangular, good to a few cm over a few hundred metres. Distances are capped at
+GEOFENCE_MARGIN, anything further away doesn't need to be known.
+*/
+
+/******************* CONFIG **********************/
+
+// Zones and vertices in all (each edge's index has to fit a uint8_t)
+#define GEOFENCE_MAX_ZONES    8
+#define GEOFENCE_MAX_VERTICES 128
+
+// Boundaries are tracked this far away, and the robot starts slowing at this distance
+#define GEOFENCE_MARGIN 3.0 // m
+
+// Smallest cell, and the most cells and edge references the grid can hold
+#define GEOFENCE_CELL_SIZE 2.0 // m
+#define GEOFENCE_MAX_CELLS 2048
+#define GEOFENCE_MAX_REFS  2048
+
+/*************************************************/
+
+#define GEOFENCE_KEEP_OUT 0
+#define GEOFENCE_KEEP_IN  1
+
+#define GEOFENCE_NO_ZONE 0xFF
+#define GEOFENCE_NO_EDGE 0xFF
+
+// A zone, vertices first_vertex to first_vertex + num_vertices - 1 in order round it (either way round)
+struct GeofenceZone
+{
+    const char *name;
+    uint8_t type; // GEOFENCE_KEEP_x
+    uint8_t first_vertex;
+    uint8_t num_vertices;
+};
+
+struct GeofenceStatus
+{
+    bool valid;      // false if no zones were built
+    bool violation;  // inside a keep-out zone, or outside a keep-in zone
+    uint8_t zone;    // the zone nearest to being (or most) violated, GEOFENCE_NO_ZONE if none within the margin
+    float clearance; // m to that zone's boundary, negative when in violation, GEOFENCE_MARGIN at most
+    float normal_x;  // unit vector from the boundary towards the allowed side (0 when clear of every zone)
+    float normal_y;
+};
+
+class Geofence
+{
+    public:
+        Geofence();
+        bool build(const GeofenceZone zones[], uint8_t num_zones, const double vertices[][2], uint8_t num_vertices,
+                   double origin_lat, double origin_lon);
+        bool is_built();
+        void to_local(double lat, double lon, float &x, float &y);
+        GeofenceStatus check(float x, float y);
+        const char *get_zone_name(uint8_t zone);
+        void print_stats();
+
+    private:
+        struct Nearest
+        {
+            bool inside;
+            float distance;
+            float x, y;   // nearest point on the boundary
+            uint8_t edge;
+        };
+
+        bool index_(float cell_size, bool fill);
+        GeofenceStatus check_cell_(uint16_t cell, float x, float y);
+        GeofenceStatus check_all_(float x, float y);
+        GeofenceStatus pick_(Nearest nearest[], float x, float y);
+        void nearest_on_edge_(uint8_t edge, float x, float y, Nearest &nearest);
+        bool inside_zone_(uint8_t zone, float x, float y);
+        bool is_edge_(uint8_t edge);
+        static bool edge_hits_box_(float ax, float ay, float bx, float by, float x0, float y0, float x1, float y1);
+
+        bool built_;
+        const GeofenceZone *zones_;
+        uint8_t num_zones_;
+        uint8_t num_edges_;
+        double origin_lat_;
+        double origin_lon_;
+        float metres_per_lon_; // per radian
+
+        // Vertices in metres, and edge i runs from vertex i to edge_end_[i] (the zone's vertices wrap round)
+        float vertex_x_[GEOFENCE_MAX_VERTICES];
+        float vertex_y_[GEOFENCE_MAX_VERTICES];
+        uint8_t edge_end_[GEOFENCE_MAX_VERTICES];
+        uint8_t edge_zone_[GEOFENCE_MAX_VERTICES];
+
+        // Grid, row by row from (min_x_, min_y_)
+        float min_x_;
+        float min_y_;
+        float cell_size_;
+        uint16_t cols_;
+        uint16_t rows_;
+        uint16_t cell_start_[GEOFENCE_MAX_CELLS + 1]; // cell i's edges are cell_edges_[cell_start_[i]] up to cell_start_[i + 1]
+        uint8_t cell_edges_[GEOFENCE_MAX_REFS];
+        uint8_t cell_inside_[GEOFENCE_MAX_CELLS];      // bit per zone, the cell's centre is inside it
+
+        // Instrumentation
+        uint32_t checks_;
+        uint32_t checks_outside_;  // outside the grid, against every edge
+        uint32_t violations_;
+        uint16_t max_cell_edges_;
+        uint16_t num_refs_;
+        unsigned long build_us_;
+        unsigned long max_check_us_;
+};
+
+Geofence::Geofence()
+{
+    this->built_          = false;
+    this->zones_          = NULL;
+    this->num_zones_      = 0;
+    this->num_edges_      = 0;
+    this->origin_lat_     = 0.0;
+    this->origin_lon_     = 0.0;
+    this->metres_per_lon_ = 0.0;
+    this->min_x_          = 0.0;
+    this->min_y_          = 0.0;
+    this->cell_size_      = GEOFENCE_CELL_SIZE;
+    this->cols_           = 0;
+    this->rows_           = 0;
+    this->checks_         = 0;
+    this->checks_outside_ = 0;
+    this->violations_     = 0;
+    this->max_cell_edges_ = 0;
+    this->num_refs_       = 0;
+    this->build_us_       = 0;
+    this->max_check_us_   = 0;
+}
+
+/**
+ * @brief Projects the zones and builds the grid, once at boot (it takes a few ms)
+ *
+ * @param zones kept, so has to stay put (a const table in flash)
+ * @param vertices lat, lon pairs (degrees), indexed by the zones' first_vertex
+ * @param origin_lat,origin_lon where x and y are measured from (degrees), somewhere near the zones
+ * @return false if the zones don't fit or refer to vertices that don't exist, nothing is then checked
+ */
+bool Geofence::build(const GeofenceZone zones[], uint8_t num_zones, const double vertices[][2], uint8_t num_vertices,
+                     double origin_lat, double origin_lon)
+{
+    unsigned long start = micros();
+    built_ = false;
+
+    if (num_zones == 0 || num_zones > GEOFENCE_MAX_ZONES || num_vertices > GEOFENCE_MAX_VERTICES)
+    {
+        return false;
+    }
+
+    zones_ = zones;
+    num_zones_ = num_zones;
+    origin_lat_ = origin_lat;
+    origin_lon_ = origin_lon;
+    metres_per_lon_ = R * cos(RAD(origin_lat));
+
+    num_edges_ = 0;
+    for (uint8_t v = 0; v < GEOFENCE_MAX_VERTICES; v++)
+    {
+        edge_zone_[v] = GEOFENCE_NO_ZONE;
+    }
+
+    for (uint8_t z = 0; z < num_zones; z++)
+    {
+        const GeofenceZone &zone = zones[z];
+        if (zone.num_vertices < 3 || int(zone.first_vertex) + zone.num_vertices > num_vertices)
+        {
+            return false;
+        }
+
+        for (uint8_t i = 0; i < zone.num_vertices; i++)
+        {
+            uint8_t v = zone.first_vertex + i;
+            to_local(vertices[v][0], vertices[v][1], vertex_x_[v], vertex_y_[v]);
+            edge_end_[v] = zone.first_vertex + (i + 1) % zone.num_vertices;
+            edge_zone_[v] = z;
+            num_edges_++;
+        }
+    }
+
+    // Bounding box of every zone, plus the margin
+    float max_x = -1e9, max_y = -1e9;
+    min_x_ = 1e9;
+    min_y_ = 1e9;
+    for (uint8_t z = 0; z < num_zones; z++)
+    {
+        for (uint8_t v = zones[z].first_vertex; v < zones[z].first_vertex + zones[z].num_vertices; v++)
+        {
+            min_x_ = min(min_x_, vertex_x_[v]);
+            min_y_ = min(min_y_, vertex_y_[v]);
+            max_x = max(max_x, vertex_x_[v]);
+            max_y = max(max_y, vertex_y_[v]);
+        }
+    }
+    min_x_ -= GEOFENCE_MARGIN;
+    min_y_ -= GEOFENCE_MARGIN;
+    max_x += GEOFENCE_MARGIN;
+    max_y += GEOFENCE_MARGIN;
+
+    // Coarser cells until it fits
+    for (cell_size_ = GEOFENCE_CELL_SIZE; ; cell_size_ *= 2.0f)
+    {
+        cols_ = uint16_t(ceil((max_x - min_x_) / cell_size_));
+        rows_ = uint16_t(ceil((max_y - min_y_) / cell_size_));
+
+        if (long(cols_) * rows_ <= GEOFENCE_MAX_CELLS && index_(cell_size_, false))
+        {
+            break;
+        }
+    }
+    index_(cell_size_, true);
+
+    // Which zones each cell's centre is inside
+    max_cell_edges_ = 0;
+    for (uint16_t cell = 0; cell < cols_ * rows_; cell++)
+    {
+        float cx = min_x_ + (cell % cols_ + 0.5f) * cell_size_;
+        float cy = min_y_ + (cell / cols_ + 0.5f) * cell_size_;
+
+        cell_inside_[cell] = 0;
+        for (uint8_t z = 0; z < num_zones; z++)
+        {
+            cell_inside_[cell] |= inside_zone_(z, cx, cy) ? (1 << z) : 0;
+        }
+
+        max_cell_edges_ = max(max_cell_edges_, uint16_t(cell_start_[cell + 1] - cell_start_[cell]));
+    }
+
+    built_ = true;
+    build_us_ = micros() - start;
+    return true;
+}
+
+bool Geofence::is_built()
+{
+    return built_;
+}
+
+/**
+ * @brief lat, lon (degrees) to metres east and north of the origin
+ */
+void Geofence::to_local(double lat, double lon, float &x, float &y)
+{
+    x = float(RAD(lon - origin_lon_) * metres_per_lon_);
+    y = float(RAD(lat - origin_lat_) * R);
+}
+
+/**
+ * @param x,y metres east and north of the origin
+ */
+GeofenceStatus Geofence::check(float x, float y)
+{
+    GeofenceStatus status;
+    if (!built_)
+    {
+        status.valid = false;
+        status.violation = false;
+        status.zone = GEOFENCE_NO_ZONE;
+        status.clearance = GEOFENCE_MARGIN;
+        status.normal_x = status.normal_y = 0.0;
+        return status;
+    }
+
+    unsigned long start = micros();
+    int col = int(floor((x - min_x_) / cell_size_));
+    int row = int(floor((y - min_y_) / cell_size_));
+
+    if (col >= 0 && col < cols_ && row >= 0 && row < rows_)
+    {
+        status = check_cell_(row * cols_ + col, x, y);
+    }
+    else
+    {
+        status = check_all_(x, y);
+        checks_outside_++;
+    }
+
+    checks_++;
+    violations_ += status.violation ? 1 : 0;
+    max_check_us_ = max(max_check_us_, micros() - start);
+    return status;
+}
+
+const char *Geofence::get_zone_name(uint8_t zone)
+{
+    return (zone < num_zones_) ? zones_[zone].name : "-";
+}
+
+void Geofence::print_stats()
+{
+    Serial.print("Geofence: zones=");
+    Serial.print(num_zones_);
+    Serial.print(", edges=");
+    Serial.print(num_edges_);
+    Serial.print(", built=");
+    Serial.print(built_);
+    Serial.print(", grid=");
+    Serial.print(cols_);
+    Serial.print("x");
+    Serial.print(rows_);
+    Serial.print(" of ");
+    Serial.print(cell_size_);
+    Serial.print(" m, refs=");
+    Serial.print(num_refs_);
+    Serial.print(", max_cell_edges=");
+    Serial.print(max_cell_edges_);
+    Serial.print(", build_us=");
+    Serial.println(build_us_);
+
+    Serial.print("  checks=");
+    Serial.print(checks_);
+    Serial.print(", outside_grid=");
+    Serial.print(checks_outside_);
+    Serial.print(", violations=");
+    Serial.print(violations_);
+    Serial.print(", check_us max=");
+    Serial.println(max_check_us_);
+}
+
+/**
+ * @brief Lists each edge in the cells it passes within the margin of
+ *
+ * @param fill false to only check that the lists fit
+ */
+bool Geofence::index_(float cell_size, bool fill)
+{
+    uint16_t num_cells = cols_ * rows_;
+    uint32_t refs = 0;
+
+    for (uint16_t cell = 0; cell <= num_cells; cell++)
+    {
+        cell_start_[cell] = 0;
+    }
+
+    // Counted, then packed (a count per cell, its start, then each cell's edges from its start)
+    for (uint8_t pass = 0; pass < (fill ? 2 : 1); pass++)
+    {
+        for (uint8_t e = 0; e < GEOFENCE_MAX_VERTICES; e++)
+        {
+            if (!is_edge_(e))
+            {
+                continue;
+            }
+
+            float ax = vertex_x_[e], ay = vertex_y_[e];
+            float bx = vertex_x_[edge_end_[e]], by = vertex_y_[edge_end_[e]];
+
+            int col0 = max(int(floor((min(ax, bx) - GEOFENCE_MARGIN - min_x_) / cell_size)), 0);
+            int col1 = min(int(floor((max(ax, bx) + GEOFENCE_MARGIN - min_x_) / cell_size)), cols_ - 1);
+            int row0 = max(int(floor((min(ay, by) - GEOFENCE_MARGIN - min_y_) / cell_size)), 0);
+            int row1 = min(int(floor((max(ay, by) + GEOFENCE_MARGIN - min_y_) / cell_size)), rows_ - 1);
+
+            for (int row = row0; row <= row1; row++)
+            {
+                for (int col = col0; col <= col1; col++)
+                {
+                    // The cell grown by the margin, a little more than the margin at its corners
+                    float x0 = min_x_ + col * cell_size - GEOFENCE_MARGIN;
+                    float y0 = min_y_ + row * cell_size - GEOFENCE_MARGIN;
+                    if (!edge_hits_box_(ax, ay, bx, by, x0, y0, x0 + cell_size + 2.0f * GEOFENCE_MARGIN,
+                                        y0 + cell_size + 2.0f * GEOFENCE_MARGIN))
+                    {
+                        continue;
+                    }
+
+                    uint16_t cell = row * cols_ + col;
+                    if (pass == 0)
+                    {
+                        refs++;
+                        cell_start_[cell + 1]++;
+                    }
+                    else
+                    {
+                        cell_edges_[cell_start_[cell]++] = e;
+                    }
+                }
+            }
+        }
+
+        if (pass == 0)
+        {
+            if (refs > GEOFENCE_MAX_REFS)
+            {
+                return false;
+            }
+
+            for (uint16_t cell = 0; cell < num_cells; cell++)
+            {
+                cell_start_[cell + 1] += cell_start_[cell];
+            }
+        }
+    }
+
+    if (fill)
+    {
+        // Each start was moved on to the next cell's as it was filled
+        for (uint16_t cell = num_cells; cell > 0; cell--)
+        {
+            cell_start_[cell] = cell_start_[cell - 1];
+        }
+        cell_start_[0] = 0;
+        num_refs_ = refs;
+    }
+
+    return true;
+}
+
+GeofenceStatus Geofence::check_cell_(uint16_t cell, float x, float y)
+{
+    Nearest nearest[GEOFENCE_MAX_ZONES];
+    for (uint8_t z = 0; z < num_zones_; z++)
+    {
+        nearest[z].inside = cell_inside_[cell] & (1 << z);
+        nearest[z].distance = GEOFENCE_MARGIN;
+        nearest[z].edge = GEOFENCE_NO_EDGE;
+    }
+
+    float cx = min_x_ + (cell % cols_ + 0.5f) * cell_size_;
+    float cy = min_y_ + (cell / cols_ + 0.5f) * cell_size_;
+    float dx = x - cx, dy = y - cy;
+
+    for (uint16_t i = cell_start_[cell]; i < cell_start_[cell + 1]; i++)
+    {
+        uint8_t e = cell_edges_[i];
+        Nearest &n = nearest[edge_zone_[e]];
+        float ax = vertex_x_[e], ay = vertex_y_[e];
+        float bx = vertex_x_[edge_end_[e]], by = vertex_y_[edge_end_[e]];
+
+        // Crossing the line from the centre to the point swaps inside and out. A vertex exactly on that line
+        // counts as being on the same side for both of its edges, so it is crossed once or not at all
+        bool a_left = dx * (ay - cy) - dy * (ax - cx) > 0.0f;
+        bool b_left = dx * (by - cy) - dy * (bx - cx) > 0.0f;
+        if (a_left != b_left)
+        {
+            float ex = bx - ax, ey = by - ay;
+            bool centre_left = ex * (cy - ay) - ey * (cx - ax) > 0.0f;
+            bool point_left = ex * (y - ay) - ey * (x - ax) > 0.0f;
+            n.inside ^= (centre_left != point_left);
+        }
+
+        nearest_on_edge_(e, x, y, n);
+    }
+
+    // Deep inside a zone it mustn't be in, there are no edges to say which way out is
+    for (uint8_t z = 0; z < num_zones_; z++)
+    {
+        if (nearest[z].edge == GEOFENCE_NO_EDGE && nearest[z].inside != (zones_[z].type == GEOFENCE_KEEP_IN))
+        {
+            return check_all_(x, y);
+        }
+    }
+
+    return pick_(nearest, x, y);
+}
+
+GeofenceStatus Geofence::check_all_(float x, float y)
+{
+    Nearest nearest[GEOFENCE_MAX_ZONES];
+    for (uint8_t z = 0; z < num_zones_; z++)
+    {
+        nearest[z].inside = inside_zone_(z, x, y);
+        nearest[z].distance = 1e9;
+        nearest[z].edge = GEOFENCE_NO_EDGE;
+
+        for (uint8_t e = zones_[z].first_vertex; e < zones_[z].first_vertex + zones_[z].num_vertices; e++)
+        {
+            nearest_on_edge_(e, x, y, nearest[z]);
+        }
+
+        // Same as from the grid, only boundaries within the margin are of interest
+        if (nearest[z].distance > GEOFENCE_MARGIN && nearest[z].inside == (zones_[z].type == GEOFENCE_KEEP_IN))
+        {
+            nearest[z].distance = GEOFENCE_MARGIN;
+            nearest[z].edge = GEOFENCE_NO_EDGE;
+        }
+    }
+
+    return pick_(nearest, x, y);
+}
+
+/**
+ * @brief The zone with the least clearance, and which way its allowed side is
+ */
+GeofenceStatus Geofence::pick_(Nearest nearest[], float x, float y)
+{
+    GeofenceStatus status;
+    status.valid = true;
+    status.violation = false;
+    status.zone = GEOFENCE_NO_ZONE;
+    status.clearance = GEOFENCE_MARGIN;
+    status.normal_x = status.normal_y = 0.0;
+
+    for (uint8_t z = 0; z < num_zones_; z++)
+    {
+        const Nearest &n = nearest[z];
+        bool allowed = (n.inside == (zones_[z].type == GEOFENCE_KEEP_IN));
+        float clearance = allowed ? n.distance : -n.distance;
+
+        if (n.edge == GEOFENCE_NO_EDGE || clearance >= status.clearance)
+        {
+            continue;
+        }
+
+        status.violation = !allowed;
+        status.zone = z;
+        status.clearance = clearance;
+
+        // Away from the boundary on our side, or towards it if we are on the wrong side
+        float nx = x - n.x, ny = y - n.y;
+        if (n.distance < 0.01f)
+        {
+            // On the boundary, square to the edge instead (towards its left, inside if the zone goes anticlockwise)
+            nx = -(vertex_y_[edge_end_[n.edge]] - vertex_y_[n.edge]);
+            ny = vertex_x_[edge_end_[n.edge]] - vertex_x_[n.edge];
+            bool left_inside = inside_zone_(z, n.x + 0.01f * nx, n.y + 0.01f * ny);
+            if (left_inside != (zones_[z].type == GEOFENCE_KEEP_IN))
+            {
+                nx = -nx;
+                ny = -ny;
+            }
+        }
+        else if (!allowed)
+        {
+            nx = -nx;
+            ny = -ny;
+        }
+
+        float length = fast_hypot(nx, ny);
+        status.normal_x = (length > 0.0f) ? nx / length : 0.0f;
+        status.normal_y = (length > 0.0f) ? ny / length : 0.0f;
+    }
+
+    return status;
+}
+
+/**
+ * @brief Updates nearest if the edge is closer
+ */
+void Geofence::nearest_on_edge_(uint8_t edge, float x, float y, Nearest &nearest)
+{
+    float ax = vertex_x_[edge], ay = vertex_y_[edge];
+    float ex = vertex_x_[edge_end_[edge]] - ax, ey = vertex_y_[edge_end_[edge]] - ay;
+    float length_sq = ex * ex + ey * ey;
+
+    float t = (length_sq > 0.0f) ? constrain(((x - ax) * ex + (y - ay) * ey) / length_sq, 0.0f, 1.0f) : 0.0f;
+    float qx = ax + t * ex, qy = ay + t * ey;
+    float distance = fast_hypot(x - qx, y - qy);
+
+    if (distance < nearest.distance)
+    {
+        nearest.distance = distance;
+        nearest.x = qx;
+        nearest.y = qy;
+        nearest.edge = edge;
+    }
+}
+
+/**
+ * @brief Even-odd ray cast against every edge of the zone
+ */
+bool Geofence::inside_zone_(uint8_t zone, float x, float y)
+{
+    bool inside = false;
+    for (uint8_t e = zones_[zone].first_vertex; e < zones_[zone].first_vertex + zones_[zone].num_vertices; e++)
+    {
+        float ax = vertex_x_[e], ay = vertex_y_[e];
+        float bx = vertex_x_[edge_end_[e]], by = vertex_y_[edge_end_[e]];
+
+        if ((ay > y) != (by > y) && x < ax + (y - ay) * (bx - ax) / (by - ay))
+        {
+            inside = !inside;
+        }
+    }
+    return inside;
+}
+
+/**
+ * @brief Vertices not in any zone don't start an edge
+ */
+bool Geofence::is_edge_(uint8_t edge)
+{
+    return edge_zone_[edge] < num_zones_;
+}
+
+/**
+ * @brief Whether segment a-b touches the box (Liang-Barsky clipping)
+ */
+bool Geofence::edge_hits_box_(float ax, float ay, float bx, float by, float x0, float y0, float x1, float y1)
+{
+    float p[4] = {ax - bx, bx - ax, ay - by, by - ay};
+    float q[4] = {ax - x0, x1 - ax, ay - y0, y1 - ay};
+    float t0 = 0.0f, t1 = 1.0f;
+
+    for (uint8_t i = 0; i < 4; i++)
+    {
+        if (p[i] == 0.0f)
+        {
+            if (q[i] < 0.0f)
+            {
+                return false;
+            }
+        }
+        else if (p[i] < 0.0f)
+        {
+            t0 = max(t0, q[i] / p[i]);
+        }
+        else
+        {
+            t1 = min(t1, q[i] / p[i]);
+        }
+    }
+
+    return t0 <= t1;
+}
+
+#endif
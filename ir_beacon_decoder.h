@@ -0,0 +1,420 @@
+#include <math.h>
+#include <stdint.h>
+
+#include "fast_math.h"
+
+/*
+Decoder for the docking station IR beacons (replication of the XR-210 protocol, see README.md)
+
+The dock sends a long SYNC pulse from all three LEDs, followed by single short pulses from the LEFT, MIDDLE
+then RIGHT LEDs, each in its own time slot:
+
+         SYNC        LEFT   MIDDLE   RIGHT
+    ____________     ___     ___     ___
+   |            |   |   |   |   |   |   |
+ __|            |___|   |___|   |___|   |_____ ... (next frame)
+
+The LEDs are shrouded so each one can only be seen from its own side of the dock axis,
+i.e. the slots a receiver sees tell us which side of the dock we are on, and which receivers see the dock
+tell us where the dock is relative to the robot heading.
+
+Edges are timestamped in the pin ISRs and pushed into a small ring buffer per receiver,
+all decoding happens off-ISR in process(). Nothing here ever waits on a pin.
+IRBeaconDecoder itself never touches the hardware, so synthetic edge traces can be fed to push_edge() on the host.
+*/
+
+/******************* CONFIG **********************/
+
+// Receivers in the order used for the ring buffers and mounting angles
+#define IR_RECEIVER_FRONT_LEFT   0
+#define IR_RECEIVER_FRONT_CENTRE 1
+#define IR_RECEIVER_FRONT_RIGHT  2
+#define IR_RECEIVER_REAR_CENTRE  3
+#define IR_NUM_RECEIVERS         4
+
+// FIXME: Mounting angle of each receiver relative to the robot heading (rad, anticlockwise positive)
+#define IR_ANGLE_FRONT_LEFT   (PI / 4.0)
+#define IR_ANGLE_FRONT_CENTRE 0.0
+#define IR_ANGLE_FRONT_RIGHT  (-PI / 4.0)
+#define IR_ANGLE_REAR_CENTRE  PI
+
+// Beacon slots within a frame
+#define IR_BEACON_LEFT   0
+#define IR_BEACON_MIDDLE 1
+#define IR_BEACON_RIGHT  2
+#define IR_NUM_BEACONS   3
+
+// 38kHz demodulators (e.g. TSOP382) pull their output LOW while the carrier is present
+#define IR_RECEIVER_ACTIVE_LOW 1
+
+// FIXME: Protocol timing, must match the docking station firmware
+#define IR_SYNC_MIN_US        1500
+#define IR_SYNC_MAX_US        3000
+#define IR_BEACON_MIN_US      250
+#define IR_BEACON_MAX_US      900
+#define IR_SLOT_OFFSET_US     500   // SYNC end to the start of the LEFT pulse
+#define IR_SLOT_PERIOD_US     1000  // start of one beacon pulse to the start of the next
+#define IR_FRAME_PERIOD_US    10000 // SYNC to SYNC
+
+// A frame is closed if the RIGHT slot has been and gone
+#define IR_FRAME_LENGTH_US (IR_SLOT_OFFSET_US + IR_NUM_BEACONS * IR_SLOT_PERIOD_US)
+
+// Per receiver link quality is an EWMA of decoded frames per frame period
+#define IR_QUALITY_ALPHA 0.2
+
+// Below this the estimate is flagged as invalid
+#define IR_MIN_CONFIDENCE 0.3
+
+// Edges buffered per receiver between calls to process(), must be a power of 2
+// 64 edges holds 8 complete frames (~80ms)
+#define IR_EDGE_BUFFER_SIZE 64
+
+/*************************************************/
+
+struct IRDockEstimate
+{
+    float bearing;        // rad, direction of the dock relative to the robot heading (anticlockwise positive)
+    float confidence;     // 0.0 (nothing seen) to 1.0 (strong, consistent signal)
+    int8_t lateral;       // which side of the dock axis we are on: -1 right, 0 on the axis, +1 left
+    uint8_t beacons;      // bitmask of beacons seen (1 << IR_BEACON_x)
+    uint8_t receivers;    // bitmask of receivers that currently see the dock (1 << IR_RECEIVER_x)
+    bool valid;
+};
+
+class IRBeaconDecoder
+{
+    public:
+        IRBeaconDecoder();
+        void push_edge(uint8_t receiver, uint32_t stamp_us, uint8_t level);
+        IRDockEstimate process(uint32_t now_us);
+        IRDockEstimate get_estimate();
+        uint32_t get_frames_decoded();
+        uint32_t get_edges_dropped();
+
+    private:
+        struct Receiver
+        {
+            // Ring buffer, written by the ISR only (head) and read by process() only (tail)
+            volatile uint32_t edges[IR_EDGE_BUFFER_SIZE]; // stamp_us with the pin level in bit 0
+            volatile uint8_t head;
+            uint8_t tail;
+
+            // Frame decoding
+            bool in_mark;
+            uint32_t mark_start;
+            bool frame_open;
+            uint32_t sync_end;
+            uint8_t frame_mask;
+
+            // Latest complete frame
+            uint8_t beacons;
+            uint32_t last_frame;
+            uint32_t last_decay;
+            float quality;
+        };
+
+        void decode_edge_(Receiver &rx, uint32_t stamp_us, uint8_t level);
+        void close_frame_(Receiver &rx, uint32_t stamp_us);
+
+        Receiver rx_[IR_NUM_RECEIVERS];
+        IRDockEstimate estimate_;
+        uint32_t frames_decoded_;
+        volatile uint32_t edges_dropped_;
+};
+
+static const float ir_receiver_angles[IR_NUM_RECEIVERS] = {
+    IR_ANGLE_FRONT_LEFT, IR_ANGLE_FRONT_CENTRE, IR_ANGLE_FRONT_RIGHT, IR_ANGLE_REAR_CENTRE};
+
+IRBeaconDecoder::IRBeaconDecoder()
+{
+    for (uint8_t i = 0; i < IR_NUM_RECEIVERS; i++)
+    {
+        Receiver &rx = rx_[i];
+        rx.head       = 0;
+        rx.tail       = 0;
+        rx.in_mark    = false;
+        rx.mark_start = 0;
+        rx.frame_open = false;
+        rx.sync_end   = 0;
+        rx.frame_mask = 0;
+        rx.beacons    = 0;
+        rx.last_frame = 0;
+        rx.last_decay = 0;
+        rx.quality    = 0.0;
+    }
+
+    this->estimate_.bearing    = 0.0;
+    this->estimate_.confidence = 0.0;
+    this->estimate_.lateral    = 0;
+    this->estimate_.beacons    = 0;
+    this->estimate_.receivers  = 0;
+    this->estimate_.valid      = false;
+    this->frames_decoded_      = 0;
+    this->edges_dropped_       = 0;
+}
+
+/**
+ * @brief Records one edge from a receiver. Safe to call from an ISR.
+ *
+ * @param receiver IR_RECEIVER_x
+ * @param stamp_us time of the edge (micros())
+ * @param level pin level after the edge
+ */
+void IRAM_ATTR IRBeaconDecoder::push_edge(uint8_t receiver, uint32_t stamp_us, uint8_t level)
+{
+    Receiver &rx = rx_[receiver];
+    uint8_t next = (rx.head + 1) & (IR_EDGE_BUFFER_SIZE - 1);
+
+    // Buffer full, process() has fallen behind
+    if (next == rx.tail)
+    {
+        edges_dropped_ = edges_dropped_ + 1;
+        return;
+    }
+
+    rx.edges[rx.head] = (stamp_us & ~1UL) | (level & 1);
+    rx.head = next;
+}
+
+/**
+ * @brief Decodes all buffered edges and updates the dock estimate. Call this from a task, never from an ISR.
+ *
+ * @param now_us current time (micros())
+ * @return IRDockEstimate, check .valid before use
+ */
+IRDockEstimate IRBeaconDecoder::process(uint32_t now_us)
+{
+    float sum_sin = 0.0;
+    float sum_cos = 0.0;
+    float sum_quality = 0.0;
+    float max_quality = 0.0;
+    uint8_t beacons = 0;
+    uint8_t receivers = 0;
+
+    for (uint8_t i = 0; i < IR_NUM_RECEIVERS; i++)
+    {
+        Receiver &rx = rx_[i];
+
+        while (rx.tail != rx.head)
+        {
+            uint32_t edge = rx.edges[rx.tail];
+            rx.tail = (rx.tail + 1) & (IR_EDGE_BUFFER_SIZE - 1);
+            decode_edge_(rx, edge & ~1UL, edge & 1);
+        }
+
+        // Close any frame whose RIGHT slot has passed (e.g. only LEFT was visible)
+        if (rx.frame_open && (now_us - rx.sync_end) > IR_FRAME_LENGTH_US + IR_SLOT_PERIOD_US)
+        {
+            close_frame_(rx, now_us);
+        }
+
+        // Decay the link quality once per frame period without a frame
+        while ((now_us - rx.last_decay) > IR_FRAME_PERIOD_US && rx.quality > 0.0)
+        {
+            rx.quality *= (1.0 - IR_QUALITY_ALPHA);
+            rx.last_decay += IR_FRAME_PERIOD_US;
+
+            if (rx.quality < 0.01)
+            {
+                rx.quality = 0.0;
+            }
+        }
+
+        if (rx.quality <= 0.0)
+        {
+            continue;
+        }
+
+        float sin_angle, cos_angle;
+        fast_sincos(ir_receiver_angles[i], sin_angle, cos_angle);
+        sum_sin += rx.quality * sin_angle;
+        sum_cos += rx.quality * cos_angle;
+        sum_quality += rx.quality;
+        max_quality = fmaxf(max_quality, rx.quality);
+        beacons |= rx.beacons;
+        receivers |= (1 << i);
+    }
+
+    IRDockEstimate est;
+    est.beacons   = beacons;
+    est.receivers = receivers;
+
+    if (sum_quality > 0.0)
+    {
+        // Weighted circular mean of the receiver angles.
+        // Receivers on opposite sides that both claim to see the dock cancel out, which lowers the confidence
+        est.bearing = fast_atan2(sum_sin, sum_cos);
+        float agreement = fast_hypot(sum_sin, sum_cos) / sum_quality;
+        est.confidence = agreement * max_quality;
+    }
+    else
+    {
+        est.bearing = 0.0;
+        est.confidence = 0.0;
+    }
+
+    bool left   = beacons & (1 << IR_BEACON_LEFT);
+    bool middle = beacons & (1 << IR_BEACON_MIDDLE);
+    bool right  = beacons & (1 << IR_BEACON_RIGHT);
+
+    if (middle || (left && right))
+    {
+        est.lateral = 0;
+    }
+    else if (left)
+    {
+        est.lateral = 1;
+    }
+    else if (right)
+    {
+        est.lateral = -1;
+    }
+    else
+    {
+        est.lateral = 0;
+    }
+
+    est.valid = (est.confidence >= IR_MIN_CONFIDENCE);
+
+    estimate_ = est;
+    return est;
+}
+
+IRDockEstimate IRBeaconDecoder::get_estimate()
+{
+    return estimate_;
+}
+
+uint32_t IRBeaconDecoder::get_frames_decoded()
+{
+    return frames_decoded_;
+}
+
+uint32_t IRBeaconDecoder::get_edges_dropped()
+{
+    return edges_dropped_;
+}
+
+void IRBeaconDecoder::decode_edge_(Receiver &rx, uint32_t stamp_us, uint8_t level)
+{
+    bool carrier_on = IR_RECEIVER_ACTIVE_LOW ? (level == 0) : (level != 0);
+
+    if (carrier_on)
+    {
+        rx.in_mark = true;
+        rx.mark_start = stamp_us;
+        return;
+    }
+
+    if (!rx.in_mark)
+    {
+        return;
+    }
+
+    rx.in_mark = false;
+    uint32_t width = stamp_us - rx.mark_start;
+
+    if (width >= IR_SYNC_MIN_US && width <= IR_SYNC_MAX_US)
+    {
+        // A new SYNC always starts a new frame
+        if (rx.frame_open)
+        {
+            close_frame_(rx, rx.mark_start);
+        }
+
+        rx.frame_open = true;
+        rx.sync_end = stamp_us;
+        rx.frame_mask = 0;
+        return;
+    }
+
+    if (!rx.frame_open || width < IR_BEACON_MIN_US || width > IR_BEACON_MAX_US)
+    {
+        // Glitch, or a beacon pulse without a SYNC
+        return;
+    }
+
+    // Which slot did this pulse start in?
+    uint32_t offset = rx.mark_start - rx.sync_end;
+    if (offset + (IR_SLOT_PERIOD_US / 2) < IR_SLOT_OFFSET_US)
+    {
+        return;
+    }
+
+    uint32_t slot = (offset + (IR_SLOT_PERIOD_US / 2) - IR_SLOT_OFFSET_US) / IR_SLOT_PERIOD_US;
+    if (slot >= IR_NUM_BEACONS)
+    {
+        return;
+    }
+
+    rx.frame_mask |= (1 << slot);
+
+    if (slot == IR_NUM_BEACONS - 1)
+    {
+        close_frame_(rx, stamp_us);
+    }
+}
+
+void IRBeaconDecoder::close_frame_(Receiver &rx, uint32_t stamp_us)
+{
+    rx.frame_open = false;
+
+    // A SYNC on its own means we saw the dock, but from behind the LED shrouds
+    if (rx.frame_mask == 0)
+    {
+        return;
+    }
+
+    rx.beacons = rx.frame_mask;
+    rx.last_frame = stamp_us;
+    rx.last_decay = stamp_us;
+    rx.quality += IR_QUALITY_ALPHA * (1.0 - rx.quality);
+    frames_decoded_++;
+}
+
+/******************* PIN INTERRUPTS **********************/
+
+// The decoder and pins that the pin ISRs feed from, set by ir_beacon_attach_interrupts()
+IRBeaconDecoder *ir_beacon_decoder_isr_target = NULL;
+uint8_t ir_beacon_pins[IR_NUM_RECEIVERS];
+
+void IRAM_ATTR ir_isr_front_left_()
+{
+    ir_beacon_decoder_isr_target->push_edge(IR_RECEIVER_FRONT_LEFT, micros(), digitalRead(ir_beacon_pins[IR_RECEIVER_FRONT_LEFT]));
+}
+
+void IRAM_ATTR ir_isr_front_centre_()
+{
+    ir_beacon_decoder_isr_target->push_edge(IR_RECEIVER_FRONT_CENTRE, micros(), digitalRead(ir_beacon_pins[IR_RECEIVER_FRONT_CENTRE]));
+}
+
+void IRAM_ATTR ir_isr_front_right_()
+{
+    ir_beacon_decoder_isr_target->push_edge(IR_RECEIVER_FRONT_RIGHT, micros(), digitalRead(ir_beacon_pins[IR_RECEIVER_FRONT_RIGHT]));
+}
+
+void IRAM_ATTR ir_isr_rear_centre_()
+{
+    ir_beacon_decoder_isr_target->push_edge(IR_RECEIVER_REAR_CENTRE, micros(), digitalRead(ir_beacon_pins[IR_RECEIVER_REAR_CENTRE]));
+}
+
+/**
+ * @brief Routes edges from the four IR receiver pins into the given decoder
+ *
+ * @param pins indexed by IR_RECEIVER_x
+ */
+void ir_beacon_attach_interrupts(IRBeaconDecoder *decoder, const uint8_t pins[IR_NUM_RECEIVERS])
+{
+    ir_beacon_decoder_isr_target = decoder;
+
+    for (uint8_t i = 0; i < IR_NUM_RECEIVERS; i++)
+    {
+        ir_beacon_pins[i] = pins[i];
+        pinMode(pins[i], INPUT);
+    }
+
+    attachInterrupt(digitalPinToInterrupt(pins[IR_RECEIVER_FRONT_LEFT]), ir_isr_front_left_, CHANGE);
+    attachInterrupt(digitalPinToInterrupt(pins[IR_RECEIVER_FRONT_CENTRE]), ir_isr_front_centre_, CHANGE);
+    attachInterrupt(digitalPinToInterrupt(pins[IR_RECEIVER_FRONT_RIGHT]), ir_isr_front_right_, CHANGE);
+    attachInterrupt(digitalPinToInterrupt(pins[IR_RECEIVER_REAR_CENTRE]), ir_isr_rear_centre_, CHANGE);
+}
@@ -4,6 +4,8 @@
 #include "Adafruit_GFX.h"
 #include "Adafruit_HX8357.h"
 
+#include "profiler.h"
+
 // ESP32
 #define STMPE_CS 32
 #define TFT_CS 15
@@ -12,6 +14,52 @@
 
 #define TFT_RST -1
 
+// Screen as it is drawn (rotation 0, portrait), the touch panel is calibrated to it
+#define TFT_WIDTH  320
+#define TFT_HEIGHT 480
+
+#include "touch_panel.h"
+
+// Display pages
+#define TFT_PAGE_STATUS   0
+#define TFT_PAGE_PROFILER 1
+#define TFT_PAGE_CONTROLS 2
+#define TFT_NUM_PAGES     3
+
+// A dashboard button on every page, and a page button that goes to the next one
+#define TFT_ALL_PAGES 0xFF
+#define TFT_PAGE_NEXT -1
+
+/*
+Dashboard buttons, touched to do what the serial command they stand for would (#S to change state, #D to change
+page). ZOMBIE drives off by itself, so it takes a long press (TOUCH_LONG_PRESS_TIME), and HALT is a tap on every
+page. Swiping left goes to the next page, right to the one before.
+*/
+struct DashboardButton
+{
+    const char *label;
+    uint8_t page;         // TFT_PAGE_x, or TFT_ALL_PAGES
+    uint8_t gesture;      // TOUCH_GESTURE_x it takes
+    int16_t x;            // px
+    int16_t y;
+    int16_t w;
+    int16_t h;
+    uint16_t color;
+    char message_type;    // serial command it stands for
+    double data1;
+};
+
+#define DASHBOARD_NUM_BUTTONS 5
+
+const DashboardButton dashboard_buttons[DASHBOARD_NUM_BUTTONS] = {
+//   label     page               gesture                    x    y    w    h   color          message  data1
+    {"HALT",   TFT_ALL_PAGES,     TOUCH_GESTURE_TAP,         0,   400, 160, 80, HX8357_RED,    'S', HALT_STATE},
+    {"PAGE >", TFT_ALL_PAGES,     TOUCH_GESTURE_TAP,         160, 400, 160, 80, HX8357_BLUE,   'D', TFT_PAGE_NEXT},
+    {"SERIAL", TFT_PAGE_CONTROLS, TOUCH_GESTURE_TAP,         0,   100, 320, 80, HX8357_GREEN,  'S', SERIAL_COMMAND_STATE},
+    {"TELEOP", TFT_PAGE_CONTROLS, TOUCH_GESTURE_TAP,         0,   200, 320, 80, HX8357_CYAN,   'S', BLUETOOTH_TELEOP_STATE},
+    {"ZOMBIE", TFT_PAGE_CONTROLS, TOUCH_GESTURE_LONG_PRESS,  0,   300, 320, 80, HX8357_YELLOW, 'S', ZOMBIE_STATE},
+};
+
 // Use hardware SPI and the above for CS/DC
 Adafruit_HX8357 tft = Adafruit_HX8357(TFT_CS, TFT_DC, TFT_RST);
 
@@ -20,19 +68,94 @@ class TFTController
     public:
         TFTController();
         void init();
-        unsigned long update(String state_name, int8_t comms_status, bool failsafe_status, double loop_rate, double x_velocity_cmd, double theta_cmd, double battery_voltage);
+        unsigned long update(const char *state_name, int8_t comms_status, bool failsafe_status, double loop_rate, double x_velocity_cmd, double theta_cmd, double battery_voltage);
+        void set_page(uint8_t page);
+        uint8_t get_page();
+        bool needs_redraw();
+        bool dashboard_command(const TouchGesture &gesture, int &message_type, double &data1);
 
       private:
-        void display_value_(String value_name, String value, uint16_t value_color, uint8_t text_size);
+        void draw_profiler_page_();
+        void draw_buttons_();
+        bool on_page_(const DashboardButton &button);
+        uint8_t page_;
+        bool redraw_;
+        void display_value_(const char *value_name, const char *value, uint16_t value_color, uint8_t text_size);
+        void display_value_(const char *value_name, double value, const char *units);
 };
 
 TFTController::TFTController()
 {
+    page_ = TFT_PAGE_STATUS;
+    redraw_ = false;
+}
+
+void TFTController::set_page(uint8_t page)
+{
+    if (page < TFT_NUM_PAGES)
+    {
+        redraw_ = redraw_ || page != page_;
+        page_ = page;
+    }
+}
+
+uint8_t TFTController::get_page()
+{
+    return page_;
+}
+
+/**
+ * @brief The page has changed since it was last drawn, so the auxillary loop shouldn't wait for its next refresh
+ */
+bool TFTController::needs_redraw()
+{
+    return redraw_;
+}
+
+/**
+ * @brief Maps a gesture to the serial command of the dashboard control it touched, on the page showing
+ *
+ * @param gesture from touch_panel.take_gesture()
+ * @param message_type 'S' or 'D'
+ * @param data1 the state or page
+ * @return false if it touched nothing
+ */
+bool TFTController::dashboard_command(const TouchGesture &gesture, int &message_type, double &data1)
+{
+    if (gesture.type == TOUCH_GESTURE_SWIPE_LEFT || gesture.type == TOUCH_GESTURE_SWIPE_RIGHT)
+    {
+        message_type = 'D';
+        data1 = (gesture.type == TOUCH_GESTURE_SWIPE_LEFT) ? (page_ + 1) % TFT_NUM_PAGES
+                                                           : (page_ + TFT_NUM_PAGES - 1) % TFT_NUM_PAGES;
+        return true;
+    }
+
+    for (uint8_t i = 0; i < DASHBOARD_NUM_BUTTONS; i++)
+    {
+        const DashboardButton &button = dashboard_buttons[i];
+        if (on_page_(button) && gesture.type == button.gesture &&
+            gesture.x >= button.x && gesture.x < button.x + button.w &&
+            gesture.y >= button.y && gesture.y < button.y + button.h)
+        {
+            message_type = button.message_type;
+            data1 = (button.message_type == 'D' && button.data1 == TFT_PAGE_NEXT) ? (page_ + 1) % TFT_NUM_PAGES
+                                                                                    : button.data1;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool TFTController::on_page_(const DashboardButton &button)
+{
+    return button.page == TFT_ALL_PAGES || button.page == page_;
 }
 
 void TFTController::init()
 {
-    // init the tft LCD controller here
+    // init the tft LCD controller here, deferred until the control loop is running (see boot_sequence.h)
+    tft.begin();
     Serial.println("HX8357D Test!");
 
     // read diagnostics (optional but can help debug problems)
@@ -53,7 +176,7 @@ void TFTController::init()
     Serial.println(x, HEX);
 }
 
-void TFTController::display_value_(String value_name, String value, uint16_t value_color = HX8357_GREEN, uint8_t text_size=2)
+void TFTController::display_value_(const char *value_name, const char *value, uint16_t value_color = HX8357_GREEN, uint8_t text_size=2)
 {
     tft.setTextSize(text_size);
     tft.setTextColor(HX8357_WHITE);
@@ -63,7 +186,15 @@ void TFTController::display_value_(String value_name, String value, uint16_t val
     tft.println(value);
 }
 
-unsigned long TFTController::update(String state_name, int8_t comms_status, bool failsafe_status, double loop_rate, double x_velocity_cmd, double theta_cmd, double battery_voltage)
+// Formats into a stack buffer (Arduino String would allocate on the heap every refresh)
+void TFTController::display_value_(const char *value_name, double value, const char *units)
+{
+    char buffer[24];
+    snprintf(buffer, sizeof(buffer), "%.2f%s", value, units);
+    display_value_(value_name, buffer);
+}
+
+unsigned long TFTController::update(const char *state_name, int8_t comms_status, bool failsafe_status, double loop_rate, double x_velocity_cmd, double theta_cmd, double battery_voltage)
 {
     tft.fillScreen(HX8357_BLACK);
     unsigned long start = micros();
@@ -73,8 +204,23 @@ unsigned long TFTController::update(String state_name, int8_t comms_status, bool
     tft.println("Alexbot");
     // tft.drawLine(0, 6, tft.width(), 6, HX8357_RED);
 
+    redraw_ = false;
+
+    if (page_ == TFT_PAGE_PROFILER)
+    {
+        draw_profiler_page_();
+        draw_buttons_();
+        return micros() - start;
+    }
+
     display_value_("State Name", state_name);
 
+    if (page_ == TFT_PAGE_CONTROLS)
+    {
+        draw_buttons_();
+        return micros() - start;
+    }
+
     if (comms_status > 0)
     {
         display_value_("ROS Communication Status", "Good", HX8357_GREEN);
@@ -88,11 +234,73 @@ unsigned long TFTController::update(String state_name, int8_t comms_status, bool
         display_value_("ROS Communication Status", "Error!", HX8357_RED);
     }
 
-    display_value_("Loop Rate", String(loop_rate, 2) + "Hz");
-    display_value_("Failsafe Status", String(failsafe_status));
-    display_value_("X Velocity", String(x_velocity_cmd, 2) + "ms");
-    display_value_("Theta", String(x_velocity_cmd, 2) + "deg/s");
-    display_value_("Battery Voltage", String(x_velocity_cmd, 2) + "V");
+    display_value_("Loop Rate", loop_rate, "Hz");
+    display_value_("Failsafe Status", failsafe_status ? "1" : "0");
+    display_value_("X Velocity", x_velocity_cmd, "ms");
+    display_value_("Theta", theta_cmd, "deg/s");
+    display_value_("Battery Voltage", battery_voltage, "V");
 
+    draw_buttons_();
     return micros() - start;
 }
+
+/**
+ * @brief The dashboard buttons on this page, long press ones outlined rather than filled
+ */
+void TFTController::draw_buttons_()
+{
+    for (uint8_t i = 0; i < DASHBOARD_NUM_BUTTONS; i++)
+    {
+        const DashboardButton &button = dashboard_buttons[i];
+        if (!on_page_(button))
+        {
+            continue;
+        }
+
+        bool filled = button.gesture == TOUCH_GESTURE_TAP;
+        if (filled)
+        {
+            tft.fillRoundRect(button.x + 4, button.y + 4, button.w - 8, button.h - 8, 8, button.color);
+        }
+        else
+        {
+            tft.drawRoundRect(button.x + 4, button.y + 4, button.w - 8, button.h - 8, 8, button.color);
+        }
+
+        // Size 3 text is 18 x 24 px a character
+        tft.setTextSize(3);
+        tft.setTextColor(filled ? HX8357_BLACK : button.color);
+        tft.setCursor(button.x + (button.w - 18 * int16_t(strlen(button.label))) / 2, button.y + (button.h - 24) / 2);
+        tft.print(button.label);
+    }
+}
+
+/**
+ * @brief Per-stage latency table from the hot-path profiler (see profiler.h)
+ */
+void TFTController::draw_profiler_page_()
+{
+#if ALEXBOT_PROFILING
+    char buffer[48];
+
+    tft.setTextSize(2);
+    tft.setTextColor(HX8357_WHITE);
+    tft.println("Stage       count   p50   p99   max (us)");
+
+    for (uint8_t i = 0; i < PROFILE_NUM_STAGES; i++)
+    {
+        // Highlight stages whose worst case is over a millisecond
+        tft.setTextColor(profiler.get_max_us(i) > 1000 ? HX8357_RED : HX8357_GREEN);
+
+        snprintf(buffer, sizeof(buffer), "%-9s %7lu %5lu %5lu %5lu",
+                 profiler.get_name(i),
+                 (unsigned long)profiler.get_count(i),
+                 (unsigned long)profiler.get_percentile_us(i, 50),
+                 (unsigned long)profiler.get_percentile_us(i, 99),
+                 (unsigned long)profiler.get_max_us(i));
+        tft.println(buffer);
+    }
+#else
+    display_value_("Profiler", "Disabled", HX8357_YELLOW);
+#endif
+}
@@ -0,0 +1,271 @@
+#include <new>
+#include <utility>
+
+/*
+Static allocation helpers and memory reporting.
+
+All long-lived objects are placement-constructed into static storage (see StaticInstance), so the heap stays
+unfragmented and the RAM they use shows up at link time instead of at runtime.
+
+Building with ALEXBOT_ZERO_HEAP set to 1 also turns any C++ heap allocation made after heap_lock() (called at the
+end of setup()) into a loud crash, so leaks and hidden String allocations get caught on the bench rather than
+after a week in the field. To trap plain malloc/calloc/realloc as well, also link with
+    -Wl,--wrap=malloc -Wl,--wrap=calloc -Wl,--wrap=realloc
+and set ALEXBOT_ZERO_HEAP_WRAP_MALLOC to 1.
+*/
+
+/******************* CONFIG **********************/
+
+#ifndef ALEXBOT_ZERO_HEAP
+#define ALEXBOT_ZERO_HEAP 0
+#endif
+
+#ifndef ALEXBOT_ZERO_HEAP_WRAP_MALLOC
+#define ALEXBOT_ZERO_HEAP_WRAP_MALLOC 0
+#endif
+
+// How often to print the stack high-water marks and heap trend
+#define MEMORY_REPORT_INTERVAL 10000 // ms
+
+// Number of free heap samples used for the trend
+#define MEMORY_TREND_SAMPLES 8
+
+#define MEMORY_MAX_TASKS 8
+
+/*************************************************/
+
+/**
+ * @brief Reserves static storage for one T, constructed later (e.g. from init()) with create()
+ * In Arduino, hardware init calls do not work from global constructors, hence the two steps.
+ */
+template <typename T>
+class StaticInstance
+{
+    public:
+        template <typename... Args>
+        T *create(Args &&... args)
+        {
+            return new (storage_) T(std::forward<Args>(args)...);
+        }
+
+    private:
+        alignas(T) uint8_t storage_[sizeof(T)];
+};
+
+/******************* HEAP TRAP **********************/
+
+volatile bool heap_locked = false;
+
+/**
+ * @brief Call once at the end of setup(), from then on heap allocations are fatal in ALEXBOT_ZERO_HEAP builds
+ */
+void heap_lock()
+{
+    heap_locked = true;
+}
+
+// The one task allowed to allocate while the heap is locked, see HeapTrapExemption
+TaskHandle_t volatile heap_exempt_task = NULL;
+
+/**
+ * @brief Lets the calling task allocate for as long as this is in scope, the trap stays armed for every other task
+ * For explicit operator actions that must allocate (e.g. NVS writes). Only one task may hold one at a time.
+ */
+class HeapTrapExemption
+{
+    public:
+        HeapTrapExemption()
+        {
+            this->previous_  = heap_exempt_task;
+            heap_exempt_task = xTaskGetCurrentTaskHandle();
+        }
+
+        ~HeapTrapExemption()
+        {
+            heap_exempt_task = this->previous_;
+        }
+
+    private:
+        TaskHandle_t previous_;
+};
+
+#if ALEXBOT_ZERO_HEAP
+
+bool heap_trapped_()
+{
+    return heap_locked && xTaskGetCurrentTaskHandle() != heap_exempt_task;
+}
+
+void heap_trap_(size_t size, void *caller)
+{
+    // ets_printf writes straight to the UART from ROM, it doesn't allocate
+    ets_printf("\nFATAL: %u byte heap allocation after setup(), called from %p\n", (unsigned)size, caller);
+    abort();
+}
+
+void *operator new(size_t size)
+{
+    if (heap_trapped_())
+    {
+        heap_trap_(size, __builtin_return_address(0));
+    }
+    return malloc(size);
+}
+
+void *operator new[](size_t size)
+{
+    if (heap_trapped_())
+    {
+        heap_trap_(size, __builtin_return_address(0));
+    }
+    return malloc(size);
+}
+
+#if ALEXBOT_ZERO_HEAP_WRAP_MALLOC
+
+extern "C" void *__real_malloc(size_t size);
+extern "C" void *__real_calloc(size_t n, size_t size);
+extern "C" void *__real_realloc(void *ptr, size_t size);
+
+extern "C" void *__wrap_malloc(size_t size)
+{
+    if (heap_trapped_())
+    {
+        heap_trap_(size, __builtin_return_address(0));
+    }
+    return __real_malloc(size);
+}
+
+extern "C" void *__wrap_calloc(size_t n, size_t size)
+{
+    if (heap_trapped_())
+    {
+        heap_trap_(n * size, __builtin_return_address(0));
+    }
+    return __real_calloc(n, size);
+}
+
+extern "C" void *__wrap_realloc(void *ptr, size_t size)
+{
+    if (heap_trapped_())
+    {
+        heap_trap_(size, __builtin_return_address(0));
+    }
+    return __real_realloc(ptr, size);
+}
+
+#endif
+#endif
+
+/******************* REPORTING **********************/
+
+class MemoryMonitor
+{
+    public:
+        MemoryMonitor();
+        void add_task(TaskHandle_t task, const char *name, uint32_t stack_size);
+        void update();
+        void report();
+
+    private:
+        struct TaskInfo
+        {
+            TaskHandle_t handle;
+            const char *name;
+            uint32_t stack_size;
+        };
+
+        TaskInfo tasks_[MEMORY_MAX_TASKS];
+        uint8_t num_tasks_;
+
+        // Ring of free heap samples, one per MEMORY_REPORT_INTERVAL
+        uint32_t free_heap_[MEMORY_TREND_SAMPLES];
+        uint8_t num_samples_;
+        uint8_t next_sample_;
+        unsigned long last_sample_;
+};
+
+MemoryMonitor::MemoryMonitor()
+{
+    this->num_tasks_   = 0;
+    this->num_samples_ = 0;
+    this->next_sample_ = 0;
+    this->last_sample_ = 0;
+}
+
+/**
+ * @brief Registers a task for stack high-water reporting
+ *
+ * @param stack_size the stack size the task was created with
+ */
+void MemoryMonitor::add_task(TaskHandle_t task, const char *name, uint32_t stack_size)
+{
+    if (num_tasks_ >= MEMORY_MAX_TASKS)
+    {
+        return;
+    }
+
+    tasks_[num_tasks_].handle     = task;
+    tasks_[num_tasks_].name       = name;
+    tasks_[num_tasks_].stack_size = stack_size;
+    num_tasks_++;
+}
+
+/**
+ * @brief Call this from a low priority loop, samples and reports every MEMORY_REPORT_INTERVAL ms
+ */
+void MemoryMonitor::update()
+{
+    if (num_samples_ > 0 && (millis() - last_sample_) < MEMORY_REPORT_INTERVAL)
+    {
+        return;
+    }
+
+    last_sample_ = millis();
+
+    free_heap_[next_sample_] = esp_get_free_heap_size();
+    next_sample_ = (next_sample_ + 1) % MEMORY_TREND_SAMPLES;
+
+    if (num_samples_ < MEMORY_TREND_SAMPLES)
+    {
+        num_samples_++;
+    }
+
+    report();
+}
+
+/**
+ * @brief Prints the unused stack of each registered task, and the free heap trend
+ * Use the high-water marks to shrink the task stacks and reclaim RAM
+ */
+void MemoryMonitor::report()
+{
+    for (uint8_t i = 0; i < num_tasks_; i++)
+    {
+        Serial.print("Task \"");
+        Serial.print(tasks_[i].name);
+        Serial.print("\" stack: ");
+        Serial.print(tasks_[i].stack_size);
+        Serial.print(", never used: ");
+        Serial.println(uxTaskGetStackHighWaterMark(tasks_[i].handle));
+    }
+
+    Serial.print("Free heap: ");
+    Serial.print(esp_get_free_heap_size());
+    Serial.print(", minimum ever: ");
+    Serial.print(esp_get_minimum_free_heap_size());
+
+    if (num_samples_ >= 2)
+    {
+        // Oldest and newest samples in the ring
+        uint8_t newest = (next_sample_ + MEMORY_TREND_SAMPLES - 1) % MEMORY_TREND_SAMPLES;
+        uint8_t oldest = (num_samples_ < MEMORY_TREND_SAMPLES) ? 0 : next_sample_;
+        double minutes = (num_samples_ - 1) * MEMORY_REPORT_INTERVAL / 60000.0;
+
+        Serial.print(", trend: ");
+        Serial.print((double(free_heap_[newest]) - double(free_heap_[oldest])) / minutes);
+        Serial.print(" bytes/min");
+    }
+
+    Serial.println("");
+}
@@ -1,112 +1,234 @@
+/******************* CONFIG **********************/
 
+// Position loop gains, in Sabertooth power units
+#define MOTOR_POSITION_KP  300.0 // per metre of position error
+#define MOTOR_POSITION_KFF 60.0  // per m/s of profile velocity (feedforward)
 
-class MotorPositionController
-{
-    public:
-      MotorController(String _my_name, SabertoothSimplified* _motor_interface,
-          int _motor_id, int _feedback_pin, int _motor_min_pos, int _motor_max_pos, int _motor_max_power,
-          double _Kp = 0.5, double _Ki = 0.0, double _Kd = 0.0);
-          
-      void SetTargetPosition(double target_pos);
-      
+// Below this the Sabertooth output is set to zero, so the motors don't buzz when holding position
+#define MOTOR_POSITION_DEADBAND 10
 
-      // FIXME: TEST THIS!!!
-      double GetCurrentPosition();
-      boolean isMotorMoving();
+/*************************************************/
 
-      // TODO: Add the option for a callback when the target position is reached???  
+/**
+ * @brief Time-optimal trapezoidal motion profile (or triangular, for moves too short to reach max_vel)
+ */
+class TrapezoidalProfile
+{
+    public:
+        TrapezoidalProfile();
+        void plan(double distance, double max_vel, double max_accel);
+        void sample(double t, double &position, double &velocity);
+        double get_distance();
+        double get_duration();
 
     private:
-      String my_name;
-      SabertoothSimplified* motor_interface;
-      int motor_id;
-      int feedback_pin;
-      double Kp;
-      double Kd;
-      double Ki;
-      int motor_min_pos;
-      int motor_max_pos;
-      int motor_max_power;
-      bool motor_is_moving;
+        double distance_;   // signed
+        double accel_;
+        double peak_vel_;
+        double t_accel_;
+        double t_cruise_;
 };
 
-MotorController::MotorController(String _my_name, SabertoothSimplified* _motor_interface,
-    int _motor_id, int _feedback_pin, int _motor_min_pos, int _motor_max_pos, int _motor_max_power,
-    double _Kp = 0.5, double _Ki = 0.0, double _Kd = 0.0)
+TrapezoidalProfile::TrapezoidalProfile()
 {
-    // init the motor controller here
-    this->my_name         = _my_name;
-    this->motor_id        = _motor_id;
-    this->motor_interface = _motor_interface;
-    this->feedback_pin    = _feedback_pin;
-    this->motor_min_pos   = _motor_min_pos;
-    this->motor_max_pos   = _motor_max_pos;
-    this->motor_max_power = _motor_max_power;
-    this->Kp              = _Kp;
-    this->Ki              = _Ki;
-    this->Kd              = _Kd;
-    this->motor_is_moving = false;
+    plan(0.0, 1.0, 1.0);
 }
 
-double MotorController::GetCurrentPosition()
+/**
+ * @param distance to travel, either sign
+ * @param max_vel must be > 0
+ * @param max_accel must be > 0, also used for the deceleration
+ */
+void TrapezoidalProfile::plan(double distance, double max_vel, double max_accel)
 {
-    Serial.print("potpos = ");
-    Serial.println(analogRead(feedback_pin));
-    return double(analogRead(feedback_pin));
+    double abs_distance = fabs(distance);
+
+    distance_ = distance;
+    accel_ = max_accel;
+
+    if (abs_distance < max_vel * max_vel / max_accel)
+    {
+        // Triangular, never reaches max_vel
+        peak_vel_ = sqrt(abs_distance * max_accel);
+        t_accel_  = peak_vel_ / max_accel;
+        t_cruise_ = 0.0;
+    }
+    else
+    {
+        peak_vel_ = max_vel;
+        t_accel_  = max_vel / max_accel;
+        t_cruise_ = (abs_distance - max_vel * max_vel / max_accel) / max_vel;
+    }
 }
 
-void MotorController::SetTargetPosition(double target_pos)
+/**
+ * @brief Position and velocity along the profile at time t (seconds since the start)
+ */
+void TrapezoidalProfile::sample(double t, double &position, double &velocity)
 {
-    // Implementation of a PID controller
-    // TODO add make P and D terms work properly
+    double duration = get_duration();
+    double abs_distance = fabs(distance_);
+
+    t = constrain(t, 0.0, duration);
+
+    if (t < t_accel_)
+    {
+        position = 0.5 * accel_ * t * t;
+        velocity = accel_ * t;
+    }
+    else if (t < t_accel_ + t_cruise_)
+    {
+        position = 0.5 * accel_ * t_accel_ * t_accel_ + peak_vel_ * (t - t_accel_);
+        velocity = peak_vel_;
+    }
+    else
+    {
+        double t_left = duration - t;
+        position = abs_distance - 0.5 * accel_ * t_left * t_left;
+        velocity = accel_ * t_left;
+    }
 
-    if (target_pos < motor_min_pos) {
-        target_pos = motor_min_pos;
-    } else if (target_pos > motor_max_pos) {
-        target_pos = motor_max_pos;
+    if (distance_ < 0.0)
+    {
+        position = -position;
+        velocity = -velocity;
     }
+}
+
+double TrapezoidalProfile::get_distance()
+{
+    return distance_;
+}
+
+double TrapezoidalProfile::get_duration()
+{
+    return 2.0 * t_accel_ + t_cruise_;
+}
 
-    //double current_pos = this->GetCurrentPosition();
-    double current_pos = double(analogRead(feedback_pin));
-    Serial.print(", current_pos=");
-    Serial.print(current_pos);
+/**
+ * @brief Drives one wheel to an encoder count target, with velocity feedforward from a motion profile
+ */
+class MotorPositionController
+{
+    public:
+      MotorPositionController(const char *my_name, SabertoothSimplified *motor_interface,
+                              int motor_id, WheelEncoderLS7366 *encoder_interface, int motor_max_power,
+                              double Kp, double Kff);
+
+      void SetTargetPosition(long target_count, double feedforward_vel = 0.0);
+      long GetCurrentPosition();
+      long GetPositionError();
+      bool isMotorMoving();
+      void set_gains(double Kp, double Kff);
+      void set_max_power(int motor_max_power);
+
+    private:
+      const char *my_name_;
+      SabertoothSimplified *motor_interface_;
+      WheelEncoderLS7366 *encoder_interface_;
+      int motor_id_;
+      double Kp_;
+      double Kff_;
+      int motor_max_power_;
+      long current_count_;
+      long error_count_;
+      bool motor_is_moving_;
+};
+
+MotorPositionController::MotorPositionController(const char *my_name, SabertoothSimplified *motor_interface,
+                                                 int motor_id, WheelEncoderLS7366 *encoder_interface, int motor_max_power,
+                                                 double Kp = MOTOR_POSITION_KP, double Kff = MOTOR_POSITION_KFF)
+{
+    // init the motor controller here
+    this->my_name_           = my_name;
+    this->motor_id_          = motor_id;
+    this->motor_interface_   = motor_interface;
+    this->encoder_interface_ = encoder_interface;
+    this->motor_max_power_   = motor_max_power;
+    this->Kp_                = Kp;
+    this->Kff_               = Kff;
+    this->current_count_     = 0;
+    this->error_count_       = 0;
+    this->motor_is_moving_   = false;
+}
+
+/**
+ * @brief Reads the encoder and updates the motor output, call every control tick
+ *
+ * @param target_count encoder counts
+ * @param feedforward_vel m/s, the velocity of the profile at this tick
+ */
+void MotorPositionController::SetTargetPosition(long target_count, double feedforward_vel)
+{
+    current_count_ = encoder_interface_->get_update().raw_count;
+    error_count_ = target_count - current_count_;
+
+    Serial.print(", current_count=");
+    Serial.print(current_count_);
+
+    double output;
+    {
+        PROFILE_SCOPE(PROFILE_STAGE_PID);
 
-    double pTerm = current_pos - target_pos;
-    double iTerm = 0.0;
-    double dTerm = 0.0;
-    double output = int(Kp * pTerm + Ki * iTerm + Kd * dTerm);
+        double error = double(error_count_) / encoder_interface_->get_counts_per_metre();
+        output = int(Kp_ * error + Kff_ * feedforward_vel);
 
-    if ( output < -1 * motor_max_power ) {
-      output = -1 * motor_max_power;
-    } else if ( output > motor_max_power ) {
-      output = motor_max_power;
+        if ( output < -1 * motor_max_power_ ) {
+          output = -1 * motor_max_power_;
+        } else if ( output > motor_max_power_ ) {
+          output = motor_max_power_;
+        }
     }
 
     Serial.println("");
-    Serial.print(my_name);
+    Serial.print(my_name_);
     Serial.print(", motor ID: ");
-    Serial.print(motor_id);
+    Serial.print(motor_id_);
     Serial.print(", output=");
     Serial.print(output);
-    Serial.print(", target_pos=");
-    Serial.print(target_pos);
+    Serial.print(", target_count=");
+    Serial.print(target_count);
 
-    if (abs(output) > 10)
-    {
-        motor_is_moving = true;
-        motor_interface->motor(motor_id, output);
-    }
-    else
+    motor_is_moving_ = (abs(output) > MOTOR_POSITION_DEADBAND);
+    if (!motor_is_moving_)
     {
-        motor_is_moving = false;
+        output = 0;
     }
+
+    PROFILE_SCOPE(PROFILE_STAGE_MOTOR_WRITE);
+    motor_interface_->motor(motor_id_, output);
+    blackbox.record_motor(motor_id_, output);
 }
 
-boolean MotorController::isMotorMoving()
+/**
+ * @return long, encoder counts as of the last SetTargetPosition()
+ */
+long MotorPositionController::GetCurrentPosition()
 {
-    // Returns true if a motion command is currently in operation
-    //return is_motor_moving();
-    return motor_is_moving;
+    return current_count_;
 }
 
+/**
+ * @return long, target minus current encoder counts as of the last SetTargetPosition()
+ */
+long MotorPositionController::GetPositionError()
+{
+    return error_count_;
+}
 
+bool MotorPositionController::isMotorMoving()
+{
+    // Returns true if the motor is being driven
+    return motor_is_moving_;
+}
+
+void MotorPositionController::set_gains(double Kp, double Kff)
+{
+    Kp_  = Kp;
+    Kff_ = Kff;
+}
+
+void MotorPositionController::set_max_power(int motor_max_power)
+{
+    motor_max_power_ = motor_max_power;
+}
@@ -1,14 +1,34 @@
+/******************* CONFIG **********************/
+
+// Below this the Sabertooth output is set to zero, so the motors don't buzz at standstill
+#define MOTOR_VELOCITY_DEADBAND 10
+
+// Longer than this between encoder reads (e.g. after a HALT or a manoeuvre) and the integral and derivative start again
+#define MOTOR_VELOCITY_MAX_DT 0.2 // s
+
+/*************************************************/
+
+/**
+ * @brief PID velocity loop for one wheel, with feedforward from the target velocity
+ * Gains are in Sabertooth power units: Kp per m/s of error, Ki per metre of accumulated error,
+ * Kd per m/s^2 (on the measured velocity, so a step in the target doesn't kick) and Kff per m/s of target.
+ * See tools/pid_tuner for finding them.
+ */
 class MotorVelocityController
 {
     public:
-      MotorVelocityController(String my_name, SabertoothSimplified *motor_interface,
+      MotorVelocityController(const char *my_name, SabertoothSimplified *motor_interface,
                               int motor_id, WheelEncoderLS7366 *encoder_interface, int motor_max_power,
-                              double Kp, double Ki, double Kd);
+                              double Kp, double Ki, double Kd, double Kff);
 
       void SetTargetVelocity(double target_vel);
+      void reset();
+      void set_gains(double Kp, double Ki, double Kd);
+      void set_feedforward(double Kff);
+      void set_max_power(int motor_max_power);
 
     private:
-      String my_name_;
+      const char *my_name_;
       SabertoothSimplified *motor_interface_;
       WheelEncoderLS7366 *encoder_interface_;
       int motor_id_;
@@ -16,12 +36,19 @@ class MotorVelocityController
       double Kp_;
       double Kd_;
       double Ki_;
+      double Kff_;
       int motor_max_power_;
+
+      // Loop state, carried between calls to SetTargetVelocity()
+      double integral_;          // m, integral of the velocity error
+      double prev_vel_;          // m/s
+      unsigned long prev_stamp_; // ms, of the encoder read
+      bool has_prev_;
 };
 
-MotorVelocityController::MotorVelocityController(String my_name, SabertoothSimplified *motor_interface,
+MotorVelocityController::MotorVelocityController(const char *my_name, SabertoothSimplified *motor_interface,
                                                  int motor_id, WheelEncoderLS7366 *encoder_interface, int motor_max_power,
-                                                 double Kp = 0.5, double Ki = 0.0, double Kd = 0.0)
+                                                 double Kp = 0.5, double Ki = 0.0, double Kd = 0.0, double Kff = 0.0)
 {
     // init the motor controller here
     this->my_name_           = my_name;
@@ -32,28 +59,50 @@ MotorVelocityController::MotorVelocityController(String my_name, SabertoothSimpl
     this->Kp_                = Kp;
     this->Ki_                = Ki;
     this->Kd_                = Kd;
+    this->Kff_               = Kff;
+    reset();
 }
 
+/**
+ * @brief Reads the encoder and updates the motor output, call every control tick
+ *
+ * @param target_vel m/s
+ */
 void MotorVelocityController::SetTargetVelocity(double target_vel)
 {
-    // Implementation of a PID controller
-    // TODO: add make P and D terms work properly
-
-    double current_vel = encoder_interface_->get_update().velocity;
+    WheelEncoderFeedback feedback = encoder_interface_->get_update();
+    double current_vel = feedback.velocity;
     Serial.print(", current_vel=");
     Serial.print(current_vel);
 
-    double pTerm = current_vel - target_vel;
-    double iTerm = 0.0;
-    double dTerm = 0.0;
-    double output = int(Kp_ * pTerm + Ki_ * iTerm + Kd_ * dTerm);
+    // Timed by the encoder reads (not micros()), so a black box log replays exactly
+    double dt = double(feedback.stamp - prev_stamp_) / 1000.0;
+    bool continuous = has_prev_ && feedback.velocity_is_valid && dt > 0.0 && dt <= MOTOR_VELOCITY_MAX_DT;
 
-    if ( output < -1 * motor_max_power_ ) {
-      output = -1 * motor_max_power_;
-    } else if ( output > motor_max_power_ ) {
-      output = motor_max_power_;
+    double output;
+    {
+        PROFILE_SCOPE(PROFILE_STAGE_PID);
+
+        double error = target_vel - current_vel;
+        double pTerm = error;
+        double dTerm = continuous ? -(current_vel - prev_vel_) / dt : 0.0;
+        double iTerm = integral_ + (continuous ? error * dt : 0.0);
+
+        output = Kff_ * target_vel + Kp_ * pTerm + Ki_ * iTerm + Kd_ * dTerm;
+
+        // Anti-windup: the integral only grows while the output isn't saturated in the same direction
+        if (fabs(output) <= motor_max_power_ || (output > 0.0) != (error > 0.0))
+        {
+            integral_ = iTerm;
+        }
+
+        output = int(constrain(output, -motor_max_power_, motor_max_power_));
     }
 
+    prev_vel_ = current_vel;
+    prev_stamp_ = feedback.stamp;
+    has_prev_ = true;
+
     Serial.println("");
     Serial.print(my_name_);
     Serial.print(", motor ID: ");
@@ -63,8 +112,40 @@ void MotorVelocityController::SetTargetVelocity(double target_vel)
     Serial.print(", target_vel=");
     Serial.print(target_vel);
 
-    if (abs(output) > 10)
+    if (abs(output) <= MOTOR_VELOCITY_DEADBAND)
     {
-        motor_interface_->motor(motor_id_, output);
+        output = 0;
     }
-}
\ No newline at end of file
+
+    PROFILE_SCOPE(PROFILE_STAGE_MOTOR_WRITE);
+    motor_interface_->motor(motor_id_, output);
+    blackbox.record_motor(motor_id_, output);
+}
+
+/**
+ * @brief Forgets the integral and derivative, e.g. when the wheel has been driven by something else
+ */
+void MotorVelocityController::reset()
+{
+    integral_ = 0.0;
+    prev_vel_ = 0.0;
+    prev_stamp_ = 0;
+    has_prev_ = false;
+}
+
+void MotorVelocityController::set_gains(double Kp, double Ki, double Kd)
+{
+    Kp_ = Kp;
+    Ki_ = Ki;
+    Kd_ = Kd;
+}
+
+void MotorVelocityController::set_feedforward(double Kff)
+{
+    Kff_ = Kff;
+}
+
+void MotorVelocityController::set_max_power(int motor_max_power)
+{
+    motor_max_power_ = motor_max_power;
+}
@@ -0,0 +1,282 @@
+#ifndef PARAM_REGISTRY_H
+#define PARAM_REGISTRY_H
+
+#include <Preferences.h>
+#include <stddef.h>
+
+#include "snapshot_buffer.h"
+
+/*
+Runtime parameter registry
+
+Gains, limits and geometry used to be #defines, so tuning in the field meant reflashing.
+Each parameter is described by a row in a table (name, type, range, default, location in the parameter block).
+The #defines are now only the defaults.
+
+The control loop reads the whole parameter block as one consistent snapshot at the start of each cycle,
+without locking (see snapshot_buffer.h), so a change takes effect on the next control cycle.
+Values can be persisted to NVS (flash), and are reloaded from there on boot.
+*/
+
+/******************* CONFIG **********************/
+
+// NVS namespace the parameters are stored under
+#define PARAM_NVS_NAMESPACE "alexbot"
+
+/*************************************************/
+
+#define PARAM_TYPE_FLOAT 0
+#define PARAM_TYPE_INT   1
+
+#define PARAM_NOT_FOUND 0xFF
+
+struct ParamInfo
+{
+    const char *name;     // also the NVS key, so at most 15 characters
+    uint8_t type;         // PARAM_TYPE_x
+    float min_value;
+    float max_value;
+    float default_value;
+    uint16_t offset;      // offsetof() the value in the parameter block
+};
+
+/**
+ * @brief Typed parameter registry over the parameter block T
+ * Only ONE task may call set()/init(), any task may call read()
+ */
+template <typename T>
+class ParamRegistry
+{
+    public:
+        ParamRegistry(const ParamInfo *table, uint8_t num_params);
+        void init();
+        bool set(uint8_t id, float value);
+        bool get(uint8_t id, float &value);
+        uint8_t find(const char *name);
+        uint8_t get_num_params();
+        T read() const;
+        uint32_t get_version() const;
+        bool save();
+        void print(uint8_t id);
+
+    private:
+        void store_(T &block, const ParamInfo &info, float value);
+        float load_(const T &block, const ParamInfo &info);
+
+        const ParamInfo *table_;
+        uint8_t num_params_;
+
+        // The writer's copy, published to readers through the snapshot buffer
+        T working_;
+        SnapshotBuffer<T> published_;
+
+        Preferences prefs_;
+        bool prefs_ok_;
+};
+
+template <typename T>
+ParamRegistry<T>::ParamRegistry(const ParamInfo *table, uint8_t num_params)
+{
+    this->table_      = table;
+    this->num_params_ = num_params;
+    this->prefs_ok_   = false;
+}
+
+/**
+ * @brief Loads the defaults, overrides them with any valid values saved in NVS, and publishes the result
+ * Call from setup(), Preferences does not work from a global constructor
+ */
+template <typename T>
+void ParamRegistry<T>::init()
+{
+    prefs_ok_ = prefs_.begin(PARAM_NVS_NAMESPACE, false);
+
+    for (uint8_t i = 0; i < num_params_; i++)
+    {
+        const ParamInfo &info = table_[i];
+        float value = info.default_value;
+
+        if (prefs_ok_ && prefs_.isKey(info.name))
+        {
+            float saved = prefs_.getFloat(info.name, info.default_value);
+
+            // The ranges may have changed since the value was saved
+            if (saved >= info.min_value && saved <= info.max_value)
+            {
+                value = saved;
+            }
+        }
+
+        store_(working_, info, value);
+    }
+
+    published_.write(working_);
+}
+
+/**
+ * @brief Changes a parameter, the control loop picks it up on its next cycle
+ *
+ * @return false if the ID is unknown or the value is out of range
+ */
+template <typename T>
+bool ParamRegistry<T>::set(uint8_t id, float value)
+{
+    if (id >= num_params_)
+    {
+        return false;
+    }
+
+    const ParamInfo &info = table_[id];
+
+    if (!(value >= info.min_value && value <= info.max_value))
+    {
+        Serial.print("Param ");
+        Serial.print(info.name);
+        Serial.print(" out of range [");
+        Serial.print(info.min_value);
+        Serial.print(", ");
+        Serial.print(info.max_value);
+        Serial.println("]");
+        return false;
+    }
+
+    store_(working_, info, value);
+    published_.write(working_);
+    return true;
+}
+
+template <typename T>
+bool ParamRegistry<T>::get(uint8_t id, float &value)
+{
+    if (id >= num_params_)
+    {
+        return false;
+    }
+
+    value = load_(working_, table_[id]);
+    return true;
+}
+
+/**
+ * @brief Looks up a parameter ID by name
+ *
+ * @return PARAM_NOT_FOUND if there is no such parameter
+ */
+template <typename T>
+uint8_t ParamRegistry<T>::find(const char *name)
+{
+    for (uint8_t i = 0; i < num_params_; i++)
+    {
+        if (strcmp(table_[i].name, name) == 0)
+        {
+            return i;
+        }
+    }
+
+    return PARAM_NOT_FOUND;
+}
+
+template <typename T>
+uint8_t ParamRegistry<T>::get_num_params()
+{
+    return num_params_;
+}
+
+/**
+ * @brief Lock-free consistent copy of every parameter, safe to call from any task
+ */
+template <typename T>
+T ParamRegistry<T>::read() const
+{
+    return published_.read();
+}
+
+/**
+ * @brief Changes whenever a parameter is set, compare against a stored value to skip re-applying parameters
+ */
+template <typename T>
+uint32_t ParamRegistry<T>::get_version() const
+{
+    return published_.get_version();
+}
+
+/**
+ * @brief Writes every parameter to NVS
+ * Flash writes take milliseconds, only call this on request, never from the control loop itself
+ */
+template <typename T>
+bool ParamRegistry<T>::save()
+{
+    if (!prefs_ok_)
+    {
+        return false;
+    }
+
+    // NVS allocates internally. Saving is an explicit operator action, so this task is exempt from the heap trap
+    // while it writes, the other tasks are still trapped
+    HeapTrapExemption exemption;
+
+    bool ok = true;
+    for (uint8_t i = 0; i < num_params_; i++)
+    {
+        ok &= (prefs_.putFloat(table_[i].name, load_(working_, table_[i])) > 0);
+    }
+
+    return ok;
+}
+
+/**
+ * @brief Prints a parameter in the reply format "#p,<id>,<value>!" followed by its name and range
+ */
+template <typename T>
+void ParamRegistry<T>::print(uint8_t id)
+{
+    if (id >= num_params_)
+    {
+        return;
+    }
+
+    const ParamInfo &info = table_[id];
+
+    Serial.print("#p,");
+    Serial.print(id);
+    Serial.print(",");
+    Serial.print(load_(working_, info), 4);
+    Serial.print("! ");
+    Serial.print(info.name);
+    Serial.print(" [");
+    Serial.print(info.min_value, 4);
+    Serial.print(", ");
+    Serial.print(info.max_value, 4);
+    Serial.println("]");
+}
+
+template <typename T>
+void ParamRegistry<T>::store_(T &block, const ParamInfo &info, float value)
+{
+    uint8_t *location = (uint8_t *)&block + info.offset;
+
+    if (info.type == PARAM_TYPE_INT)
+    {
+        *(int32_t *)location = int32_t(lroundf(value));
+    }
+    else
+    {
+        *(float *)location = value;
+    }
+}
+
+template <typename T>
+float ParamRegistry<T>::load_(const T &block, const ParamInfo &info)
+{
+    const uint8_t *location = (const uint8_t *)&block + info.offset;
+
+    if (info.type == PARAM_TYPE_INT)
+    {
+        return float(*(const int32_t *)location);
+    }
+
+    return *(const float *)location;
+}
+
+#endif
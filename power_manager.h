@@ -0,0 +1,352 @@
+#ifndef POWER_MANAGER_H
+#define POWER_MANAGER_H
+
+#include <esp_sleep.h>
+#include <driver/uart.h>
+#include <driver/gpio.h>
+
+#if CONFIG_PM_ENABLE
+#include <esp_pm.h>
+#endif
+
+/*
+Power manager, driven by the top-level state machine (see alexbot.h)
+
+Each state has a power profile (power_profiles[]): CPU frequency, how often the worker loops run, and whether
+the auxillary tasks run at all. Every saved milliwatt in the other states is battery left over for Zombie mode.
+
+If the ESP-IDF was built with power management (CONFIG_PM_ENABLE, plus CONFIG_FREERTOS_USE_TICKLESS_IDLE) the
+frequency is handed to the PM driver, which also scales it down and light sleeps whenever the tasks are idle.
+Otherwise (e.g. the stock Arduino core) the CPU frequency is just set directly.
+
+SLEEP_STATE:
+  - Light sleeps for up to SLEEP_WAKE_INTERVAL at a time, waking on the timer, serial input or SLEEP_WAKE_PIN.
+    RAM is kept, so the robot resumes where it left off. After serial input it stays awake for SLEEP_STAY_AWAKE,
+    so the rest of the command can arrive (the characters that woke it are lost).
+  - After SLEEP_DEEP_AFTER with no serial input it deep sleeps instead. The state and the battery charge are kept
+    in RTC memory, and restored by setup() after the wake-up reboot. After a timer wake-up it listens for
+    SLEEP_STAY_AWAKE, then goes straight back into deep sleep.
+  - SLEEP_WAKE_PIN wakes the robot up properly, into HALT_STATE.
+
+The battery power (from battery_monitor.h) is integrated per state, see print_stats().
+*/
+
+/******************* CONFIG **********************/
+
+#define SLEEP_WAKE_INTERVAL 10000  // ms, how often to wake up and check for requests
+#define SLEEP_STAY_AWAKE    2000   // ms, after being woken by serial input
+#define SLEEP_DEEP_AFTER    600000 // ms in SLEEP_STATE without serial input before deep sleeping
+
+// Button (to GND) that wakes the robot up, must be an RTC GPIO to work from deep sleep
+#define SLEEP_WAKE_PIN 27
+
+// Serial edges needed to wake from light sleep
+#define SLEEP_UART_WAKE_THRESHOLD 3
+
+/*************************************************/
+
+#define POWER_NUM_STATES 5
+#define POWER_MAX_TASKS  4
+
+struct PowerProfile
+{
+    const char *name;
+    uint16_t cpu_mhz;           // 80, 160 or 240
+    uint16_t control_period;    // ms between control loop cycles
+    uint16_t aux_period;        // ms between auxillary loop cycles
+    bool aux_tasks_run;         // false blocks every task registered with add_aux_task()
+};
+
+// Indexed by state ID (SLEEP_STATE, HALT_STATE, ...)
+const PowerProfile power_profiles[POWER_NUM_STATES] = {
+    // name       MHz  control  aux   aux tasks
+    {"SLEEP",     80,  1000,    1000, false},
+    {"HALT",      80,  200,     1000, true},
+    {"TELEOP",    240, 50,      50,   true},
+    {"ZOMBIE",    160, 50,      50,   true},
+    {"SERIAL",    240, 50,      50,   true},
+};
+
+// Survives deep sleep (but not a power cycle)
+struct PowerRetained
+{
+    uint32_t magic;
+    uint8_t state_id;
+    float charge_used;
+};
+
+#define POWER_RETAINED_MAGIC 0xA1E8B075
+
+RTC_DATA_ATTR PowerRetained power_retained;
+
+class PowerManager
+{
+    public:
+        PowerManager();
+        void init();
+        bool restore(uint8_t &state_id, float &charge_used);
+        void add_aux_task(TaskHandle_t task);
+        void aux_checkpoint();
+        void enter_state(uint8_t state_id);
+        bool update(uint8_t state_id);
+        uint16_t get_control_period();
+        uint16_t get_aux_period();
+        void print_stats();
+
+    private:
+        bool sleep_();
+        void set_cpu_frequency_(uint16_t cpu_mhz);
+
+        uint8_t state_id_;
+        bool restored_;
+
+        TaskHandle_t aux_tasks_[POWER_MAX_TASKS];
+        uint8_t num_aux_tasks_;
+        volatile bool aux_suspended_;
+
+        // Energy accounting
+        double energy_[POWER_NUM_STATES];       // Wh
+        double time_in_state_[POWER_NUM_STATES]; // s
+        unsigned long last_update_;
+
+        // Sleep bookkeeping
+        unsigned long awake_until_;
+        unsigned long last_serial_wake_;
+        bool deep_sleeping_;
+        bool woken_by_button_;
+};
+
+PowerManager::PowerManager()
+{
+    for (uint8_t i = 0; i < POWER_NUM_STATES; i++)
+    {
+        energy_[i] = 0.0;
+        time_in_state_[i] = 0.0;
+    }
+
+    this->state_id_         = HALT_STATE;
+    this->restored_         = false;
+    this->num_aux_tasks_    = 0;
+    this->aux_suspended_    = false;
+    this->last_update_      = 0;
+    this->awake_until_      = 0;
+    this->last_serial_wake_ = 0;
+    this->deep_sleeping_    = false;
+    this->woken_by_button_  = false;
+}
+
+/**
+ * @brief Checks whether this boot is a wake-up from deep sleep, call at the start of setup()
+ */
+void PowerManager::init()
+{
+    esp_sleep_wakeup_cause_t cause = esp_sleep_get_wakeup_cause();
+
+    restored_ = (power_retained.magic == POWER_RETAINED_MAGIC &&
+                 (cause == ESP_SLEEP_WAKEUP_TIMER || cause == ESP_SLEEP_WAKEUP_EXT0));
+    power_retained.magic = 0;
+
+    // Just checking in, listen for a while then go back into deep sleep
+    if (restored_ && cause == ESP_SLEEP_WAKEUP_TIMER)
+    {
+        awake_until_ = millis() + SLEEP_STAY_AWAKE;
+        deep_sleeping_ = true;
+    }
+
+    woken_by_button_ = (restored_ && cause == ESP_SLEEP_WAKEUP_EXT0);
+
+    pinMode(SLEEP_WAKE_PIN, INPUT_PULLUP);
+    last_update_ = millis();
+    last_serial_wake_ = millis();
+}
+
+/**
+ * @brief What was saved before deep sleeping
+ *
+ * @return false on a normal boot (then state_id and charge_used are left alone)
+ */
+bool PowerManager::restore(uint8_t &state_id, float &charge_used)
+{
+    if (!restored_)
+    {
+        return false;
+    }
+
+    state_id = woken_by_button_ ? HALT_STATE : power_retained.state_id;
+    charge_used = power_retained.charge_used;
+    return true;
+}
+
+/**
+ * @brief Registers a task that is only needed while the robot is active, see PowerProfile::aux_tasks_run
+ * The task must call aux_checkpoint() once per loop, at a point where it holds no locks
+ */
+void PowerManager::add_aux_task(TaskHandle_t task)
+{
+    if (num_aux_tasks_ < POWER_MAX_TASKS)
+    {
+        aux_tasks_[num_aux_tasks_++] = task;
+    }
+}
+
+/**
+ * @brief Applies the power profile of a state, call on every state transition
+ */
+void PowerManager::enter_state(uint8_t state_id)
+{
+    if (state_id >= POWER_NUM_STATES)
+    {
+        return;
+    }
+
+    const PowerProfile &profile = power_profiles[state_id];
+    state_id_ = state_id;
+
+    set_cpu_frequency_(profile.cpu_mhz);
+
+    // Suspending happens at each task's next aux_checkpoint()
+    aux_suspended_ = !profile.aux_tasks_run;
+
+    if (profile.aux_tasks_run)
+    {
+        // Notifications latch, so this can't be missed by a task that is just about to wait
+        for (uint8_t i = 0; i < num_aux_tasks_; i++)
+        {
+            xTaskNotifyGive(aux_tasks_[i]);
+        }
+    }
+
+    if (state_id == SLEEP_STATE)
+    {
+        last_serial_wake_ = millis();
+    }
+    else
+    {
+        deep_sleeping_ = false;
+    }
+}
+
+/**
+ * @brief Energy accounting, and sleeping in SLEEP_STATE. Call once per control loop cycle, without holding the baton
+ *
+ * @return true if SLEEP_WAKE_PIN woke us, the caller should leave SLEEP_STATE
+ */
+bool PowerManager::update(uint8_t state_id)
+{
+    unsigned long now = millis();
+    double dt = (now - last_update_) / 1000.0;
+    last_update_ = now;
+
+    if (state_id < POWER_NUM_STATES)
+    {
+        BatteryState battery = battery_monitor.get_state();
+        if (battery.valid)
+        {
+            energy_[state_id] += battery.voltage * battery.current * dt / 3600.0;
+        }
+        time_in_state_[state_id] += dt;
+    }
+
+    if (state_id == SLEEP_STATE && (long)(now - awake_until_) >= 0)
+    {
+        return sleep_();
+    }
+
+    return false;
+}
+
+/**
+ * @brief Blocks the calling task if the current state doesn't need the auxillary tasks, until it does again
+ * Tasks suspend themselves rather than being suspended, so they can never be frozen holding the baton or a driver lock
+ */
+void PowerManager::aux_checkpoint()
+{
+    while (aux_suspended_)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+}
+
+uint16_t PowerManager::get_control_period()
+{
+    return power_profiles[state_id_].control_period;
+}
+
+uint16_t PowerManager::get_aux_period()
+{
+    return power_profiles[state_id_].aux_period;
+}
+
+/**
+ * @brief Prints the energy used and average power in each state since boot
+ */
+void PowerManager::print_stats()
+{
+    for (uint8_t i = 0; i < POWER_NUM_STATES; i++)
+    {
+        Serial.print(power_profiles[i].name);
+        Serial.print(": ");
+        Serial.print(time_in_state_[i]);
+        Serial.print("s, ");
+        Serial.print(energy_[i], 3);
+        Serial.print("Wh, ");
+        Serial.print(time_in_state_[i] > 0.0 ? energy_[i] * 3600.0 / time_in_state_[i] : 0.0);
+        Serial.println("W");
+    }
+}
+
+bool PowerManager::sleep_()
+{
+    Serial.flush();
+
+    if (deep_sleeping_ || millis() - last_serial_wake_ >= SLEEP_DEEP_AFTER)
+    {
+        // Deep sleep, setup() restores the state and battery charge when the timer or button wakes us
+        power_retained.magic = POWER_RETAINED_MAGIC;
+        power_retained.state_id = SLEEP_STATE;
+        power_retained.charge_used = battery_monitor.get_state().charge_used;
+
+        esp_sleep_enable_timer_wakeup((uint64_t)SLEEP_WAKE_INTERVAL * 1000);
+        esp_sleep_enable_ext0_wakeup((gpio_num_t)SLEEP_WAKE_PIN, 0);
+        esp_deep_sleep_start();
+    }
+
+    esp_sleep_enable_timer_wakeup((uint64_t)SLEEP_WAKE_INTERVAL * 1000);
+    gpio_wakeup_enable((gpio_num_t)SLEEP_WAKE_PIN, GPIO_INTR_LOW_LEVEL);
+    esp_sleep_enable_gpio_wakeup();
+    uart_set_wakeup_threshold(UART_NUM_0, SLEEP_UART_WAKE_THRESHOLD);
+    esp_sleep_enable_uart_wakeup(UART_NUM_0);
+
+    esp_light_sleep_start();
+
+    esp_sleep_wakeup_cause_t cause = esp_sleep_get_wakeup_cause();
+    if (cause == ESP_SLEEP_WAKEUP_UART)
+    {
+        Serial.println("Woken up, listening for commands");
+        awake_until_ = millis() + SLEEP_STAY_AWAKE;
+        last_serial_wake_ = millis();
+    }
+
+    return (cause == ESP_SLEEP_WAKEUP_GPIO);
+}
+
+void PowerManager::set_cpu_frequency_(uint16_t cpu_mhz)
+{
+#if CONFIG_PM_ENABLE
+    esp_pm_config_esp32_t config;
+    config.max_freq_mhz = cpu_mhz;
+    config.min_freq_mhz = 80;
+#if CONFIG_FREERTOS_USE_TICKLESS_IDLE
+    config.light_sleep_enable = true;
+#else
+    config.light_sleep_enable = false;
+#endif
+    esp_pm_configure(&config);
+#else
+    setCpuFrequencyMhz(cpu_mhz);
+#endif
+}
+
+PowerManager power_manager;
+
+#endif
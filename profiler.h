@@ -0,0 +1,249 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdint.h>
+
+/*
+Hot-path profiler
+
+Wrap a block in PROFILE_SCOPE(PROFILE_STAGE_x) to time it with the CPU cycle counter (CCOUNT on the ESP32,
+std::chrono on the host). Every stage keeps a log2 latency histogram and a max-latency watermark, which can be
+dumped over serial (#H,0,0!) or shown on the TFT profiler page.
+
+With ALEXBOT_PROFILING set to 0 the probes, histograms and commands all compile out completely.
+
+CCOUNT runs at the CPU clock, which the power manager changes, so each sample is converted to nanoseconds with the
+clock it was taken at, and the histograms are kept in nanoseconds.
+*/
+
+/******************* CONFIG **********************/
+
+#ifndef ALEXBOT_PROFILING
+#define ALEXBOT_PROFILING 1
+#endif
+
+/*************************************************/
+
+#define PROFILE_STAGE_PARSE       0 // serial command parse
+#define PROFILE_STAGE_ENCODER     1 // LS7366R encoder read
+#define PROFILE_STAGE_PID         2 // wheel velocity PID
+#define PROFILE_STAGE_MOTOR_WRITE 3 // Sabertooth serial write
+#define PROFILE_STAGE_LCD         4 // TFT refresh
+#define PROFILE_STAGE_ZOMBIE      5 // Zombie mode poll + state machine
+#define PROFILE_NUM_STAGES        6
+
+// Bucket i counts samples of [2^i, 2^(i+1)) ns
+#define PROFILE_NUM_BUCKETS 32
+
+#if ALEXBOT_PROFILING
+
+#if defined(ESP32)
+inline uint32_t profile_cycles()
+{
+    return ESP.getCycleCount();
+}
+
+inline uint32_t profile_cycles_per_us()
+{
+    return getCpuFrequencyMhz();
+}
+#else
+#include <chrono>
+
+// On the host a "cycle" is a nanosecond
+inline uint32_t profile_cycles()
+{
+    return uint32_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+inline uint32_t profile_cycles_per_us()
+{
+    return 1000;
+}
+#endif
+
+/**
+ * @brief Cycles to ns at the current CPU clock, in 32 bits (up to ~4 s)
+ */
+inline uint32_t profile_cycles_to_ns(uint32_t cycles)
+{
+    uint32_t per_us = profile_cycles_per_us();
+    return (cycles / per_us) * 1000 + (cycles % per_us) * 1000 / per_us;
+}
+
+class Profiler
+{
+    public:
+        Profiler();
+        void record(uint8_t stage, uint32_t ns);
+        void reset();
+        uint32_t get_count(uint8_t stage);
+        uint32_t get_max_us(uint8_t stage);
+        uint32_t get_percentile_us(uint8_t stage, uint8_t percentile);
+        const char *get_name(uint8_t stage);
+        void print();
+
+    private:
+        struct Stage
+        {
+            uint32_t buckets[PROFILE_NUM_BUCKETS];
+            uint32_t count;
+            uint32_t max_ns;
+        };
+
+        Stage stages_[PROFILE_NUM_STAGES];
+};
+
+static const char *profile_stage_names[PROFILE_NUM_STAGES] = {
+    "parse", "encoder", "pid", "motor", "lcd", "zombie"};
+
+Profiler::Profiler()
+{
+    reset();
+}
+
+/**
+ * @brief Adds one sample to a stage's histogram, O(1)
+ */
+void Profiler::record(uint8_t stage, uint32_t ns)
+{
+    Stage &s = stages_[stage];
+
+    // Index of the highest set bit
+    uint8_t bucket = (ns == 0) ? 0 : uint8_t(31 - __builtin_clz(ns));
+
+    s.buckets[bucket]++;
+    s.count++;
+
+    if (ns > s.max_ns)
+    {
+        s.max_ns = ns;
+    }
+}
+
+void Profiler::reset()
+{
+    for (uint8_t i = 0; i < PROFILE_NUM_STAGES; i++)
+    {
+        for (uint8_t b = 0; b < PROFILE_NUM_BUCKETS; b++)
+        {
+            stages_[i].buckets[b] = 0;
+        }
+
+        stages_[i].count = 0;
+        stages_[i].max_ns = 0;
+    }
+}
+
+uint32_t Profiler::get_count(uint8_t stage)
+{
+    return stages_[stage].count;
+}
+
+uint32_t Profiler::get_max_us(uint8_t stage)
+{
+    return stages_[stage].max_ns / 1000;
+}
+
+/**
+ * @brief Upper bound of the histogram bucket containing the given percentile
+ */
+uint32_t Profiler::get_percentile_us(uint8_t stage, uint8_t percentile)
+{
+    const Stage &s = stages_[stage];
+    uint32_t target = uint32_t((uint64_t(s.count) * percentile + 99) / 100);
+    uint32_t seen = 0;
+
+    for (uint8_t b = 0; b < PROFILE_NUM_BUCKETS; b++)
+    {
+        seen += s.buckets[b];
+
+        if (seen >= target && seen > 0)
+        {
+            uint64_t upper = (uint64_t(1) << (b + 1)) - 1;
+            return uint32_t(upper / 1000);
+        }
+    }
+
+    return 0;
+}
+
+const char *Profiler::get_name(uint8_t stage)
+{
+    return profile_stage_names[stage];
+}
+
+/**
+ * @brief Dumps every stage's histogram over serial
+ * Format per stage: "stage,count,p50_us,p99_us,max_us" then one "<=upper_us:count" entry per non-empty bucket
+ */
+void Profiler::print()
+{
+    Serial.println("Profile (us): stage,count,p50,p99,max");
+
+    for (uint8_t i = 0; i < PROFILE_NUM_STAGES; i++)
+    {
+        const Stage &s = stages_[i];
+
+        Serial.print(profile_stage_names[i]);
+        Serial.print(",");
+        Serial.print(s.count);
+        Serial.print(",");
+        Serial.print(get_percentile_us(i, 50));
+        Serial.print(",");
+        Serial.print(get_percentile_us(i, 99));
+        Serial.print(",");
+        Serial.println(get_max_us(i));
+
+        for (uint8_t b = 0; b < PROFILE_NUM_BUCKETS; b++)
+        {
+            if (s.buckets[b] == 0)
+            {
+                continue;
+            }
+
+            Serial.print("  <=");
+            Serial.print(uint32_t(((uint64_t(1) << (b + 1)) - 1) / 1000));
+            Serial.print(":");
+            Serial.println(s.buckets[b]);
+        }
+    }
+}
+
+Profiler profiler;
+
+/**
+ * @brief Times its own lifetime, use through PROFILE_SCOPE
+ */
+class ProfileProbe
+{
+    public:
+        ProfileProbe(uint8_t stage)
+        {
+            stage_ = stage;
+            start_ = profile_cycles();
+        }
+
+        ~ProfileProbe()
+        {
+            // Converted now, the CPU clock may have changed by the time the histogram is read
+            profiler.record(stage_, profile_cycles_to_ns(profile_cycles() - start_));
+        }
+
+    private:
+        uint8_t stage_;
+        uint32_t start_;
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_NAME_(line) PROFILE_CONCAT_(profile_probe_, line)
+#define PROFILE_SCOPE(stage) ProfileProbe PROFILE_NAME_(__LINE__)(stage)
+
+#else
+
+#define PROFILE_SCOPE(stage)
+
+#endif
+
+#endif
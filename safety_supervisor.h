@@ -0,0 +1,355 @@
+#ifndef SAFETY_SUPERVISOR_H
+#define SAFETY_SUPERVISOR_H
+
+#include <SabertoothSimplified.h>
+
+#include "task_table.h"
+
+#include "blackbox_recorder.h"
+
+/*
+Safety supervisor
+
+Runs independently of the control and auxillary tasks, so a busy or stuck task can't keep the motors running:
+  - A hardware timer interrupt at SAFETY_TICK_RATE enforces the command watchdog, and re-samples the failsafe switch
+  - A GPIO interrupt on the failsafe switch latches the emergency stop the instant the switch opens
+
+On a trip the ISR immediately pulls the Sabertooth's S2 input low (configured as its emergency stop input, see the
+Sabertooth 2x25 manual, DIP switch 4), then wakes a highest-priority task which also sends a serial stop.
+
+A watchdog trip clears itself when commands start arriving again (see feed()), or when a state that drives is
+entered on purpose (see arm()), so the new state's command source has a chance to send its first command.
+A failsafe switch trip stays latched until rearm(), even if the switch bounces closed again.
+
+The time from the trip to the serial stop being sent is measured, and the worst case is kept (see print_stats()).
+*/
+
+/******************* CONFIG **********************/
+
+// Supervisor tick, the watchdog is enforced to within one tick
+#define SAFETY_TICK_INTERVAL 1000 // us (1 kHz)
+
+// Hardware timer used for the tick (0-3), and its prescaler (80 MHz APB clock / 80 = 1 MHz)
+#define SAFETY_TIMER_ID        0
+#define SAFETY_TIMER_PRESCALER 80
+
+// Sabertooth S2 (emergency stop input, active low)
+#define MOTOR_ESTOP_PIN 21
+
+/*************************************************/
+
+// Trip reasons, as a bitmask
+#define SAFETY_TRIP_NONE     0
+#define SAFETY_TRIP_WATCHDOG 1
+#define SAFETY_TRIP_SWITCH   2
+
+class SafetySupervisor
+{
+    public:
+        SafetySupervisor();
+        void init(SabertoothSimplified *motor_interface, uint8_t failsafe_pin, unsigned long watchdog_timeout);
+        void feed();
+        void arm(unsigned long grace);
+        void set_watchdog_timeout(unsigned long watchdog_timeout);
+        bool rearm();
+        bool is_tripped();
+        uint8_t get_trip_reasons();
+        TaskHandle_t get_task();
+        void print_stats();
+
+        // Called from the ISR glue and the stop task below, not for general use
+        void IRAM_ATTR on_tick_();
+        void IRAM_ATTR on_switch_edge_();
+        void stop_task_loop_();
+
+    private:
+        void IRAM_ATTR trip_(uint8_t reason, uint32_t stamp);
+        void release_(uint8_t reason);
+
+        SabertoothSimplified *motor_interface_;
+        uint8_t failsafe_pin_;
+
+        volatile uint32_t last_feed_us_;
+        volatile uint32_t watchdog_timeout_us_;
+        volatile uint32_t grace_us_;           // on top of the timeout, until the next feed()
+
+        // Shared with the ISRs, only touched under mux_
+        volatile uint8_t trip_reasons_;
+        volatile uint32_t trip_stamp_us_;
+        volatile uint32_t trip_count_;
+        portMUX_TYPE mux_;
+
+        // Trip to serial stop sent
+        uint32_t last_stop_latency_us_;
+        uint32_t max_stop_latency_us_;
+
+        hw_timer_t *timer_;
+        TaskHandle_t stop_task_;
+        StackType_t stop_task_stack_[task_table[TASK_SAFETY_STOP].stack_size];
+        StaticTask_t stop_task_buffer_;
+};
+
+// The ISRs and stop task can't take a "this" pointer, so they go through this
+SafetySupervisor *safety_supervisor_isr_target = NULL;
+
+void IRAM_ATTR safety_tick_isr_()
+{
+    safety_supervisor_isr_target->on_tick_();
+}
+
+void IRAM_ATTR safety_switch_isr_()
+{
+    safety_supervisor_isr_target->on_switch_edge_();
+}
+
+void safety_stop_task_func_(void *parameter)
+{
+    ((SafetySupervisor *)parameter)->stop_task_loop_();
+}
+
+SafetySupervisor::SafetySupervisor()
+{
+    this->motor_interface_       = NULL;
+    this->failsafe_pin_          = 0;
+    this->last_feed_us_          = 0;
+    this->watchdog_timeout_us_   = 0;
+    this->grace_us_              = 0;
+    this->trip_reasons_          = SAFETY_TRIP_NONE;
+    this->trip_stamp_us_         = 0;
+    this->trip_count_            = 0;
+    this->last_stop_latency_us_  = 0;
+    this->max_stop_latency_us_   = 0;
+    this->timer_                 = NULL;
+    this->stop_task_             = NULL;
+
+    portMUX_TYPE unlocked = portMUX_INITIALIZER_UNLOCKED;
+    this->mux_ = unlocked;
+}
+
+/**
+ * @brief Starts the stop task, the switch interrupt and the tick timer
+ * The motors start out stopped, until the first command arrives (and the failsafe switch is engaged)
+ *
+ * @param watchdog_timeout ms
+ */
+void SafetySupervisor::init(SabertoothSimplified *motor_interface, uint8_t failsafe_pin, unsigned long watchdog_timeout)
+{
+    motor_interface_ = motor_interface;
+    failsafe_pin_ = failsafe_pin;
+    set_watchdog_timeout(watchdog_timeout);
+
+    safety_supervisor_isr_target = this;
+
+    pinMode(MOTOR_ESTOP_PIN, OUTPUT);
+    digitalWrite(MOTOR_ESTOP_PIN, LOW);
+
+    trip_reasons_ = SAFETY_TRIP_WATCHDOG;
+    trip_stamp_us_ = micros();
+
+    if (!digitalRead(failsafe_pin_))
+    {
+        trip_reasons_ |= SAFETY_TRIP_SWITCH;
+    }
+
+    // Higher than any other task in the sketch, so the stop goes out as soon as the ISR returns
+    // On the control loop's core, which also writes to the Sabertooth (see task_table.h)
+    const TaskPlacement &placement = task_table[TASK_SAFETY_STOP];
+    stop_task_ = xTaskCreateStaticPinnedToCore(
+        safety_stop_task_func_,   /* Task function. */
+        placement.name,           /* String with name of task. */
+        placement.stack_size,     /* Stack size in words. */
+        this,                     /* Parameter passed as input of the task */
+        placement.priority,       /* Priority of the task. */
+        stop_task_stack_,         /* Stack. */
+        &stop_task_buffer_,       /* Task control block. */
+        placement.core);          /* Core ID to execute on. */
+
+    attachInterrupt(digitalPinToInterrupt(failsafe_pin_), safety_switch_isr_, CHANGE);
+
+    timer_ = timerBegin(SAFETY_TIMER_ID, SAFETY_TIMER_PRESCALER, true);
+    timerAttachInterrupt(timer_, safety_tick_isr_, true);
+    timerAlarmWrite(timer_, SAFETY_TICK_INTERVAL, true);
+    timerAlarmEnable(timer_);
+}
+
+/**
+ * @brief Call whenever a valid motion command arrives, clears a watchdog trip
+ */
+void SafetySupervisor::feed()
+{
+    last_feed_us_ = micros();
+    grace_us_ = 0;
+    release_(SAFETY_TRIP_WATCHDOG);
+}
+
+/**
+ * @brief Call on an explicit change into a state that drives, clears a watchdog trip
+ * Until the first feed() the watchdog allows grace on top of its timeout, e.g. for the joystick to join the
+ * teleop access point. Nothing drives the motors in the meantime unless a command arrives, which feeds it.
+ *
+ * @param grace ms
+ */
+void SafetySupervisor::arm(unsigned long grace)
+{
+    last_feed_us_ = micros();
+    grace_us_ = grace * 1000;
+    release_(SAFETY_TRIP_WATCHDOG);
+}
+
+/**
+ * @param watchdog_timeout ms
+ */
+void SafetySupervisor::set_watchdog_timeout(unsigned long watchdog_timeout)
+{
+    watchdog_timeout_us_ = watchdog_timeout * 1000;
+}
+
+/**
+ * @brief Clears a latched failsafe switch trip
+ *
+ * @return false if the switch is still open
+ */
+bool SafetySupervisor::rearm()
+{
+    if (!digitalRead(failsafe_pin_))
+    {
+        return false;
+    }
+
+    release_(SAFETY_TRIP_SWITCH);
+    return true;
+}
+
+bool SafetySupervisor::is_tripped()
+{
+    return trip_reasons_ != SAFETY_TRIP_NONE;
+}
+
+uint8_t SafetySupervisor::get_trip_reasons()
+{
+    return trip_reasons_;
+}
+
+TaskHandle_t SafetySupervisor::get_task()
+{
+    return stop_task_;
+}
+
+void SafetySupervisor::print_stats()
+{
+    Serial.print("Safety: trip_reasons=");
+    Serial.print(trip_reasons_);
+    Serial.print(", trips=");
+    Serial.print(trip_count_);
+    Serial.print(", stop_latency_us last=");
+    Serial.print(last_stop_latency_us_);
+    Serial.print(" max=");
+    Serial.println(max_stop_latency_us_);
+}
+
+/**
+ * @brief Timer ISR, every SAFETY_TICK_INTERVAL
+ */
+void IRAM_ATTR SafetySupervisor::on_tick_()
+{
+    uint32_t now = micros();
+
+    if ((now - last_feed_us_) >= watchdog_timeout_us_ + grace_us_)
+    {
+        trip_(SAFETY_TRIP_WATCHDOG, now);
+    }
+
+    // Backs up the edge interrupt, in case an edge was missed
+    if (!digitalRead(failsafe_pin_))
+    {
+        trip_(SAFETY_TRIP_SWITCH, now);
+    }
+}
+
+/**
+ * @brief Failsafe switch GPIO ISR, the switch reads HIGH when it is safe to drive
+ */
+void IRAM_ATTR SafetySupervisor::on_switch_edge_()
+{
+    if (!digitalRead(failsafe_pin_))
+    {
+        trip_(SAFETY_TRIP_SWITCH, micros());
+    }
+}
+
+void IRAM_ATTR SafetySupervisor::trip_(uint8_t reason, uint32_t stamp)
+{
+    bool new_reason = false;
+
+    portENTER_CRITICAL_ISR(&mux_);
+    if ((trip_reasons_ & reason) == 0)
+    {
+        new_reason = true;
+        trip_reasons_ |= reason;
+        trip_count_++;
+        trip_stamp_us_ = stamp;
+    }
+    portEXIT_CRITICAL_ISR(&mux_);
+
+    // A second reason while already tripped still wakes the stop task, so every edge gets logged
+    if (!new_reason)
+    {
+        return;
+    }
+
+    // Hardware stop first, it doesn't depend on any task getting to run
+    digitalWrite(MOTOR_ESTOP_PIN, LOW);
+
+    BaseType_t higher_priority_task_woken = pdFALSE;
+    vTaskNotifyGiveFromISR(stop_task_, &higher_priority_task_woken);
+    portYIELD_FROM_ISR(higher_priority_task_woken);
+}
+
+void SafetySupervisor::release_(uint8_t reason)
+{
+    portENTER_CRITICAL(&mux_);
+    bool released = (trip_reasons_ & reason);
+    trip_reasons_ &= ~reason;
+    uint8_t trip_reasons = trip_reasons_;
+    portEXIT_CRITICAL(&mux_);
+
+    if (!released)
+    {
+        return;
+    }
+
+    if (trip_reasons == SAFETY_TRIP_NONE)
+    {
+        digitalWrite(MOTOR_ESTOP_PIN, HIGH);
+    }
+
+    blackbox.record_failsafe(trip_reasons, micros());
+}
+
+/**
+ * @brief Body of the stop task, sends the serial stop whenever the ISR trips
+ */
+void SafetySupervisor::stop_task_loop_()
+{
+    while (true)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        // Sabertooth simplified serial commands are single bytes, so this can't corrupt a command
+        // the control loop is part way through sending
+        motor_interface_->stop();
+
+        last_stop_latency_us_ = micros() - trip_stamp_us_;
+        if (last_stop_latency_us_ > max_stop_latency_us_)
+        {
+            max_stop_latency_us_ = last_stop_latency_us_;
+        }
+
+        // Logged from here rather than the ISR, the recorder isn't ISR safe
+        blackbox.record_failsafe(trip_reasons_, trip_stamp_us_);
+    }
+}
+
+SafetySupervisor safety_supervisor;
+
+#endif
@@ -0,0 +1,629 @@
+#ifndef SCAN_STREAMER_H
+#define SCAN_STREAMER_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+Scan streamer, sends each LIDAR revolution to ROS over the serial link, compressed
+
+A revolution as text is several kB, and at 115200 baud the link carries about 11.5 kB/s, shared with the commands,
+the clock sync and the debug output. So each revolution is binned into SCAN_STREAM_BEAMS beams (the nearest point
+in each) and compressed:
+  - Ranges are quantised to the resolution (SCAN_STREAM_RESOLUTION mm by default, #F sets another). 0 is no return.
+  - A beam that has moved no more than SCAN_STREAM_DEADBAND steps since it was last sent is skipped, the host keeps
+    the value it has. What is skipped is against what the host has, not the last revolution, so slow creep still
+    gets sent and the error never grows past the deadband. So is a beam no point landed in this time round (the
+    RPLidar's points don't fall on the same angles every revolution).
+  - The beams that are sent are the difference from the last beam before them with a return (as the host has it),
+    zigzag coded into variable length integers, so a smooth wall is a byte a beam. No return is a byte too.
+  - Every SCAN_STREAM_KEYFRAME_INTERVAL revolutions, when the resolution changes, and when the host asks (#F,2,0!,
+    e.g. after it lost a frame) every beam is sent, so a host that joins late or lost a frame catches up.
+
+A revolution goes out as one or more chunks, each a frame (ScanFrameHeader, the payload, and a CRC-16 of both).
+Frames are binary, in among the text output: they start with two bytes text never has (SCAN_FRAME_SYNC_x), and
+each is written with one Serial.write(), which the UART driver doesn't interleave with other output. The host
+decoder (tools/scan_decoder) splits them out and turns each revolution back into sensor_msgs/LaserScan arrays.
+
+Payload, for the beams first_beam to first_beam + num_beams - 1 (varints are LEB128, unsigned):
+  Repeated until the payload ends: varint skip (beams unchanged), varint run (beams sent), then run varints, each 0
+  for no return or 1 + the zigzag coded difference from the last beam before it with a return (0 if none has, from
+  beam 0 on). Beams after the last run are unchanged.
+Beams are clockwise from the robot heading, as the RPLidar reports them, SCAN_STREAM_BEAMS / 360 degrees apart.
+
+The aux loop hands in the points as the LIDAR sends them (add_point()), which encodes each revolution as it
+completes and sends frames as the link allows: no more than SCAN_STREAM_BYTE_RATE, and only whole frames that fit
+in the UART's transmit FIFO, so it never waits for the link. A revolution that completes while the last is still
+going out is dropped (the next one is sent against what the host has, so nothing is lost but time).
+
+print_stats() (#F,0,0!) reports the revolutions sent and dropped, the compression ratio (against 16 bit ranges)
+and how long encoding a revolution takes. Streaming is off until ROS asks for it (#F,1,<mm>!), so the link is left
+alone otherwise. Only the aux loop may call add_point() and update(), the control loop command() and print_stats().
+*/
+
+/******************* CONFIG **********************/
+
+// Beams per revolution (the RPLidar A1 sends about 360 points)
+#define SCAN_STREAM_BEAMS 360
+
+// Range steps, the default and the most #F can set (the header has a byte for it)
+#define SCAN_STREAM_RESOLUTION     10  // mm
+#define SCAN_STREAM_MAX_RESOLUTION 255 // mm
+
+// Outside these is no return (the RPLidar A1 is good from 0.15 to 12 m)
+#define SCAN_STREAM_MIN_RANGE 150   // mm
+#define SCAN_STREAM_MAX_RANGE 12000 // mm
+
+// A beam within this many steps of what the host has is skipped
+#define SCAN_STREAM_DEADBAND 1
+
+// Every beam is sent this often
+#define SCAN_STREAM_KEYFRAME_INTERVAL 20 // revolutions
+
+// Payload bytes per frame, so a whole frame (+20 bytes) fits in the UART's 128 byte transmit FIFO
+#define SCAN_STREAM_CHUNK_PAYLOAD 100
+#define SCAN_STREAM_MAX_CHUNKS    16
+
+// Share of the link for scans (115200 baud is about 11500 bytes/s), and how far ahead of it a burst may go
+#define SCAN_STREAM_BYTE_RATE 6000 // bytes/s
+#define SCAN_STREAM_BURST     240  // bytes
+
+/*************************************************/
+
+#define SCAN_FRAME_SYNC_0 0xA5
+#define SCAN_FRAME_SYNC_1 0xDB
+
+// ScanFrameHeader flags
+#define SCAN_FRAME_KEYFRAME 0x01 // every beam is in this revolution
+#define SCAN_FRAME_LAST     0x02 // the last chunk of the revolution
+
+// Longest run in one token, so its length is a byte
+#define SCAN_STREAM_MAX_RUN 127
+
+// Largest varint a beam can take (a zigzag coded 16 bit difference, + 1, is 17 bits)
+#define SCAN_STREAM_MAX_DELTA_BYTES 3
+
+// Steps for a beam no point landed in this revolution, the host keeps what it has
+#define SCAN_STREAM_HOLD 0xFFFF
+
+// A point with no return (as a distance, further than any return)
+#define SCAN_STREAM_NO_RETURN 0xFFFF
+
+// #F modes
+#define SCAN_STREAM_STOP     -1
+#define SCAN_STREAM_STATS    0
+#define SCAN_STREAM_START    1
+#define SCAN_STREAM_KEYFRAME 2
+
+struct __attribute__((packed)) ScanFrameHeader
+{
+    uint8_t sync[2];     // SCAN_FRAME_SYNC_x
+    uint8_t length;      // of the payload that follows
+    uint8_t flags;       // SCAN_FRAME_x
+    uint16_t sequence;   // every frame, so the host can tell one went missing
+    uint16_t revolution; // every revolution, sent or not
+    uint8_t chunk;       // of this revolution, from 0
+    uint8_t resolution;  // mm per range step
+    uint16_t first_beam;
+    uint16_t num_beams;  // covered by this chunk, those not in the payload are unchanged
+    uint32_t stamp;      // millis() at the start of the revolution
+};
+
+// Then the payload, then a uint16_t CRC-16 of the header (after the sync bytes) and the payload
+#define SCAN_FRAME_MAX_LENGTH (sizeof(ScanFrameHeader) + SCAN_STREAM_CHUNK_PAYLOAD + 2)
+
+/**
+ * @brief CRC-16/CCITT (polynomial 0x1021, from 0xFFFF)
+ */
+inline uint16_t scan_stream_crc16(const uint8_t *data, uint16_t length)
+{
+    uint16_t crc = 0xFFFF;
+    for (uint16_t i = 0; i < length; i++)
+    {
+        crc ^= uint16_t(data[i]) << 8;
+        for (uint8_t bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+        }
+    }
+    return crc;
+}
+
+inline uint8_t scan_stream_varint_size(uint32_t value)
+{
+    uint8_t size = 1;
+    while (value >= 0x80)
+    {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+/**
+ * @return bytes written
+ */
+inline uint8_t scan_stream_write_varint(uint8_t *out, uint32_t value)
+{
+    uint8_t size = 0;
+    while (value >= 0x80)
+    {
+        out[size++] = uint8_t(value) | 0x80;
+        value >>= 7;
+    }
+    out[size++] = uint8_t(value);
+    return size;
+}
+
+/**
+ * @return bytes read, 0 if it runs past the end
+ */
+inline uint8_t scan_stream_read_varint(const uint8_t *in, uint16_t available, uint32_t &value)
+{
+    value = 0;
+    for (uint8_t i = 0; i < available && i < 5; i++)
+    {
+        value |= uint32_t(in[i] & 0x7F) << (7 * i);
+        if (!(in[i] & 0x80))
+        {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+inline uint32_t scan_stream_zigzag(int32_t value)
+{
+    return (uint32_t(value) << 1) ^ uint32_t(value >> 31);
+}
+
+inline int32_t scan_stream_unzigzag(uint32_t value)
+{
+    return int32_t(value >> 1) ^ -int32_t(value & 1);
+}
+
+/**
+ * @brief The beam a point falls in
+ *
+ * @param angle degrees, clockwise
+ */
+inline uint16_t scan_stream_beam(float angle)
+{
+    int32_t beam = int32_t(angle * (SCAN_STREAM_BEAMS / 360.0f) + 0.5f) % SCAN_STREAM_BEAMS;
+    return beam < 0 ? beam + SCAN_STREAM_BEAMS : beam;
+}
+
+/**
+ * @brief Range in mm to steps of resolution, 0 for no return
+ */
+inline uint16_t scan_stream_quantise(uint16_t distance, uint8_t resolution)
+{
+    if (distance < SCAN_STREAM_MIN_RANGE || distance > SCAN_STREAM_MAX_RANGE)
+    {
+        return 0;
+    }
+    return (distance + resolution / 2) / resolution;
+}
+
+/**
+ * @brief The compression itself, no serial or buffering (runs on the host too)
+ */
+class ScanEncoder
+{
+    public:
+        ScanEncoder();
+        uint8_t encode(const uint16_t *steps, uint8_t resolution, bool keyframe, uint16_t revolution, uint32_t stamp,
+                       uint8_t frames[][SCAN_FRAME_MAX_LENGTH], uint8_t *lengths);
+        bool was_keyframe();
+        uint16_t get_beams_sent();
+
+    private:
+        bool changed_(const uint16_t *steps, uint16_t beam);
+
+        // What the host has, in steps
+        uint16_t sent_[SCAN_STREAM_BEAMS];
+        uint8_t resolution_;
+        bool synced_;           // the host has every beam, unless a frame went missing on the way
+        bool keyframe_;         // the revolution being (or last) encoded
+        uint16_t since_keyframe_;
+        uint16_t beams_sent_;   // in the last revolution encoded
+
+        uint16_t sequence_;
+};
+
+ScanEncoder::ScanEncoder()
+{
+    memset(sent_, 0, sizeof(sent_));
+    this->resolution_     = 0;
+    this->synced_         = false;
+    this->keyframe_       = false;
+    this->since_keyframe_ = 0;
+    this->beams_sent_     = 0;
+    this->sequence_       = 0;
+}
+
+/**
+ * @brief Compresses one revolution into frames
+ *
+ * @param steps SCAN_STREAM_BEAMS ranges, in steps of resolution (scan_stream_quantise()), or SCAN_STREAM_HOLD
+ * @param keyframe send every beam, whether it has changed or not
+ * @param revolution counts every revolution, sent or not, so the host can tell how long each took
+ * @param stamp millis() at the start of the revolution
+ * @param frames, lengths filled with the frames to send, in order
+ * @return number of frames, 0 if it needed more than SCAN_STREAM_MAX_CHUNKS (the next one will be a keyframe)
+ */
+uint8_t ScanEncoder::encode(const uint16_t *steps, uint8_t resolution, bool keyframe, uint16_t revolution,
+                            uint32_t stamp, uint8_t frames[][SCAN_FRAME_MAX_LENGTH], uint8_t *lengths)
+{
+    keyframe_ = keyframe || !synced_ || resolution != resolution_ ||
+                since_keyframe_ + 1 >= SCAN_STREAM_KEYFRAME_INTERVAL;
+    resolution_ = resolution;
+    beams_sent_ = 0;
+
+    uint16_t first_sequence = sequence_;
+    uint16_t beam = 0;
+    uint8_t chunk = 0;
+
+    // Last beam with a return, as the host has it, which the next one sent is a difference from
+    uint16_t base = 0;
+
+    // At least one frame, even with nothing changed, so the host knows the revolution happened
+    do
+    {
+        if (chunk == SCAN_STREAM_MAX_CHUNKS)
+        {
+            // Some of sent_ went into frames that won't be sent
+            sequence_ = first_sequence;
+            synced_ = false;
+            return 0;
+        }
+
+        uint8_t *payload = frames[chunk] + sizeof(ScanFrameHeader);
+        uint8_t length = 0;
+        uint16_t first_beam = beam;
+
+        while (beam < SCAN_STREAM_BEAMS)
+        {
+            uint16_t skip = 0;
+            while (beam + skip < SCAN_STREAM_BEAMS && !changed_(steps, beam + skip))
+            {
+                base = sent_[beam + skip] ? sent_[beam + skip] : base;
+                skip++;
+            }
+
+            if (beam + skip == SCAN_STREAM_BEAMS)
+            {
+                // The rest are unchanged, nothing to say about them
+                beam = SCAN_STREAM_BEAMS;
+                break;
+            }
+
+            // Room for the skip, the run length and at least one difference, or on to the next chunk
+            if (length + scan_stream_varint_size(skip) + 1 + SCAN_STREAM_MAX_DELTA_BYTES > SCAN_STREAM_CHUNK_PAYLOAD)
+            {
+                break;
+            }
+
+            length += scan_stream_write_varint(payload + length, skip);
+            uint8_t *run_length = payload + length++;
+            uint8_t run = 0;
+            beam += skip;
+
+            while (beam < SCAN_STREAM_BEAMS && run < SCAN_STREAM_MAX_RUN && changed_(steps, beam))
+            {
+                // A keyframe sends the held ones as the host has them
+                uint16_t value = (steps[beam] == SCAN_STREAM_HOLD) ? sent_[beam] : steps[beam];
+                uint32_t symbol = value ? scan_stream_zigzag(int32_t(value) - base) + 1 : 0;
+
+                if (length + scan_stream_varint_size(symbol) > SCAN_STREAM_CHUNK_PAYLOAD)
+                {
+                    break;
+                }
+
+                length += scan_stream_write_varint(payload + length, symbol);
+                sent_[beam] = value;
+                base = value ? value : base;
+                beam++;
+                run++;
+            }
+
+            *run_length = run;
+            beams_sent_ += run;
+        }
+
+        ScanFrameHeader header;
+        header.sync[0]    = SCAN_FRAME_SYNC_0;
+        header.sync[1]    = SCAN_FRAME_SYNC_1;
+        header.length     = length;
+        header.flags      = (keyframe_ ? SCAN_FRAME_KEYFRAME : 0) | (beam == SCAN_STREAM_BEAMS ? SCAN_FRAME_LAST : 0);
+        header.sequence   = sequence_++;
+        header.revolution = revolution;
+        header.chunk      = chunk;
+        header.resolution = resolution;
+        header.first_beam = first_beam;
+        header.num_beams  = beam - first_beam;
+        header.stamp      = stamp;
+        memcpy(frames[chunk], &header, sizeof(header));
+
+        uint16_t crc_length = sizeof(header) - 2 + length;
+        uint16_t crc = scan_stream_crc16(frames[chunk] + 2, crc_length);
+        frames[chunk][2 + crc_length]     = uint8_t(crc);
+        frames[chunk][2 + crc_length + 1] = uint8_t(crc >> 8);
+
+        lengths[chunk] = sizeof(header) + length + 2;
+        chunk++;
+    } while (beam < SCAN_STREAM_BEAMS);
+
+    synced_ = true;
+    since_keyframe_ = keyframe_ ? 0 : since_keyframe_ + 1;
+    return chunk;
+}
+
+bool ScanEncoder::was_keyframe()
+{
+    return keyframe_;
+}
+
+/**
+ * @brief Beams that weren't skipped in the last revolution encoded
+ */
+uint16_t ScanEncoder::get_beams_sent()
+{
+    return beams_sent_;
+}
+
+bool ScanEncoder::changed_(const uint16_t *steps, uint16_t beam)
+{
+    if (keyframe_)
+    {
+        return true;
+    }
+
+    if (steps[beam] == SCAN_STREAM_HOLD)
+    {
+        return false;
+    }
+
+    // A return appearing or going away always counts, however close the steps
+    if ((steps[beam] == 0) != (sent_[beam] == 0))
+    {
+        return true;
+    }
+
+    return abs(int32_t(steps[beam]) - int32_t(sent_[beam])) > SCAN_STREAM_DEADBAND;
+}
+
+class ScanStreamer
+{
+    public:
+        ScanStreamer();
+        void add_point(float distance, float angle, uint8_t quality, bool start_bit);
+        void update();
+        void command(int mode, double resolution);
+        void print_stats();
+
+    private:
+        void complete_revolution_();
+
+        ScanEncoder encoder_;
+
+        // The revolution coming in, nearest point in each beam (mm, SCAN_STREAM_NO_RETURN, 0 if none landed in it)
+        uint16_t distance_[SCAN_STREAM_BEAMS];
+        uint16_t steps_[SCAN_STREAM_BEAMS];
+        unsigned long revolution_start_; // ms
+        bool started_;                   // seen a start bit, so the revolution coming in is a whole one
+
+        // The last revolution's frames, frames_[next_frame_] goes next
+        uint8_t frames_[SCAN_STREAM_MAX_CHUNKS][SCAN_FRAME_MAX_LENGTH];
+        uint8_t frame_lengths_[SCAN_STREAM_MAX_CHUNKS];
+        uint8_t num_frames_;
+        uint8_t next_frame_;
+
+        // Bytes the link may take now, in thousandths
+        uint32_t budget_;
+        unsigned long last_refill_; // ms
+
+        // Set by the control loop, taken up at the next revolution
+        volatile bool streaming_;
+        volatile uint8_t resolution_;
+        volatile bool keyframe_requested_;
+
+        // Stats
+        uint32_t revolutions_;
+        uint32_t sent_;
+        uint32_t keyframes_;
+        uint32_t dropped_;
+        uint32_t too_big_;
+        uint32_t frames_sent_;
+        uint32_t bytes_;
+        uint32_t beams_sent_;
+        uint32_t last_encode_us_;
+        uint32_t max_encode_us_;
+};
+
+ScanStreamer::ScanStreamer()
+{
+    memset(distance_, 0, sizeof(distance_));
+    this->revolution_start_   = 0;
+    this->started_            = false;
+    this->num_frames_         = 0;
+    this->next_frame_         = 0;
+    this->budget_             = 0;
+    this->last_refill_        = 0;
+    this->streaming_          = false;
+    this->resolution_         = SCAN_STREAM_RESOLUTION;
+    this->keyframe_requested_ = false;
+    this->revolutions_        = 0;
+    this->sent_               = 0;
+    this->keyframes_          = 0;
+    this->dropped_            = 0;
+    this->too_big_            = 0;
+    this->frames_sent_        = 0;
+    this->bytes_              = 0;
+    this->beams_sent_         = 0;
+    this->last_encode_us_     = 0;
+    this->max_encode_us_      = 0;
+}
+
+/**
+ * @brief Call for each LIDAR point as it arrives, from one task only (the aux loop)
+ *
+ * @param distance mm
+ * @param angle degrees, clockwise
+ * @param start_bit the first point of a new revolution
+ */
+void ScanStreamer::add_point(float distance, float angle, uint8_t quality, bool start_bit)
+{
+    if (start_bit)
+    {
+        // Whatever came before the first start bit was part of a revolution
+        if (started_)
+        {
+            complete_revolution_();
+        }
+        memset(distance_, 0, sizeof(distance_));
+        started_ = true;
+        revolution_start_ = millis();
+    }
+
+    uint16_t beam = scan_stream_beam(angle);
+    uint16_t mm = SCAN_STREAM_NO_RETURN;
+    if (quality > 0 && distance >= SCAN_STREAM_MIN_RANGE && distance <= SCAN_STREAM_MAX_RANGE)
+    {
+        mm = uint16_t(distance + 0.5f);
+    }
+    if (distance_[beam] == 0 || mm < distance_[beam])
+    {
+        distance_[beam] = mm;
+    }
+
+    update();
+}
+
+/**
+ * @brief Sends what frames the link has room for, call often from the aux loop (add_point() does too)
+ */
+void ScanStreamer::update()
+{
+    unsigned long now = millis();
+    uint32_t elapsed = min(uint32_t(now - last_refill_), uint32_t(1000));
+    last_refill_ = now;
+    budget_ = min(budget_ + elapsed * SCAN_STREAM_BYTE_RATE, uint32_t(SCAN_STREAM_BURST * 1000));
+
+    while (next_frame_ < num_frames_)
+    {
+        uint8_t length = frame_lengths_[next_frame_];
+        if (budget_ < length * 1000UL || Serial.availableForWrite() < length)
+        {
+            return;
+        }
+
+        Serial.write(frames_[next_frame_], length);
+        budget_ -= length * 1000UL;
+        next_frame_++;
+        frames_sent_++;
+        bytes_ += length;
+    }
+}
+
+/**
+ * @brief #F,<mode>,<resolution>!, from the control loop
+ *
+ * @param mode SCAN_STREAM_x: stop, print the stats, start (at resolution mm, 0 for the default), or send every
+ * beam in the next revolution
+ */
+void ScanStreamer::command(int mode, double resolution)
+{
+    if (mode == SCAN_STREAM_STOP)
+    {
+        streaming_ = false;
+    }
+    else if (mode == SCAN_STREAM_START)
+    {
+        resolution_ = (resolution >= 1.0) ? uint8_t(min(resolution, double(SCAN_STREAM_MAX_RESOLUTION)))
+                                          : SCAN_STREAM_RESOLUTION;
+        streaming_ = true;
+    }
+    else if (mode == SCAN_STREAM_KEYFRAME)
+    {
+        keyframe_requested_ = true;
+    }
+    else
+    {
+        print_stats();
+    }
+}
+
+void ScanStreamer::print_stats()
+{
+    Serial.print("Scan stream: streaming=");
+    Serial.print(streaming_);
+    Serial.print(", resolution_mm=");
+    Serial.print(resolution_);
+    Serial.print(", revolutions=");
+    Serial.print(revolutions_);
+    Serial.print(", sent=");
+    Serial.print(sent_);
+    Serial.print(", keyframes=");
+    Serial.print(keyframes_);
+    Serial.print(", dropped (link busy)=");
+    Serial.print(dropped_);
+    Serial.print(", too big=");
+    Serial.print(too_big_);
+    Serial.print(", frames=");
+    Serial.print(frames_sent_);
+    Serial.print(", bytes=");
+    Serial.println(bytes_);
+
+    // Against each revolution as SCAN_STREAM_BEAMS 16 bit ranges
+    Serial.print("  compression=");
+    Serial.print(bytes_ > 0 ? double(sent_) * SCAN_STREAM_BEAMS * 2 / bytes_ : 0.0);
+    Serial.print(", beams sent %=");
+    Serial.print(sent_ > 0 ? 100.0 * beams_sent_ / (double(sent_) * SCAN_STREAM_BEAMS) : 0.0);
+    Serial.print(", encode_us last=");
+    Serial.print(last_encode_us_);
+    Serial.print(" max=");
+    Serial.println(max_encode_us_);
+}
+
+void ScanStreamer::complete_revolution_()
+{
+    revolutions_++;
+
+    if (streaming_ && next_frame_ < num_frames_)
+    {
+        dropped_++;
+    }
+    else if (streaming_)
+    {
+        uint8_t resolution = resolution_;
+        bool keyframe = keyframe_requested_;
+        keyframe_requested_ = false;
+
+        unsigned long start = micros();
+        for (uint16_t i = 0; i < SCAN_STREAM_BEAMS; i++)
+        {
+            steps_[i] = distance_[i] ? scan_stream_quantise(distance_[i], resolution) : SCAN_STREAM_HOLD;
+        }
+        num_frames_ = encoder_.encode(steps_, resolution, keyframe, uint16_t(revolutions_), revolution_start_, frames_,
+                                      frame_lengths_);
+        next_frame_ = 0;
+        last_encode_us_ = micros() - start;
+        max_encode_us_ = max(max_encode_us_, last_encode_us_);
+
+        if (num_frames_ == 0)
+        {
+            too_big_++;
+        }
+        else
+        {
+            sent_++;
+            keyframes_ += encoder_.was_keyframe();
+            beams_sent_ += encoder_.get_beams_sent();
+        }
+    }
+}
+
+ScanStreamer scan_streamer;
+
+#endif
@@ -20,17 +20,19 @@ class SerialCommand
 		int message_type;
 		double message_data1;
 		double message_data2;
+		unsigned long message_start; // millis() when the MESSAGE_START was read
 
 		SerialCommand();
 		void ReadData();
 		void reset();
 
 		private:
-			String cmd_string;
+			char cmd_string[MAX_CHARS + 1];
 			int curr_pos;
 			bool reading_message;
 
 			bool haveValidMessage();
+			bool isNumberChar(char c);
 };
 
 
@@ -52,14 +54,16 @@ void SerialCommand::ReadData()
   if (! reading_message) {
     if (read_byte == MESSAGE_START) {
       reading_message = true;
+      message_start = millis();
     }
     return;
   }
 
   if (read_byte != MESSAGE_END)
   {
-    cmd_string += (char)read_byte;
+    cmd_string[curr_pos] = (char)read_byte;
     curr_pos++;
+    cmd_string[curr_pos] = '\0';
     if ( curr_pos >= MAX_CHARS ) {
       reset();
     }
@@ -73,15 +77,15 @@ void SerialCommand::ReadData()
     return;
   }
 
-  message_type = cmd_string.substring(0).toInt();
+  message_type = cmd_string[0];
   bool found = false;
-  char p = 2;
+  int p = 2;
   for (; p < MAX_CHARS; p++)
   {
-    if ( ! ( isDigit( cmd_string.charAt(p) ) || cmd_string.charAt(p) == '.' ) ) {
+    if ( ! isNumberChar( cmd_string[p] ) ) {
       // If the char is a comma, then parse the data we have
-      if ( cmd_string.charAt(p) == 0x2c ) {
-        message_data1 = cmd_string.substring(2, p).toFloat();
+      if ( cmd_string[p] == 0x2c ) {
+        message_data1 = atof(&cmd_string[2]);
         found = true;
         break;
       }
@@ -98,11 +102,10 @@ void SerialCommand::ReadData()
   found = false;
   for (int q = p + 1; q < MAX_CHARS; q++)
   {
-    if ( ! ( isDigit( cmd_string.charAt(q) ) || cmd_string.charAt(q) == '.' ) ) {
+    if ( ! isNumberChar( cmd_string[q] ) ) {
       // If the char is a comma, then parse the data we have
-      // if ( cmd_string.charAt(q) == NULL )
-      if ( ! cmd_string.charAt(q) ) {
-        message_data2 = cmd_string.substring(p + 1, q).toFloat();
+      if ( ! cmd_string[q] ) {
+        message_data2 = atof(&cmd_string[p + 1]);
         found = true;
         break;
       }
@@ -118,18 +121,19 @@ void SerialCommand::ReadData()
 }
     
 void SerialCommand::reset() {
-  cmd_string      = "";
+  cmd_string[0]   = '\0';
   reading_message = false;
   curr_pos        = 0;
   message_type    = -1;
   message_data1   = -1;
   message_data2   = -1;
+  message_start   = 0;
 }
 
 bool SerialCommand::haveValidMessage() {
   int comma_count = 0;
-  for ( int p = 1; p < cmd_string.length(); p++ ) {
-    if ( cmd_string.charAt(p) == ',' ) {
+  for ( int p = 1; p < curr_pos; p++ ) {
+    if ( cmd_string[p] == ',' ) {
       comma_count += 1;
     }
   }
@@ -137,3 +141,7 @@ bool SerialCommand::haveValidMessage() {
   return ( comma_count == 2 );
 }
 
+bool SerialCommand::isNumberChar(char c) {
+  // Digits, decimal point and sign (negative velocities and parameters)
+  return ( isDigit(c) || c == '.' || c == '-' || c == '+' );
+}
@@ -0,0 +1,202 @@
+#ifndef SERIAL_DISPATCH_H
+#define SERIAL_DISPATCH_H
+
+/*
+Serial motion command dispatch, the messages from ROS that move the robot or say when to
+
+  #V,<linear>,<angular>!       velocity
+  #A,<metres>,0! #T,<degrees>,0! #R,<power>,<ms>!   manoeuvres and the motor step test
+  #Q,<host ms>,0! / #Q,0,0!    schedule the next message, or clear the schedule (see command_schedule.h)
+  #C,<host ms>,<host ms>! / #C,0,0!   clock sync ping, or the sync and schedule stats (see clock_sync.h)
+
+The message after a #Q goes into the schedule instead of running, an immediate #V, #A, #T or #R replaces whatever
+was scheduled. run_schedule() runs the scheduled commands whose time has come, call it at the start of each control
+cycle while the robot may drive (clear_schedule() otherwise).
+
+The robot is a template parameter, so tools/serial_latency drives its bench robot through this same path. It needs:
+    void process_velocity_command(double linear, double angular)
+    void process_motion_command(int message_type, double data1, double data2)   #A, #T and #R
+    void keep_link_alive()                                                      a command was scheduled
+Only the control loop's task may use it.
+*/
+
+#include "clock_sync.h"
+#include "command_schedule.h"
+#include "blackbox_recorder.h"
+
+template <typename Robot>
+class SerialDispatch
+{
+    public:
+        SerialDispatch(Robot *robot);
+        bool dispatch(int message_type, double data1, double data2, unsigned long message_start);
+        void run_schedule();
+        void clear_schedule();
+
+    private:
+        bool schedule_command_(int message_type, double data1, double data2);
+        void process_schedule_command_(double host_time);
+
+        Robot *robot_;
+
+        CommandSchedule schedule_;
+        bool stamp_pending_;  // the next message is to be scheduled
+        bool stamp_synced_;   // and stamp_ is when, on our clock
+        unsigned long stamp_;
+};
+
+template <typename Robot>
+SerialDispatch<Robot>::SerialDispatch(Robot *robot)
+{
+    this->robot_         = robot;
+    this->stamp_pending_ = false;
+    this->stamp_synced_  = false;
+    this->stamp_         = 0;
+}
+
+/**
+ * @brief Call with every message from the serial port
+ *
+ * @param message_start millis() the message started arriving, for the clock sync
+ * @return false if it isn't one of these messages (it still ends a pending #Q)
+ */
+template <typename Robot>
+bool SerialDispatch<Robot>::dispatch(int message_type, double data1, double data2, unsigned long message_start)
+{
+    // The message after #Q,<host ms>,0! waits until then
+    if (schedule_command_(message_type, data1, data2))
+    {
+        Serial.println("Command scheduled");
+        return true;
+    }
+
+    switch (message_type)
+    {
+        case 'V':
+            schedule_.clear();
+            robot_->process_velocity_command(data1, data2);
+            return true;
+
+        case 'A':
+        case 'T':
+        case 'R':
+            schedule_.clear();
+            robot_->process_motion_command(message_type, data1, data2);
+            return true;
+
+        case 'Q':
+            process_schedule_command_(data1);
+            return true;
+
+        case 'C':
+            if (data1 > 0)
+            {
+                // The estimate goes in the black box, to line it up with the host's logs
+                if (clock_sync.ping(data1, data2, message_start))
+                {
+                    blackbox.record_serial('c', clock_sync.get_offset(millis()), clock_sync.get_drift() * 1e6);
+                }
+            }
+            else
+            {
+                clock_sync.print_stats(millis());
+                schedule_.print_stats();
+            }
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+/**
+ * @brief Runs the scheduled commands whose time has come, as if they had just arrived
+ */
+template <typename Robot>
+void SerialDispatch<Robot>::run_schedule()
+{
+    ScheduledCommand scheduled;
+    while (schedule_.take(millis(), scheduled))
+    {
+        blackbox.record_serial(scheduled.message_type, scheduled.data1, scheduled.data2);
+
+        if (scheduled.message_type == 'V')
+        {
+            robot_->process_velocity_command(scheduled.data1, scheduled.data2);
+        }
+        else
+        {
+            robot_->process_motion_command(scheduled.message_type, scheduled.data1, scheduled.data2);
+        }
+    }
+}
+
+/**
+ * @brief Forgets everything scheduled, and a #Q waiting for its message
+ * Nothing scheduled may run once the robot has stopped, it would have to be sent again anyway
+ */
+template <typename Robot>
+void SerialDispatch<Robot>::clear_schedule()
+{
+    schedule_.clear();
+    stamp_pending_ = false;
+}
+
+/**
+ * @brief The one after #Q is scheduled rather than run now
+ *
+ * @return true if the message was taken (scheduled, or refused)
+ */
+template <typename Robot>
+bool SerialDispatch<Robot>::schedule_command_(int message_type, double data1, double data2)
+{
+    if (!stamp_pending_ || message_type == 'Q')
+    {
+        return false;
+    }
+
+    stamp_pending_ = false;
+
+    if (message_type != 'V' && message_type != 'A' && message_type != 'T')
+    {
+        Serial.println("ERROR: Only #V, #A and #T can be scheduled");
+        return true;
+    }
+
+    if (!stamp_synced_ || !schedule_.add(stamp_, message_type, data1, data2, millis()))
+    {
+        Serial.println("ERROR: Command not scheduled (clock not synced, late, too far ahead or the schedule is full)");
+        return true;
+    }
+
+    // The link is alive, as for an immediate command
+    robot_->keep_link_alive();
+    return true;
+}
+
+/**
+ * @brief #Q,<host ms>,0! the next message runs at that time on the host's clock, #Q,0,0! forgets everything scheduled
+ */
+template <typename Robot>
+void SerialDispatch<Robot>::process_schedule_command_(double host_time)
+{
+    stamp_pending_ = false;
+
+    if (host_time <= 0.0)
+    {
+        schedule_.clear();
+        Serial.println("Schedule cleared");
+        return;
+    }
+
+    // The next message is taken either way, a trajectory point must not run as soon as it arrives
+    stamp_pending_ = true;
+    stamp_synced_ = clock_sync.to_local(host_time, millis(), stamp_);
+
+    if (!stamp_synced_)
+    {
+        Serial.println("ERROR: Clock not synced, send #C pings first");
+    }
+}
+
+#endif
@@ -0,0 +1,228 @@
+#ifndef SETPOINT_GENERATOR_H
+#define SETPOINT_GENERATOR_H
+
+/*
+Setpoint generator
+
+Velocity commands arrive at 10-20 Hz (or whenever the operator moves the joystick). Passing them straight to the
+wheels as steps causes current spikes through the Sabertooth, especially when braking (it regenerates into the battery).
+
+Each control cycle this:
+  1. Saturates the commanded (v, w) so that neither wheel exceeds SETPOINT_MAX_WHEEL_VEL,
+     scaling v and w together so the commanded curvature (the path) is kept
+  2. Moves the profiled (v, w) towards it with limited acceleration and jerk (S-curve)
+  3. Converts the profiled (v, w) to left/right wheel velocities (differential drive inverse kinematics)
+
+The acceleration and jerk limits are given at the wheel, the angular limits are derived from them using the track width.
+*/
+
+/******************* CONFIG **********************/
+
+// Distance between the left and right wheel contact patches
+#define WHEEL_TRACK 0.55 // metres, FIXME: measure
+
+// Fastest either wheel may be commanded to go
+#define SETPOINT_MAX_WHEEL_VEL 1.0 // m/s
+
+// The update is skipped if called faster than this, and dt is clamped to the maximum
+// (so a stalled loop doesn't produce one huge step)
+#define SETPOINT_MIN_DT 0.0005 // s
+#define SETPOINT_MAX_DT 0.1    // s
+
+/*************************************************/
+
+struct WheelTargets
+{
+    double left;  // m/s
+    double right; // m/s
+};
+
+class SetpointGenerator
+{
+    public:
+        SetpointGenerator();
+        void set_command(Velocity cmd);
+        WheelTargets update(unsigned long now_us);
+        void reset();
+        void set_track(double wheel_track);
+        void set_limits(double max_wheel_vel, double max_accel, double max_decel, double max_jerk);
+        Velocity get_profiled();
+
+    private:
+        // One profiled degree of freedom (linear or angular)
+        struct Axis
+        {
+            double vel;
+            double accel;
+        };
+
+        Velocity saturate_(Velocity cmd);
+        void step_axis_(Axis &axis, double target, double dt, double max_accel, double max_decel, double max_jerk);
+
+        Velocity command_;
+        Axis linear_;
+        Axis angular_;
+        unsigned long last_update_;
+        bool started_;
+
+        double wheel_track_;
+        double max_wheel_vel_;
+        double max_accel_;
+        double max_decel_;
+        double max_jerk_;
+};
+
+SetpointGenerator::SetpointGenerator()
+{
+    this->wheel_track_   = WHEEL_TRACK;
+    this->max_wheel_vel_ = SETPOINT_MAX_WHEEL_VEL;
+    this->max_accel_     = ROBOT_MAX_ACCEL_RATE;
+    this->max_decel_     = ROBOT_MAX_DECEL_RATE;
+    this->max_jerk_      = ROBOT_MAX_JERK;
+    reset();
+}
+
+/**
+ * @brief Sets the velocity the profile heads towards, call whenever a new command arrives
+ */
+void SetpointGenerator::set_command(Velocity cmd)
+{
+    command_ = saturate_(cmd);
+}
+
+/**
+ * @brief Advances the profile to now, call once per motor control cycle
+ *
+ * @param now_us micros()
+ * @return WheelTargets for this cycle
+ */
+WheelTargets SetpointGenerator::update(unsigned long now_us)
+{
+    double dt = 0.0;
+
+    if (started_)
+    {
+        dt = double(now_us - last_update_) * 1e-6;
+    }
+
+    if (!started_ || dt >= SETPOINT_MIN_DT)
+    {
+        dt = min(dt, SETPOINT_MAX_DT);
+        last_update_ = now_us;
+        started_ = true;
+
+        // Turning w at the robot's centre moves each wheel at w * track / 2
+        double wheel_to_angular = 2.0 / wheel_track_;
+
+        step_axis_(linear_, command_.linear, dt, max_accel_, max_decel_, max_jerk_);
+        step_axis_(angular_, command_.angular, dt,
+                   max_accel_ * wheel_to_angular, max_decel_ * wheel_to_angular, max_jerk_ * wheel_to_angular);
+    }
+
+    WheelTargets targets;
+    targets.left  = linear_.vel - angular_.vel * wheel_track_ * 0.5;
+    targets.right = linear_.vel + angular_.vel * wheel_track_ * 0.5;
+    return targets;
+}
+
+/**
+ * @brief Jumps the profile to standstill, e.g. after the motors have been stopped by a failsafe
+ */
+void SetpointGenerator::reset()
+{
+    command_.linear  = 0.0;
+    command_.angular = 0.0;
+    linear_.vel      = 0.0;
+    linear_.accel    = 0.0;
+    angular_.vel     = 0.0;
+    angular_.accel   = 0.0;
+    last_update_     = 0;
+    started_         = false;
+}
+
+void SetpointGenerator::set_track(double wheel_track)
+{
+    wheel_track_ = wheel_track;
+}
+
+/**
+ * @param max_wheel_vel m/s
+ * @param max_accel m/s^2, when speeding up
+ * @param max_decel m/s^2, when slowing down
+ * @param max_jerk m/s^3
+ */
+void SetpointGenerator::set_limits(double max_wheel_vel, double max_accel, double max_decel, double max_jerk)
+{
+    max_wheel_vel_ = max_wheel_vel;
+    max_accel_     = max_accel;
+    max_decel_     = max_decel;
+    max_jerk_      = max_jerk;
+}
+
+/**
+ * @brief The (v, w) actually being commanded to the wheels this cycle
+ */
+Velocity SetpointGenerator::get_profiled()
+{
+    Velocity vel;
+    vel.linear  = linear_.vel;
+    vel.angular = angular_.vel;
+    return vel;
+}
+
+Velocity SetpointGenerator::saturate_(Velocity cmd)
+{
+    double half_track = wheel_track_ * 0.5;
+    double fastest = max(fabs(cmd.linear - cmd.angular * half_track), fabs(cmd.linear + cmd.angular * half_track));
+
+    if (fastest > max_wheel_vel_)
+    {
+        double scale = max_wheel_vel_ / fastest;
+        cmd.linear  *= scale;
+        cmd.angular *= scale;
+    }
+
+    return cmd;
+}
+
+/**
+ * @brief One step of a jerk-limited velocity profile
+ * The acceleration is ramped (at max_jerk) towards the largest value that can still be ramped back to zero
+ * by the time the velocity reaches the target, so the velocity arrives without overshoot.
+ */
+void SetpointGenerator::step_axis_(Axis &axis, double target, double dt, double max_accel, double max_decel, double max_jerk)
+{
+    double error = target - axis.vel;
+
+    // Slowing down if the target is on the same side of zero and smaller, or on the other side
+    bool slowing = (axis.vel * error < 0.0);
+    double accel_limit = slowing ? max_decel : max_accel;
+
+    // Ramping the acceleration a down to zero at max_jerk changes the velocity by a^2 / (2 * max_jerk).
+    // In discrete time the ramp takes whole steps, each adding j * dt^2 / 2 more, and this step's a * dt is already committed
+    double max_accel_change = max_jerk * dt;
+    double remaining = max(0.0, fabs(error) - fabs(axis.accel) * dt);
+    double accel_wanted = sqrt(2.0 * max_jerk * remaining + 0.25 * max_accel_change * max_accel_change) - 0.5 * max_accel_change;
+    accel_wanted = min(accel_limit, accel_wanted);
+
+    if (error < 0.0)
+    {
+        accel_wanted = -accel_wanted;
+    }
+
+    axis.accel += constrain(accel_wanted - axis.accel, -max_accel_change, max_accel_change);
+
+    double next_vel = axis.vel + axis.accel * dt;
+
+    // Would reach the target this step. The acceleration is already close to zero here, so stopping on it is smooth
+    if ((next_vel - target) * error >= 0.0)
+    {
+        axis.vel   = target;
+        axis.accel = 0.0;
+        return;
+    }
+
+    axis.vel = next_vel;
+}
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef SNAPSHOT_BUFFER_H
+#define SNAPSHOT_BUFFER_H
+
+#include <stdint.h>
+
+/*
+Double-buffered, versioned snapshot of a plain struct, for passing data between tasks/cores without locks.
+
+The writer fills the buffer that readers are NOT using, then bumps the version to publish it.
+Readers copy the published buffer, then check whether the writer has since started filling that same buffer
+again (i.e. started the next-but-one write). If so the copy may be torn, and the read is retried.
+Readers never block the writer and the writer never blocks readers.
+
+Only ONE task may write. Any number of tasks may read.
+*/
+
+template <typename T>
+class SnapshotBuffer
+{
+    public:
+        SnapshotBuffer();
+        void write(const T &value);
+        T read() const;
+        uint32_t get_version() const;
+
+    private:
+        T buffers_[2];
+        volatile uint32_t version_; // the published buffer is buffers_[version_ & 1]
+        volatile uint32_t writing_; // version currently being written (== version_ when idle)
+};
+
+template <typename T>
+SnapshotBuffer<T>::SnapshotBuffer()
+{
+    this->buffers_[0] = T();
+    this->buffers_[1] = T();
+    this->version_    = 0;
+    this->writing_    = 0;
+}
+
+/**
+ * @brief Publishes a new value, readers see it on their next read()
+ */
+template <typename T>
+void SnapshotBuffer<T>::write(const T &value)
+{
+    uint32_t next = version_ + 1;
+
+    // Readers must be able to see that this buffer is being modified before it is touched
+    writing_ = next;
+    __sync_synchronize();
+
+    buffers_[next & 1] = value;
+
+    // The buffer must be complete before the new version becomes visible
+    __sync_synchronize();
+    version_ = next;
+}
+
+/**
+ * @brief Returns a consistent copy of the latest published value
+ */
+template <typename T>
+T SnapshotBuffer<T>::read() const
+{
+    T value;
+    uint32_t version, writing;
+
+    do
+    {
+        version = version_;
+        __sync_synchronize();
+        value = buffers_[version & 1];
+        __sync_synchronize();
+        writing = writing_;
+    }
+    while ((writing - version) >= 2);
+
+    return value;
+}
+
+/**
+ * @brief Increments each time a new value is published, cheap way to check for changes
+ */
+template <typename T>
+uint32_t SnapshotBuffer<T>::get_version() const
+{
+    return version_;
+}
+
+#endif
@@ -0,0 +1,510 @@
+#ifndef TASK_MONITOR_H
+#define TASK_MONITOR_H
+
+#include <esp_freertos_hooks.h>
+
+#include "task_table.h"
+
+/*
+Task monitor, what each core actually spends its time on
+
+CPU load: the FreeRTOS tick interrupt (every portTICK_PERIOD_MS, on each core) samples which task it interrupted.
+Over a few seconds that gives each task's share of its core, the idle time, and the time taken by tasks that
+aren't in the table (the Wi-Fi and lwIP tasks, esp_timer, ...). It works on the stock Arduino core, which is built
+without configGENERATE_RUN_TIME_STATS, and costs a few hundred cycles per tick.
+
+For the two loop tasks, which mark their cycles with begin_cycle() and end_cycle():
+  - Preemptions: ticks that find another task running in the middle of a cycle (other than while waiting for
+    the baton). Each run of such ticks counts once. Anything shorter than a tick can be missed.
+  - Baton waits: time blocked in take_baton().
+  - Start jitter: how late the cycle got the baton, from when its delay() should have ended. This is how far the
+    control loop's period wanders, and what the placement in task_table.h is meant to keep small.
+
+#L,0,0! prints the stats since the last reset (#L,1,0! resets them).
+
+Stress benchmark, #K,<seconds>,<load %>!: resets the stats, then for the given time runs a busy task on each core
+(the "Stress" rows in task_table.h, each spinning for MONITOR_STRESS_BURST at a time, for <load %> of its core)
+while the auxillary loop refreshes the TFT every cycle to fight over the baton. When it finishes the stats are
+printed with a STRESS line summing up the control loop's jitter, to compare placements by:
+    STRESS,<load>,<control core>,<control priority>,<aux core>,<aux priority>,<p50 us>,<p99 us>,<max us>,<preemptions>,<max baton wait us>
+Cores can't be changed while running, so for each placement edit task_table.h, flash, and run the benchmark again.
+*/
+
+/******************* CONFIG **********************/
+
+// Busy time per burst of the stress tasks
+#define MONITOR_STRESS_BURST 5 // ms
+
+#define MONITOR_MAX_STRESS_TIME 600 // s
+
+/*************************************************/
+
+#define MONITOR_NUM_CORES 2
+
+// Bucket i counts start jitter of [2^i, 2^(i+1)) us
+#define MONITOR_JITTER_BUCKETS 24
+
+class TaskMonitor
+{
+    public:
+        TaskMonitor();
+        void init();
+        void add_task(uint8_t task_id, TaskHandle_t handle);
+        void begin_cycle(uint8_t task_id);
+        void end_cycle(uint8_t task_id, uint32_t sleep_ms);
+        void take_baton(uint8_t task_id, SemaphoreHandle_t baton);
+        bool start_stress(unsigned long seconds, uint8_t load);
+        bool is_stressed();
+        void update();
+        void reset();
+        void print_stats();
+
+        // Called from the tick hooks and the stress tasks below, not for general use
+        void IRAM_ATTR on_tick_(uint8_t core);
+        void stress_task_loop_(uint8_t task_id);
+
+    private:
+        uint32_t get_jitter_percentile_us_(uint8_t task_id, uint8_t percentile);
+
+        struct TaskStats
+        {
+            TaskHandle_t handle;
+
+            // Written by the tick hook on the task's own core
+            volatile uint32_t ticks;
+            volatile uint32_t preemptions;
+            volatile uint32_t preempted_ticks;
+            volatile bool preempted;
+
+            // Written by the task itself
+            volatile bool in_cycle;
+            uint32_t cycles;
+            uint32_t baton_waits;
+            uint64_t baton_wait_us;
+            uint32_t max_baton_wait_us;
+            uint32_t expected_start_us;
+            bool has_expected_start;
+            uint32_t jitter_buckets[MONITOR_JITTER_BUCKETS];
+            uint32_t jitter_count;
+            uint32_t max_jitter_us;
+        };
+
+        TaskStats tasks_[TASK_NUM_TASKS];
+        uint8_t task_cores_[TASK_NUM_TASKS]; // copied out of the table, which the tick hook can't read from flash
+
+        TaskHandle_t idle_tasks_[MONITOR_NUM_CORES];
+        volatile uint32_t core_ticks_[MONITOR_NUM_CORES];
+        volatile uint32_t idle_ticks_[MONITOR_NUM_CORES];
+
+        // Stress benchmark
+        volatile bool stress_running_;
+        volatile unsigned long stress_until_;
+        volatile uint32_t stress_rest_ms_;
+        uint8_t stress_load_;
+
+        StackType_t stress_stack_0_[task_table[TASK_STRESS_0].stack_size];
+        StackType_t stress_stack_1_[task_table[TASK_STRESS_1].stack_size];
+        StaticTask_t stress_buffers_[2];
+};
+
+TaskMonitor task_monitor;
+
+void IRAM_ATTR task_monitor_tick_hook_0_()
+{
+    task_monitor.on_tick_(0);
+}
+
+void IRAM_ATTR task_monitor_tick_hook_1_()
+{
+    task_monitor.on_tick_(1);
+}
+
+void task_monitor_stress_func_(void *parameter)
+{
+    task_monitor.stress_task_loop_(uint8_t(uintptr_t(parameter)));
+}
+
+TaskMonitor::TaskMonitor()
+{
+    for (uint8_t i = 0; i < TASK_NUM_TASKS; i++)
+    {
+        this->tasks_[i].handle = NULL;
+        this->task_cores_[i]   = task_table[i].core;
+    }
+
+    for (uint8_t c = 0; c < MONITOR_NUM_CORES; c++)
+    {
+        this->idle_tasks_[c] = NULL;
+    }
+
+    this->stress_running_ = false;
+    this->stress_until_   = 0;
+    this->stress_rest_ms_ = 0;
+    this->stress_load_    = 0;
+
+    reset();
+}
+
+/**
+ * @brief Starts sampling, and creates the (idle) stress tasks
+ * Call from setup()
+ */
+void TaskMonitor::init()
+{
+    for (uint8_t c = 0; c < MONITOR_NUM_CORES; c++)
+    {
+        idle_tasks_[c] = xTaskGetIdleTaskHandleForCPU(c);
+    }
+
+    uint8_t stress_ids[2] = {TASK_STRESS_0, TASK_STRESS_1};
+    StackType_t *stress_stacks[2] = {stress_stack_0_, stress_stack_1_};
+
+    for (uint8_t i = 0; i < 2; i++)
+    {
+        const TaskPlacement &placement = task_table[stress_ids[i]];
+        add_task(stress_ids[i], xTaskCreateStaticPinnedToCore(
+            task_monitor_stress_func_,           /* Task function. */
+            placement.name,                      /* String with name of task. */
+            placement.stack_size,                /* Stack size in words. */
+            (void *)uintptr_t(stress_ids[i]),    /* Parameter passed as input of the task */
+            placement.priority,                  /* Priority of the task. */
+            stress_stacks[i],                    /* Stack. */
+            &stress_buffers_[i],                 /* Task control block. */
+            placement.core));                    /* Core ID to execute on. */
+    }
+
+    esp_register_freertos_tick_hook_for_cpu(task_monitor_tick_hook_0_, 0);
+    esp_register_freertos_tick_hook_for_cpu(task_monitor_tick_hook_1_, 1);
+}
+
+/**
+ * @brief Registers one of the tasks in task_table.h
+ */
+void TaskMonitor::add_task(uint8_t task_id, TaskHandle_t handle)
+{
+    if (task_id < TASK_NUM_TASKS)
+    {
+        tasks_[task_id].handle = handle;
+    }
+}
+
+/**
+ * @brief Call from a loop task when it wakes up
+ */
+void TaskMonitor::begin_cycle(uint8_t task_id)
+{
+    TaskStats &task = tasks_[task_id];
+    task.cycles++;
+    task.preempted = false;
+    task.in_cycle = true;
+}
+
+/**
+ * @brief Call from a loop task just before it sleeps
+ *
+ * @param sleep_ms how long it is about to delay() for
+ */
+void TaskMonitor::end_cycle(uint8_t task_id, uint32_t sleep_ms)
+{
+    TaskStats &task = tasks_[task_id];
+    task.in_cycle = false;
+    task.expected_start_us = micros() + sleep_ms * 1000;
+    task.has_expected_start = true;
+}
+
+/**
+ * @brief Takes the baton (waiting as long as it takes), timing the wait
+ * The first take of a cycle also measures the start jitter
+ */
+void TaskMonitor::take_baton(uint8_t task_id, SemaphoreHandle_t baton)
+{
+    TaskStats &task = tasks_[task_id];
+
+    task.in_cycle = false;
+    uint32_t start = micros();
+    xSemaphoreTake(baton, portMAX_DELAY);
+    uint32_t now = micros();
+    task.in_cycle = true;
+
+    uint32_t wait = now - start;
+    task.baton_waits++;
+    task.baton_wait_us += wait;
+    task.max_baton_wait_us = max(task.max_baton_wait_us, wait);
+
+    if (task.has_expected_start)
+    {
+        // delay() counts whole ticks from the next one, so a cycle can start up to a tick early
+        int32_t late = int32_t(now - task.expected_start_us);
+        uint32_t jitter = (late > 0) ? uint32_t(late) : 0;
+
+        uint8_t bucket = (jitter == 0) ? 0 : uint8_t(31 - __builtin_clz(jitter));
+        task.jitter_buckets[min(bucket, uint8_t(MONITOR_JITTER_BUCKETS - 1))]++;
+        task.jitter_count++;
+        task.max_jitter_us = max(task.max_jitter_us, jitter);
+        task.has_expected_start = false;
+    }
+}
+
+/**
+ * @brief Starts the stress benchmark, the stats are reset now and printed when it ends
+ *
+ * @param load percentage of each core the stress tasks take, 1 to 99
+ */
+bool TaskMonitor::start_stress(unsigned long seconds, uint8_t load)
+{
+    if (seconds == 0 || seconds > MONITOR_MAX_STRESS_TIME || load == 0 || load > 99)
+    {
+        Serial.println("ERROR: Stress benchmark time or load out of range");
+        return false;
+    }
+
+    reset();
+
+    stress_load_ = load;
+    stress_rest_ms_ = max(1UL, (unsigned long)(MONITOR_STRESS_BURST * (100 - load) / load));
+    stress_until_ = millis() + seconds * 1000;
+    stress_running_ = true;
+
+    xTaskNotifyGive(tasks_[TASK_STRESS_0].handle);
+    xTaskNotifyGive(tasks_[TASK_STRESS_1].handle);
+
+    Serial.print("Stress benchmark running for ");
+    Serial.print(seconds);
+    Serial.println(" s");
+    return true;
+}
+
+bool TaskMonitor::is_stressed()
+{
+    return stress_running_;
+}
+
+/**
+ * @brief Call from a low priority loop, reports the stress benchmark when it has finished
+ */
+void TaskMonitor::update()
+{
+    if (!stress_running_ || long(millis() - stress_until_) < 0)
+    {
+        return;
+    }
+
+    stress_running_ = false;
+    print_stats();
+
+    const TaskPlacement &control = task_table[TASK_CONTROL_LOOP];
+    const TaskPlacement &aux = task_table[TASK_AUX_LOOP];
+    const TaskStats &task = tasks_[TASK_CONTROL_LOOP];
+
+    Serial.print("STRESS,");
+    Serial.print(stress_load_);
+    Serial.print(",");
+    Serial.print(control.core);
+    Serial.print(",");
+    Serial.print(control.priority);
+    Serial.print(",");
+    Serial.print(aux.core);
+    Serial.print(",");
+    Serial.print(aux.priority);
+    Serial.print(",");
+    Serial.print(get_jitter_percentile_us_(TASK_CONTROL_LOOP, 50));
+    Serial.print(",");
+    Serial.print(get_jitter_percentile_us_(TASK_CONTROL_LOOP, 99));
+    Serial.print(",");
+    Serial.print(task.max_jitter_us);
+    Serial.print(",");
+    Serial.print(task.preemptions);
+    Serial.print(",");
+    Serial.println(task.max_baton_wait_us);
+}
+
+void TaskMonitor::reset()
+{
+    for (uint8_t i = 0; i < TASK_NUM_TASKS; i++)
+    {
+        TaskStats &task = tasks_[i];
+        task.ticks              = 0;
+        task.preemptions        = 0;
+        task.preempted_ticks    = 0;
+        task.preempted          = false;
+        task.in_cycle           = false;
+        task.cycles             = 0;
+        task.baton_waits        = 0;
+        task.baton_wait_us      = 0;
+        task.max_baton_wait_us  = 0;
+        task.expected_start_us  = 0;
+        task.has_expected_start = false;
+        task.jitter_count       = 0;
+        task.max_jitter_us      = 0;
+
+        for (uint8_t b = 0; b < MONITOR_JITTER_BUCKETS; b++)
+        {
+            task.jitter_buckets[b] = 0;
+        }
+    }
+
+    for (uint8_t c = 0; c < MONITOR_NUM_CORES; c++)
+    {
+        core_ticks_[c] = 0;
+        idle_ticks_[c] = 0;
+    }
+}
+
+/**
+ * @brief Prints each core's idle time, then each task's load, preemptions, baton waits and start jitter
+ */
+void TaskMonitor::print_stats()
+{
+    for (uint8_t c = 0; c < MONITOR_NUM_CORES; c++)
+    {
+        uint32_t total = max(uint32_t(core_ticks_[c]), uint32_t(1));
+        uint32_t listed = 0;
+
+        for (uint8_t i = 0; i < TASK_NUM_TASKS; i++)
+        {
+            if (task_cores_[i] == c)
+            {
+                listed += tasks_[i].ticks;
+            }
+        }
+
+        Serial.print("Core ");
+        Serial.print(c);
+        Serial.print(": ticks=");
+        Serial.print(core_ticks_[c]);
+        Serial.print(", idle=");
+        Serial.print(100.0 * idle_ticks_[c] / total);
+        Serial.print("%, unlisted tasks (radio, system)=");
+        Serial.print(100.0 * (total - min(total, listed + idle_ticks_[c])) / total);
+        Serial.println("%");
+    }
+
+    for (uint8_t i = 0; i < TASK_NUM_TASKS; i++)
+    {
+        const TaskStats &task = tasks_[i];
+        if (task.handle == NULL)
+        {
+            continue;
+        }
+
+        Serial.print("Task \"");
+        Serial.print(task_table[i].name);
+        Serial.print("\" core=");
+        Serial.print(task_cores_[i]);
+        Serial.print(", priority=");
+        Serial.print(uxTaskPriorityGet(task.handle));
+        Serial.print(", cpu=");
+        Serial.print(100.0 * task.ticks / max(uint32_t(core_ticks_[task_cores_[i]]), uint32_t(1)));
+        Serial.print("%");
+
+        if (task.cycles == 0)
+        {
+            Serial.println("");
+            continue;
+        }
+
+        Serial.print(", cycles=");
+        Serial.print(task.cycles);
+        Serial.print(", preemptions=");
+        Serial.print(task.preemptions);
+        Serial.print(" (");
+        Serial.print(task.preempted_ticks * portTICK_PERIOD_MS);
+        Serial.print(" ms), baton waits=");
+        Serial.print(task.baton_waits);
+        Serial.print(" (");
+        Serial.print(uint32_t(task.baton_wait_us / 1000));
+        Serial.print(" ms, max ");
+        Serial.print(task.max_baton_wait_us);
+        Serial.print(" us), start jitter us p50=");
+        Serial.print(get_jitter_percentile_us_(i, 50));
+        Serial.print(" p99=");
+        Serial.print(get_jitter_percentile_us_(i, 99));
+        Serial.print(" max=");
+        Serial.println(task.max_jitter_us);
+    }
+}
+
+/**
+ * @brief Tick hook, runs in the tick interrupt of the given core
+ */
+void IRAM_ATTR TaskMonitor::on_tick_(uint8_t core)
+{
+    TaskHandle_t current = xTaskGetCurrentTaskHandleForCPU(core);
+
+    core_ticks_[core]++;
+    if (current == idle_tasks_[core])
+    {
+        idle_ticks_[core]++;
+    }
+
+    for (uint8_t i = 0; i < TASK_NUM_TASKS; i++)
+    {
+        TaskStats &task = tasks_[i];
+        if (task.handle == NULL || task_cores_[i] != core)
+        {
+            continue;
+        }
+
+        if (task.handle == current)
+        {
+            task.ticks++;
+            task.preempted = false;
+        }
+        else if (task.in_cycle)
+        {
+            if (!task.preempted)
+            {
+                task.preemptions++;
+                task.preempted = true;
+            }
+            task.preempted_ticks++;
+        }
+    }
+}
+
+/**
+ * @brief Body of a stress task, sleeps until start_stress()
+ */
+void TaskMonitor::stress_task_loop_(uint8_t task_id)
+{
+    while (true)
+    {
+        if (!stress_running_ || long(millis() - stress_until_) >= 0)
+        {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+
+        // Spin without yielding, then let everything else have the core
+        uint32_t start = micros();
+        while (micros() - start < MONITOR_STRESS_BURST * 1000UL)
+        {
+        }
+
+        vTaskDelay(pdMS_TO_TICKS(stress_rest_ms_));
+    }
+}
+
+/**
+ * @brief Upper bound of the histogram bucket containing the given percentile
+ */
+uint32_t TaskMonitor::get_jitter_percentile_us_(uint8_t task_id, uint8_t percentile)
+{
+    const TaskStats &task = tasks_[task_id];
+    uint32_t target = uint32_t((uint64_t(task.jitter_count) * percentile + 99) / 100);
+    uint32_t seen = 0;
+
+    for (uint8_t b = 0; b < MONITOR_JITTER_BUCKETS; b++)
+    {
+        seen += task.jitter_buckets[b];
+
+        if (seen >= target && seen > 0)
+        {
+            return (uint32_t(1) << (b + 1)) - 1;
+        }
+    }
+
+    return 0;
+}
+
+#endif
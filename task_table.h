@@ -0,0 +1,58 @@
+#ifndef TASK_TABLE_H
+#define TASK_TABLE_H
+
+#include <stdint.h>
+
+/*
+Task placement, every FreeRTOS task in the sketch in one table: which core it runs on, its priority and its stack.
+The modules create their own tasks from their row, so the whole topology can be tuned here, then checked with the
+task monitor (task_monitor.h: #L,0,0! for the load, #K,<seconds>,<load>! for the stress benchmark).
+
+The tasks' periods change with the state, they are in power_profiles[] (power_manager.h).
+
+Things to know when moving tasks around:
+  - The Wi-Fi (priority 23) and lwIP (18) tasks run on core 0, and preempt anything below them there.
+  - The Arduino loop task on core 1 is deleted at the end of setup(), so core 1 is ours.
+  - Priorities run from 0 to configMAX_PRIORITIES - 1 (24), anything higher is silently cut to 24.
+  - The safety stop task must stay on the control loop's core, the two of them write to the Sabertooth and on
+    one core the stop can only go out between the control loop's writes, never in the middle of one.
+  - The baton is a mutex, so a low priority task holding it (e.g. the auxillary loop refreshing the TFT) is
+    raised to the priority of whoever is waiting, but only while it holds it.
+*/
+
+#define TASK_CONTROL_LOOP  0
+#define TASK_AUX_LOOP      1
+#define TASK_SAFETY_STOP   2
+#define TASK_BATTERY       3
+#define TASK_BLACKBOX      4
+#define TASK_UDP_TELEOP    5
+#define TASK_DOCK_DETECTOR 6
+#define TASK_TOUCH         7
+#define TASK_STRESS_0      8
+#define TASK_STRESS_1      9
+#define TASK_NUM_TASKS     10
+
+struct TaskPlacement
+{
+    const char *name;
+    uint8_t core;
+    uint8_t priority;
+    uint16_t stack_size;
+};
+
+// Indexed by TASK_x
+constexpr TaskPlacement task_table[TASK_NUM_TASKS] = {
+    // name              core  priority  stack
+    {"Control Loop",     1,    20,       5000}, // motor control, on the core without the radio
+    {"Auxillary Loop",   0,    5,        5000}, // TFT and LIDAR, everything else can go before it
+    {"Safety Stop",      1,    24,       2048}, // the highest there is, with the control loop (see above)
+    {"Battery Monitor",  0,    12,       2048}, // must keep up with the ADC DMA ring, but only wakes every 32 ms
+    {"Blackbox Writer",  0,    1,        3072}, // SD card writes, whenever nothing else wants the CPU
+    {"UDP Teleop",       0,    15,       2048}, // with the Wi-Fi and lwIP tasks, just below lwIP
+    {"Dock Detector",    1,    8,        2048}, // LIDAR matching, tens of ms per scan, in the control loop's gaps
+    {"Touch Panel",      0,    3,        2048}, // STMPE610 FIFO bursts, woken by its interrupt, can wait for a TFT refresh
+    {"Stress 0",         0,    22,       1024}, // stress benchmark load, like the radio on core 0
+    {"Stress 1",         1,    10,       1024}, // stress benchmark load, an ordinary task on core 1
+};
+
+#endif
@@ -4,7 +4,10 @@
 #define TELEOP_MAX_LIN_VEL 0.5 // metres/s
 #define TELEOP_MAX_ANG_VEL 1.0 // rad/s
 
+// Limits on the wheel velocity profile, see setpoint_generator.h
+#define ROBOT_MAX_ACCEL_RATE 0.5 // m/s^2
 #define ROBOT_MAX_DECEL_RATE 1.0 // m/s^2
+#define ROBOT_MAX_JERK       4.0 // m/s^3
 
 /*************************************************/
 
@@ -23,16 +26,30 @@ class TeleopController
         TeleopController();
         void change_state(uint8_t state_id);
         void set_input_sensitivity(double lin_sensitivity, double ang_sensitivity);
+        void set_limits(double max_lin_vel, double max_ang_vel);
         Velocity process_command(double lin_vel, double ang_vel);
 
       private:
         uint8_t _state_id;
         double _lin_vel_scaling_factor;
         double _ang_vel_scaling_factor;
+        double _max_lin_vel;
+        double _max_ang_vel;
 };
 
 TeleopController::TeleopController()
 {
+    _state_id = REGULAR_TELEOP_MODE;
+    _lin_vel_scaling_factor = 1.0;
+    _ang_vel_scaling_factor = 1.0;
+    _max_lin_vel = TELEOP_MAX_LIN_VEL;
+    _max_ang_vel = TELEOP_MAX_ANG_VEL;
+}
+
+void TeleopController::set_limits(double max_lin_vel, double max_ang_vel)
+{
+    _max_lin_vel = max_lin_vel;
+    _max_ang_vel = max_ang_vel;
 }
 
 void TeleopController::set_input_sensitivity(double lin_sensitivity, double ang_sensitivity)
@@ -58,12 +75,14 @@ void TeleopController::change_state(uint8_t state_id)
 Velocity TeleopController::process_command(double lin_vel, double ang_vel)
 {
     Velocity outvel;
+    outvel.linear = 0.0;
+    outvel.angular = 0.0;
 
     if (_state_id == REGULAR_TELEOP_MODE)
     {
         // Apply scaling and constraints
-        outvel.linear = constrain(_lin_vel_scaling_factor * lin_vel, -TELEOP_MAX_LIN_VEL, TELEOP_MAX_LIN_VEL);
-        outvel.angular = constrain(_ang_vel_scaling_factor * ang_vel, -TELEOP_MAX_ANG_VEL, TELEOP_MAX_ANG_VEL);
+        outvel.linear = constrain(_lin_vel_scaling_factor * lin_vel, -_max_lin_vel, _max_lin_vel);
+        outvel.angular = constrain(_ang_vel_scaling_factor * ang_vel, -_max_ang_vel, _max_ang_vel);
     }
     else if (_state_id == SEPF_ASSISTED_TELEOP_MODE)
     {
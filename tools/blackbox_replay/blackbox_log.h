@@ -0,0 +1,108 @@
+#ifndef BLACKBOX_LOG_H
+#define BLACKBOX_LOG_H
+
+#include <vector>
+
+#include "blackbox_recorder.h"
+
+/*
+Reading black box logs (blackbox_recorder.h) on the host, for blackbox_replay and the PID tuner
+*/
+
+struct Record
+{
+    uint8_t type;
+    uint64_t stamp;         // micros(), unwrapped
+    const uint8_t *payload;
+    uint8_t length;
+    bool consumed;          // already used by a replayed control cycle
+};
+
+/**
+ * @brief Splits the log into records
+ *
+ * @return false if the file isn't a black box log
+ */
+bool parse_log(const std::vector<uint8_t> &log, std::vector<Record> &records)
+{
+    const size_t header_size = sizeof(BlackboxRecordHeader);
+
+    if (log.size() < header_size + sizeof(BlackboxFileHeader))
+    {
+        return false;
+    }
+
+    BlackboxRecordHeader first;
+    BlackboxFileHeader file_header;
+    memcpy(&first, &log[0], header_size);
+    memcpy(&file_header, &log[header_size], sizeof(file_header));
+
+    if (first.type != BLACKBOX_RECORD_HEADER || file_header.magic != BLACKBOX_MAGIC)
+    {
+        return false;
+    }
+
+    if (file_header.version != BLACKBOX_VERSION)
+    {
+        fprintf(stderr, "Log version %u, expected %u\n", file_header.version, BLACKBOX_VERSION);
+        return false;
+    }
+
+    size_t block_size = file_header.block_size;
+    uint64_t stamp = first.stamp;
+    uint32_t last_stamp = first.stamp;
+
+    for (size_t block = 0; block < log.size(); block += block_size)
+    {
+        size_t end = min(block + block_size, log.size());
+        size_t offset = block;
+
+        while (offset + header_size <= end)
+        {
+            BlackboxRecordHeader header;
+            memcpy(&header, &log[offset], header_size);
+
+            if (header.type == BLACKBOX_RECORD_PAD)
+            {
+                break;
+            }
+
+            if (offset + header_size + header.length > end)
+            {
+                fprintf(stderr, "Truncated record at offset %zu\n", offset);
+                break;
+            }
+
+            // micros() wraps every ~71 minutes. Records from different tasks can be a little out of order,
+            // so the difference is taken as signed
+            stamp += int32_t(header.stamp - last_stamp);
+            last_stamp = header.stamp;
+
+            Record record;
+            record.type = header.type;
+            record.stamp = stamp;
+            record.payload = &log[offset + header_size];
+            record.length = header.length;
+            record.consumed = false;
+            records.push_back(record);
+
+            offset += header_size + header.length;
+        }
+    }
+
+    return true;
+}
+
+template <typename T>
+bool get_payload(const Record &record, T &payload)
+{
+    if (record.length != sizeof(T))
+    {
+        return false;
+    }
+
+    memcpy(&payload, record.payload, sizeof(T));
+    return true;
+}
+
+#endif
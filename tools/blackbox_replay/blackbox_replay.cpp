@@ -0,0 +1,489 @@
+/*
+Black box replay
+
+Runs a log recorded by blackbox_recorder.h back through the firmware's own setpoint generator, wheel encoder
+and velocity controller code, and checks every motor output against what the robot actually sent.
+The clock, encoder counts and parameters all come from the log, so the replay is deterministic: with unchanged
+controller code every output matches. Change a controller (or a parameter, see -p) to see what it would have done.
+
+Onboard manoeuvres (#A, #T) and step tests (#R) are not replayed yet, their cycles are skipped (their encoder reads are still fed
+through, so the velocity estimate stays in step).
+
+Build (from the repository root):
+    g++ -std=gnu++11 -O2 -I tools/host -I . tools/blackbox_replay/blackbox_replay.cpp -o blackbox_replay
+
+Usage:
+    blackbox_replay BB0000.BIN                    replay, one CSV line per control cycle on stdout
+    blackbox_replay BB0000.BIN -d                 print every record instead
+    blackbox_replay BB0000.BIN -p vel_kp=0.8      replay with a parameter overridden (repeatable)
+
+The exit status is 1 if any motor output differed from the log.
+*/
+
+#define ALEXBOT_PROFILING 0
+
+#include "Arduino.h"
+#include <SabertoothSimplified.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "encoder_driver.h"
+#include "teleop_controller.h"
+#include "setpoint_generator.h"
+#include "motor_velocity_controller.h"
+
+#include "alexbot_hardware.h"
+
+#include "blackbox_log.h"
+
+void dump_record(const Record &record)
+{
+    printf("%12.6f ", record.stamp * 1e-6);
+
+    switch (record.type)
+    {
+        case BLACKBOX_RECORD_HEADER:
+        {
+            BlackboxFileHeader header;
+            if (get_payload(record, header))
+            {
+                printf("HEADER version=%u block_size=%u\n", header.version, header.block_size);
+                return;
+            }
+            break;
+        }
+        case BLACKBOX_RECORD_PARAM:
+        {
+            BlackboxParam param;
+            if (get_payload(record, param))
+            {
+                printf("PARAM %u %.*s=%g\n", param.id, BLACKBOX_PARAM_NAME_LENGTH, param.name, param.value);
+                return;
+            }
+            break;
+        }
+        case BLACKBOX_RECORD_TICK:
+        {
+            BlackboxTick tick;
+            if (get_payload(record, tick))
+            {
+                printf("TICK state=%u mode=%u linear=%g angular=%g\n", tick.state_id, tick.mode, tick.linear, tick.angular);
+                return;
+            }
+            break;
+        }
+        case BLACKBOX_RECORD_ENCODER:
+        {
+            BlackboxEncoder encoder;
+            if (get_payload(record, encoder))
+            {
+                printf("ENCODER %u count=%d stamp_ms=%u\n", encoder.encoder_id, encoder.raw_count, encoder.stamp_ms);
+                return;
+            }
+            break;
+        }
+        case BLACKBOX_RECORD_GPS:
+        {
+            BlackboxGps gps;
+            if (get_payload(record, gps))
+            {
+                printf("GPS %.7f,%.7f fix=%u sats=%u hdop=%g\n", gps.latitude, gps.longitude, gps.fix_quality, gps.satellites, gps.hdop);
+                return;
+            }
+            break;
+        }
+        case BLACKBOX_RECORD_LIDAR:
+        {
+            BlackboxLidar lidar;
+            if (get_payload(record, lidar))
+            {
+                printf("LIDAR distance=%g angle=%g quality=%u start=%u\n", lidar.distance, lidar.angle, lidar.quality, lidar.start_bit);
+                return;
+            }
+            break;
+        }
+        case BLACKBOX_RECORD_SERIAL:
+        {
+            BlackboxSerial serial;
+            if (get_payload(record, serial))
+            {
+                printf("SERIAL #%c,%g,%g!\n", serial.message_type, serial.data1, serial.data2);
+                return;
+            }
+            break;
+        }
+        case BLACKBOX_RECORD_FAILSAFE:
+        {
+            BlackboxFailsafe failsafe;
+            if (get_payload(record, failsafe))
+            {
+                printf("FAILSAFE trip_reasons=%u\n", failsafe.trip_reasons);
+                return;
+            }
+            break;
+        }
+        case BLACKBOX_RECORD_MOTOR:
+        {
+            BlackboxMotor motor;
+            if (get_payload(record, motor))
+            {
+                printf("MOTOR %u power=%d\n", motor.motor_id, motor.power);
+                return;
+            }
+            break;
+        }
+    }
+
+    printf("UNKNOWN type=%u length=%u\n", record.type, record.length);
+}
+
+/**
+ * @brief The firmware's controllers for both wheels, driven from the log
+ */
+class Replay
+{
+    public:
+        Replay(const std::map<std::string, float> &overrides)
+            : overrides_(overrides),
+              left_encoder_(LEFT_MOTOR_ID, LEFT_ENCODER_CS_PIN, 1.0, 1.0),
+              right_encoder_(RIGHT_MOTOR_ID, RIGHT_ENCODER_CS_PIN, 1.0, 1.0),
+              left_motor_("Left motor", &sabertooth_, LEFT_MOTOR_ID, &left_encoder_, DRIVE_MOTORS_MAX_POWER),
+              right_motor_("Right motor", &sabertooth_, RIGHT_MOTOR_ID, &right_encoder_, DRIVE_MOTORS_MAX_POWER)
+        {
+            cycles_ = 0;
+            skipped_ = 0;
+            mismatches_ = 0;
+            params_changed_ = false;
+        }
+
+        void run(std::vector<Record> &records)
+        {
+            printf("time,state,mode,cmd_linear,cmd_angular,target_left,target_right,"
+                   "output_left,output_right,logged_left,logged_right\n");
+
+            for (size_t i = 0; i < records.size(); i++)
+            {
+                Record &record = records[i];
+                if (record.consumed)
+                {
+                    continue;
+                }
+
+                switch (record.type)
+                {
+                    case BLACKBOX_RECORD_PARAM:
+                    {
+                        BlackboxParam param;
+                        if (get_payload(record, param))
+                        {
+                            params_[std::string(param.name, strnlen(param.name, BLACKBOX_PARAM_NAME_LENGTH))] = param.value;
+                            params_changed_ = true;
+                        }
+                        break;
+                    }
+
+                    case BLACKBOX_RECORD_ENCODER:
+                    {
+                        // A read outside a replayed cycle (e.g. by a manoeuvre), the encoder still needs to see it
+                        BlackboxEncoder encoder;
+                        if (get_payload(record, encoder))
+                        {
+                            feed_encoder_(record.stamp, encoder);
+                            get_encoder_(encoder.encoder_id)->get_update();
+                        }
+                        break;
+                    }
+
+                    case BLACKBOX_RECORD_TICK:
+                        replay_cycle_(records, i);
+                        break;
+                }
+            }
+
+            fprintf(stderr, "%u cycles replayed, %u manoeuvre and step test cycles skipped, %u motor outputs differed from the log\n",
+                    cycles_, skipped_, mismatches_);
+        }
+
+        unsigned get_mismatches()
+        {
+            return mismatches_;
+        }
+
+    private:
+        /**
+         * @param fallback for parameters added since the log was recorded (negative: the log must have it)
+         */
+        float param_(const char *name, float fallback = -1.0f)
+        {
+            std::map<std::string, float>::const_iterator it = overrides_.find(name);
+            if (it != overrides_.end())
+            {
+                return it->second;
+            }
+
+            it = params_.find(name);
+            if (it == params_.end() && fallback >= 0.0f)
+            {
+                return fallback;
+            }
+            if (it == params_.end())
+            {
+                fprintf(stderr, "Parameter %s is missing from the log\n", name);
+                exit(2);
+            }
+            return it->second;
+        }
+
+        /**
+         * @brief Same as AlexbotController::apply_params_(), for the parts being replayed
+         */
+        void apply_params_()
+        {
+            left_motor_.set_gains(param_("vel_kp"), param_("vel_ki"), param_("vel_kd"));
+            right_motor_.set_gains(param_("vel_kp"), param_("vel_ki"), param_("vel_kd"));
+            left_motor_.set_feedforward(param_("vel_kff", 0.0f));
+            right_motor_.set_feedforward(param_("vel_kff", 0.0f));
+            left_motor_.set_max_power(int32_t(param_("max_power")));
+            right_motor_.set_max_power(int32_t(param_("max_power")));
+
+            left_encoder_.set_geometry(int32_t(param_("enc_cpr")), param_("wheel_radius"));
+            right_encoder_.set_geometry(int32_t(param_("enc_cpr")), param_("wheel_radius"));
+
+            setpoint_generator_.set_track(param_("wheel_track"));
+            setpoint_generator_.set_limits(SETPOINT_MAX_WHEEL_VEL, param_("max_accel"), param_("max_decel"), param_("max_jerk"));
+
+            params_changed_ = false;
+        }
+
+        WheelEncoderLS7366 *get_encoder_(uint8_t encoder_id)
+        {
+            return (encoder_id == LEFT_MOTOR_ID) ? &left_encoder_ : &right_encoder_;
+        }
+
+        /**
+         * @brief Sets up the clock and SPI so the next encoder read returns this record
+         */
+        void feed_encoder_(uint64_t stamp, const BlackboxEncoder &encoder)
+        {
+            host_clock.micros = stamp;
+            host_clock.millis = encoder.stamp_ms;
+            SPI.set_count(encoder.encoder_id == LEFT_MOTOR_ID ? LEFT_ENCODER_CS_PIN : RIGHT_ENCODER_CS_PIN, encoder.raw_count);
+        }
+
+        /**
+         * @brief The records a cycle produced, up to the next cycle or serial frame
+         */
+        int find_in_cycle_(std::vector<Record> &records, size_t tick_index, uint8_t type, uint8_t id)
+        {
+            for (size_t i = tick_index + 1; i < records.size(); i++)
+            {
+                Record &record = records[i];
+                if (record.type == BLACKBOX_RECORD_TICK || record.type == BLACKBOX_RECORD_SERIAL)
+                {
+                    break;
+                }
+
+                if (record.type != type || record.consumed || record.length < 1 || record.payload[0] != id)
+                {
+                    continue;
+                }
+
+                return i;
+            }
+
+            return -1;
+        }
+
+        void replay_cycle_(std::vector<Record> &records, size_t tick_index)
+        {
+            BlackboxTick tick;
+            if (!get_payload(records[tick_index], tick))
+            {
+                return;
+            }
+
+            if (params_changed_)
+            {
+                apply_params_();
+            }
+
+            host_clock.micros = records[tick_index].stamp;
+
+            if (tick.mode != BLACKBOX_TICK_VELOCITY)
+            {
+                // HALT, SLEEP, manoeuvres and step tests all leave the velocity loops starting again from standstill
+                setpoint_generator_.reset();
+                left_motor_.reset();
+                right_motor_.reset();
+                skipped_ += (tick.mode == BLACKBOX_TICK_MANOEUVRE || tick.mode == BLACKBOX_TICK_STEP);
+                return;
+            }
+
+            Velocity command;
+            command.linear = tick.linear;
+            command.angular = tick.angular;
+            setpoint_generator_.set_command(command);
+            WheelTargets targets = setpoint_generator_.update(records[tick_index].stamp);
+
+            sabertooth_.clear_written();
+            drive_wheel_(records, tick_index, LEFT_MOTOR_ID, targets.left);
+            drive_wheel_(records, tick_index, RIGHT_MOTOR_ID, targets.right);
+            cycles_++;
+
+            printf("%.6f,%u,%u,%g,%g,%g,%g", records[tick_index].stamp * 1e-6, tick.state_id, tick.mode,
+                   tick.linear, tick.angular, targets.left, targets.right);
+
+            int logged[2];
+            bool logged_written[2];
+            for (uint8_t id = 0; id < 2; id++)
+            {
+                int index = find_in_cycle_(records, tick_index, BLACKBOX_RECORD_MOTOR, id);
+                BlackboxMotor motor;
+                logged_written[id] = (index >= 0 && get_payload(records[index], motor));
+                logged[id] = logged_written[id] ? motor.power : 0;
+
+                if (index >= 0)
+                {
+                    records[index].consumed = true;
+                }
+
+                if (logged_written[id] != sabertooth_.was_written(id) || (logged_written[id] && logged[id] != sabertooth_.power(id)))
+                {
+                    mismatches_++;
+                }
+            }
+
+            // Blank when nothing was sent to the motor that cycle
+            for (uint8_t id = 0; id < 2; id++)
+            {
+                if (sabertooth_.was_written(id))
+                {
+                    printf(",%d", sabertooth_.power(id));
+                }
+                else
+                {
+                    printf(",");
+                }
+            }
+
+            for (uint8_t id = 0; id < 2; id++)
+            {
+                if (logged_written[id])
+                {
+                    printf(",%d", logged[id]);
+                }
+                else
+                {
+                    printf(",");
+                }
+            }
+
+            printf("\n");
+        }
+
+        void drive_wheel_(std::vector<Record> &records, size_t tick_index, uint8_t id, double target)
+        {
+            int index = find_in_cycle_(records, tick_index, BLACKBOX_RECORD_ENCODER, id);
+            BlackboxEncoder encoder;
+            if (index < 0 || !get_payload(records[index], encoder))
+            {
+                fprintf(stderr, "%.6f: encoder %u read missing from the log\n", records[tick_index].stamp * 1e-6, id);
+                return;
+            }
+
+            records[index].consumed = true;
+            feed_encoder_(records[index].stamp, encoder);
+
+            MotorVelocityController &motor = (id == LEFT_MOTOR_ID) ? left_motor_ : right_motor_;
+            motor.SetTargetVelocity(target);
+        }
+
+        std::map<std::string, float> overrides_;
+        std::map<std::string, float> params_;
+        bool params_changed_;
+
+        SabertoothSimplified sabertooth_;
+        WheelEncoderLS7366 left_encoder_;
+        WheelEncoderLS7366 right_encoder_;
+        MotorVelocityController left_motor_;
+        MotorVelocityController right_motor_;
+        SetpointGenerator setpoint_generator_;
+
+        unsigned cycles_;
+        unsigned skipped_;
+        unsigned mismatches_;
+};
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <log> [-d] [-p name=value]...\n", argv[0]);
+        return 2;
+    }
+
+    bool dump = false;
+    std::map<std::string, float> overrides;
+
+    for (int i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-d") == 0)
+        {
+            dump = true;
+        }
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+        {
+            std::string assignment(argv[++i]);
+            size_t equals = assignment.find('=');
+            if (equals == std::string::npos)
+            {
+                fprintf(stderr, "Expected -p name=value\n");
+                return 2;
+            }
+            overrides[assignment.substr(0, equals)] = atof(assignment.c_str() + equals + 1);
+        }
+        else
+        {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 2;
+        }
+    }
+
+    FILE *file = fopen(argv[1], "rb");
+    if (!file)
+    {
+        perror(argv[1]);
+        return 2;
+    }
+
+    std::vector<uint8_t> log;
+    uint8_t chunk[BLACKBOX_SECTOR_SIZE];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0)
+    {
+        log.insert(log.end(), chunk, chunk + n);
+    }
+    fclose(file);
+
+    std::vector<Record> records;
+    if (!parse_log(log, records))
+    {
+        fprintf(stderr, "%s is not a black box log\n", argv[1]);
+        return 2;
+    }
+
+    if (dump)
+    {
+        for (size_t i = 0; i < records.size(); i++)
+        {
+            dump_record(records[i]);
+        }
+        return 0;
+    }
+
+    Replay replay(overrides);
+    replay.run(records);
+    return replay.get_mismatches() > 0 ? 1 : 0;
+}
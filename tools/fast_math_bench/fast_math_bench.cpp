@@ -0,0 +1,498 @@
+/*
+Accuracy check and benchmark of fast_math.h
+
+Accuracy: each function is run on every float in its domain and compared with double precision libm, split across
+the host's cores (tools/sim/parallel_runner.h):
+    sincos      every float with |x| <= FAST_TRIG_MAX_ARG, absolute error of sin and of cos
+    atan        every float ratio in [0, 1], unfolded into all eight octants, absolute error
+    atan2       random (y, x) pairs over the whole float range, for the division in front of the polynomial
+    inv_sqrt    every normal float > 0, relative error
+    sqrt        the same
+    hypot       random pairs over the range it supports, relative error
+    gps         compute_bearing() and compute_distance() against the double precision formulas they replaced,
+                for random waypoints up to 10 km apart anywhere on Earth
+Any function over its documented maximum error (the table in fast_math.h) fails the run.
+
+Benchmark: ns per call of each function against libm (sinf and cosf, atan2f, 1 / sqrtf, hypotf), over arrays
+that don't fit in the registers, and a whole 720 point LIDAR scan through fast_polar_to_cartesian() against the
+obvious libm loop. These are the host's numbers: on the ESP32 libm is further behind, as its doubles are done in
+software.
+
+Build (from the repository root):
+    g++ -std=gnu++11 -O2 -I tools/host -I . tools/fast_math_bench/fast_math_bench.cpp -o fast_math_bench
+
+Usage:
+    fast_math_bench                 every float (about 20 minutes on one core)
+    fast_math_bench -q              every 97th float, to check quickly
+    fast_math_bench -j 8            on 8 workers
+    fast_math_bench -b              benchmark only
+*/
+
+#include "Arduino.h"
+
+#include <time.h>
+
+#include <vector>
+
+#include "gps_utils.h"
+
+#include "../sim/parallel_runner.h"
+
+// Documented maximum errors, as in fast_math.h
+#define MAX_SINCOS_ERROR   1.0e-7
+#define MAX_ATAN2_ERROR    3.2e-7
+#define MAX_INV_SQRT_ERROR 2.0e-7
+#define MAX_SQRT_ERROR     2.5e-7
+#define MAX_HYPOT_ERROR    2.5e-7
+#define MAX_BEARING_ERROR  1e-6 // rad, as in gps_utils.h
+#define MAX_DISTANCE_ERROR 2e-6 // relative, or m under 1 m
+
+// Floats are walked as bit patterns, this many jobs per check
+#define JOBS_PER_CHECK 64
+
+#define RANDOM_PAIRS 20000000
+
+#define LIDAR_SCAN_POINTS 720
+#define BENCH_ARRAY_SIZE  4096
+#define BENCH_ROUNDS      2000
+
+struct ErrorResult
+{
+    double max_error;
+    double worst_input[2];
+    uint64_t count;
+};
+
+static float float_from_bits(uint32_t bits)
+{
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+static uint32_t bits_from_float(float f)
+{
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return bits;
+}
+
+static void record_error(ErrorResult &result, double error, double input_0, double input_1 = 0.0)
+{
+    result.count++;
+    if (!(error <= result.max_error))
+    {
+        result.max_error = error;
+        result.worst_input[0] = input_0;
+        result.worst_input[1] = input_1;
+    }
+}
+
+static ErrorResult new_result()
+{
+    ErrorResult result;
+    result.max_error = 0.0;
+    result.worst_input[0] = 0.0;
+    result.worst_input[1] = 0.0;
+    result.count = 0;
+    return result;
+}
+
+/**
+ * @brief Splits the bit patterns [first, last] into JOBS_PER_CHECK jobs, runs check(result, x) on every stride'th one
+ */
+template <typename Check>
+static ErrorResult check_floats(uint32_t first, uint32_t last, uint32_t stride, unsigned workers, Check check)
+{
+    uint64_t span = uint64_t(last) - first + 1;
+
+    std::vector<bool> done;
+    std::vector<ErrorResult> results = run_parallel<ErrorResult>(JOBS_PER_CHECK, workers, [&](size_t job) {
+        ErrorResult result = new_result();
+        uint64_t begin = first + span * job / JOBS_PER_CHECK;
+        uint64_t end = first + span * (job + 1) / JOBS_PER_CHECK;
+
+        for (uint64_t bits = begin; bits < end; bits += stride)
+        {
+            check(result, float_from_bits(uint32_t(bits)));
+        }
+        return result;
+    }, done);
+
+    ErrorResult total = new_result();
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        if (!done[i])
+        {
+            fprintf(stderr, "Job %zu of the check was lost\n", i);
+            total.max_error = INFINITY;
+            continue;
+        }
+
+        total.count += results[i].count;
+        if (!(results[i].max_error <= total.max_error))
+        {
+            total.max_error = results[i].max_error;
+            total.worst_input[0] = results[i].worst_input[0];
+            total.worst_input[1] = results[i].worst_input[1];
+        }
+    }
+    return total;
+}
+
+/**
+ * @brief Runs check(result, rng) RANDOM_PAIRS / stride times across the workers, each job with its own seed
+ */
+template <typename Check>
+static ErrorResult check_random(uint32_t stride, unsigned workers, Check check)
+{
+    uint64_t per_job = RANDOM_PAIRS / stride / JOBS_PER_CHECK + 1;
+
+    std::vector<bool> done;
+    std::vector<ErrorResult> results = run_parallel<ErrorResult>(JOBS_PER_CHECK, workers, [&](size_t job) {
+        ErrorResult result = new_result();
+        uint64_t rng = 0x9E3779B97F4A7C15ULL * (job + 1);
+
+        for (uint64_t i = 0; i < per_job; i++)
+        {
+            check(result, rng);
+        }
+        return result;
+    }, done);
+
+    ErrorResult total = new_result();
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        total.count += results[i].count;
+        if (!done[i] || !(results[i].max_error <= total.max_error))
+        {
+            total.max_error = done[i] ? results[i].max_error : INFINITY;
+            total.worst_input[0] = results[i].worst_input[0];
+            total.worst_input[1] = results[i].worst_input[1];
+        }
+    }
+    return total;
+}
+
+// xorshift64*, uniform in [0, 1)
+static double random_uniform(uint64_t &rng)
+{
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return double((rng * 0x2545F4914F6CDD1DULL) >> 11) / 9007199254740992.0;
+}
+
+// Log-uniform magnitude in [10^min_exp, 10^max_exp), random sign
+static float random_magnitude(uint64_t &rng, double min_exp, double max_exp)
+{
+    double magnitude = pow(10.0, min_exp + (max_exp - min_exp) * random_uniform(rng));
+    return float(random_uniform(rng) < 0.5 ? -magnitude : magnitude);
+}
+
+// The double precision formulas gps_utils.h used before fast_math.h
+static double reference_bearing(double i_lat, double i_lon, double f_lat, double f_lon)
+{
+    double y = sin(f_lon - i_lon) * cos(f_lat);
+    double x = cos(i_lat) * sin(f_lat) - sin(i_lat) * cos(f_lat) * cos(f_lon - i_lon);
+    return atan2(y, x);
+}
+
+static double reference_distance(double i_lat, double i_lon, double f_lat, double f_lon)
+{
+    double a = sin((f_lat - i_lat) / 2) * sin((f_lat - i_lat) / 2) +
+               cos(i_lat) * cos(f_lat) * sin((f_lon - i_lon) / 2) * sin((f_lon - i_lon) / 2);
+    return R * 2 * atan2(sqrt(a), sqrt(1 - a));
+}
+
+static double wrap_angle(double angle)
+{
+    while (angle > PI)
+    {
+        angle -= 2.0 * PI;
+    }
+    while (angle < -PI)
+    {
+        angle += 2.0 * PI;
+    }
+    return angle;
+}
+
+static bool report(const char *name, const ErrorResult &result, double limit, const char *unit)
+{
+    bool passed = (result.max_error <= limit);
+    printf("%-10s %12llu inputs  max error %.3g %-4s (limit %.3g) at %.9g, %.9g  %s\n", name,
+           (unsigned long long)result.count, result.max_error, unit, limit, result.worst_input[0],
+           result.worst_input[1], passed ? "ok" : "FAIL");
+    return passed;
+}
+
+static bool check_accuracy(uint32_t stride, unsigned workers)
+{
+    bool passed = true;
+
+    // sincos, every float in [-FAST_TRIG_MAX_ARG, FAST_TRIG_MAX_ARG] (both signs, as the bit patterns aren't symmetric)
+    uint32_t max_arg_bits = bits_from_float(FAST_TRIG_MAX_ARG);
+    auto sincos_check = [](ErrorResult &result, float x) {
+        float s, c;
+        fast_sincos(x, s, c);
+        record_error(result, max(fabs(s - sin(double(x))), fabs(c - cos(double(x)))), x);
+    };
+    ErrorResult sincos_result = check_floats(0, max_arg_bits, stride, workers, sincos_check);
+    ErrorResult sincos_negative = check_floats(0x80000000u, 0x80000000u | max_arg_bits, stride, workers, sincos_check);
+    sincos_result.count += sincos_negative.count;
+    if (!(sincos_negative.max_error <= sincos_result.max_error))
+    {
+        sincos_result.max_error = sincos_negative.max_error;
+        sincos_result.worst_input[0] = sincos_negative.worst_input[0];
+    }
+    passed &= report("sincos", sincos_result, MAX_SINCOS_ERROR, "");
+
+    // atan, every ratio in [0, 1] as (y, x) = (a, 1), in each of the eight octants
+    ErrorResult atan_result = check_floats(0, bits_from_float(1.0f), stride, workers, [](ErrorResult &result, float a) {
+        const float signs[2] = {1.0f, -1.0f};
+        for (int sx = 0; sx < 2; sx++)
+        {
+            for (int sy = 0; sy < 2; sy++)
+            {
+                float x = signs[sx], y = signs[sy] * a;
+                record_error(result, fabs(wrap_angle(fast_atan2(y, x) - atan2(double(y), double(x)))), y, x);
+                record_error(result, fabs(wrap_angle(fast_atan2(x, y) - atan2(double(x), double(y)))), x, y);
+            }
+        }
+    });
+    passed &= report("atan", atan_result, MAX_ATAN2_ERROR, "rad");
+
+    // atan2, random pairs from tiny to huge, the far quadrant edges (y = -0 and x = -0 aside) wrap to +-pi
+    ErrorResult atan2_result = check_random(stride, workers, [](ErrorResult &result, uint64_t &rng) {
+        float y = random_magnitude(rng, -30.0, 30.0);
+        float x = random_magnitude(rng, -30.0, 30.0);
+        record_error(result, fabs(wrap_angle(fast_atan2(y, x) - atan2(double(y), double(x)))), y, x);
+    });
+    passed &= report("atan2", atan2_result, MAX_ATAN2_ERROR, "rad");
+
+    // inv_sqrt, every normal float > 0
+    ErrorResult inv_sqrt_result = check_floats(0x00800000u, 0x7F7FFFFFu, stride, workers, [](ErrorResult &result, float x) {
+        double exact = 1.0 / sqrt(double(x));
+        record_error(result, fabs(fast_inv_sqrt(x) - exact) / exact, x);
+    });
+    passed &= report("inv_sqrt", inv_sqrt_result, MAX_INV_SQRT_ERROR, "");
+
+    // sqrt, the same floats
+    ErrorResult sqrt_result = check_floats(0x00800000u, 0x7F7FFFFFu, stride, workers, [](ErrorResult &result, float x) {
+        double exact = sqrt(double(x));
+        record_error(result, fabs(fast_sqrt(x) - exact) / exact, x);
+    });
+    passed &= report("sqrt", sqrt_result, MAX_SQRT_ERROR, "");
+
+    // hypot, random pairs over the range where x^2 + y^2 stays normal
+    ErrorResult hypot_result = check_random(stride, workers, [](ErrorResult &result, uint64_t &rng) {
+        float x = random_magnitude(rng, -18.0, 18.0);
+        float y = random_magnitude(rng, -18.0, 18.0);
+        double exact = hypot(double(x), double(y));
+        record_error(result, fabs(fast_hypot(x, y) - exact) / exact, x, y);
+    });
+    passed &= report("hypot", hypot_result, MAX_HYPOT_ERROR, "");
+
+    // gps_utils.h, random start points anywhere short of the poles, random destinations up to 10 km away
+    ErrorResult bearing_result = new_result();
+    ErrorResult distance_result = check_random(stride, workers, [](ErrorResult &result, uint64_t &rng) {
+        double i_lat = RAD(-85.0 + 170.0 * random_uniform(rng));
+        double i_lon = RAD(-180.0 + 360.0 * random_uniform(rng));
+        double range = 10000.0 * random_uniform(rng) / R;
+        double direction = 2.0 * PI * random_uniform(rng);
+        double f_lat = i_lat + range * cos(direction);
+        double f_lon = i_lon + range * sin(direction) / cos(i_lat);
+
+        double exact = reference_distance(i_lat, i_lon, f_lat, f_lon);
+        record_error(result, fabs(compute_distance(i_lat, i_lon, f_lat, f_lon) - exact) / max(exact, 1.0), DEG(i_lat),
+                     DEG(i_lon));
+    });
+    bearing_result = check_random(stride, workers, [](ErrorResult &result, uint64_t &rng) {
+        double i_lat = RAD(-85.0 + 170.0 * random_uniform(rng));
+        double i_lon = RAD(-180.0 + 360.0 * random_uniform(rng));
+        // Bearings are meaningless closer than a few cm
+        double range = (0.1 + 9999.9 * random_uniform(rng)) / R;
+        double direction = 2.0 * PI * random_uniform(rng);
+        double f_lat = i_lat + range * cos(direction);
+        double f_lon = i_lon + range * sin(direction) / cos(i_lat);
+
+        record_error(result, fabs(wrap_angle(compute_bearing(i_lat, i_lon, f_lat, f_lon) -
+                                             reference_bearing(i_lat, i_lon, f_lat, f_lon))), DEG(i_lat), DEG(i_lon));
+    });
+    passed &= report("bearing", bearing_result, MAX_BEARING_ERROR, "rad");
+    passed &= report("distance", distance_result, MAX_DISTANCE_ERROR, "");
+
+    return passed;
+}
+
+static double now_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Keeps results alive so the compiler can't drop the loops
+static volatile float sink;
+
+/**
+ * @brief ns per element of body(i) over BENCH_ROUNDS passes of count elements, best of 5
+ */
+template <typename Body>
+static double time_per_element(size_t count, Body body)
+{
+    double best = INFINITY;
+    for (int attempt = 0; attempt < 5; attempt++)
+    {
+        double start = now_ns();
+        for (int round = 0; round < BENCH_ROUNDS; round++)
+        {
+            body();
+        }
+        best = min(best, (now_ns() - start) / (double(BENCH_ROUNDS) * count));
+    }
+    return best;
+}
+
+static void print_timing(const char *name, double fast_ns, double libm_ns)
+{
+    printf("%-24s fast %7.2f ns  libm %7.2f ns  x%.1f\n", name, fast_ns, libm_ns, libm_ns / fast_ns);
+}
+
+static void benchmark()
+{
+    std::vector<float> a(BENCH_ARRAY_SIZE), b(BENCH_ARRAY_SIZE), out_0(BENCH_ARRAY_SIZE), out_1(BENCH_ARRAY_SIZE);
+    uint64_t rng = 1;
+    for (size_t i = 0; i < BENCH_ARRAY_SIZE; i++)
+    {
+        a[i] = float(-2.0 * PI + 4.0 * PI * random_uniform(rng));
+        b[i] = float(0.1 + 10000.0 * random_uniform(rng));
+    }
+
+    print_timing("sincos",
+        time_per_element(BENCH_ARRAY_SIZE, [&]() { fast_sincos_batch(&a[0], &out_0[0], &out_1[0], BENCH_ARRAY_SIZE); sink = out_0[7]; }),
+        time_per_element(BENCH_ARRAY_SIZE, [&]() {
+            for (size_t i = 0; i < BENCH_ARRAY_SIZE; i++) { out_0[i] = sinf(a[i]); out_1[i] = cosf(a[i]); }
+            sink = out_0[7];
+        }));
+
+    print_timing("atan2",
+        time_per_element(BENCH_ARRAY_SIZE, [&]() {
+            for (size_t i = 0; i < BENCH_ARRAY_SIZE; i++) { out_0[i] = fast_atan2(a[i], b[i] - 5000.0f); }
+            sink = out_0[7];
+        }),
+        time_per_element(BENCH_ARRAY_SIZE, [&]() {
+            for (size_t i = 0; i < BENCH_ARRAY_SIZE; i++) { out_0[i] = atan2f(a[i], b[i] - 5000.0f); }
+            sink = out_0[7];
+        }));
+
+    print_timing("inv_sqrt",
+        time_per_element(BENCH_ARRAY_SIZE, [&]() {
+            for (size_t i = 0; i < BENCH_ARRAY_SIZE; i++) { out_0[i] = fast_inv_sqrt(b[i]); }
+            sink = out_0[7];
+        }),
+        time_per_element(BENCH_ARRAY_SIZE, [&]() {
+            for (size_t i = 0; i < BENCH_ARRAY_SIZE; i++) { out_0[i] = 1.0f / sqrtf(b[i]); }
+            sink = out_0[7];
+        }));
+
+    print_timing("hypot",
+        time_per_element(BENCH_ARRAY_SIZE, [&]() {
+            for (size_t i = 0; i < BENCH_ARRAY_SIZE; i++) { out_0[i] = fast_hypot(a[i], b[i]); }
+            sink = out_0[7];
+        }),
+        time_per_element(BENCH_ARRAY_SIZE, [&]() {
+            for (size_t i = 0; i < BENCH_ARRAY_SIZE; i++) { out_0[i] = hypotf(a[i], b[i]); }
+            sink = out_0[7];
+        }));
+
+    // A LIDAR scan as the RPLidar gives it, mm and clockwise degrees, converted to x ahead and y to the left
+    std::vector<float> distance(LIDAR_SCAN_POINTS), angle(LIDAR_SCAN_POINTS), x(LIDAR_SCAN_POINTS), y(LIDAR_SCAN_POINTS);
+    for (size_t i = 0; i < LIDAR_SCAN_POINTS; i++)
+    {
+        distance[i] = b[i];
+        angle[i] = 360.0f * i / LIDAR_SCAN_POINTS;
+    }
+
+    print_timing("lidar scan (per point)",
+        time_per_element(LIDAR_SCAN_POINTS, [&]() {
+            fast_polar_to_cartesian(&distance[0], &angle[0], &x[0], &y[0], LIDAR_SCAN_POINTS, -FAST_DEG_TO_RAD);
+            sink = x[7];
+        }),
+        time_per_element(LIDAR_SCAN_POINTS, [&]() {
+            for (size_t i = 0; i < LIDAR_SCAN_POINTS; i++)
+            {
+                float theta = -angle[i] * FAST_DEG_TO_RAD;
+                x[i] = distance[i] * cosf(theta);
+                y[i] = distance[i] * sinf(theta);
+            }
+            sink = x[7];
+        }));
+
+    // Waypoint geometry as Zombie mode does it, against the double precision version it replaced
+    std::vector<double> lat(BENCH_ARRAY_SIZE), lon(BENCH_ARRAY_SIZE);
+    for (size_t i = 0; i < BENCH_ARRAY_SIZE; i++)
+    {
+        lat[i] = RAD(-33.8688 + 0.01 * random_uniform(rng));
+        lon[i] = RAD(151.2093 + 0.01 * random_uniform(rng));
+    }
+
+    double fast_sum = 0.0, reference_sum = 0.0;
+    print_timing("gps bearing + distance",
+        time_per_element(BENCH_ARRAY_SIZE, [&]() {
+            for (size_t i = 1; i < BENCH_ARRAY_SIZE; i++)
+            {
+                fast_sum += compute_bearing(lat[i - 1], lon[i - 1], lat[i], lon[i]) +
+                            compute_distance(lat[i - 1], lon[i - 1], lat[i], lon[i]);
+            }
+        }),
+        time_per_element(BENCH_ARRAY_SIZE, [&]() {
+            for (size_t i = 1; i < BENCH_ARRAY_SIZE; i++)
+            {
+                reference_sum += reference_bearing(lat[i - 1], lon[i - 1], lat[i], lon[i]) +
+                                 reference_distance(lat[i - 1], lon[i - 1], lat[i], lon[i]);
+            }
+        }));
+    sink = float(fast_sum + reference_sum);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t stride = 1;
+    unsigned workers = parallel_default_workers();
+    bool accuracy = true;
+
+    for (int i = 1; i < argc; i++)
+    {
+        bool has_value = (i + 1 < argc);
+
+        if (strcmp(argv[i], "-q") == 0)
+        {
+            stride = 97;
+        }
+        else if (strcmp(argv[i], "-j") == 0 && has_value)
+        {
+            workers = max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "-b") == 0)
+        {
+            accuracy = false;
+        }
+        else
+        {
+            fprintf(stderr, "Usage: %s [-q] [-j workers] [-b]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    bool passed = true;
+    if (accuracy)
+    {
+        passed = check_accuracy(stride, workers);
+    }
+
+    benchmark();
+
+    return passed ? 0 : 1;
+}
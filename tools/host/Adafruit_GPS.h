@@ -0,0 +1,86 @@
+#ifndef HOST_ADAFRUIT_GPS_H
+#define HOST_ADAFRUIT_GPS_H
+
+/*
+Stands in for the Adafruit Ultimate GPS: the tool hands it whole fixes (host_deliver()) instead of NMEA characters.
+The firmware's read loop (available(), read(), newNMEAreceived(), parse()) sees one "sentence" per fix,
+and parse() fills in the same public fields the real library does.
+*/
+
+class Adafruit_GPS
+{
+    public:
+        Adafruit_GPS(void *serial)
+        {
+            pending_ = false;
+            received_ = false;
+            sentence_[0] = '\0';
+            latitudeDegrees = longitudeDegrees = 0.0;
+            angle = speed = HDOP = 0.0;
+            fix = false;
+            fixquality = satellites = 0;
+        }
+
+        void begin(uint32_t baud) {}
+        void sendCommand(const char *command) {}
+
+        /**
+         * @brief A fix has arrived, the firmware picks it up on its next read loop
+         *
+         * @param course degrees clockwise from north, speed in knots (as in RMC sentences)
+         */
+        void host_deliver(float latitude, float longitude, float course, float speed_knots, uint8_t sats, float hdop)
+        {
+            staged_latitude_ = latitude;
+            staged_longitude_ = longitude;
+            staged_course_ = course;
+            staged_speed_ = speed_knots;
+            staged_satellites_ = sats;
+            staged_hdop_ = hdop;
+            pending_ = true;
+        }
+
+        int available() { return pending_ ? 1 : 0; }
+
+        char read()
+        {
+            received_ = pending_;
+            pending_ = false;
+            return '\n';
+        }
+
+        bool newNMEAreceived() { return received_; }
+
+        char *lastNMEA()
+        {
+            received_ = false;
+            return sentence_;
+        }
+
+        bool parse(char *sentence)
+        {
+            latitudeDegrees = staged_latitude_;
+            longitudeDegrees = staged_longitude_;
+            angle = staged_course_;
+            speed = staged_speed_;
+            satellites = staged_satellites_;
+            HDOP = staged_hdop_;
+            fixquality = 1;
+            fix = true;
+            return true;
+        }
+
+        float latitudeDegrees, longitudeDegrees, angle, speed, HDOP;
+        bool fix;
+        uint8_t fixquality, satellites;
+
+    private:
+        bool pending_;
+        bool received_;
+        char sentence_[1];
+
+        float staged_latitude_, staged_longitude_, staged_course_, staged_speed_, staged_hdop_;
+        uint8_t staged_satellites_;
+};
+
+#endif
@@ -0,0 +1,175 @@
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+/*
+Just enough of the Arduino API to run the firmware headers on a PC, for the host tools (tools/blackbox_replay,
+tools/zombie_sim). This, SPI.h, SabertoothSimplified.h and Adafruit_GPS.h are the hardware seam: the tools
+drive them in place of the real peripherals, and the firmware headers are compiled unmodified.
+
+The clock is set by the tool (host_clock), it doesn't move by itself.
+Pins are just levels, host_set_pin() changes one and runs its interrupt handler as the hardware would.
+Serial output is thrown away, Serial input comes from host_serial_input if the tool sets one (tools/serial_latency).
+Binary writes go to host_serial_output if the tool sets one (tools/scan_decoder), the text is still thrown away.
+
+Everything here is a plain global, the tools run one robot per process.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cmath>
+#include <algorithm>
+
+using std::abs;
+using std::min;
+using std::max;
+
+typedef uint8_t byte;
+
+#define HIGH   1
+#define LOW    0
+#define INPUT  0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define CHANGE 3
+#define HEX    16
+#define DEC    10
+
+#define PI 3.1415926535897932384626433832795
+
+#define IRAM_ATTR
+#define F(x) x
+
+inline bool isDigit(int c) { return c >= '0' && c <= '9'; }
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+#define radians(deg) ((deg) * 0.017453292519943295)
+
+// binary.h, only the constants the firmware uses
+#define B00000000 0
+#define B00001000 8
+#define B00010000 16
+#define B00011000 24
+#define B00100000 32
+#define B00101000 40
+#define B00110000 48
+#define B01000000 64
+#define B10000000 128
+#define B11000000 192
+
+/******************* CLOCK **********************/
+
+struct HostClock
+{
+    unsigned long micros;
+    unsigned long millis;
+};
+
+HostClock host_clock = {0, 0};
+
+inline unsigned long micros() { return host_clock.micros; }
+inline unsigned long millis() { return host_clock.millis; }
+inline void delay(unsigned long) {}
+
+/**
+ * @brief Sets both clocks from one time, for tools that simulate rather than replay
+ */
+inline void host_set_time(unsigned long now_us)
+{
+    host_clock.micros = now_us;
+    host_clock.millis = now_us / 1000;
+}
+
+/******************* PINS **********************/
+
+#define HOST_NUM_PINS 40
+
+uint8_t host_pin_levels[HOST_NUM_PINS];
+void (*host_pin_isrs[HOST_NUM_PINS])();
+
+// A pulled up input reads HIGH until something drives it
+inline void pinMode(uint8_t pin, uint8_t mode)
+{
+    if (mode == INPUT_PULLUP)
+    {
+        host_pin_levels[pin] = HIGH;
+    }
+}
+inline int digitalRead(uint8_t pin) { return host_pin_levels[pin]; }
+inline void digitalWrite(uint8_t pin, uint8_t level) { host_pin_levels[pin] = level; }
+
+inline int digitalPinToInterrupt(uint8_t pin) { return pin; }
+
+// Only CHANGE is used by the firmware
+inline void attachInterrupt(int pin, void (*isr)(), int mode) { host_pin_isrs[pin] = isr; }
+
+/**
+ * @brief An input pin changing, from outside (e.g. a simulated sensor). Runs its handler if it has one
+ */
+inline void host_set_pin(uint8_t pin, uint8_t level)
+{
+    if (host_pin_levels[pin] == level)
+    {
+        return;
+    }
+
+    host_pin_levels[pin] = level;
+    if (host_pin_isrs[pin])
+    {
+        host_pin_isrs[pin]();
+    }
+}
+
+/******************* SERIAL **********************/
+
+/**
+ * @brief Where Serial reads from, e.g. a model of the UART receive buffer
+ */
+class HostSerialInput
+{
+    public:
+        virtual int available() = 0;
+        virtual int read() = 0;
+};
+
+HostSerialInput *host_serial_input = NULL;
+
+/**
+ * @brief Where Serial.write() goes, e.g. a model of the UART transmit FIFO
+ */
+class HostSerialOutput
+{
+    public:
+        virtual int available_for_write() = 0;
+        virtual void write(const uint8_t *data, size_t length) = 0;
+};
+
+HostSerialOutput *host_serial_output = NULL;
+
+// The controllers print a lot of debug output, it is thrown away
+class HostSerial
+{
+    public:
+        void begin(unsigned long) {}
+        int available() { return host_serial_input ? host_serial_input->available() : 0; }
+        int read() { return host_serial_input ? host_serial_input->read() : -1; }
+        int availableForWrite() { return host_serial_output ? host_serial_output->available_for_write() : 128; }
+
+        size_t write(const uint8_t *data, size_t length)
+        {
+            if (host_serial_output)
+            {
+                host_serial_output->write(data, length);
+            }
+            return length;
+        }
+
+        template <typename... Args> void print(Args...) {}
+        template <typename... Args> void println(Args...) {}
+};
+
+HostSerial Serial;
+
+#endif
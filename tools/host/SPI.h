@@ -0,0 +1,80 @@
+#ifndef HOST_SPI_H
+#define HOST_SPI_H
+
+/*
+Stands in for the LS7366R encoder counters on the SPI bus.
+The tool sets each counter's count (by chip select pin), a read counter command (0x60) while that chip is
+selected latches it, and the reads that follow get it back a byte at a time (highest order byte first).
+The firmware selects the LS7366R with its chip select HIGH.
+*/
+
+#define HOST_SPI_MAX_COUNTERS 4
+
+class HostSPI
+{
+    public:
+        HostSPI() : num_counters_(0), next_(4) {}
+
+        void set_count(uint8_t chip_select_pin, long count)
+        {
+            for (int i = 0; i < num_counters_; i++)
+            {
+                if (pins_[i] == chip_select_pin)
+                {
+                    counts_[i] = count;
+                    return;
+                }
+            }
+
+            if (num_counters_ < HOST_SPI_MAX_COUNTERS)
+            {
+                pins_[num_counters_] = chip_select_pin;
+                counts_[num_counters_++] = count;
+            }
+        }
+
+        uint8_t transfer(uint8_t data)
+        {
+            if (data == 0x60)
+            {
+                latch_();
+                return 0;
+            }
+
+            if (data != 0x00 || next_ >= 4)
+            {
+                return 0;
+            }
+
+            return bytes_[next_++];
+        }
+
+    private:
+        void latch_()
+        {
+            next_ = 4;
+
+            for (int i = 0; i < num_counters_; i++)
+            {
+                if (digitalRead(pins_[i]) == HIGH)
+                {
+                    for (int b = 0; b < 4; b++)
+                    {
+                        bytes_[b] = (counts_[i] >> (24 - 8 * b)) & 0xFF;
+                    }
+                    next_ = 0;
+                    return;
+                }
+            }
+        }
+
+        uint8_t pins_[HOST_SPI_MAX_COUNTERS];
+        long counts_[HOST_SPI_MAX_COUNTERS];
+        int num_counters_;
+        uint8_t bytes_[4];
+        int next_;
+};
+
+HostSPI SPI;
+
+#endif
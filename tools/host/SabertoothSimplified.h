@@ -0,0 +1,49 @@
+#ifndef HOST_SABERTOOTH_SIMPLIFIED_H
+#define HOST_SABERTOOTH_SIMPLIFIED_H
+
+/*
+Captures what the controllers send to the Sabertooth.
+Like the real one, each motor holds the last power it was sent until it is sent another.
+*/
+
+class SabertoothSimplified
+{
+    public:
+        SabertoothSimplified()
+        {
+            power_[0] = power_[1] = 0;
+            clear_written();
+        }
+
+        void motor(uint8_t motor_id, int power)
+        {
+            if (motor_id < 2)
+            {
+                written_[motor_id] = true;
+                power_[motor_id] = power;
+            }
+        }
+
+        void stop()
+        {
+            motor(0, 0);
+            motor(1, 0);
+        }
+
+        /**
+         * @brief Forgets which motors have been written to, e.g. at the start of a control cycle
+         */
+        void clear_written()
+        {
+            written_[0] = written_[1] = false;
+        }
+
+        bool was_written(uint8_t motor_id) { return written_[motor_id]; }
+        int power(uint8_t motor_id) { return power_[motor_id]; }
+
+    private:
+        bool written_[2];
+        int power_[2];
+};
+
+#endif
@@ -0,0 +1,816 @@
+/*
+Wheel velocity loop tuner
+
+Fits a first order plus dead time model of each drive motor to a step response captured on the robot, then
+searches for the MotorVelocityController gains (Kp, Ki, Kd and the feedforward Kff) that track the setpoint
+generator's profiles best against those models, and prints them as serial commands the firmware can load.
+
+The search runs the firmware's own setpoint generator, wheel encoder and velocity controller code (through the
+host seam in tools/host), so sample time, encoder quantisation, the output deadband and saturation are all as
+on the robot. Each gain set is scored on both wheels' models and on variants of them with more or less gain,
+a longer time constant and more dead time, and the worst of those is what counts:
+    cost = (rms tracking error / top speed)^2 + effort weight * (rms change in power per cycle / max power)^2
+A coarse sweep of the gain space runs in parallel across the host's cores (tools/sim/parallel_runner.h), and
+the best few are then refined by pattern search, also in parallel.
+
+Capturing a step response (robot on blocks, in SERIAL_COMMAND_STATE, #S,4,0!):
+    #R,40,2000!     both motors open loop at power 40 for 2 s, then at 0 for 2 s
+Save the serial output (only the STEP lines are used, the last test in the file), or use the black box log
+from the SD card, which has the same test in it.
+
+Build (from the repository root):
+    g++ -std=gnu++11 -O2 -I tools/host -I . tools/pid_tuner/pid_tuner.cpp -o pid_tuner
+
+Usage:
+    pid_tuner capture.txt                   fit and tune, the gain set goes to stdout
+    pid_tuner BB0003.BIN                    the same, from a black box log
+    pid_tuner capture.txt -w 0.1            with control effort weighted more (default 0.02)
+    pid_tuner capture.txt -j 8              on 8 workers
+    pid_tuner capture.txt -p max_power=80   with a different max_power, max_accel, max_decel or max_jerk
+
+Send the output to the robot (in SERIAL_COMMAND_STATE) to load and save the gains. The fit and the search are
+reported on stderr, including the gains as -p options for blackbox_replay and zombie_sim.
+*/
+
+#define ALEXBOT_PROFILING 0
+
+#include "Arduino.h"
+#include <SabertoothSimplified.h>
+
+#include <time.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "encoder_driver.h"
+#include "teleop_controller.h"
+#include "setpoint_generator.h"
+#include "motor_velocity_controller.h"
+#include "alexbot_hardware.h"
+
+#include "../blackbox_replay/blackbox_log.h"
+#include "../sim/plant_models.h"
+#include "../sim/parallel_runner.h"
+
+// Row numbers in alexbot_param_table[], for the #P commands
+#define PARAM_ID_VEL_KP  0
+#define PARAM_ID_VEL_KI  1
+#define PARAM_ID_VEL_KD  2
+#define PARAM_ID_VEL_KFF 19
+
+// The range the firmware accepts for each gain
+#define TUNER_MAX_GAIN 1000.0
+
+#define TUNER_STEP_S 0.001 // plant simulation step
+
+// Model fit, dead time and time constant search ranges
+#define FIT_MAX_DEAD_TIME     0.3  // s
+#define FIT_DEAD_TIME_STEP    0.005
+#define FIT_MIN_TIME_CONSTANT 0.01 // s
+#define FIT_MAX_TIME_CONSTANT 3.0
+#define FIT_TIME_CONSTANT_STEPS 80
+
+#define TUNER_DEFAULT_EFFORT_WEIGHT 0.02
+#define TUNER_REFINE_STARTS 4   // best sweep results to refine
+#define TUNER_REFINE_ITERATIONS 200
+
+/******************* CAPTURE **********************/
+
+struct StepSample
+{
+    double t;     // s
+    long count;   // encoder counts
+    int power;    // sent to the motor at this sample, held until the next
+};
+
+struct StepCapture
+{
+    double counts_per_metre;
+    std::vector<StepSample> wheels[2];
+};
+
+/**
+ * @brief Reads the STEP lines of a serial capture (see AlexbotController::start_step_test()), keeping the last test
+ */
+bool load_serial_capture(FILE *file, StepCapture &capture)
+{
+    char line[256];
+    bool configured = false;
+
+    while (fgets(line, sizeof(line), file))
+    {
+        double counts_per_metre;
+        unsigned long t;
+        int power;
+        long left, right;
+
+        if (sscanf(line, "STEP_CONFIG,%lf", &counts_per_metre) == 1)
+        {
+            capture.counts_per_metre = counts_per_metre;
+            capture.wheels[LEFT_MOTOR_ID].clear();
+            capture.wheels[RIGHT_MOTOR_ID].clear();
+            configured = true;
+        }
+        else if (configured && sscanf(line, "STEP,%lu,%d,%ld,%ld", &t, &power, &left, &right) == 4)
+        {
+            StepSample sample;
+            sample.t = t / 1000.0;
+            sample.power = power;
+            sample.count = left;
+            capture.wheels[LEFT_MOTOR_ID].push_back(sample);
+            sample.count = right;
+            capture.wheels[RIGHT_MOTOR_ID].push_back(sample);
+        }
+    }
+
+    return configured;
+}
+
+/**
+ * @brief Finds the last step test in a black box log (the control cycles with BLACKBOX_TICK_STEP)
+ */
+bool load_blackbox_capture(const std::vector<uint8_t> &log, StepCapture &capture)
+{
+    std::vector<Record> records;
+    if (!parse_log(log, records))
+    {
+        return false;
+    }
+
+    std::map<std::string, float> params;
+    bool in_test = false;
+    bool found = false;
+
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        const Record &record = records[i];
+
+        switch (record.type)
+        {
+            case BLACKBOX_RECORD_PARAM:
+            {
+                BlackboxParam param;
+                if (get_payload(record, param))
+                {
+                    params[std::string(param.name, strnlen(param.name, BLACKBOX_PARAM_NAME_LENGTH))] = param.value;
+                }
+                break;
+            }
+
+            case BLACKBOX_RECORD_TICK:
+            {
+                BlackboxTick tick;
+                bool step = get_payload(record, tick) && tick.mode == BLACKBOX_TICK_STEP;
+
+                if (step && !in_test)
+                {
+                    if (!params.count("enc_cpr") || !params.count("wheel_radius"))
+                    {
+                        fprintf(stderr, "The encoder geometry is missing from the log\n");
+                        return false;
+                    }
+
+                    capture.counts_per_metre = params["enc_cpr"] / (TAU * params["wheel_radius"]);
+                    capture.wheels[LEFT_MOTOR_ID].clear();
+                    capture.wheels[RIGHT_MOTOR_ID].clear();
+                    found = true;
+                }
+                in_test = step;
+                break;
+            }
+
+            case BLACKBOX_RECORD_ENCODER:
+            {
+                // Each step cycle reads both encoders, then sends both motors their power
+                BlackboxEncoder encoder;
+                if (in_test && get_payload(record, encoder) && encoder.encoder_id < 2)
+                {
+                    StepSample sample;
+                    sample.t = encoder.stamp_ms / 1000.0;
+                    sample.count = encoder.raw_count;
+                    sample.power = 0;
+                    capture.wheels[encoder.encoder_id].push_back(sample);
+                }
+                break;
+            }
+
+            case BLACKBOX_RECORD_MOTOR:
+            {
+                BlackboxMotor motor;
+                if (in_test && get_payload(record, motor) && motor.motor_id < 2 && !capture.wheels[motor.motor_id].empty())
+                {
+                    capture.wheels[motor.motor_id].back().power = motor.power;
+                }
+                break;
+            }
+        }
+    }
+
+    // Relative to the start of the test
+    for (uint8_t id = 0; id < 2; id++)
+    {
+        std::vector<StepSample> &samples = capture.wheels[id];
+        for (size_t i = 1; i < samples.size(); i++)
+        {
+            samples[i].t -= samples[0].t;
+        }
+        if (!samples.empty())
+        {
+            samples[0].t = 0.0;
+        }
+    }
+
+    return found;
+}
+
+/******************* MODEL FIT **********************/
+
+/**
+ * @brief Mean wheel velocity over each sample interval, measured and modelled
+ */
+class StepFit
+{
+    public:
+        StepFit(const std::vector<StepSample> &samples, double counts_per_metre) : samples_(samples)
+        {
+            for (size_t k = 1; k < samples_.size(); k++)
+            {
+                double dt = samples_[k].t - samples_[k - 1].t;
+                double distance = (samples_[k].count - samples_[k - 1].count) / counts_per_metre;
+                measured_.push_back(dt > 0.0 ? distance / dt : 0.0);
+            }
+        }
+
+        /**
+         * @brief Best gain for this time constant and dead time, by least squares
+         *
+         * @return sum of squared velocity errors
+         */
+        double fit_gain(double time_constant, double dead_time, double &gain)
+        {
+            std::vector<double> unit;
+            simulate_(time_constant, dead_time, unit);
+
+            double num = 0.0, den = 0.0;
+            for (size_t k = 0; k < unit.size(); k++)
+            {
+                num += unit[k] * measured_[k];
+                den += unit[k] * unit[k];
+            }
+            gain = (den > 0.0) ? num / den : 0.0;
+
+            double sse = 0.0;
+            for (size_t k = 0; k < unit.size(); k++)
+            {
+                double e = measured_[k] - gain * unit[k];
+                sse += e * e;
+            }
+            return sse;
+        }
+
+        MotorModelParams fit(double &rms, double &r_squared)
+        {
+            MotorModelParams best;
+            best.gain = 0.0;
+            best.time_constant = FIT_MIN_TIME_CONSTANT;
+            best.dead_time = 0.0;
+            double best_sse = -1.0;
+
+            double tc_ratio = pow(FIT_MAX_TIME_CONSTANT / FIT_MIN_TIME_CONSTANT, 1.0 / (FIT_TIME_CONSTANT_STEPS - 1));
+
+            // Coarse grid, then a finer one around the best
+            for (double dead_time = 0.0; dead_time <= FIT_MAX_DEAD_TIME + 1e-9; dead_time += FIT_DEAD_TIME_STEP)
+            {
+                for (double tc = FIT_MIN_TIME_CONSTANT; tc <= FIT_MAX_TIME_CONSTANT * 1.0001; tc *= tc_ratio)
+                {
+                    try_fit_(tc, dead_time, best, best_sse);
+                }
+            }
+
+            MotorModelParams coarse = best;
+            for (double dead_time = max(0.0, coarse.dead_time - FIT_DEAD_TIME_STEP);
+                 dead_time <= coarse.dead_time + FIT_DEAD_TIME_STEP + 1e-9; dead_time += TUNER_STEP_S)
+            {
+                for (double tc = coarse.time_constant / tc_ratio; tc <= coarse.time_constant * tc_ratio; tc *= pow(tc_ratio, 0.05))
+                {
+                    try_fit_(tc, dead_time, best, best_sse);
+                }
+            }
+
+            double mean = 0.0, total = 0.0;
+            for (size_t k = 0; k < measured_.size(); k++)
+            {
+                mean += measured_[k] / measured_.size();
+            }
+            for (size_t k = 0; k < measured_.size(); k++)
+            {
+                total += (measured_[k] - mean) * (measured_[k] - mean);
+            }
+
+            rms = sqrt(best_sse / max(size_t(1), measured_.size()));
+            r_squared = (total > 0.0) ? 1.0 - best_sse / total : 0.0;
+            return best;
+        }
+
+    private:
+        void try_fit_(double time_constant, double dead_time, MotorModelParams &best, double &best_sse)
+        {
+            double gain;
+            double sse = fit_gain(time_constant, dead_time, gain);
+            if (best_sse < 0.0 || sse < best_sse)
+            {
+                best_sse = sse;
+                best.gain = gain;
+                best.time_constant = time_constant;
+                best.dead_time = dead_time;
+            }
+        }
+
+        /**
+         * @brief Unit gain response, averaged over each sample interval. At rest with no power before the test.
+         */
+        void simulate_(double time_constant, double dead_time, std::vector<double> &unit)
+        {
+            unit.assign(measured_.size(), 0.0);
+            if (samples_.size() < 2)
+            {
+                return;
+            }
+
+            double decay = exp(-TUNER_STEP_S / time_constant);
+            double velocity = 0.0;
+            size_t input = 0;   // the sample whose power is acting (after the dead time)
+            size_t interval = 0;
+            double sum = 0.0;
+            unsigned steps = 0;
+
+            for (double t = samples_[0].t; interval < unit.size(); t += TUNER_STEP_S)
+            {
+                double delayed = t - dead_time;
+                while (input + 1 < samples_.size() && samples_[input + 1].t <= delayed)
+                {
+                    input++;
+                }
+                double power = (delayed >= samples_[0].t) ? samples_[input].power : 0.0;
+
+                velocity = power + (velocity - power) * decay;
+                sum += velocity;
+                steps++;
+
+                if (t + TUNER_STEP_S >= samples_[interval + 1].t - 1e-9)
+                {
+                    unit[interval] = steps ? sum / steps : velocity;
+                    sum = 0.0;
+                    steps = 0;
+                    interval++;
+                }
+            }
+        }
+
+        const std::vector<StepSample> &samples_;
+        std::vector<double> measured_;
+};
+
+/******************* CLOSED LOOP **********************/
+
+struct Gains
+{
+    double kp;
+    double ki;
+    double kd;
+    double kff;
+};
+
+struct Score
+{
+    Gains gains;
+    double cost;     // worst over the plant variants
+    double tracking; // m/s rms, in the worst variant
+    double effort;   // rms change in power per cycle, in the worst variant
+};
+
+struct TunerSetup
+{
+    MotorModelParams models[2];
+    double counts_per_metre;
+    double control_period; // s
+    double top_speed;      // m/s, what the nominal motors reach at max_power
+    double effort_weight;
+    std::map<std::string, float> params;
+};
+
+/**
+ * @brief The reference the loop is scored on: wheel speeds as fractions of top speed, and how long each is held
+ */
+const double tuner_profile[][2] = {
+    // fraction  seconds
+    {0.4,        2.0},
+    {0.8,        2.5},
+    {0.15,       2.0},
+    {-0.5,       2.5},
+    {0.0,        2.0},
+};
+
+#define TUNER_PROFILE_LENGTH (sizeof(tuner_profile) / sizeof(tuner_profile[0]))
+
+/**
+ * @brief Runs the firmware's velocity loop on one wheel model through the reference profile
+ */
+void run_closed_loop(const TunerSetup &setup, MotorModelParams model, Gains gains, double &tracking, double &effort)
+{
+    // Back to power on, each run gets a fresh host seam
+    memset(host_pin_levels, 0, sizeof(host_pin_levels));
+    SPI = HostSPI();
+    host_set_time(0);
+
+    const std::map<std::string, float> &p = setup.params;
+    int max_power = int(p.at("max_power"));
+
+    SabertoothSimplified sabertooth;
+    WheelEncoderLS7366 encoder(LEFT_MOTOR_ID, LEFT_ENCODER_CS_PIN, 1.0, 1.0);
+    MotorVelocityController controller("Tuned motor", &sabertooth, LEFT_MOTOR_ID, &encoder, max_power);
+    SetpointGenerator setpoint_generator;
+
+    // Counts per metre as on the robot, whatever the wheel size
+    encoder.set_geometry(setup.counts_per_metre * TAU, 1.0);
+    controller.set_gains(gains.kp, gains.ki, gains.kd);
+    controller.set_feedforward(gains.kff);
+    setpoint_generator.set_limits(SETPOINT_MAX_WHEEL_VEL, p.at("max_accel"), p.at("max_decel"), p.at("max_jerk"));
+
+    SabertoothMotorModel motor(model, TUNER_STEP_S);
+    LS7366Model counter(LEFT_ENCODER_CS_PIN, setup.counts_per_metre);
+
+    const unsigned long period_us = (unsigned long)lround(setup.control_period * 1e6);
+    unsigned long next_control = 0;
+    unsigned long now = 0;
+    double target = 0.0;
+    double error_sum = 0.0;
+    double effort_sum = 0.0;
+    unsigned long steps = 0;
+    unsigned cycles = 0;
+    int last_power = 0;
+
+    for (size_t segment = 0; segment < TUNER_PROFILE_LENGTH; segment++)
+    {
+        Velocity command;
+        command.linear = tuner_profile[segment][0] * setup.top_speed;
+        command.angular = 0.0;
+        setpoint_generator.set_command(command);
+
+        unsigned long segment_end = now + (unsigned long)lround(tuner_profile[segment][1] * 1e6);
+        for (; now < segment_end; now += (unsigned long)lround(TUNER_STEP_S * 1e6))
+        {
+            host_set_time(now);
+
+            if (now >= next_control)
+            {
+                next_control += period_us;
+                target = setpoint_generator.update(now).left;
+                controller.SetTargetVelocity(target);
+
+                int power = sabertooth.power(LEFT_MOTOR_ID);
+                effort_sum += double(power - last_power) * (power - last_power);
+                last_power = power;
+                cycles++;
+            }
+
+            double velocity = motor.step(sabertooth.power(LEFT_MOTOR_ID));
+            counter.step(velocity, TUNER_STEP_S);
+
+            error_sum += (target - velocity) * (target - velocity);
+            steps++;
+        }
+    }
+
+    tracking = sqrt(error_sum / max(1ul, steps));
+    effort = sqrt(effort_sum / max(1u, cycles));
+}
+
+/**
+ * @brief Scores a gain set on every plant variant, the worst one counts
+ */
+Score score_gains(const TunerSetup &setup, Gains gains)
+{
+    Score score;
+    score.gains = gains;
+    score.cost = -1.0;
+    score.tracking = 0.0;
+    score.effort = 0.0;
+
+    double max_power = setup.params.at("max_power");
+
+    for (uint8_t id = 0; id < 2; id++)
+    {
+        // Nominal, weaker and stronger motors, a slower motor, and a longer dead time
+        const double variants[][3] = {
+            // gain  time constant  dead time
+            {1.0,    1.0,           1.0},
+            {0.8,    1.0,           1.0},
+            {1.2,    1.0,           1.0},
+            {1.0,    1.5,           1.0},
+            {1.0,    1.0,           1.5},
+        };
+
+        for (size_t v = 0; v < sizeof(variants) / sizeof(variants[0]); v++)
+        {
+            MotorModelParams model = setup.models[id];
+            model.gain *= variants[v][0];
+            model.time_constant *= variants[v][1];
+            model.dead_time = model.dead_time * variants[v][2] + (variants[v][2] > 1.0 ? 0.01 : 0.0);
+
+            double tracking, effort;
+            run_closed_loop(setup, model, gains, tracking, effort);
+
+            double cost = pow(tracking / setup.top_speed, 2) + setup.effort_weight * pow(effort / max_power, 2);
+            if (!(cost == cost))
+            {
+                cost = 1e9;
+            }
+
+            if (cost > score.cost)
+            {
+                score.cost = cost;
+                score.tracking = tracking;
+                score.effort = effort;
+            }
+        }
+    }
+
+    return score;
+}
+
+/**
+ * @param dim 0 Kp, 1 Ki, 2 Kd, 3 Kff
+ */
+double &gain_component(Gains &gains, int dim)
+{
+    switch (dim)
+    {
+        case 0:  return gains.kp;
+        case 1:  return gains.ki;
+        case 2:  return gains.kd;
+        default: return gains.kff;
+    }
+}
+
+/**
+ * @brief Hooke-Jeeves pattern search from a starting gain set, each gain kept within the firmware's range
+ */
+Score refine_gains(const TunerSetup &setup, Score start, const double initial_steps[4])
+{
+    Score best = start;
+    double steps[4];
+    memcpy(steps, initial_steps, sizeof(steps));
+
+    for (int iteration = 0; iteration < TUNER_REFINE_ITERATIONS; iteration++)
+    {
+        bool improved = false;
+
+        for (int dim = 0; dim < 4; dim++)
+        {
+            for (int direction = -1; direction <= 1; direction += 2)
+            {
+                Gains candidate = best.gains;
+                double &value = gain_component(candidate, dim);
+                value = constrain(value + direction * steps[dim], 0.0, TUNER_MAX_GAIN);
+
+                Score score = score_gains(setup, candidate);
+                if (score.cost < best.cost)
+                {
+                    best = score;
+                    improved = true;
+                    break;
+                }
+            }
+        }
+
+        if (!improved)
+        {
+            bool converged = true;
+            for (int dim = 0; dim < 4; dim++)
+            {
+                steps[dim] *= 0.5;
+                converged &= (steps[dim] < initial_steps[dim] * 0.01);
+            }
+
+            if (converged)
+            {
+                break;
+            }
+        }
+    }
+
+    return best;
+}
+
+/******************* MAIN **********************/
+
+bool score_less(const Score &a, const Score &b)
+{
+    return a.cost < b.cost;
+}
+
+void print_score(const char *label, const Score &score)
+{
+    fprintf(stderr, "%s Kp=%.2f Ki=%.2f Kd=%.3f Kff=%.2f: cost %.5f, tracking %.4f m/s rms, effort %.2f power/cycle rms\n",
+            label, score.gains.kp, score.gains.ki, score.gains.kd, score.gains.kff, score.cost, score.tracking, score.effort);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <capture or black box log> [-w effort_weight] [-j workers] [-p name=value]...\n", argv[0]);
+        return 2;
+    }
+
+    TunerSetup setup;
+    setup.effort_weight = TUNER_DEFAULT_EFFORT_WEIGHT;
+    setup.params["max_power"] = DRIVE_MOTORS_MAX_POWER;
+    setup.params["max_accel"] = ROBOT_MAX_ACCEL_RATE;
+    setup.params["max_decel"] = ROBOT_MAX_DECEL_RATE;
+    setup.params["max_jerk"]  = ROBOT_MAX_JERK;
+    unsigned workers = parallel_default_workers();
+
+    for (int i = 2; i < argc; i++)
+    {
+        bool has_value = (i + 1 < argc);
+
+        if (strcmp(argv[i], "-w") == 0 && has_value)
+        {
+            setup.effort_weight = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-j") == 0 && has_value)
+        {
+            workers = max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "-p") == 0 && has_value)
+        {
+            std::string assignment(argv[++i]);
+            size_t equals = assignment.find('=');
+            if (equals == std::string::npos || !setup.params.count(assignment.substr(0, equals)))
+            {
+                fprintf(stderr, "Expected -p name=value, where name is max_power, max_accel, max_decel or max_jerk\n");
+                return 2;
+            }
+            setup.params[assignment.substr(0, equals)] = atof(assignment.c_str() + equals + 1);
+        }
+        else
+        {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 2;
+        }
+    }
+
+    // A black box log or a serial capture, told apart by the log's header
+    FILE *file = fopen(argv[1], "rb");
+    if (!file)
+    {
+        perror(argv[1]);
+        return 2;
+    }
+
+    std::vector<uint8_t> contents;
+    uint8_t chunk[BLACKBOX_SECTOR_SIZE];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0)
+    {
+        contents.insert(contents.end(), chunk, chunk + n);
+    }
+
+    StepCapture capture;
+    bool loaded;
+    std::vector<Record> records;
+    if (parse_log(contents, records))
+    {
+        loaded = load_blackbox_capture(contents, capture);
+    }
+    else
+    {
+        rewind(file);
+        loaded = load_serial_capture(file, capture);
+    }
+    fclose(file);
+
+    if (!loaded || capture.wheels[LEFT_MOTOR_ID].size() < 10 || capture.wheels[RIGHT_MOTOR_ID].size() < 10)
+    {
+        fprintf(stderr, "No step test found in %s (see #R)\n", argv[1]);
+        return 2;
+    }
+
+    // Models of both motors
+    setup.counts_per_metre = capture.counts_per_metre;
+    const char *wheel_names[2] = {"left", "right"};
+
+    for (uint8_t id = 0; id < 2; id++)
+    {
+        StepFit fit(capture.wheels[id], capture.counts_per_metre);
+        double rms, r_squared;
+        setup.models[id] = fit.fit(rms, r_squared);
+
+        fprintf(stderr, "%s motor: gain %.5f m/s per unit power, time constant %.3f s, dead time %.3f s "
+                        "(fit %.4f m/s rms, R^2 %.3f)\n", wheel_names[id], setup.models[id].gain,
+                setup.models[id].time_constant, setup.models[id].dead_time, rms, r_squared);
+
+        if (setup.models[id].gain <= 0.0)
+        {
+            fprintf(stderr, "ERROR: the %s motor goes backwards with positive power, check the wiring\n", wheel_names[id]);
+            return 1;
+        }
+    }
+
+    // Sample time as on the robot
+    std::vector<double> intervals;
+    const std::vector<StepSample> &samples = capture.wheels[LEFT_MOTOR_ID];
+    for (size_t k = 1; k < samples.size(); k++)
+    {
+        intervals.push_back(samples[k].t - samples[k - 1].t);
+    }
+    std::sort(intervals.begin(), intervals.end());
+    setup.control_period = max(TUNER_STEP_S, TUNER_STEP_S * lround(intervals[intervals.size() / 2] / TUNER_STEP_S));
+
+    double gain = 0.5 * (setup.models[LEFT_MOTOR_ID].gain + setup.models[RIGHT_MOTOR_ID].gain);
+    setup.top_speed = min(SETPOINT_MAX_WHEEL_VEL, gain * setup.params["max_power"]);
+    fprintf(stderr, "control period %.3f s, top speed %.3f m/s at max_power %g\n", setup.control_period,
+            setup.top_speed, setup.params["max_power"]);
+
+    // Coarse sweep, scaled by the feedforward that would give the right steady state speed on its own
+    double unit = 1.0 / gain;
+    const double kff_scales[] = {0.0, 0.5, 0.75, 0.9, 1.0, 1.1, 1.25};
+    const double kp_scales[]  = {0.0, 0.25, 0.5, 1.0, 2.0, 3.0, 5.0};
+    const double ki_scales[]  = {0.0, 0.5, 1.0, 2.0, 4.0, 8.0, 16.0};
+    const double kd_scales[]  = {0.0, 0.02, 0.05, 0.1};
+
+    std::vector<Gains> candidates;
+    for (size_t a = 0; a < sizeof(kff_scales) / sizeof(double); a++)
+    for (size_t b = 0; b < sizeof(kp_scales) / sizeof(double); b++)
+    for (size_t c = 0; c < sizeof(ki_scales) / sizeof(double); c++)
+    for (size_t d = 0; d < sizeof(kd_scales) / sizeof(double); d++)
+    {
+        Gains g;
+        g.kff = min(TUNER_MAX_GAIN, kff_scales[a] * unit);
+        g.kp  = min(TUNER_MAX_GAIN, kp_scales[b] * unit);
+        g.ki  = min(TUNER_MAX_GAIN, ki_scales[c] * unit);
+        g.kd  = min(TUNER_MAX_GAIN, kd_scales[d] * unit);
+        candidates.push_back(g);
+    }
+
+    timespec wall_start, wall_end;
+    clock_gettime(CLOCK_MONOTONIC, &wall_start);
+
+    std::vector<bool> done;
+    std::vector<Score> sweep = run_parallel<Score>(candidates.size(), workers,
+        [&](size_t i) { return score_gains(setup, candidates[i]); }, done);
+
+    std::vector<Score> ranked;
+    for (size_t i = 0; i < sweep.size(); i++)
+    {
+        if (done[i])
+        {
+            ranked.push_back(sweep[i]);
+        }
+    }
+
+    if (ranked.empty())
+    {
+        fprintf(stderr, "ERROR: the sweep failed\n");
+        return 1;
+    }
+
+    std::sort(ranked.begin(), ranked.end(), score_less);
+    fprintf(stderr, "%zu gain sets swept\n", ranked.size());
+
+    // Refine the best few, in parallel
+    size_t starts = min(size_t(TUNER_REFINE_STARTS), ranked.size());
+    const double steps[4] = {0.25 * unit, 0.5 * unit, 0.02 * unit, 0.1 * unit}; // kp, ki, kd, kff
+
+    std::vector<Score> refined = run_parallel<Score>(starts, workers,
+        [&](size_t i) { return refine_gains(setup, ranked[i], steps); }, done);
+
+    Score best = ranked[0];
+    for (size_t i = 0; i < refined.size(); i++)
+    {
+        if (done[i] && refined[i].cost < best.cost)
+        {
+            best = refined[i];
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &wall_end);
+    double wall = (wall_end.tv_sec - wall_start.tv_sec) + (wall_end.tv_nsec - wall_start.tv_nsec) * 1e-9;
+
+    print_score("best swept: ", ranked[0]);
+    print_score("tuned:      ", best);
+    fprintf(stderr, "searched in %.1f s on %u workers\n", wall, workers);
+    fprintf(stderr, "-p vel_kp=%.2f -p vel_ki=%.2f -p vel_kd=%.3f -p vel_kff=%.2f\n",
+            best.gains.kp, best.gains.ki, best.gains.kd, best.gains.kff);
+
+    // The gain set, as commands the firmware takes in SERIAL_COMMAND_STATE, then saved
+    printf("#P,%d,%.2f!\n", PARAM_ID_VEL_KP, best.gains.kp);
+    printf("#P,%d,%.2f!\n", PARAM_ID_VEL_KI, best.gains.ki);
+    printf("#P,%d,%.3f!\n", PARAM_ID_VEL_KD, best.gains.kd);
+    printf("#P,%d,%.2f!\n", PARAM_ID_VEL_KFF, best.gains.kff);
+    printf("#N,0,0!\n");
+    return 0;
+}
@@ -0,0 +1,627 @@
+/*
+LIDAR scan stream decoder
+
+Turns the compressed scans the robot streams over the serial link (scan_streamer.h) back into
+sensor_msgs/LaserScan arrays, as the ROS node does.
+
+From the robot's serial port it asks for the stream (#F,1,<mm>!), asks for a keyframe whenever it has lost one
+(#F,2,0!), and prints each revolution as a CSV line on stdout: the LaserScan fields, then the ranges in m ("inf"
+for no return). The robot's text output goes to stderr with -v. From a file (a capture of the port) it decodes the
+same, without asking for anything.
+
+--loopback tests the stream without a robot: a LIDAR in a room (a RPLidar A1 on a robot driving a circle) feeds
+the firmware's own ScanStreamer, as the aux loop would, through the host seam (tools/host). Its frames go through
+a model of the UART (a 128 byte transmit FIFO, drained at the baud rate) along with a line of debug text every
+LOOPBACK_TEXT_INTERVAL, and --loss drops bytes on the wire. --speed 0 keeps the robot still. The decoder's revolutions are checked beam by beam
+against what the LIDAR measured, and the keyframe requests go back to the streamer. It prints a CSV line per
+revolution on stdout (encode time, largest error) and on stderr the compression ratio, against 16 bit ranges and
+against the ranges as text, the encode time per revolution (on this PC, #F,0,0! gives the robot's), the share of
+the link used and the largest error.
+
+Build (from the repository root):
+    g++ -std=gnu++11 -O2 -I tools/host -I . tools/scan_decoder/scan_decoder.cpp -o scan_decoder
+
+Usage:
+    scan_decoder /dev/ttyUSB0 > scans.csv        stream from the robot at the default resolution, until Ctrl-C
+    scan_decoder /dev/ttyUSB0 -r 20 -t 60 -v     at 20 mm, for 60 s, with the robot's text on stderr
+    scan_decoder capture.bin > scans.csv         decode a capture
+    scan_decoder --loopback                      60 s of the simulated LIDAR at the default resolution
+    scan_decoder --loopback -r 5 --loss 0.001 -t 120
+    scan_decoder --loopback -r 50 --speed 0
+*/
+
+#include "Arduino.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <deque>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "scan_streamer.h"
+#include "scan_decoder.h"
+
+#define DECODER_BAUD         B115200
+#define DECODER_DEFAULT_TIME 60.0 // s, for --loopback
+
+// The robot's link, and the UART's transmit FIFO
+#define LOOPBACK_BAUD        115200
+#define LOOPBACK_TX_FIFO     128  // bytes
+
+// The firmware prints a line of debug output about this often
+#define LOOPBACK_TEXT_INTERVAL 20 // ms
+#define LOOPBACK_TEXT          "main_task Done\r\n"
+
+// RPLidar A1 (as tools/sim/sim_models.h)
+#define LOOPBACK_LIDAR_RATE    5.5   // Hz, revolutions
+#define LOOPBACK_LIDAR_POINTS  360   // per revolution
+#define LOOPBACK_LIDAR_NOISE   0.01  // m
+#define LOOPBACK_LIDAR_RANGE   6.0   // m
+#define LOOPBACK_LIDAR_DROPOUT 0.02  // probability of each point having no return
+
+// A room with some posts in it, and the robot driving a circle in the middle
+#define LOOPBACK_ROOM_WIDTH    8.0   // m
+#define LOOPBACK_ROOM_DEPTH    6.0   // m
+#define LOOPBACK_NUM_POSTS     4
+#define LOOPBACK_POST_SIZE     0.3   // m
+#define LOOPBACK_CIRCLE_RADIUS 1.5   // m
+#define LOOPBACK_SPEED         0.3   // m/s, by default
+
+volatile sig_atomic_t stop_requested = 0;
+
+void on_signal(int)
+{
+    stop_requested = 1;
+}
+
+double wall_seconds()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+void print_csv_header()
+{
+    printf("revolution,stamp_ms,keyframe,angle_min,angle_max,angle_increment,time_increment,scan_time,range_min,"
+           "range_max,ranges...\n");
+}
+
+void print_scan(const LaserScanArrays &scan)
+{
+    printf("%u,%u,%d,%.6f,%.6f,%.6f,%.8f,%.6f,%.3f,%.3f", scan.revolution, scan.stamp, scan.keyframe,
+           scan.angle_min, scan.angle_max, scan.angle_increment, scan.time_increment, scan.scan_time,
+           scan.range_min, scan.range_max);
+    for (size_t i = 0; i < scan.ranges.size(); i++)
+    {
+        if (std::isinf(scan.ranges[i]))
+        {
+            printf(",inf");
+        }
+        else
+        {
+            printf(",%.3f", scan.ranges[i]);
+        }
+    }
+    printf("\n");
+}
+
+/**
+ * @brief Raw 8N1 at the robot's baud rate
+ */
+bool open_port(const char *path, int &fd)
+{
+    fd = open(path, O_RDWR | O_NOCTTY);
+    if (fd < 0)
+    {
+        perror(path);
+        return false;
+    }
+
+    termios raw;
+    if (tcgetattr(fd, &raw) != 0)
+    {
+        perror(path);
+        return false;
+    }
+    cfmakeraw(&raw);
+    cfsetispeed(&raw, DECODER_BAUD);
+    cfsetospeed(&raw, DECODER_BAUD);
+    raw.c_cc[VMIN] = 0;
+    raw.c_cc[VTIME] = 1; // reads return after 0.1 s with nothing, so -t and Ctrl-C are noticed
+    return tcsetattr(fd, TCSANOW, &raw) == 0;
+}
+
+void send_command(int fd, int mode, int data1)
+{
+    char command[24];
+    int length = snprintf(command, sizeof(command), "#F,%d,%d!", mode, data1);
+    if (write(fd, command, length) != length)
+    {
+        perror("write");
+    }
+}
+
+/**
+ * @brief Decodes a serial port or a capture until it ends, -t runs out or Ctrl-C
+ */
+int run_port(const char *path, int resolution, double duration, bool verbose)
+{
+    struct stat info;
+    if (stat(path, &info) != 0)
+    {
+        perror(path);
+        return 1;
+    }
+
+    bool port = S_ISCHR(info.st_mode);
+    int fd = -1;
+    if (port && !open_port(path, fd))
+    {
+        return 1;
+    }
+    if (!port && (fd = open(path, O_RDONLY)) < 0)
+    {
+        perror(path);
+        return 1;
+    }
+
+    signal(SIGINT, on_signal);
+    print_csv_header();
+
+    if (port)
+    {
+        send_command(fd, SCAN_STREAM_START, resolution);
+    }
+
+    ScanDecoder decoder;
+    double start = wall_seconds();
+    uint8_t buffer[256];
+
+    while (!stop_requested && (duration <= 0.0 || wall_seconds() - start < duration))
+    {
+        ssize_t count = read(fd, buffer, sizeof(buffer));
+        if (count < 0 || (count == 0 && !port))
+        {
+            break;
+        }
+
+        for (ssize_t i = 0; i < count; i++)
+        {
+            decoder.feed(buffer[i]);
+        }
+
+        LaserScanArrays scan;
+        while (decoder.take_scan(scan))
+        {
+            print_scan(scan);
+        }
+
+        std::string line;
+        while (decoder.take_line(line))
+        {
+            if (verbose)
+            {
+                fprintf(stderr, "%s\n", line.c_str());
+            }
+        }
+
+        if (decoder.needs_keyframe() && port)
+        {
+            send_command(fd, SCAN_STREAM_KEYFRAME, 0);
+        }
+    }
+
+    if (port)
+    {
+        send_command(fd, SCAN_STREAM_STOP, 0);
+    }
+    close(fd);
+
+    decoder.print_stats(stderr);
+    return 0;
+}
+
+/******************* LOOPBACK **********************/
+
+/**
+ * @brief The ESP32's UART: a transmit FIFO drained onto the wire at the baud rate, bytes lost on the way at random
+ */
+class UartModel : public HostSerialOutput
+{
+    public:
+        UartModel(std::mt19937 *random, double loss) : random_(random), loss_(loss), credit_(0.0), frame_bytes_(0) {}
+
+        int available_for_write() { return LOOPBACK_TX_FIFO - int(fifo_.size()); }
+
+        void write(const uint8_t *data, size_t length)
+        {
+            fifo_.insert(fifo_.end(), data, data + length);
+            frame_bytes_ += length;
+        }
+
+        // The firmware's text output (Serial.print is thrown away by the host seam)
+        void print(const char *text)
+        {
+            fifo_.insert(fifo_.end(), text, text + strlen(text));
+        }
+
+        /**
+         * @brief The bytes that went out in the last dt
+         */
+        void drain(double dt, ScanDecoder &decoder)
+        {
+            std::uniform_real_distribution<double> uniform(0.0, 1.0);
+            credit_ = min(credit_ + dt * LOOPBACK_BAUD / 10.0, double(LOOPBACK_TX_FIFO));
+
+            while (credit_ >= 1.0 && !fifo_.empty())
+            {
+                uint8_t byte = fifo_.front();
+                fifo_.pop_front();
+                credit_ -= 1.0;
+
+                if (uniform(*random_) >= loss_)
+                {
+                    decoder.feed(byte);
+                }
+            }
+        }
+
+        uint64_t get_frame_bytes() { return frame_bytes_; }
+
+    private:
+        std::mt19937 *random_;
+        double loss_;
+        double credit_;          // bytes the wire could have taken
+        std::deque<uint8_t> fifo_;
+        uint64_t frame_bytes_;
+};
+
+/**
+ * @brief What the LIDAR sees from the middle of a room
+ */
+class Room
+{
+    public:
+        Room(std::mt19937 *random)
+        {
+            double w = 0.5 * LOOPBACK_ROOM_WIDTH, d = 0.5 * LOOPBACK_ROOM_DEPTH;
+            add_segment_(-w, -d, w, -d);
+            add_segment_(w, -d, w, d);
+            add_segment_(w, d, -w, d);
+            add_segment_(-w, d, -w, -d);
+
+            // Posts between the circle and the walls
+            std::uniform_real_distribution<double> angle(-M_PI, M_PI);
+            for (uint8_t i = 0; i < LOOPBACK_NUM_POSTS; i++)
+            {
+                double a = angle(*random);
+                double x = (LOOPBACK_CIRCLE_RADIUS + 1.0) * cos(a), y = (LOOPBACK_CIRCLE_RADIUS + 0.8) * sin(a);
+                double h = 0.5 * LOOPBACK_POST_SIZE;
+
+                add_segment_(x - h, y - h, x + h, y - h);
+                add_segment_(x + h, y - h, x + h, y + h);
+                add_segment_(x + h, y + h, x - h, y + h);
+                add_segment_(x - h, y + h, x - h, y - h);
+            }
+        }
+
+        /**
+         * @return m to the nearest wall or post along the ray, or infinity
+         */
+        double cast(double x, double y, double direction)
+        {
+            double dx = cos(direction), dy = sin(direction);
+            double nearest = INFINITY;
+
+            for (size_t i = 0; i < segments_.size(); i++)
+            {
+                const double *segment = segments_[i].xy;
+                double ex = segment[2] - segment[0], ey = segment[3] - segment[1];
+                double denominator = dx * ey - dy * ex;
+
+                if (fabs(denominator) < 1e-12)
+                {
+                    continue;
+                }
+
+                double wx = segment[0] - x, wy = segment[1] - y;
+                double t = (wx * ey - wy * ex) / denominator;
+                double u = (wx * dy - wy * dx) / denominator;
+
+                if (t > 0.0 && u >= 0.0 && u <= 1.0)
+                {
+                    nearest = min(nearest, t);
+                }
+            }
+
+            return nearest;
+        }
+
+    private:
+        struct Segment
+        {
+            double xy[4]; // x0, y0, x1, y1 in m
+        };
+
+        void add_segment_(double x0, double y0, double x1, double y1)
+        {
+            Segment segment = {{x0, y0, x1, y1}};
+            segments_.push_back(segment);
+        }
+
+        std::vector<Segment> segments_;
+};
+
+struct LoopbackResult
+{
+    uint32_t revolutions;       // the LIDAR made
+    uint32_t decoded;
+    uint32_t beams_checked;
+    uint32_t beams_wrong;       // a return where there was none, or the other way round, or further out than allowed
+    double max_error;           // mm, over the beams with a return
+    double sum_squared_error;
+    uint32_t error_beams;
+    uint64_t text_bytes;        // the same revolutions as text, "<mm>," a beam
+    double encode_seconds;
+    double max_encode_seconds;
+    uint32_t encodes;
+};
+
+int run_loopback(int resolution, double duration, double speed, double loss, uint32_t seed)
+{
+    std::mt19937 random(seed);
+    std::normal_distribution<double> noise(0.0, LOOPBACK_LIDAR_NOISE);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+    Room room(&random);
+    UartModel uart(&random, loss);
+    ScanDecoder decoder;
+    host_serial_output = &uart;
+
+    scan_streamer.command(SCAN_STREAM_START, resolution);
+    uint8_t used_resolution = resolution > 0 ? min(resolution, SCAN_STREAM_MAX_RESOLUTION) : SCAN_STREAM_RESOLUTION;
+    double allowed_error = used_resolution * (0.5 + SCAN_STREAM_DEADBAND) + 0.5; // mm, rounding to whole mm too
+
+    LoopbackResult result;
+    memset(&result, 0, sizeof(result));
+
+    // What the LIDAR measured, nearest point in each beam in mm (SCAN_STREAM_NO_RETURN, 0 if no point landed in it),
+    // by the millis() each revolution started
+    std::map<uint32_t, std::vector<uint16_t> > measured;
+    std::map<uint32_t, double> encode_times; // s
+    std::vector<uint16_t> revolution(SCAN_STREAM_BEAMS, 0);
+    uint32_t revolution_start = 0;
+    double angle_offset = 0.0;
+
+    const double point_period = 1.0 / (LOOPBACK_LIDAR_RATE * LOOPBACK_LIDAR_POINTS);
+    double last_text = 0.0;
+
+    printf("revolution,stamp_ms,keyframe,encode_us,max_error_mm\n");
+
+    for (uint64_t point = 0; point * point_period < duration; point++)
+    {
+        double now = point * point_period;
+        host_set_time((unsigned long)(now * 1e6));
+        uart.drain(point_period, decoder);
+
+        uint16_t index = point % LOOPBACK_LIDAR_POINTS;
+        bool start_bit = (index == 0);
+        uint32_t completed_start = revolution_start;
+        if (start_bit)
+        {
+            if (point > 0)
+            {
+                measured[revolution_start] = revolution;
+                result.revolutions++;
+            }
+            revolution.assign(SCAN_STREAM_BEAMS, 0);
+            revolution_start = millis();
+
+            // The RPLidar's points don't land on the same angles each time round
+            angle_offset = uniform(random);
+        }
+
+        // The robot on its circle, heading along it
+        double a = speed * now / LOOPBACK_CIRCLE_RADIUS;
+        double x = LOOPBACK_CIRCLE_RADIUS * cos(a), y = LOOPBACK_CIRCLE_RADIUS * sin(a);
+        double heading = a + 0.5 * M_PI;
+
+        // Clockwise from the heading, as the RPLidar reports it
+        double angle = fmod(360.0 * index / LOOPBACK_LIDAR_POINTS + angle_offset, 360.0);
+        double range = room.cast(x, y, heading - angle * M_PI / 180.0);
+        bool returned = range <= LOOPBACK_LIDAR_RANGE && uniform(random) >= LOOPBACK_LIDAR_DROPOUT;
+        float distance = returned ? float((range + noise(random)) * 1000.0) : 0.0f;
+
+        uint16_t beam = scan_stream_beam(float(angle));
+        uint16_t mm = SCAN_STREAM_NO_RETURN;
+        if (returned && distance >= SCAN_STREAM_MIN_RANGE && distance <= SCAN_STREAM_MAX_RANGE)
+        {
+            mm = uint16_t(distance + 0.5f);
+        }
+        revolution[beam] = (revolution[beam] == 0) ? mm : min(revolution[beam], mm);
+
+        double encode_start = wall_seconds();
+        scan_streamer.add_point(distance, float(angle), returned ? 15 : 0, start_bit);
+        if (start_bit && point > 0)
+        {
+            double encode_time = wall_seconds() - encode_start;
+            result.encode_seconds += encode_time;
+            result.max_encode_seconds = max(result.max_encode_seconds, encode_time);
+            result.encodes++;
+            encode_times[completed_start] = encode_time;
+        }
+
+        if (now - last_text >= LOOPBACK_TEXT_INTERVAL * 1e-3)
+        {
+            last_text = now;
+            uart.print(LOOPBACK_TEXT);
+        }
+
+        // As ROS would send #F,2,0! (its time on the wire isn't modelled)
+        if (decoder.needs_keyframe())
+        {
+            scan_streamer.command(SCAN_STREAM_KEYFRAME, 0.0);
+        }
+
+        LaserScanArrays scan;
+        while (decoder.take_scan(scan))
+        {
+            std::map<uint32_t, std::vector<uint16_t> >::iterator truth = measured.find(scan.stamp);
+            if (truth == measured.end())
+            {
+                fprintf(stderr, "Revolution %u at %u ms was never measured\n", scan.revolution, scan.stamp);
+                continue;
+            }
+
+            double max_error = 0.0;
+            for (uint16_t beam = 0; beam < SCAN_STREAM_BEAMS; beam++)
+            {
+                uint16_t expected = truth->second[beam];
+                float decoded = scan.ranges[beam];
+
+                // Nothing to check it against, the host keeps what it had
+                if (expected == 0)
+                {
+                    continue;
+                }
+
+                result.beams_checked++;
+                if (expected == SCAN_STREAM_NO_RETURN || std::isinf(decoded))
+                {
+                    result.beams_wrong += (expected == SCAN_STREAM_NO_RETURN) != bool(std::isinf(decoded));
+                    continue;
+                }
+
+                double error = fabs(decoded * 1000.0 - expected);
+                max_error = max(max_error, error);
+                result.beams_wrong += error > allowed_error;
+                result.sum_squared_error += error * error;
+                result.error_beams++;
+            }
+
+            result.max_error = max(result.max_error, max_error);
+            result.decoded++;
+
+            char text[8];
+            for (uint16_t beam = 0; beam < SCAN_STREAM_BEAMS; beam++)
+            {
+                uint16_t expected = truth->second[beam];
+                result.text_bytes += snprintf(text, sizeof(text), "%u,", expected == SCAN_STREAM_NO_RETURN ? 0 : expected);
+            }
+
+            printf("%u,%u,%d,%.1f,%.1f\n", scan.revolution, scan.stamp, scan.keyframe, 1e6 * encode_times[scan.stamp],
+                   max_error);
+
+            // Those before it will never be decoded now
+            measured.erase(measured.begin(), ++truth);
+            encode_times.erase(encode_times.begin(), encode_times.upper_bound(scan.stamp));
+        }
+
+        std::string line;
+        while (decoder.take_line(line))
+        {
+        }
+    }
+
+    host_serial_output = NULL;
+
+    uint64_t frame_bytes = uart.get_frame_bytes();
+    double raw_bytes = double(result.decoded) * SCAN_STREAM_BEAMS * 2;
+
+    fprintf(stderr, "Resolution %u mm, %u revolutions in %.0f s, %u decoded (%.1f%%)\n", used_resolution,
+            result.revolutions, duration, result.decoded,
+            result.revolutions > 0 ? 100.0 * result.decoded / result.revolutions : 0.0);
+    fprintf(stderr, "Frames: %llu bytes, %.0f bytes/s (%.0f%% of the link)\n", (unsigned long long)frame_bytes,
+            frame_bytes / duration, 100.0 * frame_bytes / duration / (LOOPBACK_BAUD / 10.0));
+    fprintf(stderr, "Compression: %.2f against 16 bit ranges, %.2f against text (%.0f bytes a revolution)\n",
+            frame_bytes > 0 ? raw_bytes / frame_bytes : 0.0, frame_bytes > 0 ? double(result.text_bytes) / frame_bytes : 0.0,
+            result.decoded > 0 ? double(frame_bytes) / result.decoded : 0.0);
+    fprintf(stderr, "Encode: mean %.1f us, max %.1f us a revolution on this PC\n",
+            result.encodes > 0 ? 1e6 * result.encode_seconds / result.encodes : 0.0, 1e6 * result.max_encode_seconds);
+    fprintf(stderr, "Error: max %.1f mm (allowed %.1f), rms %.1f mm, %u of %u beams wrong\n", result.max_error,
+            allowed_error, result.error_beams > 0 ? sqrt(result.sum_squared_error / result.error_beams) : 0.0,
+            result.beams_wrong, result.beams_checked);
+    decoder.print_stats(stderr);
+
+    return result.beams_wrong == 0 ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = NULL;
+    bool loopback = false;
+    bool verbose = false;
+    int resolution = 0;
+    double duration = 0.0;
+    double speed = LOOPBACK_SPEED;
+    double loss = 0.0;
+    uint32_t seed = 1;
+
+    for (int i = 1; i < argc; i++)
+    {
+        bool has_value = (i + 1 < argc);
+
+        if (strcmp(argv[i], "--loopback") == 0)
+        {
+            loopback = true;
+        }
+        else if (strcmp(argv[i], "-v") == 0)
+        {
+            verbose = true;
+        }
+        else if (strcmp(argv[i], "-r") == 0 && has_value)
+        {
+            resolution = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-t") == 0 && has_value)
+        {
+            duration = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--speed") == 0 && has_value)
+        {
+            speed = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--loss") == 0 && has_value)
+        {
+            loss = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-s") == 0 && has_value)
+        {
+            seed = strtoul(argv[++i], NULL, 0);
+        }
+        else if (argv[i][0] != '-' && !path)
+        {
+            path = argv[i];
+        }
+        else
+        {
+            path = NULL;
+            loopback = false;
+            break;
+        }
+    }
+
+    if (loopback)
+    {
+        return run_loopback(resolution, duration > 0.0 ? duration : DECODER_DEFAULT_TIME, speed, loss, seed);
+    }
+
+    if (!path)
+    {
+        fprintf(stderr, "Usage: %s <serial port or capture> [-r resolution_mm] [-t seconds] [-v]\n"
+                        "       %s --loopback [-r resolution_mm] [-t seconds] [--speed m/s] [--loss byte_probability] "
+                        "[-s seed]\n",
+                argv[0], argv[0]);
+        return 2;
+    }
+
+    return run_port(path, resolution, duration, verbose);
+}
@@ -0,0 +1,419 @@
+#ifndef SCAN_DECODER_H
+#define SCAN_DECODER_H
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "scan_streamer.h"
+
+/*
+Decoding the LIDAR scan stream (scan_streamer.h) on the host, for scan_decoder and the ROS node
+
+Feed it every byte read from the serial port. The frames come out as revolutions in sensor_msgs/LaserScan's
+terms, everything else (the firmware's text output) as lines. The ranges are kept as the robot thinks the host
+has them, so they are only right from a keyframe on with no frame missing: after a gap, or a frame that fails its
+CRC, revolutions are dropped until the next keyframe, and needs_keyframe() says to ask for one (#F,2,0!).
+*/
+
+// The longest line of text kept, the rest of a longer one is dropped
+#define SCAN_DECODER_MAX_LINE 256
+
+/**
+ * @brief One revolution, as the fields of sensor_msgs/LaserScan
+ *
+ * The beams are in the order the RPLidar measures them, clockwise from the robot heading, so angle_increment is
+ * negative (as the rplidar_ros driver publishes them) and time_increment positive.
+ */
+struct LaserScanArrays
+{
+    uint16_t revolution;
+    uint32_t stamp;              // robot millis() at the first beam (clock_sync.h gives the host's time)
+    bool keyframe;
+    float angle_min;             // rad
+    float angle_max;
+    float angle_increment;
+    float time_increment;        // s
+    float scan_time;
+    float range_min;             // m
+    float range_max;
+    std::vector<float> ranges;   // m, +inf for no return (REP 117)
+    std::vector<float> intensities; // not sent, left empty
+};
+
+class ScanDecoder
+{
+    public:
+        ScanDecoder();
+        void feed(uint8_t byte);
+        bool take_scan(LaserScanArrays &scan);
+        bool take_line(std::string &line);
+        bool needs_keyframe();
+        void print_stats(FILE *out);
+
+        // Stats
+        uint32_t frames;
+        uint32_t frame_bytes;
+        uint32_t bad_frames;     // failed the CRC, or made no sense
+        uint32_t lost_frames;    // gaps in the sequence
+        uint32_t discarded;      // good frames while waiting for a keyframe
+        uint32_t revolutions;
+        uint32_t keyframes;
+        uint32_t sync_losses;
+
+    private:
+        void parse_();
+        void text_(uint8_t byte);
+        void apply_(const ScanFrameHeader &header, const uint8_t *payload);
+        bool decode_(const ScanFrameHeader &header, const uint8_t *payload);
+        void skip_(uint16_t &beam, uint16_t end);
+        void complete_(const ScanFrameHeader &header);
+        void lose_sync_();
+
+        std::vector<uint8_t> buffer_;
+        std::string line_;
+        std::deque<std::string> lines_;
+        std::deque<LaserScanArrays> scans_;
+
+        // What the robot thinks we have, in steps of resolution_
+        uint16_t steps_[SCAN_STREAM_BEAMS];
+        uint8_t resolution_;
+        bool synced_;
+        bool keyframe_wanted_;
+
+        bool have_sequence_;
+        uint16_t next_sequence_;
+        uint8_t next_chunk_;
+        uint16_t next_beam_;
+        uint16_t base_;          // last beam with a return before next_beam_
+
+        // For scan_time, the last revolution completed
+        bool have_revolution_;
+        uint16_t last_revolution_;
+        uint32_t last_stamp_;
+        float scan_time_;
+};
+
+ScanDecoder::ScanDecoder()
+{
+    memset(steps_, 0, sizeof(steps_));
+    this->frames           = 0;
+    this->frame_bytes      = 0;
+    this->bad_frames       = 0;
+    this->lost_frames      = 0;
+    this->discarded        = 0;
+    this->revolutions      = 0;
+    this->keyframes        = 0;
+    this->sync_losses      = 0;
+    this->resolution_      = 0;
+    this->synced_          = false;
+    this->keyframe_wanted_ = true; // a host that has just started has nothing
+    this->have_sequence_   = false;
+    this->next_sequence_   = 0;
+    this->next_chunk_      = 0;
+    this->next_beam_       = 0;
+    this->base_            = 0;
+    this->have_revolution_ = false;
+    this->last_revolution_ = 0;
+    this->last_stamp_      = 0;
+    this->scan_time_       = 0.0f;
+}
+
+void ScanDecoder::feed(uint8_t byte)
+{
+    if (buffer_.empty() && byte != SCAN_FRAME_SYNC_0)
+    {
+        text_(byte);
+        return;
+    }
+
+    buffer_.push_back(byte);
+    parse_();
+}
+
+/**
+ * @return false if no revolution has been completed since the last call
+ */
+bool ScanDecoder::take_scan(LaserScanArrays &scan)
+{
+    if (scans_.empty())
+    {
+        return false;
+    }
+
+    scan = scans_.front();
+    scans_.pop_front();
+    return true;
+}
+
+/**
+ * @return false if no line of text has been completed since the last call
+ */
+bool ScanDecoder::take_line(std::string &line)
+{
+    if (lines_.empty())
+    {
+        return false;
+    }
+
+    line = lines_.front();
+    lines_.pop_front();
+    return true;
+}
+
+/**
+ * @brief True once each time the ranges are lost, send #F,2,0! so the next revolution is a keyframe
+ */
+bool ScanDecoder::needs_keyframe()
+{
+    bool wanted = keyframe_wanted_;
+    keyframe_wanted_ = false;
+    return wanted;
+}
+
+void ScanDecoder::print_stats(FILE *out)
+{
+    fprintf(out, "Decoder: frames=%u (%u bytes), bad=%u, lost=%u, discarded=%u, revolutions=%u, keyframes=%u, "
+                 "sync_losses=%u\n",
+            frames, frame_bytes, bad_frames, lost_frames, discarded, revolutions, keyframes, sync_losses);
+}
+
+/**
+ * @brief Takes every whole frame off the front of the buffer, and the bytes that aren't one as text
+ */
+void ScanDecoder::parse_()
+{
+    const size_t header_size = sizeof(ScanFrameHeader);
+
+    while (!buffer_.empty())
+    {
+        // Not the start of a frame. After a bad frame this looks for the next one from the byte after its sync
+        if (buffer_[0] != SCAN_FRAME_SYNC_0 || (buffer_.size() >= 2 && buffer_[1] != SCAN_FRAME_SYNC_1))
+        {
+            text_(buffer_[0]);
+            buffer_.erase(buffer_.begin());
+            continue;
+        }
+
+        if (buffer_.size() < header_size)
+        {
+            return;
+        }
+
+        ScanFrameHeader header;
+        memcpy(&header, &buffer_[0], header_size);
+
+        if (header.length > SCAN_STREAM_CHUNK_PAYLOAD)
+        {
+            bad_frames++;
+            buffer_.erase(buffer_.begin());
+            continue;
+        }
+
+        size_t length = header_size + header.length + 2;
+        if (buffer_.size() < length)
+        {
+            return;
+        }
+
+        uint16_t crc = buffer_[length - 2] | (uint16_t(buffer_[length - 1]) << 8);
+        if (crc != scan_stream_crc16(&buffer_[2], length - 4))
+        {
+            bad_frames++;
+            buffer_.erase(buffer_.begin());
+            continue;
+        }
+
+        frames++;
+        frame_bytes += length;
+        apply_(header, &buffer_[header_size]);
+        buffer_.erase(buffer_.begin(), buffer_.begin() + length);
+    }
+}
+
+void ScanDecoder::text_(uint8_t byte)
+{
+    if (byte == '\n')
+    {
+        lines_.push_back(line_);
+        line_.clear();
+    }
+    // Bytes of a frame that failed its CRC aren't text
+    else if (byte >= ' ' && byte < 0x7F && line_.size() < SCAN_DECODER_MAX_LINE)
+    {
+        line_.push_back(char(byte));
+    }
+}
+
+void ScanDecoder::apply_(const ScanFrameHeader &header, const uint8_t *payload)
+{
+    if (have_sequence_ && header.sequence != next_sequence_)
+    {
+        lost_frames += uint16_t(header.sequence - next_sequence_);
+        lose_sync_();
+    }
+    have_sequence_ = true;
+    next_sequence_ = header.sequence + 1;
+
+    // A keyframe starts over, whatever came before it
+    if ((header.flags & SCAN_FRAME_KEYFRAME) && header.chunk == 0)
+    {
+        synced_ = true;
+        resolution_ = header.resolution;
+        next_chunk_ = 0;
+        next_beam_ = 0;
+    }
+
+    if (!synced_)
+    {
+        discarded++;
+        return;
+    }
+
+    if (!decode_(header, payload))
+    {
+        bad_frames++;
+        lose_sync_();
+        return;
+    }
+
+    next_chunk_++;
+    next_beam_ = header.first_beam + header.num_beams;
+
+    if (header.flags & SCAN_FRAME_LAST)
+    {
+        if (next_beam_ != SCAN_STREAM_BEAMS)
+        {
+            bad_frames++;
+            lose_sync_();
+            return;
+        }
+
+        complete_(header);
+        next_chunk_ = 0;
+        next_beam_ = 0;
+    }
+}
+
+/**
+ * @brief Applies the payload to steps_
+ *
+ * @return false if the frame doesn't follow on from the last, or its payload doesn't fit its beams
+ */
+bool ScanDecoder::decode_(const ScanFrameHeader &header, const uint8_t *payload)
+{
+    if (header.chunk != next_chunk_ || header.first_beam != next_beam_ || header.resolution != resolution_ ||
+        header.first_beam + header.num_beams > SCAN_STREAM_BEAMS)
+    {
+        return false;
+    }
+
+    uint16_t beam = header.first_beam;
+    uint16_t end = header.first_beam + header.num_beams;
+    uint16_t position = 0;
+
+    if (header.chunk == 0)
+    {
+        base_ = 0;
+    }
+
+    while (position < header.length)
+    {
+        uint32_t skip, run;
+        uint8_t size = scan_stream_read_varint(payload + position, header.length - position, skip);
+        if (size == 0)
+        {
+            return false;
+        }
+        position += size;
+
+        size = scan_stream_read_varint(payload + position, header.length - position, run);
+        if (size == 0 || beam + skip + run > end)
+        {
+            return false;
+        }
+        position += size;
+        skip_(beam, beam + skip);
+
+        for (uint32_t i = 0; i < run; i++)
+        {
+            uint32_t symbol;
+            size = scan_stream_read_varint(payload + position, header.length - position, symbol);
+            if (size == 0)
+            {
+                return false;
+            }
+            position += size;
+
+            int32_t value = symbol ? base_ + scan_stream_unzigzag(symbol - 1) : 0;
+            if (value < 0 || value >= SCAN_STREAM_HOLD)
+            {
+                return false;
+            }
+            steps_[beam++] = value;
+            base_ = value ? value : base_;
+        }
+    }
+
+    skip_(beam, end);
+    return true;
+}
+
+/**
+ * @brief Beams the robot left as we have them, up to end
+ */
+void ScanDecoder::skip_(uint16_t &beam, uint16_t end)
+{
+    for (; beam < end; beam++)
+    {
+        base_ = steps_[beam] ? steps_[beam] : base_;
+    }
+}
+
+void ScanDecoder::complete_(const ScanFrameHeader &header)
+{
+    revolutions++;
+    keyframes += (header.flags & SCAN_FRAME_KEYFRAME) ? 1 : 0;
+
+    // Revolutions the robot dropped still count, so the time between two sent ones may be several
+    uint16_t elapsed = header.revolution - last_revolution_;
+    if (have_revolution_ && elapsed > 0 && header.stamp > last_stamp_)
+    {
+        scan_time_ = (header.stamp - last_stamp_) * 1e-3f / elapsed;
+    }
+    have_revolution_ = true;
+    last_revolution_ = header.revolution;
+    last_stamp_ = header.stamp;
+
+    LaserScanArrays scan;
+    scan.revolution      = header.revolution;
+    scan.stamp           = header.stamp;
+    scan.keyframe        = (header.flags & SCAN_FRAME_KEYFRAME) != 0;
+    scan.angle_increment = -2.0f * float(M_PI) / SCAN_STREAM_BEAMS;
+    scan.angle_min       = 0.0f;
+    scan.angle_max       = scan.angle_increment * (SCAN_STREAM_BEAMS - 1);
+    scan.scan_time       = scan_time_;
+    scan.time_increment  = scan_time_ / SCAN_STREAM_BEAMS;
+    scan.range_min       = SCAN_STREAM_MIN_RANGE * 1e-3f;
+    scan.range_max       = SCAN_STREAM_MAX_RANGE * 1e-3f;
+
+    scan.ranges.resize(SCAN_STREAM_BEAMS);
+    for (uint16_t i = 0; i < SCAN_STREAM_BEAMS; i++)
+    {
+        scan.ranges[i] = (steps_[i] == 0) ? INFINITY : steps_[i] * resolution_ * 1e-3f;
+    }
+
+    scans_.push_back(scan);
+}
+
+void ScanDecoder::lose_sync_()
+{
+    if (synced_)
+    {
+        synced_ = false;
+        keyframe_wanted_ = true;
+        sync_losses++;
+    }
+}
+
+#endif
@@ -0,0 +1,952 @@
+/*
+Serial command latency benchmark
+
+Measures how long a velocity command from ROS takes to reach the motors: from a "#V,<linear>,<angular>!" frame
+being written to the serial port, to the Sabertooth bytes acting on it leaving the ESP32.
+
+The firmware's own command path runs on the PC against a pseudo-terminal. SerialCommand (serial_command.h) is
+read once per control cycle, as main_task_func() does, and each message goes through SerialDispatch
+(serial_dispatch.h) as on the robot. Velocity commands go through the CommandMux, SetpointGenerator and both
+MotorVelocityControllers as in AlexbotController::update(), then the loop sleeps for the control period. A ROS stand-in thread writes frames into the other end of the terminal, on a script of rates and
+bursts. In between is a model of the ESP32's UART: bytes come off the wire no faster than the baud rate, into a
+receive buffer as deep as the Arduino core's. Bytes that arrive when it is full are lost, as on the robot.
+
+For each frame it records when it was sent, when its last byte was received, when SerialCommand returned it, and
+when the motor bytes acting on it were out (the end of that cycle's update, plus two bytes at the Sabertooth's
+baud rate). The frames and their send times are fixed by the script and the seed, so runs can be compared
+directly before and after a change to the protocol or the loop. Anything else running on the PC adds noise, run it
+on an idle machine. Not modelled: the time the firmware spends printing debug output, and the other core.
+
+With -S <lead ms> the frames are scheduled instead (see command_schedule.h): the ROS stand-in pings the clock sync
+(clock_sync.h) every BENCH_PING_INTERVAL, starting BENCH_SYNC_WARMUP before the first frame, and sends each frame as
+"#Q,<its send time + lead on the host's clock>,0!" and the "#V" straight after. The robot's replies come back over
+the terminal (their time on the wire isn't modelled). Each frame should then reach the motors at its target time,
+and the report adds how far from it they were (motor - target) and how far out the robot's estimate of the host's
+clock ended up. --drift runs the host's clock fast by that many ppm.
+
+Output: one CSV line per frame on stdout (latencies in ms from the send, empty if the frame never got that far),
+and the latency percentiles, drop rate and throughput on stderr. --sweep runs one rate after another, doubling
+until more than BENCH_SWEEP_DROP of the frames are lost, which gives the throughput ceiling.
+
+Build (from the repository root):
+    g++ -std=gnu++11 -O2 -pthread -I tools/host -I . tools/serial_latency/serial_latency.cpp -o serial_latency
+
+Usage:
+    serial_latency                        10 Hz for 10 s
+    serial_latency -P 20:5 -P 50x4:5      20 Hz for 5 s, then 50 bursts of 4 back to back frames a second for 5 s
+    serial_latency -j 5 -s 3              each send up to 5 ms late (random, from seed 3)
+    serial_latency -c 20 -b 921600        20 ms control period, 921600 baud
+    serial_latency --sweep 5              1, 2, 4 ... Hz, 5 s each
+    serial_latency -P 0.5:20 -S 3000      a frame every 2 s for 20 s, each to run 3 s after it was sent
+*/
+
+#include "Arduino.h"
+#include <SabertoothSimplified.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <deque>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "serial_command.h"
+#include "encoder_driver.h"
+#include "teleop_controller.h"
+#include "setpoint_generator.h"
+#include "motor_velocity_controller.h"
+#include "command_mux.h"
+#include "serial_dispatch.h"
+#include "alexbot_hardware.h"
+
+// SERIAL_COMMAND_STATE control period (power_profiles[] in power_manager.h)
+#define BENCH_CONTROL_PERIOD 50 // ms
+
+// The serial port, as SerialCommand opens it, and the Arduino ESP32 core's default receive buffer
+#define BENCH_BAUD      115200
+#define BENCH_RX_BUFFER 256 // bytes
+
+// SabertoothSimplified's default baud rate (MotorSerial), it is sent one byte per motor
+#define BENCH_SABERTOOTH_BAUD  9600
+#define BENCH_SABERTOOTH_BYTES 2
+
+#define BENCH_DEFAULT_RATE 10.0 // Hz
+#define BENCH_DEFAULT_TIME 10.0 // s
+
+// Frames still on their way this long after the last one was sent are counted as lost
+#define BENCH_DRAIN_TIME 2.0 // s
+
+#define BENCH_SWEEP_MAX_RATE 1024.0 // Hz
+#define BENCH_SWEEP_DROP     0.01   // fraction of frames lost at which the firmware can no longer keep up
+
+// The frame number is sent in the angular velocity, modulo this
+#define BENCH_SEQUENCE_MODULO 10000
+
+// Scheduled frames (-S)
+#define BENCH_PING_INTERVAL 5.0    // s between clock sync pings
+#define BENCH_SYNC_WARMUP   30.0   // s of pings before the first frame, enough for CLOCK_SYNC_MIN_SAMPLES
+#define BENCH_HOST_EPOCH    1000.0 // s, the host's clock at the start of the run
+#define BENCH_ROBOT_EPOCH   10.0   // s, millis() at the start of the run, as if the robot had booted a while ago
+
+/**
+ * @brief Seconds on the host's monotonic clock, shared by the ROS stand-in and the firmware
+ */
+double host_seconds()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+void sleep_until(double deadline)
+{
+    double wait = deadline - host_seconds();
+    if (wait > 0.0)
+    {
+        usleep(useconds_t(wait * 1e6));
+    }
+}
+
+/******************* SCRIPT **********************/
+
+struct Phase
+{
+    double rate;    // Hz, bursts per second
+    unsigned burst; // frames back to back in each burst
+    double seconds;
+};
+
+struct Frame
+{
+    double send_at; // s from the start of the run
+    uint8_t phase;
+};
+
+/**
+ * @brief Every frame the ROS stand-in sends, in order
+ *
+ * @param jitter s, each burst is sent up to this much late
+ */
+std::vector<Frame> make_schedule(const std::vector<Phase> &phases, double jitter, uint32_t seed)
+{
+    std::mt19937 engine(seed);
+    std::uniform_real_distribution<double> delay(0.0, jitter);
+    std::vector<Frame> frames;
+    double phase_start = 0.0;
+    double last = 0.0;
+
+    for (size_t p = 0; p < phases.size(); p++)
+    {
+        unsigned bursts = unsigned(phases[p].rate * phases[p].seconds);
+
+        for (unsigned b = 0; b < bursts; b++)
+        {
+            // A serial port can't reorder, a late burst delays the ones behind it
+            double at = max(phase_start + b / phases[p].rate + delay(engine), last);
+            last = at;
+
+            for (unsigned i = 0; i < phases[p].burst; i++)
+            {
+                Frame frame;
+                frame.send_at = at;
+                frame.phase = uint8_t(p);
+                frames.push_back(frame);
+            }
+        }
+
+        phase_start += phases[p].seconds;
+    }
+
+    return frames;
+}
+
+// The linear velocity cycles through a few values, so a frame spliced from two others is unlikely to pass for one
+double frame_linear(size_t seq)
+{
+    return 0.10 + 0.01 * (seq % 7);
+}
+
+double frame_angular(size_t seq)
+{
+    return double(seq % BENCH_SEQUENCE_MODULO) / BENCH_SEQUENCE_MODULO;
+}
+
+/******************* UART **********************/
+
+/**
+ * @brief The ESP32's receive side of the serial port: the wire (at the baud rate) and the receive buffer
+ * Serial.available() and Serial.read() come here (host_serial_input).
+ */
+class UartModel : public HostSerialInput
+{
+    public:
+        UartModel(int fd, double baud, size_t rx_buffer)
+            : fd_(fd), byte_time_(10.0 / baud), rx_buffer_(rx_buffer), last_off_wire_(0.0), frame_type_(0),
+              overflows_(0) {}
+
+        /**
+         * @brief Takes what the PC has written, and moves what has come off the wire by now into the buffer
+         */
+        void pump(double now)
+        {
+            uint8_t bytes[256];
+            ssize_t count;
+            while ((count = ::read(fd_, bytes, sizeof(bytes))) > 0)
+            {
+                for (ssize_t i = 0; i < count; i++)
+                {
+                    last_off_wire_ = max(now, last_off_wire_) + byte_time_;
+                    wire_.push_back(std::make_pair(last_off_wire_, bytes[i]));
+                }
+            }
+
+            while (!wire_.empty() && wire_.front().first <= now)
+            {
+                // Every frame ends in the only MESSAGE_END, so this is when the k'th velocity frame was received
+                uint8_t byte = wire_.front().second;
+                if (byte == MESSAGE_END && frame_type_ == 'V')
+                {
+                    frame_ends_.push_back(wire_.front().first);
+                }
+                frame_type_ = (byte == MESSAGE_START) ? MESSAGE_START : (frame_type_ == MESSAGE_START) ? byte : frame_type_;
+
+                if (rx_.size() < rx_buffer_)
+                {
+                    rx_.push_back(wire_.front().second);
+                }
+                else
+                {
+                    overflows_++;
+                }
+                wire_.pop_front();
+            }
+        }
+
+        /**
+         * @brief Waits up to timeout for the PC to write something
+         */
+        void wait(double timeout)
+        {
+            pollfd pfd;
+            pfd.fd = fd_;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            poll(&pfd, 1, max(0, int(timeout * 1000.0)));
+        }
+
+        int available()
+        {
+            pump(host_seconds());
+            return int(rx_.size());
+        }
+
+        int read()
+        {
+            if (rx_.empty())
+            {
+                return -1;
+            }
+
+            int byte = rx_.front();
+            rx_.pop_front();
+            return byte;
+        }
+
+        const std::vector<double> &get_frame_ends() { return frame_ends_; }
+        uint32_t get_overflows() { return overflows_; }
+        size_t get_backlog() { return wire_.size() + rx_.size(); }
+
+    private:
+        int fd_;
+        double byte_time_; // s, a start bit, 8 data bits and a stop bit
+        size_t rx_buffer_;
+        double last_off_wire_;
+        uint8_t frame_type_; // of the frame coming off the wire, MESSAGE_START until its type is in
+        std::deque<std::pair<double, uint8_t> > wire_; // when each byte will have been received
+        std::deque<uint8_t> rx_;
+        std::vector<double> frame_ends_;
+        uint32_t overflows_;
+};
+
+/******************* BENCHMARK **********************/
+
+struct BenchOptions
+{
+    double control_period; // s
+    double baud;
+    size_t rx_buffer;
+    double jitter;         // s
+    uint32_t seed;
+    double lead;           // s, frames are scheduled to run this long after they are sent (0 to run them straight away)
+    double drift;          // how much faster the host's clock runs, e.g. 100e-6
+};
+
+struct RunResult
+{
+    std::vector<Frame> frames;
+    std::vector<double> sent;     // s from the start of the run, NAN if not (yet)
+    std::vector<double> received;
+    std::vector<double> parsed;
+    std::vector<double> motor;
+    std::vector<double> target;   // when a scheduled frame was meant to reach the motors
+    uint32_t garbled;             // frames SerialCommand returned that were never sent
+    uint32_t overflows;           // bytes lost to a full receive buffer
+    size_t backlog;               // bytes still on their way at the end
+    uint32_t cycles;
+    double duration;              // s, first send to the end of the run
+    bool synced;                  // the clock sync had an estimate at the end
+    double offset_error;          // ms, estimated - true offset at the end
+    double drift_estimate;        // ppm
+    double true_drift;            // ppm, robot - host
+};
+
+/**
+ * @brief The firmware's velocity command path, wired as main_task_func() and AlexbotController wire it
+ */
+class BenchRobot
+{
+    public:
+        /**
+         * @param reply_fd where the robot's serial output goes, for the clock sync replies
+         */
+        BenchRobot(int reply_fd)
+            : reply_fd_(reply_fd), ran_(NULL), dispatch_(this),
+              left_encoder_(LEFT_MOTOR_ID, LEFT_ENCODER_CS_PIN, 1.0, 1.0),
+              right_encoder_(RIGHT_MOTOR_ID, RIGHT_ENCODER_CS_PIN, 1.0, 1.0),
+              left_motor_("Left motor", &sabertooth_, LEFT_MOTOR_ID, &left_encoder_, DRIVE_MOTORS_MAX_POWER),
+              right_motor_("Right motor", &sabertooth_, RIGHT_MOTOR_ID, &right_encoder_, DRIVE_MOTORS_MAX_POWER) {}
+
+        /**
+         * @brief The serial part of one control cycle, each message goes through the firmware's SerialDispatch
+         *
+         * @return true if SerialCommand returned a velocity command (run now or scheduled), in linear and angular
+         */
+        bool read_command(double &linear, double &angular)
+        {
+            sc_.ReadData();
+            if (sc_.message_type == NO_MESSAGE)
+            {
+                return false;
+            }
+
+            bool velocity = (sc_.message_type == 'V');
+            linear = sc_.message_data1;
+            angular = sc_.message_data2;
+
+            dispatch_.dispatch(sc_.message_type, sc_.message_data1, sc_.message_data2, sc_.message_start);
+
+            // What ClockSync::ping() printed, the host's Serial throws it away. millis() doesn't move within a cycle here
+            if (sc_.message_type == 'C' && sc_.message_data1 > 0)
+            {
+                char reply[64];
+                int length = snprintf(reply, sizeof(reply), "CLOCK_SYNC,%.0f,%lu,%lu\n", sc_.message_data1,
+                                      sc_.message_start, millis());
+                for (int written = 0; written < length;)
+                {
+                    ssize_t count = write(reply_fd_, reply + written, length - written);
+                    written += (count > 0) ? int(count) : 0;
+                }
+            }
+
+            sc_.reset();
+            return velocity;
+        }
+
+        /**
+         * @brief AlexbotController::update() in SERIAL_COMMAND_STATE
+         *
+         * @param ran the angular velocity of each scheduled command run this cycle
+         */
+        void update(std::vector<double> &ran)
+        {
+            ran_ = &ran;
+            dispatch_.run_schedule();
+            ran_ = NULL;
+
+            MuxSelection selection = mux_.select(millis(), MUX_SOURCE_BIT(MUX_SOURCE_SERIAL));
+            setpoint_generator_.set_command(selection.velocity);
+
+            WheelTargets targets = setpoint_generator_.update(micros());
+            left_motor_.SetTargetVelocity(targets.left);
+            right_motor_.SetTargetVelocity(targets.right);
+        }
+
+        // What SerialDispatch drives, as AlexbotController's
+        void process_velocity_command(double linear, double angular)
+        {
+            Velocity velocity;
+            velocity.linear = linear;
+            velocity.angular = angular;
+            mux_.publish(MUX_SOURCE_SERIAL, velocity, millis());
+
+            if (ran_)
+            {
+                ran_->push_back(angular);
+            }
+        }
+
+        // The bench only sends #V
+        void process_motion_command(int message_type, double data1, double data2) {}
+        void keep_link_alive() {}
+
+    private:
+        int reply_fd_;
+        std::vector<double> *ran_;
+        SerialDispatch<BenchRobot> dispatch_;
+
+        SerialCommand sc_;
+        SabertoothSimplified sabertooth_;
+        WheelEncoderLS7366 left_encoder_;
+        WheelEncoderLS7366 right_encoder_;
+        MotorVelocityController left_motor_;
+        MotorVelocityController right_motor_;
+        SetpointGenerator setpoint_generator_;
+        CommandMux mux_;
+};
+
+struct RosStandIn
+{
+    int fd;
+    const std::vector<Frame> *frames;
+    double start;
+    std::vector<double> *sent;
+    double lead;  // s, 0 to send the frames to run straight away (and no pings)
+    double drift;
+
+    /**
+     * @brief The host's clock, whole ms
+     */
+    double host_ms(double now) const
+    {
+        return floor(((now - start) * (1.0 + drift) + BENCH_HOST_EPOCH) * 1000.0);
+    }
+};
+
+void write_all(int fd, const char *text, int length)
+{
+    for (int written = 0; written < length;)
+    {
+        ssize_t count = write(fd, text + written, length - written);
+        written += (count > 0) ? int(count) : 0;
+    }
+}
+
+/**
+ * @brief Reads the robot's output until deadline
+ *
+ * @param last_reply the host's time the last clock sync reply arrived
+ */
+void read_replies(const RosStandIn &ros, double deadline, std::string &line, double &last_reply)
+{
+    for (double now = host_seconds(); now < deadline; now = host_seconds())
+    {
+        pollfd pfd;
+        pfd.fd = ros.fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, max(1, int((deadline - now) * 1000.0))) <= 0)
+        {
+            continue;
+        }
+
+        char bytes[256];
+        ssize_t count = ::read(ros.fd, bytes, sizeof(bytes));
+        double arrived = ros.host_ms(host_seconds());
+
+        for (ssize_t i = 0; i < count; i++)
+        {
+            if (bytes[i] != '\n')
+            {
+                line += bytes[i];
+                continue;
+            }
+
+            if (line.compare(0, 11, "CLOCK_SYNC,") == 0)
+            {
+                last_reply = arrived;
+            }
+            line.clear();
+        }
+    }
+}
+
+/**
+ * @brief The ROS end of the terminal, writes each frame at its time, and pings the clock sync if they are scheduled
+ */
+void ros_stand_in(const RosStandIn *ros)
+{
+    const std::vector<Frame> &frames = *ros->frames;
+    double next_ping = ros->start;
+    double last_reply = 0.0;
+    std::string line;
+
+    for (size_t i = 0; i < frames.size();)
+    {
+        double frame_at = ros->start + frames[i].send_at;
+        bool ping = (ros->lead > 0.0 && next_ping < frame_at);
+
+        read_replies(*ros, ping ? next_ping : frame_at, line, last_reply);
+
+        // A ping never goes between a #Q and its #V
+        if (ping)
+        {
+            char message[MAX_CHARS + 2];
+            int length = snprintf(message, sizeof(message), "#C,%.0f,%.0f!", ros->host_ms(host_seconds()), last_reply);
+            write_all(ros->fd, message, length);
+
+            last_reply = 0.0;
+            next_ping += BENCH_PING_INTERVAL;
+            continue;
+        }
+
+        char frame[2 * (MAX_CHARS + 2)];
+        int length = 0;
+        if (ros->lead > 0.0)
+        {
+            length = snprintf(frame, sizeof(frame), "#Q,%.0f,0!", ros->host_ms(frame_at) + ros->lead * 1000.0);
+        }
+        length += snprintf(frame + length, sizeof(frame) - length, "#V,%.2f,%.4f!", frame_linear(i), frame_angular(i));
+
+        (*ros->sent)[i] = host_seconds() - ros->start;
+        write_all(ros->fd, frame, length);
+        i++;
+    }
+}
+
+/**
+ * @brief Opens a pseudo-terminal, raw in both directions
+ *
+ * @return false if there are no pseudo-terminals
+ */
+bool open_pty(int &master, int &slave)
+{
+    master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0)
+    {
+        return false;
+    }
+
+    slave = open(ptsname(master), O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (slave < 0)
+    {
+        return false;
+    }
+
+    termios raw;
+    tcgetattr(slave, &raw);
+    cfmakeraw(&raw);
+    tcsetattr(slave, TCSANOW, &raw);
+    return true;
+}
+
+bool run_benchmark(const std::vector<Phase> &phases, const BenchOptions &options, RunResult &result)
+{
+    int master, slave;
+    if (!open_pty(master, slave))
+    {
+        perror("Pseudo-terminal");
+        return false;
+    }
+
+    result.frames = make_schedule(phases, options.jitter, options.seed);
+    size_t count = result.frames.size();
+    result.sent.assign(count, NAN);
+    result.received.assign(count, NAN);
+    result.parsed.assign(count, NAN);
+    result.motor.assign(count, NAN);
+    result.target.assign(count, NAN);
+    result.garbled = 0;
+    result.cycles = 0;
+
+    // Scheduled frames wait for the clock sync to settle, then each is meant for its send time + lead on the host's clock
+    bool scheduled = (options.lead > 0.0);
+    for (size_t i = 0; i < count && scheduled; i++)
+    {
+        result.frames[i].send_at += BENCH_SYNC_WARMUP;
+        result.target[i] = result.frames[i].send_at + options.lead / (1.0 + options.drift);
+    }
+
+    UartModel uart(slave, options.baud, options.rx_buffer);
+    host_serial_input = &uart;
+    clock_sync = ClockSync();
+    BenchRobot robot(slave);
+
+    // Give the robot a moment to start, as the ESP32 would have been running a while
+    double start = host_seconds() + 0.1;
+    double end = start + (count ? result.frames.back().send_at : 0.0) + (scheduled ? options.lead : 0.0) +
+                 BENCH_DRAIN_TIME;
+
+    RosStandIn ros_options;
+    ros_options.fd = master;
+    ros_options.frames = &result.frames;
+    ros_options.start = start;
+    ros_options.sent = &result.sent;
+    ros_options.lead = options.lead;
+    ros_options.drift = options.drift;
+    std::thread ros(ros_stand_in, &ros_options);
+
+    size_t next_seq = 0;
+    size_t parsed = 0;
+    size_t run = 0;
+    std::vector<size_t> acted_on;
+    std::map<long, size_t> waiting; // scheduled frames by sequence number modulo, not run yet
+
+    while (host_seconds() < end && (scheduled ? run : parsed) < count)
+    {
+        double now = host_seconds();
+        host_set_time((unsigned long)((now - start + BENCH_ROBOT_EPOCH) * 1e6));
+        uart.pump(now);
+
+        double linear, angular;
+        if (robot.read_command(linear, angular))
+        {
+            // Which frame was it? Normally the next one, unless some were lost
+            size_t seq = next_seq;
+            long modulo = lround(angular * BENCH_SEQUENCE_MODULO);
+            while (seq < count && seq < next_seq + BENCH_SEQUENCE_MODULO &&
+                   !(long(seq % BENCH_SEQUENCE_MODULO) == modulo && fabs(frame_linear(seq) - linear) < 0.005))
+            {
+                seq++;
+            }
+
+            if (seq < count && seq < next_seq + BENCH_SEQUENCE_MODULO)
+            {
+                result.parsed[seq] = host_seconds() - start;
+                if (scheduled)
+                {
+                    waiting[modulo] = seq;
+                }
+                else
+                {
+                    acted_on.push_back(seq);
+                }
+                next_seq = seq + 1;
+                parsed++;
+            }
+            else
+            {
+                result.garbled++;
+            }
+        }
+
+        std::vector<double> ran;
+        robot.update(ran);
+
+        for (size_t i = 0; i < ran.size(); i++)
+        {
+            std::map<long, size_t>::iterator frame = waiting.find(lround(ran[i] * BENCH_SEQUENCE_MODULO));
+            if (frame != waiting.end())
+            {
+                acted_on.push_back(frame->second);
+                waiting.erase(frame);
+                run++;
+            }
+        }
+
+        double motor = host_seconds() - start + BENCH_SABERTOOTH_BYTES * 10.0 / BENCH_SABERTOOTH_BAUD;
+        for (size_t i = 0; i < acted_on.size(); i++)
+        {
+            result.motor[acted_on[i]] = motor;
+        }
+        acted_on.clear();
+        result.cycles++;
+
+        // delay(control_period), the UART keeps receiving
+        double wake = host_seconds() + options.control_period;
+        while (host_seconds() < wake)
+        {
+            uart.wait(wake - host_seconds());
+            uart.pump(host_seconds());
+        }
+    }
+
+    ros.join();
+    uart.pump(host_seconds());
+
+    const std::vector<double> &frame_ends = uart.get_frame_ends();
+    for (size_t i = 0; i < frame_ends.size() && i < count; i++)
+    {
+        result.received[i] = frame_ends[i] - start;
+    }
+
+    result.overflows = uart.get_overflows();
+    result.backlog = uart.get_backlog();
+    result.duration = host_seconds() - start;
+
+    // Both clocks are known here, robot - host
+    double now = host_seconds();
+    double true_offset = ((now - start + BENCH_ROBOT_EPOCH) - ((now - start) * (1.0 + options.drift) + BENCH_HOST_EPOCH)) * 1000.0;
+    result.synced = clock_sync.is_synced(millis());
+    result.offset_error = clock_sync.get_offset(millis()) - true_offset;
+    result.drift_estimate = clock_sync.get_drift() * 1e6;
+    result.true_drift = -options.drift / (1.0 + options.drift) * 1e6;
+
+    host_serial_input = NULL;
+    close(slave);
+    close(master);
+    return true;
+}
+
+/******************* REPORT **********************/
+
+/**
+ * @return ms from the send to each of the times that exists
+ */
+std::vector<double> latencies(const std::vector<double> &sent, const std::vector<double> &times)
+{
+    std::vector<double> values;
+    for (size_t i = 0; i < times.size(); i++)
+    {
+        if (!std::isnan(times[i]) && !std::isnan(sent[i]))
+        {
+            values.push_back(1000.0 * (times[i] - sent[i]));
+        }
+    }
+
+    std::sort(values.begin(), values.end());
+    return values;
+}
+
+// Nearest rank, of sorted values
+double percentile(const std::vector<double> &values, double fraction)
+{
+    if (values.empty())
+    {
+        return NAN;
+    }
+
+    size_t rank = size_t(ceil(fraction * values.size()));
+    return values[min(max(rank, size_t(1)), values.size()) - 1];
+}
+
+void print_frames(const std::vector<Phase> &phases, const RunResult &r)
+{
+    for (size_t i = 0; i < r.frames.size(); i++)
+    {
+        const Phase &phase = phases[r.frames[i].phase];
+        printf("%.1f,%u,%zu,%.6f", phase.rate, phase.burst, i, r.sent[i]);
+
+        const std::vector<double> *times[] = {&r.received, &r.parsed, &r.motor, &r.target};
+        for (size_t t = 0; t < 4; t++)
+        {
+            if (std::isnan((*times[t])[i]) || std::isnan(r.sent[i]))
+            {
+                printf(",");
+            }
+            else
+            {
+                printf(",%.3f", 1000.0 * ((*times[t])[i] - r.sent[i]));
+            }
+        }
+        printf("\n");
+    }
+}
+
+size_t count_parsed(const RunResult &r)
+{
+    size_t parsed = 0;
+    for (size_t i = 0; i < r.parsed.size(); i++)
+    {
+        parsed += std::isnan(r.parsed[i]) ? 0 : 1;
+    }
+    return parsed;
+}
+
+/**
+ * @return frames/s parsed, from the first send to the last frame parsed
+ */
+double throughput(const RunResult &r)
+{
+    double last = NAN;
+    for (size_t i = 0; i < r.parsed.size(); i++)
+    {
+        last = std::isnan(r.parsed[i]) ? last : r.parsed[i];
+    }
+
+    return (std::isnan(last) || r.sent.empty() || last <= r.sent[0]) ? 0.0 : count_parsed(r) / (last - r.sent[0]);
+}
+
+void print_summary(const RunResult &r)
+{
+    size_t sent = r.frames.size();
+    size_t parsed = count_parsed(r);
+
+    fprintf(stderr, "%-10s %8s %8s %8s %8s %8s\n", "latency_ms", "p50", "p90", "p99", "max", "frames");
+
+    const char *names[] = {"received", "parsed", "motor"};
+    const std::vector<double> *times[] = {&r.received, &r.parsed, &r.motor};
+    for (size_t t = 0; t < 3; t++)
+    {
+        std::vector<double> values = latencies(r.sent, *times[t]);
+        fprintf(stderr, "%-10s %8.2f %8.2f %8.2f %8.2f %8zu\n", names[t], percentile(values, 0.5),
+                percentile(values, 0.9), percentile(values, 0.99), values.empty() ? NAN : values.back(), values.size());
+    }
+
+    fprintf(stderr, "sent %zu, parsed %zu, lost %.1f%%, garbled %u, receive buffer overflows %u bytes, "
+                    "%zu bytes still queued\n", sent, parsed, sent ? 100.0 * (sent - parsed) / sent : 0.0,
+            r.garbled, r.overflows, r.backlog);
+    fprintf(stderr, "throughput %.2f frames/s parsed, %u control cycles in %.1f s\n", throughput(r), r.cycles, r.duration);
+
+    // Scheduled frames, how far from their target they reached the motors
+    std::vector<double> errors;
+    for (size_t i = 0; i < r.target.size(); i++)
+    {
+        if (!std::isnan(r.target[i]) && !std::isnan(r.motor[i]))
+        {
+            errors.push_back(1000.0 * (r.motor[i] - r.target[i]));
+        }
+    }
+
+    if (errors.empty())
+    {
+        return;
+    }
+
+    std::sort(errors.begin(), errors.end());
+    fprintf(stderr, "%-10s %8s %8s %8s %8s %8s %8s\n", "error_ms", "min", "p50", "p90", "p99", "max", "frames");
+    fprintf(stderr, "%-10s %8.2f %8.2f %8.2f %8.2f %8.2f %8zu\n", "motor", errors.front(), percentile(errors, 0.5),
+            percentile(errors, 0.9), percentile(errors, 0.99), errors.back(), errors.size());
+    fprintf(stderr, "clock sync %s, offset error %.2f ms, drift %.1f ppm (true %.1f)\n",
+            r.synced ? "synced" : "NOT synced", r.offset_error, r.drift_estimate, r.true_drift);
+}
+
+bool parse_phase(const char *text, Phase &phase)
+{
+    phase.burst = 1;
+    if (sscanf(text, "%lfx%u:%lf", &phase.rate, &phase.burst, &phase.seconds) == 3 ||
+        sscanf(text, "%lf:%lf", &phase.rate, &phase.seconds) == 2)
+    {
+        return phase.rate > 0.0 && phase.burst > 0 && phase.seconds > 0.0;
+    }
+    return false;
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<Phase> phases;
+    double sweep = 0.0;
+
+    BenchOptions options;
+    options.control_period = BENCH_CONTROL_PERIOD * 1e-3;
+    options.baud = BENCH_BAUD;
+    options.rx_buffer = BENCH_RX_BUFFER;
+    options.jitter = 0.0;
+    options.seed = 1;
+    options.lead = 0.0;
+    options.drift = 0.0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        bool has_value = (i + 1 < argc);
+        Phase phase;
+
+        if (strcmp(argv[i], "-P") == 0 && has_value && parse_phase(argv[i + 1], phase))
+        {
+            phases.push_back(phase);
+            i++;
+        }
+        else if (strcmp(argv[i], "-c") == 0 && has_value)
+        {
+            options.control_period = atof(argv[++i]) * 1e-3;
+        }
+        else if (strcmp(argv[i], "-b") == 0 && has_value)
+        {
+            options.baud = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--rx-buffer") == 0 && has_value)
+        {
+            options.rx_buffer = strtoul(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "-j") == 0 && has_value)
+        {
+            options.jitter = atof(argv[++i]) * 1e-3;
+        }
+        else if (strcmp(argv[i], "-s") == 0 && has_value)
+        {
+            options.seed = strtoul(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "-S") == 0 && has_value)
+        {
+            options.lead = atof(argv[++i]) * 1e-3;
+        }
+        else if (strcmp(argv[i], "--drift") == 0 && has_value)
+        {
+            options.drift = atof(argv[++i]) * 1e-6;
+        }
+        else if (strcmp(argv[i], "--sweep") == 0 && has_value)
+        {
+            sweep = atof(argv[++i]);
+        }
+        else
+        {
+            fprintf(stderr, "Usage: %s [-P rate[xburst]:seconds]... [-c control_period_ms] [-b baud] "
+                            "[--rx-buffer bytes] [-j jitter_ms] [-s seed] [-S lead_ms] [--drift ppm] "
+                            "[--sweep seconds_per_rate]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    printf("rate,burst,seq,sent_s,received_ms,parsed_ms,motor_ms,target_ms\n");
+
+    if (sweep <= 0.0)
+    {
+        if (phases.empty())
+        {
+            Phase phase = {BENCH_DEFAULT_RATE, 1, BENCH_DEFAULT_TIME};
+            phases.push_back(phase);
+        }
+
+        RunResult result;
+        if (!run_benchmark(phases, options, result))
+        {
+            return 1;
+        }
+
+        print_frames(phases, result);
+        print_summary(result);
+        return 0;
+    }
+
+    // Sweep: double the rate until the firmware can't keep up
+    fprintf(stderr, "%8s %6s %6s %7s %12s %12s %12s\n", "rate_hz", "sent", "parsed", "lost", "frames_per_s",
+            "motor_p50_ms", "motor_p99_ms");
+
+    double ceiling = 0.0;
+    for (double rate = 1.0; rate <= BENCH_SWEEP_MAX_RATE; rate *= 2.0)
+    {
+        std::vector<Phase> one_rate(1);
+        one_rate[0].rate = rate;
+        one_rate[0].burst = 1;
+        one_rate[0].seconds = sweep;
+
+        RunResult result;
+        if (!run_benchmark(one_rate, options, result))
+        {
+            return 1;
+        }
+        print_frames(one_rate, result);
+
+        size_t sent = result.frames.size();
+        size_t parsed = count_parsed(result);
+        double lost = sent ? double(sent - parsed) / sent : 0.0;
+        std::vector<double> motor = latencies(result.sent, result.motor);
+
+        fprintf(stderr, "%8.0f %6zu %6zu %6.1f%% %12.2f %12.2f %12.2f\n", rate, sent, parsed, 100.0 * lost,
+                throughput(result), percentile(motor, 0.5), percentile(motor, 0.99));
+
+        if (lost > BENCH_SWEEP_DROP)
+        {
+            break;
+        }
+        ceiling = rate;
+    }
+
+    fprintf(stderr, "ceiling: %.0f frames/s with under %.0f%% lost\n", ceiling, 100.0 * BENCH_SWEEP_DROP);
+    return 0;
+}
@@ -0,0 +1,177 @@
+#ifndef PARALLEL_RUNNER_H
+#define PARALLEL_RUNNER_H
+
+#include <poll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <type_traits>
+#include <vector>
+
+/*
+Runs independent jobs across the host's cores, one forked worker process per core.
+
+The firmware headers and the host seam are full of globals (one robot per process), so workers are
+processes rather than threads: each one gets its own copy of everything at the fork. Worker w runs
+jobs w, w + num_workers, ... and sends each result back over a pipe. Results must be plain data.
+*/
+
+/**
+ * @brief Number of workers to use by default, one per online core
+ */
+inline unsigned parallel_default_workers()
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? unsigned(cores) : 1;
+}
+
+/**
+ * @brief Runs job(i) for i in [0, num_jobs), in parallel
+ *
+ * @param done set for each job whose result came back (a worker that crashes loses the rest of its jobs)
+ * @return the results, in job order
+ */
+template <typename Result, typename Job>
+std::vector<Result> run_parallel(size_t num_jobs, unsigned num_workers, Job job, std::vector<bool> &done)
+{
+    static_assert(std::is_trivially_copyable<Result>::value, "results are sent between processes as bytes");
+
+    struct Message
+    {
+        size_t index;
+        Result result;
+    };
+
+    std::vector<Result> results(num_jobs);
+    done.assign(num_jobs, false);
+
+    num_workers = max(1u, min(num_workers, unsigned(num_jobs)));
+    if (num_jobs == 0)
+    {
+        return results;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+
+    std::vector<pid_t> pids;
+    std::vector<pollfd> fds;
+
+    for (unsigned w = 0; w < num_workers; w++)
+    {
+        int pipe_fds[2];
+        if (pipe(pipe_fds) != 0)
+        {
+            perror("pipe");
+            break;
+        }
+
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            perror("fork");
+            close(pipe_fds[0]);
+            close(pipe_fds[1]);
+            break;
+        }
+
+        if (pid == 0)
+        {
+            // Worker
+            close(pipe_fds[0]);
+            for (size_t i = 0; i < fds.size(); i++)
+            {
+                close(fds[i].fd);
+            }
+
+            for (size_t i = w; i < num_jobs; i += num_workers)
+            {
+                Message message;
+                message.index = i;
+                message.result = job(i);
+
+                const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&message);
+                size_t sent = 0;
+                while (sent < sizeof(message))
+                {
+                    ssize_t n = write(pipe_fds[1], bytes + sent, sizeof(message) - sent);
+                    if (n <= 0)
+                    {
+                        _exit(1);
+                    }
+                    sent += n;
+                }
+            }
+            _exit(0);
+        }
+
+        close(pipe_fds[1]);
+        pids.push_back(pid);
+
+        pollfd fd;
+        fd.fd = pipe_fds[0];
+        fd.events = POLLIN;
+        fd.revents = 0;
+        fds.push_back(fd);
+    }
+
+    // Collect results as they arrive, a message can come in pieces
+    std::vector<std::vector<uint8_t> > partial(fds.size());
+    size_t open_pipes = fds.size();
+
+    while (open_pipes > 0)
+    {
+        if (poll(&fds[0], fds.size(), -1) < 0)
+        {
+            perror("poll");
+            break;
+        }
+
+        for (size_t w = 0; w < fds.size(); w++)
+        {
+            if (fds[w].fd < 0 || !(fds[w].revents & (POLLIN | POLLHUP | POLLERR)))
+            {
+                continue;
+            }
+
+            uint8_t buffer[4096];
+            ssize_t n = read(fds[w].fd, buffer, sizeof(buffer));
+            if (n <= 0)
+            {
+                close(fds[w].fd);
+                fds[w].fd = -1;
+                open_pipes--;
+                continue;
+            }
+
+            partial[w].insert(partial[w].end(), buffer, buffer + n);
+            while (partial[w].size() >= sizeof(Message))
+            {
+                Message message;
+                memcpy(&message, &partial[w][0], sizeof(message));
+                partial[w].erase(partial[w].begin(), partial[w].begin() + sizeof(message));
+
+                if (message.index < num_jobs)
+                {
+                    results[message.index] = message.result;
+                    done[message.index] = true;
+                }
+            }
+        }
+    }
+
+    for (size_t w = 0; w < pids.size(); w++)
+    {
+        int status;
+        waitpid(pids[w], &status, 0);
+
+        if (WIFSIGNALED(status))
+        {
+            fprintf(stderr, "Worker %zu died (signal %d)\n", w, WTERMSIG(status));
+        }
+    }
+
+    return results;
+}
+
+#endif
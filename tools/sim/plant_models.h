@@ -0,0 +1,179 @@
+#ifndef PLANT_MODELS_H
+#define PLANT_MODELS_H
+
+#include <random>
+#include <vector>
+
+/*
+Drive train models shared by the host tools (tools/sim, tools/pid_tuner)
+
+They drive the firmware through the host seam (tools/host): motor power is read back from the
+SabertoothSimplified stand-in and encoder counts go to the SPI stand-in.
+*/
+
+#define SIM_DEG(v) ((v) * PI / 180.0)
+
+/**
+ * @brief Wraps an angle into (-PI, PI]
+ */
+inline double sim_wrap_angle(double angle)
+{
+    while (angle > PI)
+    {
+        angle -= 2.0 * PI;
+    }
+    while (angle <= -PI)
+    {
+        angle += 2.0 * PI;
+    }
+    return angle;
+}
+
+class SimRandom
+{
+    public:
+        SimRandom(uint32_t seed) : engine_(seed) {}
+
+        double uniform(double low, double high)
+        {
+            return std::uniform_real_distribution<double>(low, high)(engine_);
+        }
+
+        double gaussian(double sigma)
+        {
+            return std::normal_distribution<double>(0.0, sigma)(engine_);
+        }
+
+        bool chance(double probability)
+        {
+            return uniform(0.0, 1.0) < probability;
+        }
+
+    private:
+        std::mt19937 engine_;
+};
+
+struct SimPose
+{
+    double x;       // m
+    double y;       // m
+    double heading; // rad
+};
+
+/**
+ * @brief First order plus dead time response of one wheel to Sabertooth power
+ */
+struct MotorModelParams
+{
+    double gain;          // m/s of wheel speed per unit of power, at steady state (negative if wired backwards)
+    double time_constant; // s
+    double dead_time;     // s
+};
+
+/**
+ * @brief One Sabertooth channel driving one wheel
+ * The Sabertooth holds each motor at the last power it was sent.
+ */
+class SabertoothMotorModel
+{
+    public:
+        /**
+         * @param dt the step() interval, the dead time is rounded to a whole number of them
+         */
+        SabertoothMotorModel(MotorModelParams params, double dt)
+            : params_(params), velocity_(0.0),
+              delay_(size_t(lround(max(params.dead_time, 0.0) / dt)) + 1, 0), next_(0)
+        {
+            decay_ = exp(-dt / params_.time_constant);
+        }
+
+        /**
+         * @param power as sent to SabertoothSimplified::motor(), -127 to 127
+         * @return wheel surface speed, m/s
+         */
+        double step(int power)
+        {
+            // The oldest power in the delay line is the one acting now
+            delay_[next_] = constrain(power, -127, 127);
+            next_ = (next_ + 1) % delay_.size();
+            int acting = delay_[next_];
+
+            double target = params_.gain * acting;
+            velocity_ = target + (velocity_ - target) * decay_;
+            return velocity_;
+        }
+
+        double get_velocity()
+        {
+            return velocity_;
+        }
+
+    private:
+        MotorModelParams params_;
+        double decay_;
+        double velocity_;
+        std::vector<int> delay_;
+        size_t next_;
+};
+
+/**
+ * @brief LS7366R counting one wheel's quadrature encoder, read over the SPI stand-in
+ */
+class LS7366Model
+{
+    public:
+        LS7366Model(uint8_t chip_select_pin, double counts_per_metre)
+            : chip_select_pin_(chip_select_pin), counts_per_metre_(counts_per_metre), distance_(0.0)
+        {
+            SPI.set_count(chip_select_pin_, 0);
+        }
+
+        void step(double wheel_velocity, double dt)
+        {
+            distance_ += wheel_velocity * dt;
+            SPI.set_count(chip_select_pin_, long(floor(distance_ * counts_per_metre_)));
+        }
+
+    private:
+        uint8_t chip_select_pin_;
+        double counts_per_metre_;
+        double distance_;
+};
+
+/**
+ * @brief Differential drive kinematics, the wheels don't slip
+ */
+class DiffDriveBody
+{
+    public:
+        DiffDriveBody(SimPose start, double track) : pose_(start), track_(track), speed_(0.0) {}
+
+        void step(double left_velocity, double right_velocity, double dt)
+        {
+            speed_ = 0.5 * (left_velocity + right_velocity);
+            double angular = (right_velocity - left_velocity) / track_;
+
+            // Midpoint heading, so arcs are integrated accurately even at large dt
+            double mid_heading = pose_.heading + 0.5 * angular * dt;
+            pose_.x += speed_ * cos(mid_heading) * dt;
+            pose_.y += speed_ * sin(mid_heading) * dt;
+            pose_.heading = sim_wrap_angle(pose_.heading + angular * dt);
+        }
+
+        SimPose get_pose()
+        {
+            return pose_;
+        }
+
+        double get_speed()
+        {
+            return speed_;
+        }
+
+    private:
+        SimPose pose_;
+        double track_;
+        double speed_;
+};
+
+#endif
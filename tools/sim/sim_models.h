@@ -0,0 +1,440 @@
+#ifndef SIM_MODELS_H
+#define SIM_MODELS_H
+
+#include "plant_models.h"
+
+/*
+Sensor models and the simulated robot for the Zombie mode simulator (see zombie_sim.cpp), the drive train
+models are in plant_models.h
+
+World frame is the docking station frame used by the DW1000 anchors (zombie_mode.h), in metres:
+the dock is at the origin, its LEDs face -y (the robot drives in along +y to dock), and +y is north.
+Headings are anticlockwise from +x (east).
+
+The models drive the firmware through the host seam (tools/host): GPS fixes go to the Adafruit_GPS stand-in,
+the IR receivers and dock contacts are pins with interrupts, and LIDAR points go straight to dock_detector.
+*/
+
+/******************* CONFIG **********************/
+
+// The physical robot, as opposed to the controller parameters (which may be wrong)
+#define SIM_WHEEL_RADIUS        0.07  // m
+#define SIM_WHEEL_TRACK         0.55  // m
+#define SIM_ENCODER_CPR         22000 // counts per wheel revolution
+#define SIM_ROBOT_LENGTH        0.6   // m, the dock contacts are at the front
+
+// Sabertooth 2x25 + motor + gearbox, full power no load speed at the wheel and its time constant
+#define SIM_MOTOR_TOP_SPEED     1.5   // m/s
+#define SIM_MOTOR_TIME_CONSTANT 0.15  // s
+#define SIM_MOTOR_GAIN_SPREAD   0.05  // each motor's gain is off by up to this fraction
+
+// Adafruit Ultimate GPS
+#define SIM_GPS_RATE            1.0   // Hz
+#define SIM_GPS_LATENCY         0.2   // s, from the position being measured to the sentence being parsed
+#define SIM_GPS_NOISE           1.5   // m, white noise per fix (per axis)
+#define SIM_GPS_BIAS            2.0   // m, slowly wandering bias (per axis)
+#define SIM_GPS_BIAS_TIME       60.0  // s, correlation time of the bias
+
+// DW1000 ranging to the dock anchors
+#define SIM_UWB_RATE            10.0  // Hz
+#define SIM_UWB_NOISE           0.05  // m
+#define SIM_UWB_MAX_RANGE       30.0  // m
+#define SIM_UWB_DROPOUT         0.05  // probability of each range being missing
+
+// Dock IR beacons (timing is in ir_beacon_decoder.h)
+#define SIM_IR_RANGE            4.0   // m
+#define SIM_IR_SYNC_CONE        75.0  // degrees either side of the dock axis that the SYNC can be seen from
+#define SIM_IR_SIDE_CONE        60.0  // degrees, LEFT and RIGHT are each seen on their own side up to this
+#define SIM_IR_MIDDLE_CONE      5.0   // degrees, MIDDLE is seen this close to the axis
+#define SIM_IR_RECEIVER_FOV     50.0  // degrees either side of each receiver's mounting angle
+#define SIM_IR_DROPOUT          0.05  // probability of a receiver missing a whole frame
+
+// RPLidar A1, on the robot's centre
+#define SIM_LIDAR_RATE          5.5   // Hz, revolutions
+#define SIM_LIDAR_POINTS        360   // per revolution
+#define SIM_LIDAR_NOISE         0.01  // m
+#define SIM_LIDAR_MAX_RANGE     6.0   // m
+#define SIM_LIDAR_DROPOUT       0.05  // probability of each point having no return
+
+// Things the LIDAR sees besides the dock: a wall just behind it, and posts (squares) scattered in front
+#define SIM_WALL_OFFSET         0.05  // m behind the dock's back
+#define SIM_WALL_HALF_LENGTH    5.0   // m
+#define SIM_NUM_POSTS           3
+#define SIM_POST_SIZE           0.3   // m
+
+// Docked when the front of the robot is this close to the contacts, pointing this close to into the dock
+#define SIM_DOCK_CAPTURE_RADIUS 0.15  // m
+#define SIM_DOCK_CAPTURE_ANGLE  30.0  // degrees
+
+/*************************************************/
+
+#define SIM_COUNTS_PER_METRE (SIM_ENCODER_CPR / (2.0 * PI * SIM_WHEEL_RADIUS))
+
+/**
+ * @brief One of the robot's drive motors
+ *
+ * @param gain_error fraction this motor is stronger (or weaker) than nominal
+ * @param polarity -1 if the motor is wired so positive power drives it backwards
+ */
+inline MotorModelParams sim_motor_params(double gain_error, int polarity)
+{
+    MotorModelParams params;
+    params.gain = polarity * (1.0 + gain_error) * SIM_MOTOR_TOP_SPEED / 127.0;
+    params.time_constant = SIM_MOTOR_TIME_CONSTANT;
+    params.dead_time = 0.0;
+    return params;
+}
+
+/**
+ * @brief Fixes at SIM_GPS_RATE, measured with noise and a wandering bias, delivered SIM_GPS_LATENCY later
+ */
+class GpsModel
+{
+    public:
+        GpsModel(Adafruit_GPS *gps, SimRandom *random, double origin_lat, double origin_lon)
+            : gps_(gps), random_(random), origin_lat_(origin_lat), origin_lon_(origin_lon),
+              bias_x_(0.0), bias_y_(0.0), next_sample_(0.0), num_pending_(0)
+        {
+            bias_x_ = random_->gaussian(SIM_GPS_BIAS);
+            bias_y_ = random_->gaussian(SIM_GPS_BIAS);
+        }
+
+        void step(double now, SimPose pose, double speed)
+        {
+            if (now >= next_sample_ && num_pending_ < SIM_GPS_MAX_PENDING)
+            {
+                next_sample_ = now + 1.0 / SIM_GPS_RATE;
+
+                // First order Gauss-Markov bias
+                double decay = exp(-1.0 / (SIM_GPS_RATE * SIM_GPS_BIAS_TIME));
+                double drive = SIM_GPS_BIAS * sqrt(1.0 - decay * decay);
+                bias_x_ = decay * bias_x_ + random_->gaussian(drive);
+                bias_y_ = decay * bias_y_ + random_->gaussian(drive);
+
+                double x = pose.x + bias_x_ + random_->gaussian(SIM_GPS_NOISE);
+                double y = pose.y + bias_y_ + random_->gaussian(SIM_GPS_NOISE);
+
+                Fix &fix = pending_[num_pending_++];
+                fix.deliver_at = now + SIM_GPS_LATENCY;
+                fix.latitude = origin_lat_ + DEG(y / EARTH_RADIUS_);
+                fix.longitude = origin_lon_ + DEG(x / (EARTH_RADIUS_ * cos(RAD(origin_lat_))));
+
+                // Course over ground, clockwise from north
+                fix.course = fmod(DEG(PI / 2.0 - pose.heading) + 360.0, 360.0);
+                fix.speed_knots = fabs(speed) * 1.943844;
+            }
+
+            if (num_pending_ > 0 && now >= pending_[0].deliver_at)
+            {
+                gps_->host_deliver(pending_[0].latitude, pending_[0].longitude, pending_[0].course, pending_[0].speed_knots, 8, 1.0);
+
+                for (int i = 1; i < num_pending_; i++)
+                {
+                    pending_[i - 1] = pending_[i];
+                }
+                num_pending_--;
+            }
+        }
+
+    private:
+        static const int SIM_GPS_MAX_PENDING = 8;
+        static constexpr double EARTH_RADIUS_ = 6371000.0;
+
+        struct Fix
+        {
+            double deliver_at;
+            double latitude;
+            double longitude;
+            double course;
+            double speed_knots;
+        };
+
+        Adafruit_GPS *gps_;
+        SimRandom *random_;
+        double origin_lat_;
+        double origin_lon_;
+        double bias_x_;
+        double bias_y_;
+        double next_sample_;
+        Fix pending_[SIM_GPS_MAX_PENDING];
+        int num_pending_;
+};
+
+/**
+ * @brief DW1000 ranges from the robot to each dock anchor, at SIM_UWB_RATE
+ */
+class UwbModel
+{
+    public:
+        UwbModel(SimRandom *random) : random_(random), next_sample_(0.0) {}
+
+        /**
+         * @param ranges filled in mm, ordered as anchors[] in zombie_mode.h (0 marks a missing range)
+         * @return true when a new set of ranges is ready
+         */
+        bool step(double now, SimPose pose, uint32_t ranges[POZYX_NUM_ANCHORS])
+        {
+            if (now < next_sample_)
+            {
+                return false;
+            }
+            next_sample_ = now + 1.0 / SIM_UWB_RATE;
+
+            for (uint8_t i = 0; i < POZYX_NUM_ANCHORS; i++)
+            {
+                double dx = pose.x - anchors_x[i] / 1000.0;
+                double dy = pose.y - anchors_y[i] / 1000.0;
+                double range = sqrt(dx * dx + dy * dy) + random_->gaussian(SIM_UWB_NOISE);
+
+                bool missing = (range > SIM_UWB_MAX_RANGE) || random_->chance(SIM_UWB_DROPOUT);
+                ranges[i] = missing ? 0 : uint32_t(max(range, 0.0) * 1000.0);
+            }
+
+            return true;
+        }
+
+    private:
+        SimRandom *random_;
+        double next_sample_;
+};
+
+/**
+ * @brief The dock's IR beacon frames, as edges on the robot's receiver pins
+ * Call every step, the step must divide the beacon timing (ir_beacon_decoder.h) exactly.
+ */
+class IrDockModel
+{
+    public:
+        IrDockModel(SimRandom *random) : random_(random)
+        {
+            // Receivers idle with no carrier
+            for (uint8_t i = 0; i < IR_NUM_RECEIVERS; i++)
+            {
+                visible_[i] = 0;
+                host_set_pin(ir_pins[i], carrier_level_(false));
+            }
+        }
+
+        void step(unsigned long now_us, SimPose pose)
+        {
+            unsigned long phase = now_us % IR_FRAME_PERIOD_US;
+
+            // What each receiver can see is decided once per frame
+            if (phase == 0)
+            {
+                plan_frame_(pose);
+            }
+
+            for (uint8_t i = 0; i < IR_NUM_RECEIVERS; i++)
+            {
+                host_set_pin(ir_pins[i], carrier_level_(carrier_on_(i, phase)));
+            }
+        }
+
+    private:
+        // Slot bits as IR_BEACON_x, plus the SYNC
+        static const uint8_t SYNC_BIT_ = (1 << IR_NUM_BEACONS);
+
+        void plan_frame_(SimPose pose)
+        {
+            double distance = sqrt(pose.x * pose.x + pose.y * pose.y);
+
+            // Angle of the robot off the dock axis, positive to the east (the right hand side, coming in)
+            double off_axis = atan2(pose.x, -pose.y);
+            uint8_t emitted = 0;
+
+            if (distance <= SIM_IR_RANGE && fabs(off_axis) <= SIM_DEG(SIM_IR_SYNC_CONE))
+            {
+                emitted |= SYNC_BIT_;
+
+                if (off_axis <= SIM_DEG(SIM_IR_MIDDLE_CONE) && off_axis >= -SIM_DEG(SIM_IR_SIDE_CONE))
+                {
+                    emitted |= (1 << IR_BEACON_LEFT);
+                }
+                if (fabs(off_axis) <= SIM_DEG(SIM_IR_MIDDLE_CONE))
+                {
+                    emitted |= (1 << IR_BEACON_MIDDLE);
+                }
+                if (off_axis >= -SIM_DEG(SIM_IR_MIDDLE_CONE) && off_axis <= SIM_DEG(SIM_IR_SIDE_CONE))
+                {
+                    emitted |= (1 << IR_BEACON_RIGHT);
+                }
+            }
+
+            // Direction of the dock from the robot, relative to its heading
+            double dock_bearing = sim_wrap_angle(atan2(-pose.y, -pose.x) - pose.heading);
+
+            for (uint8_t i = 0; i < IR_NUM_RECEIVERS; i++)
+            {
+                bool in_view = fabs(sim_wrap_angle(dock_bearing - ir_receiver_angles[i])) <= SIM_DEG(SIM_IR_RECEIVER_FOV);
+                visible_[i] = (in_view && !random_->chance(SIM_IR_DROPOUT)) ? emitted : 0;
+            }
+        }
+
+        bool carrier_on_(uint8_t receiver, unsigned long phase)
+        {
+            // SYNC from the start of the frame, then one pulse per slot
+            const unsigned long sync_length = (IR_SYNC_MIN_US + IR_SYNC_MAX_US) / 2;
+            const unsigned long pulse_length = (IR_BEACON_MIN_US + IR_BEACON_MAX_US) / 2;
+
+            if (phase < sync_length)
+            {
+                return visible_[receiver] & SYNC_BIT_;
+            }
+
+            if (phase < sync_length + IR_SLOT_OFFSET_US)
+            {
+                return false;
+            }
+
+            unsigned long slot_phase = phase - sync_length - IR_SLOT_OFFSET_US;
+            unsigned long slot = slot_phase / IR_SLOT_PERIOD_US;
+
+            return slot < IR_NUM_BEACONS && (slot_phase % IR_SLOT_PERIOD_US) < pulse_length &&
+                   (visible_[receiver] & (1 << slot));
+        }
+
+        uint8_t carrier_level_(bool carrier_on)
+        {
+            return (carrier_on == bool(IR_RECEIVER_ACTIVE_LOW)) ? LOW : HIGH;
+        }
+
+        SimRandom *random_;
+        uint8_t visible_[IR_NUM_RECEIVERS];
+};
+
+/**
+ * @brief LIDAR revolutions of the dock (dock_outline[] in dock_detector.h), the wall it stands against and some
+ * posts, handed to dock_detector as the aux loop would. Each point is measured at its own time in the revolution,
+ * so the robot's motion smears the scan as it does on the robot.
+ */
+class LidarModel
+{
+    public:
+        LidarModel(SimRandom *random) : random_(random), next_point_(0), revolution_start_(0.0), num_segments_(0)
+        {
+            // Dock frame to world: the dock opens towards -y, its +y is world +x
+            for (uint8_t v = 0; v + 1 < DOCK_OUTLINE_VERTICES; v++)
+            {
+                add_segment_(dock_outline[v][1] / 1000.0, -dock_outline[v][0] / 1000.0,
+                             dock_outline[v + 1][1] / 1000.0, -dock_outline[v + 1][0] / 1000.0);
+            }
+
+            add_segment_(-SIM_WALL_HALF_LENGTH, SIM_WALL_OFFSET, SIM_WALL_HALF_LENGTH, SIM_WALL_OFFSET);
+
+            // Posts out to the sides, where they don't block the view down the dock axis
+            for (uint8_t i = 0; i < SIM_NUM_POSTS; i++)
+            {
+                double x = random_->uniform(1.0, 4.0) * (random_->chance(0.5) ? 1.0 : -1.0);
+                double y = random_->uniform(-5.0, -0.8);
+                double h = 0.5 * SIM_POST_SIZE;
+
+                add_segment_(x - h, y - h, x + h, y - h);
+                add_segment_(x + h, y - h, x + h, y + h);
+                add_segment_(x + h, y + h, x - h, y + h);
+                add_segment_(x - h, y + h, x - h, y - h);
+            }
+        }
+
+        /**
+         * @return true when a revolution has been completed (and so matched, on the host)
+         */
+        bool step(double now, SimPose pose)
+        {
+            const double period = 1.0 / SIM_LIDAR_RATE;
+            bool completed = false;
+
+            while (now >= revolution_start_ + next_point_ * period / SIM_LIDAR_POINTS)
+            {
+                // Clockwise from the robot's heading, as the RPLidar reports it
+                double angle = 360.0 * next_point_ / SIM_LIDAR_POINTS;
+                double range = cast_(pose.x, pose.y, pose.heading - SIM_DEG(angle));
+                bool returned = (range <= SIM_LIDAR_MAX_RANGE) && !random_->chance(SIM_LIDAR_DROPOUT);
+
+                range += random_->gaussian(SIM_LIDAR_NOISE);
+                dock_detector.add_point(returned ? float(range * 1000.0) : 0.0f, float(angle), returned ? 15 : 0,
+                                        next_point_ == 0);
+                completed |= (next_point_ == 0);
+
+                if (++next_point_ == SIM_LIDAR_POINTS)
+                {
+                    next_point_ = 0;
+                    revolution_start_ += period;
+                }
+            }
+
+            return completed;
+        }
+
+    private:
+        static const uint8_t SIM_MAX_SEGMENTS_ = DOCK_OUTLINE_VERTICES + 1 + 4 * SIM_NUM_POSTS;
+
+        void add_segment_(double x0, double y0, double x1, double y1)
+        {
+            double *segment = segments_[num_segments_++];
+            segment[0] = x0;
+            segment[1] = y0;
+            segment[2] = x1;
+            segment[3] = y1;
+        }
+
+        /**
+         * @return m to the nearest segment along the ray, or infinity
+         */
+        double cast_(double x, double y, double direction)
+        {
+            double dx = cos(direction), dy = sin(direction);
+            double nearest = INFINITY;
+
+            for (uint8_t i = 0; i < num_segments_; i++)
+            {
+                const double *segment = segments_[i];
+                double ex = segment[2] - segment[0], ey = segment[3] - segment[1];
+                double denominator = dx * ey - dy * ex;
+
+                if (fabs(denominator) < 1e-12)
+                {
+                    continue;
+                }
+
+                // Distance along the ray, and fraction along the segment, where they cross
+                double wx = segment[0] - x, wy = segment[1] - y;
+                double t = (wx * ey - wy * ex) / denominator;
+                double u = (wx * dy - wy * dx) / denominator;
+
+                if (t > 0.0 && u >= 0.0 && u <= 1.0)
+                {
+                    nearest = min(nearest, t);
+                }
+            }
+
+            return nearest;
+        }
+
+        SimRandom *random_;
+        uint16_t next_point_;
+        double revolution_start_; // s
+        double segments_[SIM_MAX_SEGMENTS_][4]; // x0, y0, x1, y1 in m
+        uint8_t num_segments_;
+};
+
+/**
+ * @brief The charging contacts, on HOMING_SENSOR_PIN
+ */
+class DockContactModel
+{
+    public:
+        bool step(SimPose pose)
+        {
+            double front_x = pose.x + 0.5 * SIM_ROBOT_LENGTH * cos(pose.heading);
+            double front_y = pose.y + 0.5 * SIM_ROBOT_LENGTH * sin(pose.heading);
+
+            bool docked = (sqrt(front_x * front_x + front_y * front_y) <= SIM_DOCK_CAPTURE_RADIUS) &&
+                          (fabs(sim_wrap_angle(pose.heading - PI / 2.0)) <= SIM_DEG(SIM_DOCK_CAPTURE_ANGLE));
+
+            host_set_pin(HOMING_SENSOR_PIN, docked ? LOW : HIGH);
+            return docked;
+        }
+};
+
+#endif
@@ -0,0 +1,601 @@
+/*
+Zombie mode simulator
+
+Drives the robot home to its dock in closed loop, many times over and faster than real time, to see how well
+Zombie mode actually docks. The firmware's own ZombieController, setpoint generator, wheel encoder and velocity
+controller code run unmodified against the plant and sensor models in sim_models.h: Sabertooth motor dynamics,
+LS7366R encoder counts, GPS noise and latency, DW1000 anchor ranges, the dock's IR beacon edges (through the
+same interrupt handlers as on the robot), and LIDAR revolutions for the dock detector (dock_detector.h).
+
+Each scenario starts the robot somewhere around the dock and runs until the charging contacts close (HOMED) or it
+times out. The scenarios are split into sets by how far out they start, i.e. which stage of homing they exercise:
+    gps    25 - 45 m out, GPS waypoints then the DW1000 anchors then the IR beacons
+    uwb    4 - 9 m out, in front of the dock
+    ir     1.2 - 2.5 m out, roughly lined up with the dock
+Scenarios are independent and run in parallel, one worker process per core (parallel_runner.h).
+
+Controller parameters default to values that suit the simulated robot rather than the firmware defaults (which
+are placeholders, see the FIXMEs in alexbot.h), the velocity loop gains are from tools/pid_tuner on the simulated
+motors. -p overrides them by the names in alexbot_param_table[].
+
+The CPU budget is the host's CPU time for each control cycle (zombie_controller->poll() through to both
+SetTargetVelocity() calls) against the 50 ms Zombie control period. It is a relative measure: the ESP32 is much
+slower than the host, but what costs more here costs more there too. Matching a LIDAR revolution against the dock
+(its own task on the robot) is timed separately, as are the detector's errors against the true dock pose. The true
+position is checked against the geofence (geofence_zones[] in zombie_mode.h) every cycle, for how close the robot
+came to a boundary and how many runs breached one.
+
+Build (from the repository root):
+    g++ -std=gnu++11 -O2 -I tools/host -I . tools/sim/zombie_sim.cpp -o zombie_sim
+or without the DW1000 anchors, GPS handing over straight to the IR beacons (see zombie_mode.h), as on the robot:
+    g++ -std=gnu++11 -O2 -DUWB_PRESENT=0 -I tools/host -I . tools/sim/zombie_sim.cpp -o zombie_sim
+
+Usage:
+    zombie_sim                        16 scenarios per set, one CSV line per scenario on stdout, summary on stderr
+    zombie_sim -n 100 -j 8 -s 7       100 per set on 8 workers, from seed 7
+    zombie_sim --set ir -t 60         only the ir set, 60 s timeout
+    zombie_sim -p vel_kp=150          with a parameter overridden (repeatable)
+    zombie_sim --invert-motors        with the motors wired the other way round
+*/
+
+#define ALEXBOT_PROFILING 0
+
+// The simulated anchors' ranges go to update_uwb_ranges(), -DUWB_PRESENT=0 runs Zombie mode as the robot is built
+#ifndef UWB_PRESENT
+#define UWB_PRESENT 1
+#endif
+
+#include "Arduino.h"
+#include <SabertoothSimplified.h>
+#include <Adafruit_GPS.h>
+
+#include <time.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "encoder_driver.h"
+#include "teleop_controller.h"
+#include "setpoint_generator.h"
+#include "motor_velocity_controller.h"
+#include "zombie_mode.h"
+#include "command_mux.h"
+#include "alexbot_hardware.h"
+
+#include "sim_models.h"
+#include "parallel_runner.h"
+
+// Zombie control period (power_profiles[] in power_manager.h)
+#define SIM_CONTROL_PERIOD_US 50000
+
+// Plant step, must divide the IR beacon timing (ir_beacon_decoder.h) exactly
+#define SIM_STEP_US 500
+
+// The firmware's clock has been running a while by the time it goes home
+#define SIM_START_US 10000000UL
+
+#define SIM_DEFAULT_TIMEOUT 300.0 // s
+#define SIM_DEFAULT_SCENARIOS 16  // per set
+
+static_assert(IR_FRAME_PERIOD_US % SIM_STEP_US == 0 && IR_SLOT_OFFSET_US % SIM_STEP_US == 0 &&
+              IR_SLOT_PERIOD_US % SIM_STEP_US == 0 && SIM_CONTROL_PERIOD_US % SIM_STEP_US == 0,
+              "the plant step must land on every beacon edge");
+
+/******************* SCENARIOS **********************/
+
+struct ScenarioSet
+{
+    const char *name;
+    double min_distance;  // m from the dock
+    double max_distance;
+    double max_off_axis;  // degrees either side of the dock axis
+    double max_heading;   // degrees either side of facing the dock (180: any heading)
+};
+
+const ScenarioSet scenario_sets[] = {
+    {"gps", 25.0, 45.0, 60.0, 180.0},
+    {"uwb", 4.0,  9.0,  45.0, 45.0},
+    {"ir",  1.2,  2.5,  25.0, 30.0},
+};
+
+#define SIM_NUM_SETS (sizeof(scenario_sets) / sizeof(scenario_sets[0]))
+
+struct Scenario
+{
+    uint8_t set;
+    uint32_t seed;
+    SimPose start;
+};
+
+Scenario make_scenario(uint8_t set, uint32_t seed)
+{
+    const ScenarioSet &s = scenario_sets[set];
+    SimRandom random(seed);
+
+    double distance = random.uniform(s.min_distance, s.max_distance);
+    double off_axis = SIM_DEG(random.uniform(-s.max_off_axis, s.max_off_axis));
+
+    Scenario scenario;
+    scenario.set = set;
+    scenario.seed = seed;
+    scenario.start.x = distance * sin(off_axis);
+    scenario.start.y = -distance * cos(off_axis);
+
+    double towards_dock = atan2(-scenario.start.y, -scenario.start.x);
+    scenario.start.heading = sim_wrap_angle(towards_dock + SIM_DEG(random.uniform(-s.max_heading, s.max_heading)));
+    return scenario;
+}
+
+/******************* SIMULATION **********************/
+
+struct SimOptions
+{
+    double timeout;  // s
+    int motor_polarity;
+    std::map<std::string, float> params;
+};
+
+// Suits the simulated robot (sim_models.h), -p overrides these
+const std::pair<const char *, float> sim_default_params[] = {
+    std::make_pair("vel_kp",       210.0f),
+    std::make_pair("vel_ki",       780.0f),
+    std::make_pair("vel_kd",       0.0f),
+    std::make_pair("vel_kff",      36.0f),
+    std::make_pair("max_power",    float(DRIVE_MOTORS_MAX_POWER)),
+    std::make_pair("zombie_speed", float(ZOMBIE_MAX_SPEED)),
+    std::make_pair("wheel_radius", float(SIM_WHEEL_RADIUS)),
+    std::make_pair("enc_cpr",      float(SIM_ENCODER_CPR)),
+    std::make_pair("wheel_track",  float(SIM_WHEEL_TRACK)),
+    std::make_pair("max_accel",    float(ROBOT_MAX_ACCEL_RATE)),
+    std::make_pair("max_decel",    float(ROBOT_MAX_DECEL_RATE)),
+    std::make_pair("max_jerk",     float(ROBOT_MAX_JERK)),
+};
+
+struct ScenarioResult
+{
+    bool docked;
+    double time_to_dock;    // s, from the start of the run
+    uint8_t final_state;    // ZOMBIE_MODE_x_STATE
+    uint8_t deepest_state;  // furthest homing stage reached (GPS, POZYX, IR, HOMED)
+    double final_distance;  // m, front of the robot to the dock
+    uint32_t cycles;
+    double cpu_mean_us;
+    double cpu_max_us;
+    uint32_t dock_matched;  // LIDAR revolutions matched against the dock, and the dock found in
+    uint32_t dock_found;
+    double dock_range_err_mean; // m
+    double dock_range_err_max;
+    double dock_bearing_err_max;     // rad
+    double dock_orientation_err_max; // rad
+    double match_cpu_max_us;
+    double fence_clearance_min; // m, of the true position from the geofence (geofence_zones[]), negative if breached
+};
+
+double thread_cpu_us()
+{
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec * 1e-3;
+}
+
+/**
+ * @brief The firmware's controllers for Zombie mode, wired as AlexbotController wires them
+ */
+class SimRobot
+{
+    public:
+        SimRobot(const SimOptions &options)
+            : gps_(NULL),
+              left_encoder_(LEFT_MOTOR_ID, LEFT_ENCODER_CS_PIN, 1.0, 1.0),
+              right_encoder_(RIGHT_MOTOR_ID, RIGHT_ENCODER_CS_PIN, 1.0, 1.0),
+              left_motor_("Left motor", &sabertooth_, LEFT_MOTOR_ID, &left_encoder_, DRIVE_MOTORS_MAX_POWER),
+              right_motor_("Right motor", &sabertooth_, RIGHT_MOTOR_ID, &right_encoder_, DRIVE_MOTORS_MAX_POWER),
+              zombie_(&gps_)
+        {
+            // Same as AlexbotController::apply_params_(), for the parts being simulated
+            const std::map<std::string, float> &p = options.params;
+            left_motor_.set_gains(p.at("vel_kp"), p.at("vel_ki"), p.at("vel_kd"));
+            right_motor_.set_gains(p.at("vel_kp"), p.at("vel_ki"), p.at("vel_kd"));
+            left_motor_.set_feedforward(p.at("vel_kff"));
+            right_motor_.set_feedforward(p.at("vel_kff"));
+            left_motor_.set_max_power(int32_t(p.at("max_power")));
+            right_motor_.set_max_power(int32_t(p.at("max_power")));
+
+            left_encoder_.set_geometry(int32_t(p.at("enc_cpr")), p.at("wheel_radius"));
+            right_encoder_.set_geometry(int32_t(p.at("enc_cpr")), p.at("wheel_radius"));
+
+            zombie_.set_max_speed(p.at("zombie_speed"));
+            setpoint_generator_.set_track(p.at("wheel_track"));
+            setpoint_generator_.set_limits(SETPOINT_MAX_WHEEL_VEL, p.at("max_accel"), p.at("max_decel"), p.at("max_jerk"));
+
+            // As set_current_state_ID(ZOMBIE_STATE)
+            zombie_.set_target(DOCK_LATITUDE, DOCK_LONGITUDE, anchors);
+        }
+
+        /**
+         * @brief The ZOMBIE_STATE branch of AlexbotController::update()
+         */
+        void update()
+        {
+            zombie_.poll();
+
+            Velocity zombie_command;
+            if (zombie_.run(zombie_command))
+            {
+                mux_.publish(MUX_SOURCE_ZOMBIE, zombie_command, millis());
+            }
+
+            Velocity command = mux_.select(millis(), MUX_SOURCE_BIT(MUX_SOURCE_ZOMBIE)).velocity;
+            setpoint_generator_.set_command(command);
+
+            WheelTargets targets = setpoint_generator_.update(micros());
+            left_motor_.SetTargetVelocity(targets.left);
+            right_motor_.SetTargetVelocity(targets.right);
+        }
+
+        Adafruit_GPS gps_;
+        SabertoothSimplified sabertooth_;
+        WheelEncoderLS7366 left_encoder_;
+        WheelEncoderLS7366 right_encoder_;
+        MotorVelocityController left_motor_;
+        MotorVelocityController right_motor_;
+        SetpointGenerator setpoint_generator_;
+        ZombieController zombie_;
+        CommandMux mux_;
+};
+
+/**
+ * @brief Puts the host seam back to power on, so scenarios in the same worker don't see each other
+ */
+void reset_host()
+{
+    memset(host_pin_levels, 0, sizeof(host_pin_levels));
+    memset(host_pin_isrs, 0, sizeof(host_pin_isrs));
+    SPI = HostSPI();
+    host_set_time(SIM_START_US);
+
+    // Global, as on the robot
+    dock_detector = DockDetector();
+}
+
+ScenarioResult run_scenario(const Scenario &scenario, const SimOptions &options)
+{
+    reset_host();
+
+    SimRandom random(scenario.seed ^ 0x9E3779B9u);
+    SimRobot robot(options);
+
+    const double dt = SIM_STEP_US * 1e-6;
+
+    SabertoothMotorModel left_motor(sim_motor_params(random.uniform(-SIM_MOTOR_GAIN_SPREAD, SIM_MOTOR_GAIN_SPREAD), options.motor_polarity), dt);
+    SabertoothMotorModel right_motor(sim_motor_params(random.uniform(-SIM_MOTOR_GAIN_SPREAD, SIM_MOTOR_GAIN_SPREAD), options.motor_polarity), dt);
+    LS7366Model left_counter(LEFT_ENCODER_CS_PIN, SIM_COUNTS_PER_METRE);
+    LS7366Model right_counter(RIGHT_ENCODER_CS_PIN, SIM_COUNTS_PER_METRE);
+    DiffDriveBody body(scenario.start, SIM_WHEEL_TRACK);
+    GpsModel gps(&robot.gps_, &random, DOCK_LATITUDE, DOCK_LONGITUDE);
+    UwbModel uwb(&random);
+    IrDockModel ir(&random);
+    LidarModel lidar(&random);
+    DockContactModel contacts;
+
+    ScenarioResult result;
+    memset(&result, 0, sizeof(result));
+    result.fence_clearance_min = GEOFENCE_MARGIN;
+
+    // The sim's frame is the geofence's (metres east and north of the dock)
+    Geofence fence;
+    fence.build(geofence_zones, GEOFENCE_NUM_ZONES, geofence_vertices, GEOFENCE_NUM_VERTICES, DOCK_LATITUDE, DOCK_LONGITUDE);
+
+    const unsigned long end_us = SIM_START_US + (unsigned long)(options.timeout * 1e6);
+    unsigned long next_control = SIM_START_US;
+    double cpu_total = 0.0;
+    double range_err_total = 0.0;
+    uint32_t dock_version = dock_detector.get_version();
+
+    for (unsigned long now = SIM_START_US; now < end_us; now += SIM_STEP_US)
+    {
+        host_set_time(now);
+        double t = (now - SIM_START_US) * 1e-6;
+
+        double left_velocity = left_motor.step(robot.sabertooth_.power(LEFT_MOTOR_ID));
+        double right_velocity = right_motor.step(robot.sabertooth_.power(RIGHT_MOTOR_ID));
+        body.step(left_velocity, right_velocity, dt);
+        left_counter.step(left_velocity, dt);
+        right_counter.step(right_velocity, dt);
+
+        SimPose pose = body.get_pose();
+        contacts.step(pose);
+        ir.step(now, pose);
+        gps.step(t, pose, body.get_speed());
+
+        uint32_t ranges[POZYX_NUM_ANCHORS];
+        if (uwb.step(t, pose, ranges))
+        {
+            robot.zombie_.update_uwb_ranges(ranges);
+        }
+
+        // Completing a revolution matches it, there and then
+        double start = thread_cpu_us();
+        if (lidar.step(t, pose))
+        {
+            result.match_cpu_max_us = max(result.match_cpu_max_us, thread_cpu_us() - start);
+        }
+
+        if (dock_detector.get_version() != dock_version)
+        {
+            dock_version = dock_detector.get_version();
+            DockPose dock = dock_detector.get_pose();
+
+            // Revolutions not searched (no IR bearing) have no confidence at all
+            result.dock_matched += (dock.confidence > 0.0f) ? 1 : 0;
+
+            if (dock.valid)
+            {
+                // Against the truth at the end of the revolution (the LIDAR is at the robot's centre)
+                double range_err = fabs(dock.range - sqrt(pose.x * pose.x + pose.y * pose.y));
+                double bearing = sim_wrap_angle(atan2(-pose.y, -pose.x) - pose.heading);
+                double orientation = sim_wrap_angle(PI / 2.0 - pose.heading);
+
+                result.dock_found++;
+                range_err_total += range_err;
+                result.dock_range_err_max = max(result.dock_range_err_max, range_err);
+                result.dock_bearing_err_max = max(result.dock_bearing_err_max, fabs(sim_wrap_angle(dock.bearing - bearing)));
+                result.dock_orientation_err_max = max(result.dock_orientation_err_max,
+                                                      fabs(sim_wrap_angle(dock.orientation - orientation)));
+            }
+        }
+
+        if (now < next_control)
+        {
+            continue;
+        }
+        next_control += SIM_CONTROL_PERIOD_US;
+
+        start = thread_cpu_us();
+        robot.update();
+        double cpu = thread_cpu_us() - start;
+
+        cpu_total += cpu;
+        result.cpu_max_us = max(result.cpu_max_us, cpu);
+        result.cycles++;
+
+        result.fence_clearance_min = min(result.fence_clearance_min, double(fence.check(pose.x, pose.y).clearance));
+
+        uint8_t state = robot.zombie_.get_current_state();
+        if (state != ZOMBIE_MODE_DISABLED_STATE)
+        {
+            result.deepest_state = max(result.deepest_state, state);
+        }
+
+        if (state == ZOMBIE_MODE_HOMED_STATE)
+        {
+            result.docked = true;
+            result.time_to_dock = t;
+            break;
+        }
+    }
+
+    SimPose pose = body.get_pose();
+    double front_x = pose.x + 0.5 * SIM_ROBOT_LENGTH * cos(pose.heading);
+    double front_y = pose.y + 0.5 * SIM_ROBOT_LENGTH * sin(pose.heading);
+
+    result.final_state = robot.zombie_.get_current_state();
+    result.final_distance = sqrt(front_x * front_x + front_y * front_y);
+    result.cpu_mean_us = result.cycles ? cpu_total / result.cycles : 0.0;
+    result.dock_range_err_mean = result.dock_found ? range_err_total / result.dock_found : 0.0;
+    return result;
+}
+
+/******************* REPORT **********************/
+
+const char *zombie_state_name(uint8_t state_id)
+{
+    static const char *names[ZOMBIE_NUM_STATES] = {"DISABLED", "GPS", "POZYX", "IR", "HOMED", "ACTIVE"};
+    return state_id < ZOMBIE_NUM_STATES ? names[state_id] : "?";
+}
+
+double median(std::vector<double> values)
+{
+    if (values.empty())
+    {
+        return 0.0;
+    }
+
+    std::sort(values.begin(), values.end());
+    size_t mid = values.size() / 2;
+    return (values.size() % 2) ? values[mid] : 0.5 * (values[mid - 1] + values[mid]);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned per_set = SIM_DEFAULT_SCENARIOS;
+    unsigned workers = parallel_default_workers();
+    uint32_t base_seed = 1;
+    int only_set = -1;
+
+    SimOptions options;
+    options.timeout = SIM_DEFAULT_TIMEOUT;
+    options.motor_polarity = 1;
+    for (size_t i = 0; i < sizeof(sim_default_params) / sizeof(sim_default_params[0]); i++)
+    {
+        options.params[sim_default_params[i].first] = sim_default_params[i].second;
+    }
+
+    for (int i = 1; i < argc; i++)
+    {
+        bool has_value = (i + 1 < argc);
+
+        if (strcmp(argv[i], "-n") == 0 && has_value)
+        {
+            per_set = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-j") == 0 && has_value)
+        {
+            workers = max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "-s") == 0 && has_value)
+        {
+            base_seed = strtoul(argv[++i], NULL, 0);
+        }
+        else if (strcmp(argv[i], "-t") == 0 && has_value)
+        {
+            options.timeout = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--set") == 0 && has_value)
+        {
+            const char *name = argv[++i];
+            for (size_t s = 0; s < SIM_NUM_SETS; s++)
+            {
+                if (strcmp(name, scenario_sets[s].name) == 0)
+                {
+                    only_set = s;
+                }
+            }
+
+            if (only_set < 0)
+            {
+                fprintf(stderr, "Unknown scenario set %s\n", name);
+                return 2;
+            }
+        }
+        else if (strcmp(argv[i], "--invert-motors") == 0)
+        {
+            options.motor_polarity = -1;
+        }
+        else if (strcmp(argv[i], "-p") == 0 && has_value)
+        {
+            std::string assignment(argv[++i]);
+            size_t equals = assignment.find('=');
+            if (equals == std::string::npos || !options.params.count(assignment.substr(0, equals)))
+            {
+                fprintf(stderr, "Expected -p name=value, where name is one of:");
+                for (std::map<std::string, float>::iterator it = options.params.begin(); it != options.params.end(); ++it)
+                {
+                    fprintf(stderr, " %s", it->first.c_str());
+                }
+                fprintf(stderr, "\n");
+                return 2;
+            }
+            options.params[assignment.substr(0, equals)] = atof(assignment.c_str() + equals + 1);
+        }
+        else
+        {
+            fprintf(stderr, "Usage: %s [-n per_set] [-j workers] [-s seed] [-t timeout_s] [--set gps|uwb|ir] "
+                            "[--invert-motors] [-p name=value]...\n", argv[0]);
+            return 2;
+        }
+    }
+
+    std::vector<Scenario> scenarios;
+    for (uint8_t s = 0; s < SIM_NUM_SETS; s++)
+    {
+        if (only_set >= 0 && s != only_set)
+        {
+            continue;
+        }
+
+        for (unsigned i = 0; i < per_set; i++)
+        {
+            scenarios.push_back(make_scenario(s, base_seed * 1000003u + s * 65537u + i));
+        }
+    }
+
+    timespec wall_start, wall_end;
+    clock_gettime(CLOCK_MONOTONIC, &wall_start);
+
+    std::vector<bool> done;
+    std::vector<ScenarioResult> results = run_parallel<ScenarioResult>(scenarios.size(), workers,
+        [&](size_t i) { return run_scenario(scenarios[i], options); }, done);
+
+    clock_gettime(CLOCK_MONOTONIC, &wall_end);
+    double wall = (wall_end.tv_sec - wall_start.tv_sec) + (wall_end.tv_nsec - wall_start.tv_nsec) * 1e-9;
+
+    printf("id,set,seed,start_x,start_y,start_heading,docked,time_to_dock,final_state,deepest_state,"
+           "final_distance,cycles,cpu_mean_us,cpu_max_us,budget_pct,dock_matched,dock_found,dock_range_err_mean,"
+           "dock_range_err_max,dock_bearing_err_max,dock_orientation_err_max,match_cpu_max_us,fence_clearance_min\n");
+
+    double simulated = 0.0;
+    for (size_t i = 0; i < scenarios.size(); i++)
+    {
+        const Scenario &s = scenarios[i];
+        const ScenarioResult &r = results[i];
+
+        if (!done[i])
+        {
+            printf("%zu,%s,%u,%.2f,%.2f,%.1f,,,,,,,,,,,,,,,,,\n", i, scenario_sets[s.set].name, s.seed,
+                   s.start.x, s.start.y, DEG(s.start.heading));
+            continue;
+        }
+
+        simulated += r.cycles * SIM_CONTROL_PERIOD_US * 1e-6;
+        printf("%zu,%s,%u,%.2f,%.2f,%.1f,%d,%.2f,%s,%s,%.2f,%u,%.2f,%.2f,%.4f,%u,%u,%.3f,%.3f,%.1f,%.1f,%.0f,%.2f\n", i,
+               scenario_sets[s.set].name, s.seed, s.start.x, s.start.y, DEG(s.start.heading), r.docked,
+               r.docked ? r.time_to_dock : 0.0, zombie_state_name(r.final_state), zombie_state_name(r.deepest_state),
+               r.final_distance, r.cycles, r.cpu_mean_us, r.cpu_max_us, 100.0 * r.cpu_mean_us / SIM_CONTROL_PERIOD_US,
+               r.dock_matched, r.dock_found, r.dock_range_err_mean, r.dock_range_err_max, DEG(r.dock_bearing_err_max),
+               DEG(r.dock_orientation_err_max), r.match_cpu_max_us, r.fence_clearance_min);
+    }
+
+    fprintf(stderr, "%-4s %5s %7s %9s %12s %12s %10s %11s %12s %13s %14s %15s\n", "set", "runs", "docked", "success",
+            "median_dock", "cpu_mean_us", "cpu_max_us", "dock_found", "dock_err_cm", "dock_err_deg", "match_max_us",
+            "fence_breached");
+
+    for (uint8_t set = 0; set < SIM_NUM_SETS; set++)
+    {
+        unsigned runs = 0;
+        std::vector<double> dock_times;
+        double cpu_total = 0.0;
+        double cpu_max = 0.0;
+        uint32_t cycles = 0;
+        uint32_t matched = 0, found = 0;
+        double range_err_total = 0.0, bearing_err_max = 0.0, match_max = 0.0;
+        unsigned breached = 0;
+
+        for (size_t i = 0; i < scenarios.size(); i++)
+        {
+            if (scenarios[i].set != set || !done[i])
+            {
+                continue;
+            }
+
+            const ScenarioResult &r = results[i];
+            runs++;
+            if (r.docked)
+            {
+                dock_times.push_back(r.time_to_dock);
+            }
+            cpu_total += r.cpu_mean_us * r.cycles;
+            cpu_max = max(cpu_max, r.cpu_max_us);
+            cycles += r.cycles;
+            matched += r.dock_matched;
+            found += r.dock_found;
+            range_err_total += r.dock_range_err_mean * r.dock_found;
+            bearing_err_max = max(bearing_err_max, r.dock_bearing_err_max);
+            match_max = max(match_max, r.match_cpu_max_us);
+            breached += (r.fence_clearance_min < 0.0) ? 1 : 0;
+        }
+
+        if (runs == 0)
+        {
+            continue;
+        }
+
+        // Dock detector: found in what fraction of the revolutions searched, mean range error, worst bearing error
+        fprintf(stderr, "%-4s %5u %7zu %8.1f%% %11.1fs %12.2f %10.2f %10.1f%% %12.1f %13.1f %14.0f %15u\n", scenario_sets[set].name,
+                runs, dock_times.size(), 100.0 * dock_times.size() / runs, median(dock_times),
+                cycles ? cpu_total / cycles : 0.0, cpu_max, matched ? 100.0 * found / matched : 0.0,
+                found ? 100.0 * range_err_total / found : 0.0, DEG(bearing_err_max), match_max, breached);
+    }
+
+    size_t lost = std::count(done.begin(), done.end(), false);
+    if (lost > 0)
+    {
+        fprintf(stderr, "%zu scenarios did not finish (worker crashed)\n", lost);
+    }
+
+    fprintf(stderr, "%.0f s simulated in %.2f s on %u workers (%.0fx real time)\n", simulated, wall,
+            min(workers, unsigned(scenarios.size())), wall > 0.0 ? simulated / wall : 0.0);
+
+    return lost > 0 ? 1 : 0;
+}
@@ -0,0 +1,521 @@
+/*
+Joystick sender for the Wi-Fi teleop link
+
+Sends joystick packets (UdpTeleopPacket, see udp_teleop.h) to the robot in BLUETOOTH_TELEOP_STATE: from the
+keyboard, or a slow sweep of the forward axis for testing. Join the robot's access point first (UDP_TELEOP_SSID),
+the robot is at 192.168.4.1.
+
+--loopback runs the robot's side on localhost as well, so the link can be tested without a robot: a receiver
+thread passes every datagram through the firmware's own UdpTeleopLink (the same code the receiver task runs), and
+a control loop thread takes the newest command once per control period, as the firmware does. The sender and the
+receiver share a clock, so the age of the command the control loop uses is measured exactly. For comparison the
+same datagrams also go through a plain first in, first out queue, as deep as lwIP's UDP receive queue, read one
+per cycle. --loss, --delay and --jitter make the link worse (jitter reorders packets too).
+
+Build (from the repository root):
+    g++ -std=gnu++11 -O2 -pthread -I tools/host -I . tools/teleop_sender/teleop_sender.cpp -o teleop_sender
+
+Usage:
+    teleop_sender                           keyboard to 192.168.4.1: w/s forward/back, a/d turn, space stop, q quit
+    teleop_sender 10.0.0.7 -r 100           to another address, at 100 Hz (default 50 Hz)
+    teleop_sender --sweep -t 30             sweeps forward and back for 30 s instead of the keyboard
+    teleop_sender --loopback                sweeps to a receiver on localhost for 10 s, then reports
+    teleop_sender --loopback -r 200 --loss 0.05 --jitter 40
+*/
+
+#include "Arduino.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "udp_teleop.h"
+
+#define SENDER_DEFAULT_ADDRESS "192.168.4.1" // the robot, on its own access point
+#define SENDER_DEFAULT_RATE    50            // Hz
+#define SENDER_DEFAULT_TIME    10.0          // s, for --sweep and --loopback
+
+// Teleop control period (power_profiles[] in power_manager.h)
+#define SENDER_CONTROL_PERIOD 50 // ms
+
+// lwIP's default UDP receive queue (CONFIG_LWIP_UDP_RECVMBOX_SIZE), for the comparison
+#define SENDER_FIFO_DEPTH 6
+
+#define SENDER_SWEEP_PERIOD 10.0 // s
+#define SENDER_KEY_STEP     0.1  // of full deflection, per key press
+
+/**
+ * @brief Milliseconds on the host's monotonic clock, shared by the sender and the loopback receiver
+ */
+uint32_t host_ms()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return uint32_t(now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+void sleep_until_ms(uint32_t deadline)
+{
+    int32_t wait = int32_t(deadline - host_ms());
+    if (wait > 0)
+    {
+        usleep(useconds_t(wait) * 1000);
+    }
+}
+
+struct Joystick
+{
+    double linear;  // -1 to 1
+    double angular; // -1 to 1
+    bool quit;
+};
+
+/**
+ * @brief Reads w/a/s/d/space/q from the terminal without waiting for Enter
+ */
+class Keyboard
+{
+    public:
+        Keyboard() : raw_(false) {}
+
+        ~Keyboard()
+        {
+            if (raw_)
+            {
+                tcsetattr(STDIN_FILENO, TCSANOW, &saved_);
+            }
+        }
+
+        bool open()
+        {
+            if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &saved_) != 0)
+            {
+                return false;
+            }
+
+            termios raw = saved_;
+            raw.c_lflag &= ~(ICANON | ECHO);
+            raw.c_cc[VMIN] = 0;
+            raw.c_cc[VTIME] = 0;
+            raw_ = (tcsetattr(STDIN_FILENO, TCSANOW, &raw) == 0);
+            return raw_;
+        }
+
+        void update(Joystick &joystick)
+        {
+            char key;
+            while (read(STDIN_FILENO, &key, 1) == 1)
+            {
+                switch (key)
+                {
+                    case 'w': joystick.linear += SENDER_KEY_STEP; break;
+                    case 's': joystick.linear -= SENDER_KEY_STEP; break;
+                    case 'a': joystick.angular += SENDER_KEY_STEP; break;
+                    case 'd': joystick.angular -= SENDER_KEY_STEP; break;
+                    case ' ': joystick.linear = 0.0; joystick.angular = 0.0; break;
+                    case 'q': joystick.quit = true; break;
+                }
+            }
+
+            joystick.linear = constrain(joystick.linear, -1.0, 1.0);
+            joystick.angular = constrain(joystick.angular, -1.0, 1.0);
+        }
+
+    private:
+        termios saved_;
+        bool raw_;
+};
+
+/**
+ * @brief Optional bad link: packets are dropped, or held back by a random delay (which also reorders them)
+ */
+struct LinkImpairment
+{
+    double loss;   // probability
+    double delay;  // ms, on every packet
+    double jitter; // ms, up to this much more
+};
+
+struct PendingPacket
+{
+    uint32_t send_at;
+    UdpTeleopPacket packet;
+
+    bool operator>(const PendingPacket &other) const
+    {
+        return int32_t(send_at - other.send_at) > 0;
+    }
+};
+
+// Shared with the loopback threads
+std::atomic<bool> loopback_running(true);
+
+struct LoopbackReport
+{
+    std::vector<uint32_t> mailbox_ages; // ms, command used by each control cycle
+    std::vector<uint32_t> fifo_ages;
+    uint32_t cycles;
+    uint32_t fifo_overflows;
+};
+
+/**
+ * @brief The robot's side on localhost: the receiver task and the control loop, each on its own thread
+ */
+class LoopbackRobot
+{
+    public:
+        LoopbackRobot(uint16_t port, uint32_t control_period)
+            : port_(port), control_period_(control_period), socket_(-1)
+        {
+            report_.cycles = 0;
+            report_.fifo_overflows = 0;
+        }
+
+        bool open()
+        {
+            socket_ = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+            sockaddr_in address = {};
+            address.sin_family      = AF_INET;
+            address.sin_port        = htons(port_);
+            address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+            // Wakes up now and then to check whether it should stop
+            timeval timeout = {0, 100000};
+            setsockopt(socket_, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+            if (socket_ < 0 || bind(socket_, (sockaddr *)&address, sizeof(address)) != 0)
+            {
+                perror("loopback receiver");
+                return false;
+            }
+
+            receiver_ = std::thread(&LoopbackRobot::receive_loop_, this);
+            control_ = std::thread(&LoopbackRobot::control_loop_, this);
+            return true;
+        }
+
+        LoopbackReport finish()
+        {
+            loopback_running = false;
+            receiver_.join();
+            control_.join();
+            close(socket_);
+            return report_;
+        }
+
+        UdpTeleopStats get_stats()
+        {
+            return link_.get_stats();
+        }
+
+    private:
+        void receive_loop_()
+        {
+            uint8_t buffer[sizeof(UdpTeleopPacket) + 1];
+
+            while (loopback_running)
+            {
+                ssize_t length = recvfrom(socket_, buffer, sizeof(buffer), 0, NULL, NULL);
+                if (length < 0)
+                {
+                    continue;
+                }
+
+                link_.receive(buffer, length, host_ms());
+
+                // The comparison queue takes everything of the right shape, and drops arrivals while it is full
+                if (length == sizeof(UdpTeleopPacket))
+                {
+                    UdpTeleopPacket packet;
+                    memcpy(&packet, buffer, sizeof(packet));
+
+                    std::lock_guard<std::mutex> lock(fifo_mutex_);
+                    if (fifo_.size() < SENDER_FIFO_DEPTH)
+                    {
+                        fifo_.push_back(packet.stamp);
+                    }
+                    else
+                    {
+                        report_.fifo_overflows++;
+                    }
+                }
+            }
+        }
+
+        void control_loop_()
+        {
+            uint32_t next_cycle = host_ms();
+
+            while (loopback_running)
+            {
+                next_cycle += control_period_;
+                sleep_until_ms(next_cycle);
+
+                uint32_t now = host_ms();
+                report_.cycles++;
+
+                UdpTeleopCommand command;
+                if (link_.take(command, now))
+                {
+                    report_.mailbox_ages.push_back(now - command.stamp);
+                }
+
+                std::lock_guard<std::mutex> lock(fifo_mutex_);
+                if (!fifo_.empty())
+                {
+                    report_.fifo_ages.push_back(now - fifo_.front());
+                    fifo_.pop_front();
+                }
+            }
+        }
+
+        uint16_t port_;
+        uint32_t control_period_;
+        int socket_;
+
+        UdpTeleopLink link_;
+
+        std::mutex fifo_mutex_;
+        std::deque<uint32_t> fifo_;
+
+        LoopbackReport report_;
+        std::thread receiver_;
+        std::thread control_;
+};
+
+uint32_t percentile(std::vector<uint32_t> values, double fraction)
+{
+    if (values.empty())
+    {
+        return 0;
+    }
+
+    std::sort(values.begin(), values.end());
+    return values[size_t(fraction * (values.size() - 1))];
+}
+
+void print_ages(const char *name, const std::vector<uint32_t> &ages, uint32_t cycles)
+{
+    printf("%-8s cycles_with_command=%5zu/%u  age_ms p50=%4u p99=%4u max=%4u\n", name, ages.size(), cycles,
+           percentile(ages, 0.5), percentile(ages, 0.99), percentile(ages, 1.0));
+}
+
+int main(int argc, char **argv)
+{
+    const char *address_text = SENDER_DEFAULT_ADDRESS;
+    uint16_t port = UDP_TELEOP_PORT;
+    double rate = SENDER_DEFAULT_RATE;
+    double duration = -1.0;
+    uint32_t control_period = SENDER_CONTROL_PERIOD;
+    bool sweep = false;
+    bool loopback = false;
+    LinkImpairment impairment = {0.0, 0.0, 0.0};
+
+    for (int i = 1; i < argc; i++)
+    {
+        bool has_value = (i + 1 < argc);
+
+        if (strcmp(argv[i], "-r") == 0 && has_value)
+        {
+            rate = max(1.0, atof(argv[++i]));
+        }
+        else if (strcmp(argv[i], "-t") == 0 && has_value)
+        {
+            duration = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-c") == 0 && has_value)
+        {
+            control_period = max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--port") == 0 && has_value)
+        {
+            port = uint16_t(atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--loss") == 0 && has_value)
+        {
+            impairment.loss = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--delay") == 0 && has_value)
+        {
+            impairment.delay = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--jitter") == 0 && has_value)
+        {
+            impairment.jitter = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--sweep") == 0)
+        {
+            sweep = true;
+        }
+        else if (strcmp(argv[i], "--loopback") == 0)
+        {
+            loopback = true;
+            sweep = true;
+        }
+        else if (argv[i][0] != '-')
+        {
+            address_text = argv[i];
+        }
+        else
+        {
+            fprintf(stderr, "Usage: %s [address] [-r rate_hz] [-t seconds] [--sweep] [--port port]\n"
+                            "       %s --loopback [-r rate_hz] [-t seconds] [-c control_period_ms] [--loss p] [--delay ms] [--jitter ms]\n",
+                    argv[0], argv[0]);
+            return 2;
+        }
+    }
+
+    if (duration < 0.0 && sweep)
+    {
+        duration = SENDER_DEFAULT_TIME;
+    }
+
+    sockaddr_in destination = {};
+    destination.sin_family = AF_INET;
+    destination.sin_port   = htons(port);
+    if (inet_pton(AF_INET, loopback ? "127.0.0.1" : address_text, &destination.sin_addr) != 1)
+    {
+        fprintf(stderr, "Bad address %s\n", address_text);
+        return 2;
+    }
+
+    int sender = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sender < 0)
+    {
+        perror("socket");
+        return 2;
+    }
+
+    Keyboard keyboard;
+    if (!sweep && !keyboard.open())
+    {
+        fprintf(stderr, "No terminal for the keyboard, use --sweep\n");
+        return 2;
+    }
+
+    LoopbackRobot robot(port, control_period);
+    if (loopback && !robot.open())
+    {
+        return 2;
+    }
+
+    std::mt19937 random(host_ms() ^ uint32_t(getpid()));
+
+    UdpTeleopPacket packet;
+    packet.magic    = UDP_TELEOP_MAGIC;
+    packet.session  = random();
+    packet.sequence = 0;
+
+    std::priority_queue<PendingPacket, std::vector<PendingPacket>, std::greater<PendingPacket> > pending;
+    Joystick joystick = {0.0, 0.0, false};
+    uint32_t sent = 0;
+    uint32_t dropped = 0;
+
+    uint32_t start = host_ms();
+    double next_read = 0.0; // ms after start
+
+    fprintf(stderr, "Sending to %s:%u at %g Hz\n", loopback ? "127.0.0.1" : address_text, port, rate);
+
+    while (!joystick.quit)
+    {
+        double elapsed = (host_ms() - start) / 1000.0;
+        if (duration >= 0.0 && elapsed >= duration)
+        {
+            break;
+        }
+
+        // Read the joystick, and stamp the packet with the time it was read
+        if (sweep)
+        {
+            joystick.linear = sin(2.0 * PI * elapsed / SENDER_SWEEP_PERIOD);
+        }
+        else
+        {
+            keyboard.update(joystick);
+            fprintf(stderr, "\rlinear=%+4.0f%% angular=%+4.0f%%  ", joystick.linear * 100.0, joystick.angular * 100.0);
+        }
+
+        packet.sequence++;
+        packet.stamp   = host_ms();
+        packet.linear  = int16_t(lround(joystick.linear * UDP_TELEOP_FULL_SCALE));
+        packet.angular = int16_t(lround(joystick.angular * UDP_TELEOP_FULL_SCALE));
+
+        if (std::uniform_real_distribution<double>(0.0, 1.0)(random) < impairment.loss)
+        {
+            dropped++;
+        }
+        else
+        {
+            PendingPacket delayed;
+            double delay = impairment.delay + std::uniform_real_distribution<double>(0.0, impairment.jitter)(random);
+            delayed.send_at = packet.stamp + uint32_t(lround(delay));
+            delayed.packet = packet;
+            pending.push(delayed);
+        }
+
+        // Send everything whose delay is up, until it is time for the next read
+        next_read += 1000.0 / rate;
+        uint32_t read_at = start + uint32_t(lround(next_read));
+
+        do
+        {
+            while (!pending.empty() && int32_t(pending.top().send_at - host_ms()) <= 0)
+            {
+                if (sendto(sender, &pending.top().packet, sizeof(UdpTeleopPacket), 0,
+                           (sockaddr *)&destination, sizeof(destination)) == sizeof(UdpTeleopPacket))
+                {
+                    sent++;
+                }
+                pending.pop();
+            }
+
+            uint32_t wake = read_at;
+            if (!pending.empty() && int32_t(pending.top().send_at - wake) < 0)
+            {
+                wake = pending.top().send_at;
+            }
+            sleep_until_ms(wake);
+        }
+        while (int32_t(read_at - host_ms()) > 0);
+    }
+
+    // Stop the robot before leaving
+    if (!loopback)
+    {
+        packet.sequence++;
+        packet.stamp   = host_ms();
+        packet.linear  = 0;
+        packet.angular = 0;
+        sendto(sender, &packet, sizeof(packet), 0, (sockaddr *)&destination, sizeof(destination));
+        fprintf(stderr, "\nSent %u packets\n", sent + 1);
+        close(sender);
+        return 0;
+    }
+
+    // Let the last packets arrive
+    usleep(200000);
+    close(sender);
+
+    LoopbackReport report = robot.finish();
+    UdpTeleopStats stats = robot.get_stats();
+
+    printf("sent=%u dropped_by_link=%u received=%u accepted=%u lost=%u reordered=%u stale=%u\n",
+           sent, dropped, stats.received, stats.accepted, stats.lost, stats.reordered, stats.stale);
+    printf("sender %.0f Hz, control loop every %u ms\n", rate, control_period);
+    print_ages("mailbox", report.mailbox_ages, report.cycles);
+    print_ages("fifo", report.fifo_ages, report.cycles);
+    printf("fifo overflows=%u (depth %d)\n", report.fifo_overflows, SENDER_FIFO_DEPTH);
+    return 0;
+}
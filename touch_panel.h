@@ -0,0 +1,655 @@
+#ifndef TOUCH_PANEL_H
+#define TOUCH_PANEL_H
+
+#include <stdint.h>
+#include <SPI.h>
+
+#include "task_table.h"
+
+/*
+Touch panel, the STMPE610 resistive touch controller on the TFT FeatherWing, for the dashboard controls
+
+The STMPE610 shares the SPI bus with the encoders, the TFT and the SD card, so it is never polled. It samples the
+panel by itself into its FIFO, and pulls its interrupt line low when the panel is touched or let go, or once
+TOUCH_FIFO_THRESHOLD samples are waiting. The interrupt only wakes the touch task (core 0, below the auxillary loop,
+see task_table.h), which takes the baton once, reads every sample waiting in one burst, and lets go. While the
+panel is touched the task also wakes every TOUCH_HOLD_POLL, for long presses and in case the release was missed.
+
+The samples are debounced into gestures (TouchGestureDetector, which has no hardware so it builds on the host):
+  - A touch only counts once TOUCH_DEBOUNCE_SAMPLES samples close together have come in, so a brush of the panel
+    or a stray sample doesn't. It is where those samples were, on the screen as it is drawn (TFT_WIDTH x
+    TFT_HEIGHT in lcd_controller.h, calibrated by TOUCH_RAW_x).
+  - Let go within TOUCH_TAP_MAX_MOVE of where it started it is a tap. Dragged further than TOUCH_SWIPE_MIN_MOVE,
+    mostly sideways, it is a swipe left or right.
+  - Held still for TOUCH_LONG_PRESS_TIME it is a long press, straight away rather than on release, and the
+    release after it is nothing.
+
+Gestures go into a queue with one producer (the touch task) and one consumer (the control loop), and neither side
+ever waits for the other: a gesture with the queue full is dropped and counted. The control loop takes them each
+cycle and maps each to a dashboard control (TFTController::dashboard_command() in lcd_controller.h), which does
+what the serial command it stands for would.
+
+print_stats() (#I,0,0!) reports the interrupts, the samples read, how long the bursts held the bus, the gestures,
+and how long they waited in the queue.
+
+FIXME: the FeatherWing's touch IRQ pad isn't connected to anything, it has to be wired to STMPE_IRQ_PIN.
+With ALEXBOT_TOUCH set to 0 (or when building on the host) TouchPanel compiles down to empty calls.
+*/
+
+/******************* CONFIG **********************/
+
+#ifndef ALEXBOT_TOUCH
+#define ALEXBOT_TOUCH 1
+#endif
+
+// STMPE610 interrupt (active low), 27 is the sleep wake button's (SLEEP_WAKE_PIN)
+#define STMPE_IRQ_PIN 22
+
+// The STMPE610's SPI clock, it tops out at 1 MHz
+#define TOUCH_SPI_CLOCK 1000000 // Hz
+
+// Samples the STMPE610 queues before interrupting (it also interrupts on touch and release)
+#define TOUCH_FIFO_THRESHOLD 4
+
+// Most samples read in one burst, the rest of a fuller FIFO is thrown away
+#define TOUCH_MAX_BURST 32
+
+// While touched, the task checks this often even without an interrupt
+#define TOUCH_HOLD_POLL 50 // ms
+
+// FIXME: calibrate, raw readings at the edges of the screen as it is drawn (rotation 0, portrait)
+#define TOUCH_RAW_LEFT   3800
+#define TOUCH_RAW_RIGHT  100
+#define TOUCH_RAW_TOP    100
+#define TOUCH_RAW_BOTTOM 3750
+
+// Gestures
+#define TOUCH_DEBOUNCE_SAMPLES 3
+#define TOUCH_TAP_MAX_MOVE     20  // px
+#define TOUCH_SWIPE_MIN_MOVE   80  // px
+#define TOUCH_LONG_PRESS_TIME  800 // ms
+
+// Gestures waiting for the control loop
+#define TOUCH_QUEUE_LEN 8
+
+/*************************************************/
+
+#define TOUCH_GESTURE_TAP         0
+#define TOUCH_GESTURE_LONG_PRESS  1
+#define TOUCH_GESTURE_SWIPE_LEFT  2
+#define TOUCH_GESTURE_SWIPE_RIGHT 3
+#define TOUCH_NUM_GESTURES        4
+
+// Indexed by TOUCH_GESTURE_x
+const char *const touch_gesture_names[TOUCH_NUM_GESTURES] = {"tap", "long_press", "swipe_left", "swipe_right"};
+
+struct TouchGesture
+{
+    uint8_t type;       // TOUCH_GESTURE_x
+    int16_t x;          // where it started, px
+    int16_t y;
+    unsigned long stamp; // millis() when it was recognised
+};
+
+/**
+ * @brief Debounces touch samples into gestures, fed by one task only
+ */
+class TouchGestureDetector
+{
+    public:
+        TouchGestureDetector();
+        bool add_sample(int16_t x, int16_t y, unsigned long now, TouchGesture &gesture);
+        bool release(unsigned long now, TouchGesture &gesture);
+        bool is_touched();
+
+    private:
+        void make_gesture_(uint8_t type, unsigned long now, TouchGesture &gesture);
+
+        bool touched_;           // debounced
+        bool long_pressed_;      // this touch has already been a long press
+        uint8_t samples_;        // in a row, while debouncing
+        int32_t sum_x_;
+        int32_t sum_y_;
+        int16_t start_x_;
+        int16_t start_y_;
+        int16_t last_x_;
+        int16_t last_y_;
+        unsigned long down_;     // millis() the touch counted from
+};
+
+TouchGestureDetector::TouchGestureDetector()
+{
+    this->touched_      = false;
+    this->long_pressed_ = false;
+    this->samples_      = 0;
+    this->sum_x_        = 0;
+    this->sum_y_        = 0;
+    this->start_x_      = 0;
+    this->start_y_      = 0;
+    this->last_x_       = 0;
+    this->last_y_       = 0;
+    this->down_         = 0;
+}
+
+/**
+ * @param x,y px
+ * @param now millis()
+ * @return true if it made a gesture (a long press)
+ */
+bool TouchGestureDetector::add_sample(int16_t x, int16_t y, unsigned long now, TouchGesture &gesture)
+{
+    if (!touched_)
+    {
+        // A sample that jumps away from the one before starts the debounce over, one of them was noise
+        if (samples_ > 0 && (abs(x - last_x_) > TOUCH_TAP_MAX_MOVE || abs(y - last_y_) > TOUCH_TAP_MAX_MOVE))
+        {
+            samples_ = 0;
+            sum_x_ = sum_y_ = 0;
+        }
+
+        if (samples_ == 0)
+        {
+            down_ = now;
+        }
+
+        samples_++;
+        sum_x_ += x;
+        sum_y_ += y;
+        last_x_ = x;
+        last_y_ = y;
+
+        if (samples_ >= TOUCH_DEBOUNCE_SAMPLES)
+        {
+            touched_ = true;
+            long_pressed_ = false;
+            start_x_ = sum_x_ / samples_;
+            start_y_ = sum_y_ / samples_;
+        }
+        return false;
+    }
+
+    last_x_ = x;
+    last_y_ = y;
+
+    bool still = abs(x - start_x_) <= TOUCH_TAP_MAX_MOVE && abs(y - start_y_) <= TOUCH_TAP_MAX_MOVE;
+    if (!long_pressed_ && still && (now - down_) >= TOUCH_LONG_PRESS_TIME)
+    {
+        long_pressed_ = true;
+        make_gesture_(TOUCH_GESTURE_LONG_PRESS, now, gesture);
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * @brief The panel is no longer touched
+ *
+ * @return true if it made a gesture (a tap or a swipe)
+ */
+bool TouchGestureDetector::release(unsigned long now, TouchGesture &gesture)
+{
+    bool was_touched = touched_;
+    touched_ = false;
+    samples_ = 0;
+    sum_x_ = sum_y_ = 0;
+
+    if (!was_touched || long_pressed_)
+    {
+        return false;
+    }
+
+    int16_t dx = last_x_ - start_x_;
+    int16_t dy = last_y_ - start_y_;
+
+    if (abs(dx) >= TOUCH_SWIPE_MIN_MOVE && abs(dx) > 2 * abs(dy))
+    {
+        make_gesture_(dx < 0 ? TOUCH_GESTURE_SWIPE_LEFT : TOUCH_GESTURE_SWIPE_RIGHT, now, gesture);
+        return true;
+    }
+
+    if (abs(dx) <= TOUCH_TAP_MAX_MOVE && abs(dy) <= TOUCH_TAP_MAX_MOVE)
+    {
+        make_gesture_(TOUCH_GESTURE_TAP, now, gesture);
+        return true;
+    }
+
+    // Dragged, but neither a swipe nor a tap
+    return false;
+}
+
+bool TouchGestureDetector::is_touched()
+{
+    return touched_;
+}
+
+void TouchGestureDetector::make_gesture_(uint8_t type, unsigned long now, TouchGesture &gesture)
+{
+    gesture.type = type;
+    gesture.x = start_x_;
+    gesture.y = start_y_;
+    gesture.stamp = now;
+}
+
+/**
+ * @brief Gestures from the touch task to the control loop, without locks (one writer, one reader)
+ */
+class TouchGestureQueue
+{
+    public:
+        TouchGestureQueue();
+        bool push(const TouchGesture &gesture);
+        bool take(TouchGesture &gesture);
+        uint32_t get_dropped();
+
+    private:
+        TouchGesture items_[TOUCH_QUEUE_LEN];
+        volatile uint32_t head_; // next to write, only the writer moves it
+        volatile uint32_t tail_; // next to read, only the reader moves it
+        volatile uint32_t dropped_;
+};
+
+TouchGestureQueue::TouchGestureQueue()
+{
+    this->head_    = 0;
+    this->tail_    = 0;
+    this->dropped_ = 0;
+}
+
+/**
+ * @return false if the queue was full, the gesture is dropped
+ */
+bool TouchGestureQueue::push(const TouchGesture &gesture)
+{
+    if (head_ - tail_ >= TOUCH_QUEUE_LEN)
+    {
+        dropped_++;
+        return false;
+    }
+
+    items_[head_ % TOUCH_QUEUE_LEN] = gesture;
+
+    // The item must be complete before the reader can see it
+    __sync_synchronize();
+    head_ = head_ + 1;
+    return true;
+}
+
+/**
+ * @return false if there is nothing waiting
+ */
+bool TouchGestureQueue::take(TouchGesture &gesture)
+{
+    if (head_ == tail_)
+    {
+        return false;
+    }
+
+    // Not read before the writer finished it, and not given back before it has been copied
+    __sync_synchronize();
+    gesture = items_[tail_ % TOUCH_QUEUE_LEN];
+    __sync_synchronize();
+    tail_ = tail_ + 1;
+    return true;
+}
+
+uint32_t TouchGestureQueue::get_dropped()
+{
+    return dropped_;
+}
+
+#if ALEXBOT_TOUCH && defined(ESP32)
+
+// STMPE610 registers and bits used (see the datasheet, and Adafruit_STMPE610.h)
+#define STMPE_CHIP_ID         0x00 // 2 bytes, 0x0811
+#define STMPE_SYS_CTRL1       0x03
+#define STMPE_SYS_CTRL1_RESET 0x02
+#define STMPE_SYS_CTRL2       0x04 // 0 turns every clock on
+#define STMPE_INT_CTRL        0x09
+#define STMPE_INT_CTRL_ENABLE 0x01 // level, active low
+#define STMPE_INT_EN          0x0A
+#define STMPE_INT_STA         0x0B
+#define STMPE_INT_TOUCH_DET   0x01
+#define STMPE_INT_FIFO_TH     0x02
+#define STMPE_INT_FIFO_OFLOW  0x04
+#define STMPE_GPIO_ALT_FUNCT  0x17
+#define STMPE_ADC_CTRL1       0x20
+#define STMPE_ADC_CTRL2       0x21
+#define STMPE_TSC_CTRL        0x40
+#define STMPE_TSC_CTRL_EN_XYZ 0x01
+#define STMPE_TSC_CTRL_TOUCHED 0x80
+#define STMPE_TSC_CFG         0x41
+#define STMPE_FIFO_TH         0x4A
+#define STMPE_FIFO_STA        0x4B
+#define STMPE_FIFO_STA_RESET  0x01
+#define STMPE_FIFO_SIZE       0x4C
+#define STMPE_TSC_FRACTION_Z  0x56
+#define STMPE_TSC_I_DRIVE     0x58
+#define STMPE_TSC_DATA_XYZ    0xD7 // 4 bytes a sample, without auto increment
+
+#define STMPE_ID 0x0811
+
+class TouchPanel
+{
+    public:
+        TouchPanel();
+        bool init(uint8_t chip_select_pin, uint8_t irq_pin, SemaphoreHandle_t spi_lock);
+        bool take_gesture(TouchGesture &gesture);
+        TaskHandle_t get_task();
+        void print_stats();
+
+        // Called from the ISR glue and the touch task below, not for general use
+        void IRAM_ATTR on_interrupt_();
+        void touch_task_loop_();
+
+    private:
+        void read_burst_();
+        uint8_t read_register_(uint8_t reg);
+        void write_register_(uint8_t reg, uint8_t value);
+
+        uint8_t chip_select_pin_;
+        SemaphoreHandle_t spi_lock_;
+        TouchGestureDetector detector_;
+        TouchGestureQueue queue_;
+
+        // Only the touch task writes these
+        volatile uint32_t interrupts_;
+        uint32_t bursts_;
+        uint32_t samples_;
+        uint32_t overflows_;
+        uint8_t max_burst_;
+        uint32_t max_read_us_;   // bus held for a burst
+        uint32_t gestures_[TOUCH_NUM_GESTURES];
+
+        // Only the control loop writes this
+        unsigned long max_queue_ms_;
+
+        TaskHandle_t task_;
+        StackType_t task_stack_[task_table[TASK_TOUCH].stack_size];
+        StaticTask_t task_buffer_;
+};
+
+// The ISR and touch task can't take a "this" pointer, so they go through this
+TouchPanel *touch_panel_isr_target = NULL;
+
+void IRAM_ATTR touch_panel_isr_()
+{
+    touch_panel_isr_target->on_interrupt_();
+}
+
+void touch_panel_task_func_(void *parameter)
+{
+    ((TouchPanel *)parameter)->touch_task_loop_();
+}
+
+TouchPanel::TouchPanel()
+{
+    for (uint8_t i = 0; i < TOUCH_NUM_GESTURES; i++)
+    {
+        gestures_[i] = 0;
+    }
+
+    this->chip_select_pin_ = 0;
+    this->spi_lock_        = NULL;
+    this->interrupts_      = 0;
+    this->bursts_          = 0;
+    this->samples_         = 0;
+    this->overflows_       = 0;
+    this->max_burst_       = 0;
+    this->max_read_us_     = 0;
+    this->max_queue_ms_    = 0;
+    this->task_            = NULL;
+}
+
+/**
+ * @brief Sets the STMPE610 sampling into its FIFO, then starts the touch task and the interrupt
+ * Call with the SPI bus held (see boot_sequence.h)
+ *
+ * @param spi_lock taken around every burst, as the STMPE610 shares the SPI bus with the encoders and the TFT
+ * @return false if there is no STMPE610 there, nothing is started
+ */
+bool TouchPanel::init(uint8_t chip_select_pin, uint8_t irq_pin, SemaphoreHandle_t spi_lock)
+{
+    chip_select_pin_ = chip_select_pin;
+    spi_lock_ = spi_lock;
+
+    pinMode(chip_select_pin_, OUTPUT);
+    digitalWrite(chip_select_pin_, HIGH);
+
+    uint16_t id = (read_register_(STMPE_CHIP_ID) << 8) | read_register_(STMPE_CHIP_ID + 1);
+    if (id != STMPE_ID)
+    {
+        Serial.print("ERROR: no STMPE610 touch controller, chip ID 0x");
+        Serial.println(id, HEX);
+        return false;
+    }
+
+    // As Adafruit_STMPE610::begin(): XYZ samples averaged over 4, 1 ms touch detect delay, 5 ms settling
+    write_register_(STMPE_SYS_CTRL1, STMPE_SYS_CTRL1_RESET);
+    delay(10);
+    write_register_(STMPE_SYS_CTRL2, 0x00);
+    write_register_(STMPE_TSC_CTRL, STMPE_TSC_CTRL_EN_XYZ);
+    write_register_(STMPE_ADC_CTRL1, 0x60);  // 10 bit, 80 clock sample time
+    write_register_(STMPE_ADC_CTRL2, 0x02);  // 6.5 MHz ADC clock
+    write_register_(STMPE_GPIO_ALT_FUNCT, 0x00);
+    write_register_(STMPE_TSC_CFG, 0xA4);
+    write_register_(STMPE_TSC_FRACTION_Z, 0x06);
+    write_register_(STMPE_FIFO_TH, TOUCH_FIFO_THRESHOLD);
+    write_register_(STMPE_FIFO_STA, STMPE_FIFO_STA_RESET);
+    write_register_(STMPE_FIFO_STA, 0x00);
+    write_register_(STMPE_TSC_I_DRIVE, 0x01); // 50 mA
+    write_register_(STMPE_INT_STA, 0xFF);
+
+    // Interrupts on touch and release, a FIFO at its threshold, and a FIFO that overflowed anyway
+    write_register_(STMPE_INT_EN, STMPE_INT_TOUCH_DET | STMPE_INT_FIFO_TH | STMPE_INT_FIFO_OFLOW);
+    write_register_(STMPE_INT_CTRL, STMPE_INT_CTRL_ENABLE);
+
+    touch_panel_isr_target = this;
+
+    // Below the auxillary loop, a touch can wait for a TFT refresh (see task_table.h)
+    const TaskPlacement &placement = task_table[TASK_TOUCH];
+    task_ = xTaskCreateStaticPinnedToCore(
+        touch_panel_task_func_,   /* Task function. */
+        placement.name,           /* String with name of task. */
+        placement.stack_size,     /* Stack size in words. */
+        this,                     /* Parameter passed as input of the task */
+        placement.priority,       /* Priority of the task. */
+        task_stack_,              /* Stack. */
+        &task_buffer_,            /* Task control block. */
+        placement.core);          /* Core ID to execute on. */
+
+    pinMode(irq_pin, INPUT_PULLUP);
+    attachInterrupt(digitalPinToInterrupt(irq_pin), touch_panel_isr_, FALLING);
+    return true;
+}
+
+/**
+ * @brief The oldest gesture waiting, call from the control loop only. Never waits
+ *
+ * @return false if there is none
+ */
+bool TouchPanel::take_gesture(TouchGesture &gesture)
+{
+    if (!queue_.take(gesture))
+    {
+        return false;
+    }
+
+    max_queue_ms_ = max(max_queue_ms_, millis() - gesture.stamp);
+    return true;
+}
+
+TaskHandle_t TouchPanel::get_task()
+{
+    return task_;
+}
+
+void TouchPanel::print_stats()
+{
+    Serial.print("Touch: interrupts=");
+    Serial.print(interrupts_);
+    Serial.print(", bursts=");
+    Serial.print(bursts_);
+    Serial.print(", samples=");
+    Serial.print(samples_);
+    Serial.print(", max_burst=");
+    Serial.print(max_burst_);
+    Serial.print(", fifo_overflows=");
+    Serial.print(overflows_);
+    Serial.print(", read_us max=");
+    Serial.println(max_read_us_);
+
+    Serial.print("  gestures:");
+    for (uint8_t i = 0; i < TOUCH_NUM_GESTURES; i++)
+    {
+        Serial.print(" ");
+        Serial.print(touch_gesture_names[i]);
+        Serial.print("=");
+        Serial.print(gestures_[i]);
+    }
+    Serial.print(", dropped (queue full)=");
+    Serial.print(queue_.get_dropped());
+    Serial.print(", queue_ms max=");
+    Serial.println(max_queue_ms_);
+}
+
+/**
+ * @brief STMPE610 interrupt, only wakes the touch task
+ */
+void IRAM_ATTR TouchPanel::on_interrupt_()
+{
+    interrupts_++;
+
+    BaseType_t higher_priority_task_woken = pdFALSE;
+    vTaskNotifyGiveFromISR(task_, &higher_priority_task_woken);
+    portYIELD_FROM_ISR(higher_priority_task_woken);
+}
+
+/**
+ * @brief Body of the touch task
+ */
+void TouchPanel::touch_task_loop_()
+{
+    while (true)
+    {
+        ulTaskNotifyTake(pdTRUE, detector_.is_touched() ? pdMS_TO_TICKS(TOUCH_HOLD_POLL) : portMAX_DELAY);
+        read_burst_();
+    }
+}
+
+/**
+ * @brief Reads every sample waiting and whether the panel is still touched, with the bus held once
+ */
+void TouchPanel::read_burst_()
+{
+    uint16_t raw_x[TOUCH_MAX_BURST];
+    uint16_t raw_y[TOUCH_MAX_BURST];
+
+    xSemaphoreTake(spi_lock_, portMAX_DELAY);
+    uint32_t start = micros();
+
+    uint8_t status = read_register_(STMPE_INT_STA);
+    uint8_t waiting = read_register_(STMPE_FIFO_SIZE);
+    uint8_t count = min(waiting, uint8_t(TOUCH_MAX_BURST));
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        uint8_t data[4];
+        for (uint8_t j = 0; j < 4; j++)
+        {
+            data[j] = read_register_(STMPE_TSC_DATA_XYZ);
+        }
+
+        // 12 bits of x, 12 of y, then 8 of pressure (not used)
+        raw_x[i] = (uint16_t(data[0]) << 4) | (data[1] >> 4);
+        raw_y[i] = (uint16_t(data[1] & 0x0F) << 8) | data[2];
+    }
+
+    // The rest of a fuller FIFO is stale by now
+    if (waiting > count || (status & STMPE_INT_FIFO_OFLOW))
+    {
+        write_register_(STMPE_FIFO_STA, STMPE_FIFO_STA_RESET);
+        write_register_(STMPE_FIFO_STA, 0x00);
+        overflows_++;
+    }
+
+    bool touched = read_register_(STMPE_TSC_CTRL) & STMPE_TSC_CTRL_TOUCHED;
+
+    // Clears what was seen, anything raised since keeps the line low, so go round again for it
+    write_register_(STMPE_INT_STA, status);
+    bool pending = read_register_(STMPE_INT_STA) != 0;
+
+    uint32_t read_us = micros() - start;
+    xSemaphoreGive(spi_lock_);
+
+    if (pending)
+    {
+        xTaskNotifyGive(task_);
+    }
+
+    bursts_++;
+    samples_ += count;
+    max_read_us_ = max(max_read_us_, read_us);
+    max_burst_ = max(max_burst_, count);
+
+    unsigned long now = millis();
+    TouchGesture gesture;
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        int16_t x = map(raw_x[i], TOUCH_RAW_LEFT, TOUCH_RAW_RIGHT, 0, TFT_WIDTH);
+        int16_t y = map(raw_y[i], TOUCH_RAW_TOP, TOUCH_RAW_BOTTOM, 0, TFT_HEIGHT);
+
+        if (detector_.add_sample(constrain(x, 0, TFT_WIDTH - 1), constrain(y, 0, TFT_HEIGHT - 1), now, gesture))
+        {
+            gestures_[gesture.type]++;
+            queue_.push(gesture);
+        }
+    }
+
+    // Let go after the samples from before it
+    if (!touched && detector_.release(now, gesture))
+    {
+        gestures_[gesture.type]++;
+        queue_.push(gesture);
+    }
+}
+
+uint8_t TouchPanel::read_register_(uint8_t reg)
+{
+    SPI.beginTransaction(SPISettings(TOUCH_SPI_CLOCK, MSBFIRST, SPI_MODE0));
+    digitalWrite(chip_select_pin_, LOW);
+    SPI.transfer(0x80 | reg);
+    uint8_t value = SPI.transfer(0x00);
+    digitalWrite(chip_select_pin_, HIGH);
+    SPI.endTransaction();
+    return value;
+}
+
+void TouchPanel::write_register_(uint8_t reg, uint8_t value)
+{
+    SPI.beginTransaction(SPISettings(TOUCH_SPI_CLOCK, MSBFIRST, SPI_MODE0));
+    digitalWrite(chip_select_pin_, LOW);
+    SPI.transfer(reg);
+    SPI.transfer(value);
+    digitalWrite(chip_select_pin_, HIGH);
+    SPI.endTransaction();
+}
+
+#else
+
+// Touch disabled, or a host build, the panel is never read
+class TouchPanel
+{
+    public:
+        bool init(uint8_t chip_select_pin, uint8_t irq_pin, void *spi_lock) { return false; }
+        bool take_gesture(TouchGesture &gesture) { return false; }
+        void *get_task() { return NULL; }
+        void print_stats() { Serial.println("Touch panel disabled"); }
+};
+
+#endif
+
+TouchPanel touch_panel;
+
+#endif
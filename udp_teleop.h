@@ -0,0 +1,536 @@
+#ifndef UDP_TELEOP_H
+#define UDP_TELEOP_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "snapshot_buffer.h"
+#include "task_table.h"
+
+/*
+Wi-Fi joystick teleop, for BLUETOOTH_TELEOP_STATE
+
+While in BLUETOOTH_TELEOP_STATE the robot runs a Wi-Fi access point (UDP_TELEOP_SSID) and listens for joystick
+packets on UDP port UDP_TELEOP_PORT. The sender (tools/teleop_sender, or anything else speaking the packet format
+below) sends one packet per joystick read, each with a sequence number and the sender's clock.
+
+UDP rather than TCP: a late joystick reading is worthless once the next one is on its way, and TCP would hold every
+later reading back until the late one had been resent.
+
+A receiver task, pinned to the core the Wi-Fi and lwIP tasks already run on (see task_table.h), blocks on the socket and passes each
+datagram through UdpTeleopLink:
+  - A packet from a new session (the sender restarted) starts the link over.
+  - A packet numbered at or below the last one accepted is dropped, it was reordered or duplicated on the way.
+  - A packet that took more than UDP_TELEOP_MAX_TRANSIT longer to arrive than the quickest one so far is dropped
+    as stale (e.g. stuck behind Wi-Fi retries). The two clocks are never compared directly, only the spread of
+    (arrival - sender stamp).
+  - Gaps in the sequence numbers are counted as lost, until the packet turns up late.
+An accepted packet overwrites the mailbox (a SnapshotBuffer), nothing is ever queued. The control loop takes the
+newest command once per cycle, so the command it uses is at most a control period old however fast the sender
+sends, rather than as old as a queue is deep.
+
+The command age (time since the joystick was read, beyond the quickest transit) and the link loss are reported by
+print_stats() (#U,0,0!). If no packet is accepted for UDP_TELEOP_LINK_TIMEOUT the link is lost and the robot
+slows to a stop, then the safety supervisor's watchdog halts it as it would for a silent serial link.
+
+Packet format (little endian, packed): UdpTeleopPacket
+
+With ALEXBOT_UDP_TELEOP set to 0 (or when building on the host) the radio side compiles down to empty calls,
+UdpTeleopLink and the packet format stay available for tools/teleop_sender.
+The Wi-Fi driver allocates from the heap for every packet, so ALEXBOT_ZERO_HEAP_WRAP_MALLOC builds need
+ALEXBOT_UDP_TELEOP set to 0.
+*/
+
+/******************* CONFIG **********************/
+
+#ifndef ALEXBOT_UDP_TELEOP
+#define ALEXBOT_UDP_TELEOP 1
+#endif
+
+// FIXME: change the password before taking the robot out
+#define UDP_TELEOP_SSID     "alexbot"
+#define UDP_TELEOP_PASSWORD "alexbot-teleop" // at least 8 characters
+#define UDP_TELEOP_CHANNEL  6
+#define UDP_TELEOP_PORT     4210
+
+// Packets slower than the quickest one by more than this are stale
+#define UDP_TELEOP_MAX_TRANSIT 100 // ms
+
+// No packet accepted for this long and the link is lost, keep it below WATCHDOG_TIMEOUT
+#define UDP_TELEOP_LINK_TIMEOUT 200 // ms
+
+// The quickest transit is let creep up by 1 ms this often, so it follows the drift between the two clocks
+#define UDP_TELEOP_TRANSIT_RELAX 1000 // ms
+
+/*************************************************/
+
+#define UDP_TELEOP_MAGIC      0x534A4241 // "ABJS"
+#define UDP_TELEOP_FULL_SCALE 32767      // joystick axis at full deflection
+
+struct __attribute__((packed)) UdpTeleopPacket
+{
+    uint32_t magic;
+    uint32_t session;  // picked at random when the sender starts
+    uint32_t sequence; // one more for every packet sent
+    uint32_t stamp;    // sender's clock when the joystick was read, ms
+    int16_t linear;    // forward, +-UDP_TELEOP_FULL_SCALE
+    int16_t angular;   // anticlockwise, +-UDP_TELEOP_FULL_SCALE
+};
+
+struct UdpTeleopCommand
+{
+    int16_t linear;
+    int16_t angular;
+    uint32_t number;        // packets accepted up to and including this one, 0 means the mailbox is empty
+    uint32_t stamp;         // sender's clock, ms
+    unsigned long received; // robot's clock, ms
+    uint32_t transit;       // ms slower than the quickest packet
+};
+
+struct UdpTeleopStats
+{
+    uint32_t received;  // datagrams
+    uint32_t accepted;
+    uint32_t malformed; // wrong size or magic
+    uint32_t reordered; // at or below the last sequence number, i.e. overtaken (or duplicated)
+    uint32_t stale;     // over UDP_TELEOP_MAX_TRANSIT
+    uint32_t lost;      // sequence numbers that haven't arrived (late arrivals within 32 are taken back off)
+    uint32_t sessions;
+};
+
+/**
+ * @brief Accepts or drops each joystick packet, and holds the newest command for the control loop
+ * receive() is called by the receiver task only, take() and is_up() by the control loop only
+ */
+class UdpTeleopLink
+{
+    public:
+        UdpTeleopLink();
+        bool receive(const uint8_t *data, size_t length, unsigned long now);
+        bool take(UdpTeleopCommand &command, unsigned long now);
+        bool is_up(unsigned long now);
+        UdpTeleopStats get_stats() const;
+        void print_stats();
+
+    private:
+        // Receiver task side
+        bool in_session_;
+        uint32_t session_;
+        uint32_t last_sequence_;
+        uint32_t arrived_; // bit n set if last_sequence_ - n has arrived
+        unsigned long last_accepted_;
+        long quickest_transit_; // arrival - sender stamp, ms
+        unsigned long last_relax_;
+        UdpTeleopStats stats_;
+
+        SnapshotBuffer<UdpTeleopCommand> mailbox_;
+
+        // Control loop side
+        uint32_t taken_number_;
+        bool link_up_;
+        uint32_t link_losses_;
+        uint32_t cycles_held_; // cycles with no new command while the link was up
+        uint32_t age_count_;
+        uint32_t age_sum_;
+        uint32_t age_max_;
+        uint32_t age_last_;
+};
+
+UdpTeleopLink::UdpTeleopLink()
+{
+    this->in_session_       = false;
+    this->session_          = 0;
+    this->last_sequence_    = 0;
+    this->arrived_          = 0;
+    this->last_accepted_    = 0;
+    this->quickest_transit_ = 0;
+    this->last_relax_       = 0;
+    memset(&this->stats_, 0, sizeof(this->stats_));
+
+    this->taken_number_     = 0;
+    this->link_up_          = false;
+    this->link_losses_      = 0;
+    this->cycles_held_      = 0;
+    this->age_count_        = 0;
+    this->age_sum_          = 0;
+    this->age_max_          = 0;
+    this->age_last_         = 0;
+}
+
+/**
+ * @brief Checks one datagram, and publishes it to the mailbox if it is the newest command
+ *
+ * @param now robot's clock when it arrived, ms
+ * @return true if it was accepted
+ */
+bool UdpTeleopLink::receive(const uint8_t *data, size_t length, unsigned long now)
+{
+    stats_.received++;
+
+    UdpTeleopPacket packet;
+    if (length != sizeof(packet))
+    {
+        stats_.malformed++;
+        return false;
+    }
+
+    memcpy(&packet, data, sizeof(packet));
+    if (packet.magic != UDP_TELEOP_MAGIC)
+    {
+        stats_.malformed++;
+        return false;
+    }
+
+    // Only the spread of this matters, the offset between the clocks cancels out
+    long transit = long(now - packet.stamp);
+
+    // After a silence the route (and the clocks) may have changed, so the quickest transit is measured again
+    bool resync = (!in_session_ || packet.session != session_ || now - last_accepted_ > UDP_TELEOP_LINK_TIMEOUT);
+
+    if (in_session_ && packet.session == session_)
+    {
+        // Wraps cleanly, a sender would need to run for years at 100 Hz to get half way round
+        int32_t ahead = int32_t(packet.sequence - last_sequence_);
+        if (ahead <= 0)
+        {
+            // Counted as lost when it was skipped, but it did arrive in the end
+            uint32_t bit = (ahead > -32) ? (1UL << -ahead) : 0;
+            if (bit != 0 && !(arrived_ & bit))
+            {
+                arrived_ |= bit;
+                stats_.lost--;
+            }
+            stats_.reordered++;
+            return false;
+        }
+        stats_.lost += ahead - 1;
+        arrived_ = ((ahead < 32) ? (arrived_ << ahead) : 0) | 1;
+    }
+    else
+    {
+        stats_.sessions++;
+        session_ = packet.session;
+        in_session_ = true;
+        arrived_ = 1;
+    }
+
+    if (resync)
+    {
+        quickest_transit_ = transit;
+        last_relax_ = now;
+    }
+    else
+    {
+        while (now - last_relax_ >= UDP_TELEOP_TRANSIT_RELAX)
+        {
+            quickest_transit_++;
+            last_relax_ += UDP_TELEOP_TRANSIT_RELAX;
+        }
+        quickest_transit_ = min(quickest_transit_, transit);
+    }
+
+    // Later packets are still compared against this one, so a stale packet can't let an older one in after it
+    last_sequence_ = packet.sequence;
+
+    if (transit - quickest_transit_ > UDP_TELEOP_MAX_TRANSIT)
+    {
+        stats_.stale++;
+        return false;
+    }
+
+    stats_.accepted++;
+    last_accepted_ = now;
+
+    UdpTeleopCommand command;
+    command.linear   = packet.linear;
+    command.angular  = packet.angular;
+    command.number   = stats_.accepted;
+    command.stamp    = packet.stamp;
+    command.received = now;
+    command.transit  = uint32_t(transit - quickest_transit_);
+    mailbox_.write(command);
+    return true;
+}
+
+/**
+ * @brief Takes the newest command, if one has arrived since the last take() and the link is up
+ *
+ * @param now ms
+ * @return false if there is nothing new
+ */
+bool UdpTeleopLink::take(UdpTeleopCommand &command, unsigned long now)
+{
+    UdpTeleopCommand newest = mailbox_.read();
+
+    if (!is_up(now))
+    {
+        return false;
+    }
+
+    if (newest.number == taken_number_)
+    {
+        cycles_held_++;
+        return false;
+    }
+
+    taken_number_ = newest.number;
+    command = newest;
+
+    age_last_ = uint32_t(now - newest.received) + newest.transit;
+    age_sum_ += age_last_;
+    age_max_ = max(age_max_, age_last_);
+    age_count_++;
+    return true;
+}
+
+/**
+ * @brief Whether a packet has been accepted within UDP_TELEOP_LINK_TIMEOUT, reports the link coming and going
+ *
+ * @param now ms
+ */
+bool UdpTeleopLink::is_up(unsigned long now)
+{
+    UdpTeleopCommand newest = mailbox_.read();
+    bool up = (newest.number != 0 && now - newest.received <= UDP_TELEOP_LINK_TIMEOUT);
+
+    if (up != link_up_)
+    {
+        link_up_ = up;
+        if (up)
+        {
+            Serial.println("Teleop link up");
+        }
+        else
+        {
+            link_losses_++;
+            Serial.println("ERROR: Teleop link lost");
+        }
+    }
+
+    return up;
+}
+
+UdpTeleopStats UdpTeleopLink::get_stats() const
+{
+    return stats_;
+}
+
+void UdpTeleopLink::print_stats()
+{
+    Serial.print("Teleop link: up=");
+    Serial.print(link_up_);
+    Serial.print(", received=");
+    Serial.print(stats_.received);
+    Serial.print(", accepted=");
+    Serial.print(stats_.accepted);
+    Serial.print(", lost=");
+    Serial.print(stats_.lost);
+    Serial.print(", reordered=");
+    Serial.print(stats_.reordered);
+    Serial.print(", stale=");
+    Serial.print(stats_.stale);
+    Serial.print(", malformed=");
+    Serial.print(stats_.malformed);
+    Serial.print(", sessions=");
+    Serial.print(stats_.sessions);
+    Serial.print(", link_losses=");
+    Serial.println(link_losses_);
+
+    Serial.print("Teleop command age_ms last=");
+    Serial.print(age_last_);
+    Serial.print(" mean=");
+    Serial.print(age_count_ > 0 ? age_sum_ / age_count_ : 0);
+    Serial.print(" max=");
+    Serial.print(age_max_);
+    Serial.print(", cycles_held=");
+    Serial.println(cycles_held_);
+}
+
+#if ALEXBOT_UDP_TELEOP && defined(ESP32)
+
+#include <WiFi.h>
+#include <esp_wifi.h>
+#include <lwip/sockets.h>
+
+class UdpTeleopReceiver
+{
+    public:
+        UdpTeleopReceiver();
+        bool init();
+        void start();
+        void stop();
+        bool take(UdpTeleopCommand &command, unsigned long now);
+        bool is_up(unsigned long now);
+        TaskHandle_t get_task();
+        void print_stats();
+
+        // Called from the receiver task below, not for general use
+        void receive_task_loop_();
+
+    private:
+        UdpTeleopLink link_;
+        int socket_;
+        bool running_;
+
+        // One byte spare, so an oversized datagram shows up as the wrong length rather than being cut to fit
+        uint8_t buffer_[sizeof(UdpTeleopPacket) + 1];
+
+        TaskHandle_t receive_task_;
+        StackType_t receive_task_stack_[task_table[TASK_UDP_TELEOP].stack_size];
+        StaticTask_t receive_task_buffer_;
+};
+
+void udp_teleop_task_func_(void *parameter)
+{
+    ((UdpTeleopReceiver *)parameter)->receive_task_loop_();
+}
+
+UdpTeleopReceiver::UdpTeleopReceiver()
+{
+    this->socket_       = -1;
+    this->running_      = false;
+    this->receive_task_ = NULL;
+}
+
+/**
+ * @brief Sets up the access point and the socket, and starts the receiver task
+ * Call from setup(), the Wi-Fi driver allocates its buffers here. The radio stays off until start().
+ */
+bool UdpTeleopReceiver::init()
+{
+    // Nothing is written to flash, the settings here are the only ones
+    WiFi.persistent(false);
+    WiFi.mode(WIFI_AP);
+
+    if (!WiFi.softAP(UDP_TELEOP_SSID, UDP_TELEOP_PASSWORD, UDP_TELEOP_CHANNEL))
+    {
+        Serial.println("ERROR: Teleop access point failed to start");
+        return false;
+    }
+
+    socket_ = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+    sockaddr_in address = {};
+    address.sin_family      = AF_INET;
+    address.sin_port        = htons(UDP_TELEOP_PORT);
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    if (socket_ < 0 || bind(socket_, (sockaddr *)&address, sizeof(address)) != 0)
+    {
+        Serial.println("ERROR: Teleop socket failed to open");
+        return false;
+    }
+
+    // The radio draws ~100 mA, it is only needed in BLUETOOTH_TELEOP_STATE
+    esp_wifi_stop();
+
+    // Spends almost all its time blocked on the socket
+    const TaskPlacement &placement = task_table[TASK_UDP_TELEOP];
+    receive_task_ = xTaskCreateStaticPinnedToCore(
+        udp_teleop_task_func_,      /* Task function. */
+        placement.name,             /* String with name of task. */
+        placement.stack_size,       /* Stack size in words. */
+        this,                       /* Parameter passed as input of the task */
+        placement.priority,         /* Priority of the task. */
+        receive_task_stack_,        /* Stack. */
+        &receive_task_buffer_,      /* Task control block. */
+        placement.core);            /* Core ID to execute on. */
+
+    return true;
+}
+
+/**
+ * @brief Turns the radio on, on transition into BLUETOOTH_TELEOP_STATE
+ */
+void UdpTeleopReceiver::start()
+{
+    if (running_ || socket_ < 0)
+    {
+        return;
+    }
+
+    running_ = (esp_wifi_start() == ESP_OK);
+
+    Serial.print(running_ ? "Teleop access point " : "ERROR: Teleop access point failed to start ");
+    Serial.print(UDP_TELEOP_SSID);
+    Serial.print(", ");
+    Serial.print(WiFi.softAPIP());
+    Serial.print(":");
+    Serial.println(UDP_TELEOP_PORT);
+}
+
+/**
+ * @brief Turns the radio off again, on transition out of BLUETOOTH_TELEOP_STATE
+ */
+void UdpTeleopReceiver::stop()
+{
+    if (running_)
+    {
+        esp_wifi_stop();
+        running_ = false;
+    }
+}
+
+/**
+ * @brief Takes the newest joystick command, call once per control cycle
+ */
+bool UdpTeleopReceiver::take(UdpTeleopCommand &command, unsigned long now)
+{
+    return link_.take(command, now);
+}
+
+bool UdpTeleopReceiver::is_up(unsigned long now)
+{
+    return link_.is_up(now);
+}
+
+TaskHandle_t UdpTeleopReceiver::get_task()
+{
+    return receive_task_;
+}
+
+void UdpTeleopReceiver::print_stats()
+{
+    link_.print_stats();
+}
+
+/**
+ * @brief Body of the receiver task
+ */
+void UdpTeleopReceiver::receive_task_loop_()
+{
+    while (true)
+    {
+        int length = recvfrom(socket_, buffer_, sizeof(buffer_), 0, NULL, NULL);
+
+        if (length < 0)
+        {
+            // Nothing to do while the radio is off
+            vTaskDelay(pdMS_TO_TICKS(100));
+            continue;
+        }
+
+        link_.receive(buffer_, length, millis());
+    }
+}
+
+#else
+
+// Wi-Fi teleop disabled, or a host build (tools/teleop_sender), the link never comes up
+class UdpTeleopReceiver
+{
+    public:
+        bool init() { return false; }
+        void start() {}
+        void stop() {}
+        bool take(UdpTeleopCommand &, unsigned long) { return false; }
+        bool is_up(unsigned long) { return false; }
+        void *get_task() { return NULL; }
+        void print_stats() { Serial.println("Teleop link disabled"); }
+};
+
+#endif
+
+UdpTeleopReceiver udp_teleop;
+
+#endif
@@ -0,0 +1,358 @@
+#include <math.h>
+#include <stdint.h>
+
+/*
+2D Least Squares Trilateration for the DW1000 RADAR sub-state of Zombie mode.
+
+The anchors are bolted to the docking station, so the geometry never changes.
+Subtracting the range equation of a reference anchor from the others linearises the problem into A * p = b,
+where A only depends on the anchor positions. The pseudo-inverse P = (A^T A)^-1 A^T is therefore computed
+once in init(), and every update is a (2 x N-1) matrix-vector product followed by outlier gating.
+
+All internal maths is done in metres (float) to keep the squared ranges well inside single precision.
+*/
+
+/******************* CONFIG **********************/
+
+// Maximum number of anchors the solver can be configured with
+#define UWB_MAX_ANCHORS 4
+
+// Ranges outside this window are treated as dropouts / multipath and are gated out
+#define UWB_MIN_RANGE_MM 50
+#define UWB_MAX_RANGE_MM 30000
+
+// Fixes with an RMS range residual above this are rejected
+#define UWB_MAX_RESIDUAL_MM 250
+
+// Consecutive fixes may not jump further than the robot could physically travel (plus some slack)
+#define UWB_MAX_SPEED_MM_PER_MS 1.0
+#define UWB_JUMP_GATE_MARGIN_MM 300
+
+// After this many consecutive jump-gated fixes we assume the previous fix was the outlier and re-acquire
+#define UWB_JUMP_GATE_MAX_REJECTS 5
+
+/*************************************************/
+
+struct UWBFix
+{
+    int32_t x;            // mm, docking station frame
+    int32_t y;            // mm, docking station frame
+    uint16_t residual;    // RMS range residual in mm (lower is better)
+    uint8_t num_ranges;   // number of anchors used in the solution
+    bool valid;
+    unsigned long stamp;  // ms
+};
+
+class UWBTrilateration
+{
+    public:
+        UWBTrilateration();
+        bool init(const int32_t anchors_x[], const int32_t anchors_y[], uint8_t num_anchors);
+        UWBFix update(const uint32_t ranges[], unsigned long stamp);
+        UWBFix get_last_fix();
+
+    private:
+        // Precomputed linear solver for one subset of the anchors
+        struct Solver
+        {
+            uint8_t mask;                          // anchors included in this solution
+            uint8_t ref;                           // reference anchor that was subtracted out
+            uint8_t num_rows;
+            uint8_t rows[UWB_MAX_ANCHORS - 1];     // anchor index of each row of A
+            float pinv[2][UWB_MAX_ANCHORS - 1];    // (A^T A)^-1 A^T
+            float k[UWB_MAX_ANCHORS - 1];          // constant (range independent) part of b
+            bool ok;
+        };
+
+        bool precompute_(Solver &solver, uint8_t mask);
+        bool solve_(const Solver &solver, const float ranges[], float &x, float &y, float &residual);
+
+        uint8_t num_anchors_;
+        float anchor_x_[UWB_MAX_ANCHORS];
+        float anchor_y_[UWB_MAX_ANCHORS];
+
+        // solvers_[0] uses every anchor, solvers_[i + 1] leaves anchor i out
+        Solver solvers_[UWB_MAX_ANCHORS + 1];
+
+        UWBFix last_fix_;
+        uint8_t jump_rejects_;
+};
+
+UWBTrilateration::UWBTrilateration()
+{
+    this->num_anchors_  = 0;
+    this->jump_rejects_ = 0;
+    this->last_fix_.x          = 0;
+    this->last_fix_.y          = 0;
+    this->last_fix_.residual   = 0;
+    this->last_fix_.num_ranges = 0;
+    this->last_fix_.valid      = false;
+    this->last_fix_.stamp      = 0;
+}
+
+/**
+ * @brief Sets the anchor geometry and precomputes the pseudo-inverses
+ *
+ * @param anchors_x anchor x-coordinates in mm (docking station frame)
+ * @param anchors_y anchor y-coordinates in mm (docking station frame)
+ * @param num_anchors between 3 and UWB_MAX_ANCHORS
+ *
+ * With 4 or more anchors, leave-one-out solvers are also precomputed so a single bad range can be rejected.
+ *
+ * @return false if the geometry is degenerate (e.g. collinear anchors)
+ */
+bool UWBTrilateration::init(const int32_t anchors_x[], const int32_t anchors_y[], uint8_t num_anchors)
+{
+    if (num_anchors < 3 || num_anchors > UWB_MAX_ANCHORS)
+    {
+        return false;
+    }
+
+    num_anchors_ = num_anchors;
+
+    for (uint8_t i = 0; i < num_anchors_; i++)
+    {
+        anchor_x_[i] = anchors_x[i] / 1000.0f;
+        anchor_y_[i] = anchors_y[i] / 1000.0f;
+    }
+
+    uint8_t all_anchors = (1 << num_anchors_) - 1;
+    bool ok = precompute_(solvers_[0], all_anchors);
+
+    for (uint8_t i = 0; i < num_anchors_; i++)
+    {
+        // Leaving one anchor out of three would leave the 2D solution ambiguous
+        solvers_[i + 1].ok = false;
+
+        if (num_anchors_ >= 4)
+        {
+            precompute_(solvers_[i + 1], all_anchors & ~(1 << i));
+        }
+    }
+
+    return ok;
+}
+
+/**
+ * @brief Computes a position fix from one set of raw anchor ranges
+ *
+ * @param ranges in mm, one per anchor (in the same order as passed to init). 0 marks a missing range.
+ * @param stamp time the ranges were measured, ms
+ * @return UWBFix, check .valid before use
+ */
+UWBFix UWBTrilateration::update(const uint32_t ranges[], unsigned long stamp)
+{
+    UWBFix fix;
+    fix.x          = 0;
+    fix.y          = 0;
+    fix.residual   = 0;
+    fix.num_ranges = 0;
+    fix.valid      = false;
+    fix.stamp      = stamp;
+
+    if (num_anchors_ == 0)
+    {
+        return fix;
+    }
+
+    // Range gating
+    float ranges_m[UWB_MAX_ANCHORS];
+    uint8_t usable = 0;
+
+    for (uint8_t i = 0; i < num_anchors_; i++)
+    {
+        ranges_m[i] = ranges[i] / 1000.0f;
+
+        if (ranges[i] >= UWB_MIN_RANGE_MM && ranges[i] <= UWB_MAX_RANGE_MM)
+        {
+            usable |= (1 << i);
+        }
+    }
+
+    // Use every anchor if we can, otherwise the best leave-one-out solution that only contains usable ranges
+    float best_x = 0.0f;
+    float best_y = 0.0f;
+    float best_residual = 0.0f;
+    const Solver *best = NULL;
+
+    for (uint8_t s = 0; s <= num_anchors_; s++)
+    {
+        const Solver &solver = solvers_[s];
+
+        if (!solver.ok || (solver.mask & ~usable))
+        {
+            continue;
+        }
+
+        float x, y, residual;
+        if (!solve_(solver, ranges_m, x, y, residual))
+        {
+            continue;
+        }
+
+        if (best == NULL || residual < best_residual)
+        {
+            best = &solver;
+            best_x = x;
+            best_y = y;
+            best_residual = residual;
+        }
+
+        // Don't bother with the subsets when every range agrees with the full solution
+        if (s == 0 && residual * 1000.0f <= UWB_MAX_RESIDUAL_MM)
+        {
+            break;
+        }
+    }
+
+    if (best == NULL)
+    {
+        return fix;
+    }
+
+    fix.x        = int32_t(lroundf(best_x * 1000.0f));
+    fix.y        = int32_t(lroundf(best_y * 1000.0f));
+    fix.residual = uint16_t(fminf(best_residual * 1000.0f, 65535.0f));
+
+    for (uint8_t i = 0; i < num_anchors_; i++)
+    {
+        if (best->mask & (1 << i))
+        {
+            fix.num_ranges++;
+        }
+    }
+
+    if (fix.residual > UWB_MAX_RESIDUAL_MM)
+    {
+        return fix;
+    }
+
+    // Jump gating against the previous accepted fix
+    if (last_fix_.valid && jump_rejects_ < UWB_JUMP_GATE_MAX_REJECTS)
+    {
+        float dx = float(fix.x - last_fix_.x);
+        float dy = float(fix.y - last_fix_.y);
+        float max_jump = UWB_MAX_SPEED_MM_PER_MS * float(stamp - last_fix_.stamp) + UWB_JUMP_GATE_MARGIN_MM;
+
+        if (dx * dx + dy * dy > max_jump * max_jump)
+        {
+            jump_rejects_++;
+            return fix;
+        }
+    }
+
+    jump_rejects_ = 0;
+    fix.valid = true;
+    last_fix_ = fix;
+
+    return fix;
+}
+
+UWBFix UWBTrilateration::get_last_fix()
+{
+    return last_fix_;
+}
+
+bool UWBTrilateration::precompute_(Solver &solver, uint8_t mask)
+{
+    solver.mask     = mask;
+    solver.num_rows = 0;
+    solver.ok       = false;
+
+    // The last anchor in the subset is the reference
+    for (uint8_t i = 0; i < num_anchors_; i++)
+    {
+        if (mask & (1 << i))
+        {
+            solver.ref = i;
+        }
+    }
+
+    float xr = anchor_x_[solver.ref];
+    float yr = anchor_y_[solver.ref];
+
+    // A (num_rows x 2) rows: [2 (xi - xr), 2 (yi - yr)]
+    float a[UWB_MAX_ANCHORS - 1][2];
+
+    for (uint8_t i = 0; i < num_anchors_; i++)
+    {
+        if (!(mask & (1 << i)) || i == solver.ref)
+        {
+            continue;
+        }
+
+        uint8_t row = solver.num_rows++;
+        solver.rows[row] = i;
+        a[row][0] = 2.0f * (anchor_x_[i] - xr);
+        a[row][1] = 2.0f * (anchor_y_[i] - yr);
+        solver.k[row] = (anchor_x_[i] * anchor_x_[i] + anchor_y_[i] * anchor_y_[i]) - (xr * xr + yr * yr);
+    }
+
+    // A^T A is 2x2, invert it directly
+    float ata00 = 0.0f, ata01 = 0.0f, ata11 = 0.0f;
+
+    for (uint8_t row = 0; row < solver.num_rows; row++)
+    {
+        ata00 += a[row][0] * a[row][0];
+        ata01 += a[row][0] * a[row][1];
+        ata11 += a[row][1] * a[row][1];
+    }
+
+    float det = ata00 * ata11 - ata01 * ata01;
+
+    // Reject collinear (or nearly collinear) anchor layouts
+    if (fabsf(det) < 1e-6f * (ata00 * ata11 + 1e-12f))
+    {
+        return false;
+    }
+
+    float inv00 =  ata11 / det;
+    float inv01 = -ata01 / det;
+    float inv11 =  ata00 / det;
+
+    for (uint8_t row = 0; row < solver.num_rows; row++)
+    {
+        solver.pinv[0][row] = inv00 * a[row][0] + inv01 * a[row][1];
+        solver.pinv[1][row] = inv01 * a[row][0] + inv11 * a[row][1];
+    }
+
+    solver.ok = true;
+    return true;
+}
+
+bool UWBTrilateration::solve_(const Solver &solver, const float ranges[], float &x, float &y, float &residual)
+{
+    float rr2 = ranges[solver.ref] * ranges[solver.ref];
+
+    x = 0.0f;
+    y = 0.0f;
+
+    for (uint8_t row = 0; row < solver.num_rows; row++)
+    {
+        float ri = ranges[solver.rows[row]];
+        float b = solver.k[row] - ri * ri + rr2;
+        x += solver.pinv[0][row] * b;
+        y += solver.pinv[1][row] * b;
+    }
+
+    // RMS difference between the measured ranges and the ranges implied by the solution
+    float sum_sq = 0.0f;
+    uint8_t n = 0;
+
+    for (uint8_t i = 0; i < num_anchors_; i++)
+    {
+        if (!(solver.mask & (1 << i)))
+        {
+            continue;
+        }
+
+        float dx = x - anchor_x_[i];
+        float dy = y - anchor_y_[i];
+        float e = sqrtf(dx * dx + dy * dy) - ranges[i];
+        sum_sq += e * e;
+        n++;
+    }
+
+    residual = sqrtf(sum_sq / n);
+    return isfinite(x) && isfinite(y);
+}
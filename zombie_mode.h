@@ -1,7 +1,10 @@
 
-//#include <IRremote.h>
-
 #include "gps_utils.h"
+#include "geofence.h"
+#include "uwb_trilateration.h"
+#include "ir_beacon_decoder.h"
+#include "dock_detector.h"
+#include "blackbox_recorder.h"
 
 /*
 "Zombie Mode" is intended for Homing the robot to its docking station for a critical battery recharge
@@ -9,6 +12,11 @@ Main computer gets turned OFF to conserve ~35W of power.
 Therefore: all localisation and navigation is performed ONBOARD OF THE ESP32
 Assisted teleop gets turned ON when transitioning to this state.
 Refer to README.md for more info about ZOMBIE_MODE
+
+The DW1000 RADAR stage needs the anchors' ranges fed to update_uwb_ranges(). There is no ranging driver on the robot
+yet, so it is built with UWB_PRESENT 0: GPS hands over straight to the IR beacons once it is within
+GPS_DIST_THRESHOLD_MIN of the dock and they have been seen, and losing them goes back to GPS. The POZYX state is never
+entered. With UWB_PRESENT 1 (tools/sim, or once the driver is in) it goes GPS, POZYX, then IR.
 */
 
 /**************** SUB-STATES *********************/
@@ -18,8 +26,30 @@ Refer to README.md for more info about ZOMBIE_MODE
 #define ZOMBIE_MODE_IR_STATE       3
 #define ZOMBIE_MODE_HOMED_STATE    4
 
+// Super-state, the parent of the GPS, POZYX and IR sub-states
+#define ZOMBIE_MODE_ACTIVE_STATE   5
+
+#define ZOMBIE_NUM_STATES          6
+#define ZOMBIE_NO_PARENT           0xFF
+
+/***************** SENSOR TOPICS *****************/
+// Each state declares which of these it depends on.
+// Its guards and velocity law are only evaluated when one of them has published a new sample
+#define ZOMBIE_TOPIC_GPS     (1 << 0) // new GPS fix parsed
+#define ZOMBIE_TOPIC_UWB     (1 << 1) // new DW1000 fix (or rejected ranges)
+#define ZOMBIE_TOPIC_IR      (1 << 2) // new IR beacon frame, or the IR estimate became invalid
+#define ZOMBIE_TOPIC_CONTACT (1 << 3) // dock charging contacts changed
+#define ZOMBIE_TOPIC_TIMER   (1 << 4) // slow periodic tick, for sensor timeouts
+#define ZOMBIE_TOPIC_ENTRY   (1 << 5) // the current state has just been entered (every state depends on this)
+#define ZOMBIE_TOPIC_LIDAR   (1 << 6) // a LIDAR revolution has been matched against the dock (dock_detector.h)
+
 /******************* CONFIG **********************/
 
+// FIXME: set to 1 once a DW1000 ranging driver calls update_uwb_ranges()
+#ifndef UWB_PRESENT
+#define UWB_PRESENT 0
+#endif
+
 // How fast do we want our Zombie to go?
 #define ZOMBIE_MAX_SPEED 0.4 // m/s
 #define ZOMBIE_DOCKING_SPEED 0.25 // m/s as it enters the dock
@@ -27,12 +57,53 @@ Refer to README.md for more info about ZOMBIE_MODE
 // how close do we have to get to a GPS waypoint to consider it hit?
 #define GPS_GET_WITHIN    5 //m
 
+// Stop in the GPS state if we haven't had a fix for this long (the receiver sends one a second)
+#define GPS_FIX_TIMEOUT 2500 // ms
+
 // How many GPS wayoints do we have?
 #define GPS_NUM_WAYPOINTS 4
 
-// TODO: FIX TO USE CONSISTENT UNITS!
-#define GPS_DIST_THRESHOLD_MIN 10000 //mm
-#define INFRARED_DIST_THRESHOLD_MAX 3000 //mm
+// FIXME: Location of the docking station
+#define DOCK_LATITUDE  -32.656632
+#define DOCK_LONGITUDE 151.337703
+
+// FIXME: Geofence zones (geofence_zones[] below): how many, and their vertices in all
+#define GEOFENCE_NUM_ZONES    2
+#define GEOFENCE_NUM_VERTICES 10
+
+// Approaching a geofence boundary, the closing speed is limited to this much per m of clearance beyond the
+// standoff, so the robot stops at the standoff (or slides along the boundary, when it knows its heading)
+#define GEOFENCE_STANDOFF      1.0 // m
+#define GEOFENCE_APPROACH_GAIN 0.3 // (m/s) per m
+#define GEOFENCE_TURN_GAIN     0.6 // (rad/s) per rad, turning along (or off) the boundary
+
+// Only fence with a fix this recent, and only use the GPS course over ground (as the heading) if it was this
+// recent and measured at least this fast (it is meaningless when stopped)
+#define GEOFENCE_FIX_TIMEOUT      2000 // ms
+#define GEOFENCE_COURSE_TIMEOUT   2000 // ms
+#define GEOFENCE_MIN_COURSE_SPEED 0.2  // m/s
+
+// Without such a fix (or any zones to check it against) the robot could be anywhere, so it only crawls
+#define GEOFENCE_BLIND_SPEED 0.1 // m/s
+
+// Distance to the dock at which we hand over between localisation methods
+#define GPS_DIST_THRESHOLD_MIN 10.0 //m
+#define INFRARED_DIST_THRESHOLD_MAX 3.0 //m
+
+// Hysteresis bands either side of the thresholds, to prevent unwanted rapid switching
+#define GPS_DIST_HYSTERESIS      2.0 //m (GPS is noisy)
+#define INFRARED_DIST_HYSTERESIS 0.5 //m
+
+// Give up on the IR beacons (and go back to the DW1000 RADAR) if they haven't been seen for this long
+#define ZOMBIE_IR_LOST_TIMEOUT 1000 //ms
+
+// Final approach on the LIDAR dock pose: aim this far out along the dock axis (from the contacts), so we come
+// in square, and only use a pose this recent (a few LIDAR revolutions)
+#define ZOMBIE_DOCK_LOOKAHEAD 0.5     //m
+#define ZOMBIE_DOCK_POSE_TIMEOUT 600  //ms
+
+// Period of ZOMBIE_TOPIC_TIMER
+#define ZOMBIE_TIMER_INTERVAL 100 //ms
 
 // what's the name of the hardware serial port for the GPS?
 #define GPSSerial Serial2
@@ -41,13 +112,17 @@ Refer to README.md for more info about ZOMBIE_MODE
 #define RADARSerial Serial1
 
 // FIXME: Pins for the IR reciever interupts
-#define IR_PIN_FRONT_LEFT   3
-#define IR_PIN_FRONT_CENTRE 4
-#define IR_PIN_FRONT_RIGHT  5
-#define IR_PIN_REAR_CENTRE  6
-
-// HOMING_SENSOR_PIN gets connected to the charging contacts (via an optoisolator?)
-#define HOMING_SENSOR_PIN   7 
+// Each takes an interrupt on every edge, so they can't share a pin with anything (checked in alexbot_firmware.ino)
+// 36 is input only, with no pull-up, the TSOP382s have their own. 17 is the TX pad, the GPS is receive only
+#define IR_PIN_FRONT_LEFT   25
+#define IR_PIN_FRONT_CENTRE 26
+#define IR_PIN_FRONT_RIGHT  36
+#define IR_PIN_REAR_CENTRE  17
+
+// HOMING_SENSOR_PIN gets connected to the charging contacts via an optoisolator, which pulls it LOW when docked.
+// 12 is a strapping pin that must be low at reset: its pull-up is only turned on after boot, and the optoisolator
+// can only pull it low
+#define HOMING_SENSOR_PIN   12
 
 // Get these from the manufacturer
 // DW-1000 ToF Tags
@@ -59,23 +134,26 @@ Refer to README.md for more info about ZOMBIE_MODE
 
 #define RADAR_TAG_SEPARATION 2500 // mm
 
-#define POSITIONING_ALGORITHM POZYX_POS_ALG_UWB_ONLY // try POZYX_POS_ALG_TRACKING for fast moving objects.
-#define POZYX_DIMENSIONS      POZYX_2D
-#define POZYX_HEIGHT          500 // HEIGHT not used in POZYX_2D
-
 #define POZYX_NUM_ANCHORS 3
 
+// Drop back out of the RADAR state if we haven't had a good fix for this long
+#define UWB_FIX_TIMEOUT 500 // ms
+
 /**************************************************/
 
 // Other Defines
 #define RADAR_DIST_THRESHOLD_MAX GPS_DIST_THRESHOLD_MIN
 #define RADAR_DIST_THRESHOLD_MIN INFRARED_DIST_THRESHOLD_MAX
 
-// Initialisation of IR recievers
-// IRrecv irrecv_fl(IR_PIN_FRONT_LEFT);
-// IRrecv irrecv_fc(IR_PIN_FRONT_CENTRE);
-// IRrecv irrecv_fr(IR_PIN_FRONT_RIGHT);
-// IRrecv irrecv_rc(IR_PIN_REAR_CENTRE);
+// What the GPS state hands over on, the RADAR or (without the anchors) the IR beacons
+#if UWB_PRESENT
+#define ZOMBIE_TOPIC_GPS_HANDOVER ZOMBIE_TOPIC_UWB
+#else
+#define ZOMBIE_TOPIC_GPS_HANDOVER ZOMBIE_TOPIC_IR
+#endif
+
+// IR recievers, ordered as IR_RECEIVER_x in ir_beacon_decoder.h
+const uint8_t ir_pins[IR_NUM_RECEIVERS] = {IR_PIN_FRONT_LEFT, IR_PIN_FRONT_CENTRE, IR_PIN_FRONT_RIGHT, IR_PIN_REAR_CENTRE};
 
 // uint16_t tags[1] = {0x0001};
 // Docking station located at (0,0,0)
@@ -90,71 +168,235 @@ double wp_list[GPS_NUM_WAYPOINTS][2] = {
     {-32.656815, 151.338882},
     {-32.656632, 151.337703}};
 
-// void print_pozyx_coordinates(coordinates_t coor)
-// {
-//     Serial.print(", x(mm): ");
-//     Serial.print(coor.x);
-//     Serial.print(", y(mm): ");
-//     Serial.print(coor.y);
-//     Serial.print(", z(mm): ");
-//     Serial.println(coor.z);
-// }
-
-// function to manually set the Pozyx anchor coordinates
-// void setAnchorsManual()
-// {
-//     for (int i = 0; i < POZYX_NUM_ANCHORS; i++)
-//     {
-//         device_coordinates_t anchor;
-//         anchor.network_id = anchors[i];
-//         anchor.flag = 0x1;
-//         anchor.pos.x = anchors_x[i];
-//         anchor.pos.y = anchors_y[i];
-//         anchor.pos.z = 0;
-//         Pozyx.addDevice(anchor, NULL);
-//     }
-//     if (POZYX_NUM_ANCHORS > 4)
-//     {
-//         Pozyx.setSelectionOfAnchors(POZYX_ANCHOR_SEL_AUTO, POZYX_NUM_ANCHORS, NULL);
-//     }
-// }
+// FIXME: survey the real ones. Geofence zones, vertices in order round each (lat,lon pairs)
+const double geofence_vertices[GEOFENCE_NUM_VERTICES][2] = {
+    // Yard, around the dock and the waypoints
+    {-32.657172, 151.337169},
+    {-32.657172, 151.339145},
+    {-32.656227, 151.339145},
+    {-32.656227, 151.337169},
+    // Flowerbed, south of the way back from the last waypoint
+    {-32.656884, 151.338184},
+    {-32.656857, 151.338258},
+    {-32.656884, 151.338344},
+    {-32.656929, 151.338344},
+    {-32.656956, 151.338258},
+    {-32.656929, 151.338184}};
+
+const GeofenceZone geofence_zones[GEOFENCE_NUM_ZONES] = {
+    // name        type               first  vertices
+    {"Yard",      GEOFENCE_KEEP_IN,  0,     4},
+    {"Flowerbed", GEOFENCE_KEEP_OUT, 4,     6},
+};
 
 class ZombieController
 {
     public:
         ZombieController(Adafruit_GPS *gps);
         bool set_target(double target_lat, double target_lon, uint16_t anchors[]);
-        Velocity run();
+        void poll();
+        bool run(Velocity &command);
         void stop();
         bool set_current_state(uint8_t new_state_id);
+        uint8_t get_current_state();
         void get_gps_update();
         bool set_next_waypoint();
         double compute_docking_station_angle_IR();
-        // coordinates_t get_pozyx_position();
+        IRDockEstimate get_ir_estimate();
+        void update_uwb_ranges(const uint32_t ranges[]);
+        bool uwb_fix_ok();
+        bool gps_fix_ok();
+        void print_stats();
+        void set_max_speed(double max_speed);
 
     private:
-        uint8_t current_state_id_;
+        // One row per state, indexed by state ID
+        struct StateInfo
+        {
+            const char *name;
+            uint8_t parent;
+            uint8_t topics;                  // sensor topics this state depends on (in addition to its parents)
+            Velocity (ZombieController::*law)();
+        };
+
+        // Evaluated in order, the first transition whose guard passes is taken.
+        // 'from' may be a super-state, in which case it applies to all of its children
+        struct Transition
+        {
+            uint8_t from;
+            uint8_t to;
+            uint8_t topics;                  // only evaluate the guard when one of these has new data
+            bool (ZombieController::*guard)();
+        };
+
+        static const StateInfo states_[ZOMBIE_NUM_STATES];
+        static const Transition transitions_[];
+
+        bool in_state_(uint8_t state_id);
+        uint8_t state_topics_(uint8_t state_id);
+        void publish_(uint8_t topics);
+
+        // Guards
+        bool gps_near_dock_();
+        bool uwb_far_or_lost_();
+        bool uwb_near_dock_();
+        bool ir_lost_or_uwb_far_();
+        bool docked_();
+
+        // Velocity laws
+        Velocity stop_velocity_();
+        Velocity gps_velocity_();
+        Velocity uwb_velocity_();
+        Velocity ir_velocity_();
+
+        Velocity apply_geofence_(Velocity vel);
 
-        //Pozyx Related
-        // bool pozyx_ok_;
-        // void init_pozyx_();
+        uint8_t current_state_id_;
+        Velocity vel_;
+        double max_speed_;
+
+        // New data published since the last evaluation
+        volatile uint8_t pending_topics_;
+        unsigned long last_timer_;
+
+        // Instrumentation
+        uint16_t transition_counts_[ZOMBIE_NUM_STATES][ZOMBIE_NUM_STATES];
+        unsigned long time_in_state_[ZOMBIE_NUM_STATES]; // ms
+        unsigned long state_entered_;
+        unsigned long evaluations_;
+        unsigned long skipped_evaluations_;
+
+        // DW1000 RADAR Related
+        UWBTrilateration uwb_;
+        UWBFix uwb_fix_;
+        double uwb_dist_to_dock_;
+
+        // IR Beacon Related
+        IRBeaconDecoder ir_decoder_;
+        IRDockEstimate ir_estimate_;
+        uint32_t ir_frames_seen_;
+        unsigned long ir_last_valid_;
+
+        // LIDAR dock detector Related
+        DockPose dock_pose_;
+        uint32_t dock_versions_seen_;
+
+        // Homing contacts
+        bool docked_contact_;
 
         // GPS Related
         Adafruit_GPS *gps_;
         GPSCoords cur_wp_;
+        GPSCoords dock_;
         uint8_t cur_wp_id_;
         double dist_to_wp_;
         double heading_to_wp_;
+        double dist_to_dock_;
+        bool gps_fix_seen_;
+        unsigned long gps_fix_stamp_;
+
+        // Geofence Related, checked at each GPS fix
+        Geofence geofence_;
+        GeofenceStatus fence_status_;
+        unsigned long fence_stamp_;
+        float fence_heading_;             // rad, anticlockwise from east, from the GPS course
+        unsigned long fence_heading_stamp_;
+        uint32_t fence_limited_;          // control cycles the geofence changed the velocity
+};
+
+// The resting states tick on the timer, so a docked robot keeps publishing a stop and stays in ZOMBIE_STATE rather
+// than the watchdog tripping it into HALT_STATE
+const ZombieController::StateInfo ZombieController::states_[ZOMBIE_NUM_STATES] = {
+    // name       parent                    topics                                                  law
+    {"DISABLED", ZOMBIE_NO_PARENT,         ZOMBIE_TOPIC_TIMER,                                     &ZombieController::stop_velocity_},
+    {"GPS",      ZOMBIE_MODE_ACTIVE_STATE, ZOMBIE_TOPIC_GPS | ZOMBIE_TOPIC_GPS_HANDOVER | ZOMBIE_TOPIC_TIMER, &ZombieController::gps_velocity_},
+    {"POZYX",    ZOMBIE_MODE_ACTIVE_STATE, ZOMBIE_TOPIC_UWB | ZOMBIE_TOPIC_IR | ZOMBIE_TOPIC_TIMER, &ZombieController::uwb_velocity_},
+    {"IR",       ZOMBIE_MODE_ACTIVE_STATE, ZOMBIE_TOPIC_IR | ZOMBIE_TOPIC_LIDAR | ZOMBIE_TOPIC_UWB | ZOMBIE_TOPIC_TIMER, &ZombieController::ir_velocity_},
+    {"HOMED",    ZOMBIE_NO_PARENT,         ZOMBIE_TOPIC_TIMER,                                     &ZombieController::stop_velocity_},
+    {"ACTIVE",   ZOMBIE_NO_PARENT,         ZOMBIE_TOPIC_CONTACT,                                   &ZombieController::stop_velocity_},
+};
+
+const ZombieController::Transition ZombieController::transitions_[] = {
+    // from                       to                          topics                                   guard
+    {ZOMBIE_MODE_ACTIVE_STATE, ZOMBIE_MODE_HOMED_STATE, ZOMBIE_TOPIC_CONTACT,                       &ZombieController::docked_},
+#if UWB_PRESENT
+    {ZOMBIE_MODE_GPS_STATE,    ZOMBIE_MODE_POZYX_STATE, ZOMBIE_TOPIC_GPS | ZOMBIE_TOPIC_UWB,        &ZombieController::gps_near_dock_},
+    {ZOMBIE_MODE_POZYX_STATE,  ZOMBIE_MODE_GPS_STATE,   ZOMBIE_TOPIC_UWB | ZOMBIE_TOPIC_TIMER,      &ZombieController::uwb_far_or_lost_},
+    {ZOMBIE_MODE_POZYX_STATE,  ZOMBIE_MODE_IR_STATE,    ZOMBIE_TOPIC_UWB | ZOMBIE_TOPIC_IR,         &ZombieController::uwb_near_dock_},
+    {ZOMBIE_MODE_IR_STATE,     ZOMBIE_MODE_POZYX_STATE, ZOMBIE_TOPIC_IR | ZOMBIE_TOPIC_UWB | ZOMBIE_TOPIC_TIMER, &ZombieController::ir_lost_or_uwb_far_},
+#else
+    {ZOMBIE_MODE_GPS_STATE,    ZOMBIE_MODE_IR_STATE,    ZOMBIE_TOPIC_GPS | ZOMBIE_TOPIC_IR,         &ZombieController::gps_near_dock_},
+    {ZOMBIE_MODE_IR_STATE,     ZOMBIE_MODE_GPS_STATE,   ZOMBIE_TOPIC_IR | ZOMBIE_TOPIC_TIMER,       &ZombieController::ir_lost_or_uwb_far_},
+#endif
 };
 
+#define ZOMBIE_NUM_TRANSITIONS (sizeof(ZombieController::transitions_) / sizeof(ZombieController::Transition))
+
 ZombieController::ZombieController(Adafruit_GPS *gps)
 {
-    set_current_state(ZOMBIE_MODE_DISABLED_STATE);
+    for (uint8_t i = 0; i < ZOMBIE_NUM_STATES; i++)
+    {
+        time_in_state_[i] = 0;
+
+        for (uint8_t j = 0; j < ZOMBIE_NUM_STATES; j++)
+        {
+            transition_counts_[i][j] = 0;
+        }
+    }
+
+    this->current_state_id_    = ZOMBIE_MODE_DISABLED_STATE;
+    this->state_entered_       = millis();
+    this->evaluations_         = 0;
+    this->skipped_evaluations_ = 0;
+    this->pending_topics_      = 0;
+    this->last_timer_          = 0;
+    this->vel_.linear          = 0.0;
+    this->vel_.angular         = 0.0;
+    this->max_speed_           = ZOMBIE_MAX_SPEED;
+
+    // Anchor geometry is fixed, so the trilateration matrices only need to be computed once
+    if (!uwb_.init(anchors_x, anchors_y, POZYX_NUM_ANCHORS))
+    {
+        Serial.println(F("ERROR: DW1000 anchor geometry is degenerate"));
+    }
+    uwb_fix_ = uwb_.get_last_fix();
+    uwb_dist_to_dock_ = 0.0;
+
+    ir_beacon_attach_interrupts(&ir_decoder_, ir_pins);
+    ir_estimate_ = ir_decoder_.get_estimate();
+    ir_frames_seen_ = 0;
+    ir_last_valid_ = 0;
+
+    dock_pose_ = dock_detector.get_pose();
+    dock_pose_.valid = false;
+    dock_versions_seen_ = dock_detector.get_version();
 
-    // Call separate init function from constructor (fixes errors)
-    // this->init_pozyx_();
     this->gps_ = gps;
-    pinMode(HOMING_SENSOR_PIN,INPUT);
+    this->dist_to_wp_    = 0.0;
+    this->heading_to_wp_ = 0.0;
+    this->dist_to_dock_  = 0.0;
+    this->gps_fix_seen_  = false;
+    this->gps_fix_stamp_ = 0;
+
+    // Zones are fixed, so they are projected and indexed once
+    if (!geofence_.build(geofence_zones, GEOFENCE_NUM_ZONES, geofence_vertices, GEOFENCE_NUM_VERTICES, DOCK_LATITUDE, DOCK_LONGITUDE))
+    {
+        Serial.println(F("ERROR: geofence zones don't fit, they won't be checked"));
+    }
+    else if (geofence_.check(0.0, 0.0).violation)
+    {
+        Serial.println(F("ERROR: the dock is outside the geofence"));
+    }
+
+    fence_status_.valid = false;
+    fence_status_.zone = GEOFENCE_NO_ZONE;
+    fence_stamp_ = 0;
+    fence_heading_ = 0.0;
+    fence_heading_stamp_ = 0;
+    fence_limited_ = 0;
+
+    pinMode(HOMING_SENSOR_PIN, INPUT_PULLUP);
+    docked_contact_ = !digitalRead(HOMING_SENSOR_PIN);
 }
 
 /**
@@ -176,6 +418,9 @@ bool ZombieController::set_target(double target_lat, double target_lon, uint16_t
     cur_wp_.lat = wp_list[cur_wp_id_][0];
     cur_wp_.lon = wp_list[cur_wp_id_][1];
 
+    dock_.lat = target_lat;
+    dock_.lon = target_lon;
+
     set_current_state(ZOMBIE_MODE_GPS_STATE);
     Serial.println("Travelling to GPS Waypoint 1");   
 
@@ -183,161 +428,489 @@ bool ZombieController::set_target(double target_lat, double target_lon, uint16_t
     return true;
 }
 
+/**
+ * @brief Checks the sensors for new samples and publishes them to the state machine
+ * Call this every control cycle in ZOMBIE_STATE, before run(). It is cheap when nothing has changed
+ */
+void ZombieController::poll()
+{
+    // GPS: feed any waiting characters to the NMEA parser
+    while (gps_->available())
+    {
+        gps_->read();
+
+        if (gps_->newNMEAreceived() && gps_->parse(gps_->lastNMEA()) && gps_->fix)
+        {
+            blackbox.record_gps(gps_->latitudeDegrees, gps_->longitudeDegrees, gps_->fixquality, gps_->satellites, gps_->HDOP);
+            get_gps_update();
+            publish_(ZOMBIE_TOPIC_GPS);
+        }
+    }
+
+    // IR: only publish when a new frame was decoded, or the estimate has just become invalid
+    bool ir_was_valid = ir_estimate_.valid;
+    compute_docking_station_angle_IR();
+
+    if (ir_decoder_.get_frames_decoded() != ir_frames_seen_ || ir_estimate_.valid != ir_was_valid)
+    {
+        ir_frames_seen_ = ir_decoder_.get_frames_decoded();
+        publish_(ZOMBIE_TOPIC_IR);
+
+        // The LIDAR dock detector only searches around the IR bearing
+        dock_detector.set_search_sector(ir_estimate_.bearing, ir_estimate_.valid, millis());
+    }
+
+    if (ir_estimate_.valid)
+    {
+        ir_last_valid_ = millis();
+    }
+
+    // LIDAR: each revolution matched, whether or not the dock was found in it
+    if (dock_detector.get_version() != dock_versions_seen_)
+    {
+        dock_versions_seen_ = dock_detector.get_version();
+        dock_pose_ = dock_detector.get_pose();
+        publish_(ZOMBIE_TOPIC_LIDAR);
+    }
+
+    // Homing contacts
+    bool contact = !digitalRead(HOMING_SENSOR_PIN);
+    if (contact != docked_contact_)
+    {
+        docked_contact_ = contact;
+        publish_(ZOMBIE_TOPIC_CONTACT);
+    }
+
+    if ((millis() - last_timer_) >= ZOMBIE_TIMER_INTERVAL)
+    {
+        last_timer_ = millis();
+        publish_(ZOMBIE_TOPIC_TIMER);
+    }
+}
+
 /**
  * @brief When in ZOMBIE_MODE: this function gets called from the main alexbot class in the loop
  * i.e. from "process_command()" 
  * 
  * This generates a Velocity vector which should guide the robot to the target (docking station) 
+ * The transition guards and velocity law of the current state are only evaluated when a sensor topic that the state
+ * depends on has published (see poll()). Only an evaluation produces a command: it is what keeps Zombie mode's
+ * command source (and with it the watchdog) alive, so a state whose sensors have gone quiet is left to time out.
+ * The command is limited by the geofence on the way out (see apply_geofence_()).
  * 
- * @return Velocity to be sent to the SEPF Assisted Teleop Controller
+ * @param command set to the Velocity to be sent to the SEPF Assisted Teleop Controller, if there was an evaluation
+ * @return true if the current state was evaluated, false if command was left untouched
  */
+bool ZombieController::run(Velocity &command)
+{
+    uint8_t topics = pending_topics_;
+
+    if (!(topics & state_topics_(current_state_id_)))
+    {
+        skipped_evaluations_++;
+        return false;
+    }
 
-// TODO: Add hysteresis to state changes to prevent unwanted rapid switching
-Velocity ZombieController::run()
+    pending_topics_ &= ~topics;
+    evaluations_++;
+
+    for (uint8_t i = 0; i < ZOMBIE_NUM_TRANSITIONS; i++)
+    {
+        const Transition &t = transitions_[i];
+
+        if ((t.topics & topics) && in_state_(t.from) && (this->*t.guard)())
+        {
+            set_current_state(t.to);
+            break;
+        }
+    }
+
+    vel_ = (this->*states_[current_state_id_].law)();
+    command = apply_geofence_(vel_);
+    return true;
+}
+
+
+void ZombieController::stop()
 {
-    // // note: function response is in mm!!
-    // coordinates_t robot_location = get_pozyx_position();
-    
-    // // Converted to metres
-    // double pozyx_dist_to_dock = sqrt(pow(double(robot_location.x), 2) + pow(double(robot_location.y), 2)) / 1000.0;
-    
-    get_gps_update();
+    set_current_state(ZOMBIE_MODE_DISABLED_STATE);
+}
 
-    Velocity vel;
+bool ZombieController::set_current_state(uint8_t new_state_id)
+{
+    if (new_state_id >= ZOMBIE_NUM_STATES || new_state_id == ZOMBIE_MODE_ACTIVE_STATE)
+    {
+        return false;
+    }
+
+    Serial.print("Changing ZombieController state from ");
+    Serial.print(states_[current_state_id_].name);
+    Serial.print(" to ");
+    Serial.println(states_[new_state_id].name);
+
+    unsigned long now = millis();
+    time_in_state_[current_state_id_] += now - state_entered_;
+    transition_counts_[current_state_id_][new_state_id]++;
+    state_entered_ = now;
 
-    switch (current_state_id_)
+    current_state_id_ = new_state_id;
+
+    // Evaluate the new state straight away, with whatever data we already have
+    publish_(ZOMBIE_TOPIC_ENTRY);
+    return true;
+}
+
+uint8_t ZombieController::get_current_state()
+{
+    return current_state_id_;
+}
+
+/**
+ * @brief Prints transition counts and time spent in each state
+ */
+void ZombieController::print_stats()
+{
+    unsigned long now = millis();
+
+    Serial.print("Zombie evaluations: ");
+    Serial.print(evaluations_);
+    Serial.print(", skipped (no new data): ");
+    Serial.println(skipped_evaluations_);
+
+    for (uint8_t i = 0; i < ZOMBIE_NUM_STATES; i++)
     {
-        case ZOMBIE_MODE_DISABLED_STATE:
+        if (i == ZOMBIE_MODE_ACTIVE_STATE)
         {
-            vel.linear = 0.0;
-            vel.angular = 0.0;
+            continue;
         }
-        case ZOMBIE_MODE_GPS_STATE:
+
+        unsigned long time_in_state = time_in_state_[i];
+        if (i == current_state_id_)
         {
+            time_in_state += now - state_entered_;
+        }
 
-            // Automatically attempt to change from GPS to DW1000 RADAR state when we get within 10m of the target
-            if (dist_to_wp_ <= GPS_DIST_THRESHOLD_MIN)
+        Serial.print(states_[i].name);
+        Serial.print(": ");
+        Serial.print(time_in_state);
+        Serial.print("ms, transitions to");
+
+        for (uint8_t j = 0; j < ZOMBIE_NUM_STATES; j++)
+        {
+            if (transition_counts_[i][j] > 0)
             {
-                // if (pozyx_ok_)
-                // {
-                //     set_current_state(ZOMBIE_MODE_POZYX_STATE);
-                // }
+                Serial.print(" ");
+                Serial.print(states_[j].name);
+                Serial.print("=");
+                Serial.print(transition_counts_[i][j]);
             }
+        }
 
-            // Use Proportional Controller? Add gyro + encoders?
-            vel.linear = constrain(1.0 * dist_to_wp_, -ZOMBIE_MAX_SPEED, ZOMBIE_MAX_SPEED);
+        Serial.println("");
+    }
 
-            // FIXME: compute delta_theta between angle_to_target and current heading
-            double current_heading = 0.0;
-            double gps_delta_theta = heading_to_wp_ + current_heading;
+    Serial.print("Geofence: nearest=");
+    Serial.print(geofence_.get_zone_name(fence_status_.zone));
+    Serial.print(", clearance=");
+    Serial.print(fence_status_.clearance);
+    Serial.print(" m, violation=");
+    Serial.print(fence_status_.violation);
+    Serial.print(", cycles limited=");
+    Serial.println(fence_limited_);
+    geofence_.print_stats();
+}
 
-            vel.angular = 0.3 * gps_delta_theta;
+/**
+ * @brief Speed limit for the GPS and RADAR sub-states (m/s)
+ */
+void ZombieController::set_max_speed(double max_speed)
+{
+    max_speed_ = max_speed;
+}
+
+bool ZombieController::in_state_(uint8_t state_id)
+{
+    for (uint8_t s = current_state_id_; s != ZOMBIE_NO_PARENT; s = states_[s].parent)
+    {
+        if (s == state_id)
+        {
+            return true;
         }
+    }
+
+    return false;
+}
+
+uint8_t ZombieController::state_topics_(uint8_t state_id)
+{
+    uint8_t topics = ZOMBIE_TOPIC_ENTRY;
+
+    for (uint8_t s = state_id; s != ZOMBIE_NO_PARENT; s = states_[s].parent)
+    {
+        topics |= states_[s].topics;
+    }
+
+    return topics;
+}
+
+void ZombieController::publish_(uint8_t topics)
+{
+    pending_topics_ |= topics;
+}
+
+/******************* GUARDS **********************/
+
+bool ZombieController::gps_near_dock_()
+{
+    // Automatically attempt to change from GPS to DW1000 RADAR state when we get within 10m of the target
+    // Without the anchors, straight to the IR state once the beacons have been seen
+    bool handover_ok = UWB_PRESENT ? uwb_fix_ok() : ir_estimate_.valid;
+    return (dist_to_dock_ <= GPS_DIST_THRESHOLD_MIN - GPS_DIST_HYSTERESIS / 2.0) && handover_ok;
+}
+
+bool ZombieController::uwb_far_or_lost_()
+{
+    // Fall back to GPS if the RADAR fixes have dried up, or we have wandered away from the dock
+    return !uwb_fix_ok() || (uwb_dist_to_dock_ > RADAR_DIST_THRESHOLD_MAX + GPS_DIST_HYSTERESIS / 2.0);
+}
+
+bool ZombieController::uwb_near_dock_()
+{
+    // Automatically attempt to change from DW1000 RADAR to IR state when we get within 3m of the target
+    return (uwb_dist_to_dock_ <= RADAR_DIST_THRESHOLD_MIN - INFRARED_DIST_HYSTERESIS / 2.0) && ir_estimate_.valid;
+}
+
+bool ZombieController::ir_lost_or_uwb_far_()
+{
+    // Without the anchors there is never a RADAR fix, so this is just the beacons being lost
+    bool ir_lost = (millis() - ir_last_valid_) > ZOMBIE_IR_LOST_TIMEOUT;
+    bool uwb_far = uwb_fix_ok() && (uwb_dist_to_dock_ > RADAR_DIST_THRESHOLD_MIN + INFRARED_DIST_HYSTERESIS / 2.0);
+    return ir_lost || uwb_far;
+}
+
+bool ZombieController::docked_()
+{
+    // If we have arrived at the docking station
+    return docked_contact_;
+}
+
+/***************** VELOCITY LAWS *****************/
+
+Velocity ZombieController::stop_velocity_()
+{
+    Velocity vel;
+    vel.linear = 0.0;
+    vel.angular = 0.0;
+    return vel;
+}
+
+Velocity ZombieController::gps_velocity_()
+{
+    // The distance and heading to the waypoint are from the last fix, don't keep driving on them once it is stale
+    if (!gps_fix_ok())
+    {
+        return stop_velocity_();
+    }
+
+    Velocity vel;
+
+    // Use Proportional Controller? Add gyro + encoders?
+    vel.linear = constrain(1.0 * dist_to_wp_, -max_speed_, max_speed_);
+
+    // FIXME: compute delta_theta between angle_to_target and current heading
+    double current_heading = 0.0;
+    double gps_delta_theta = heading_to_wp_ + current_heading;
+
+    vel.angular = 0.3 * gps_delta_theta;
+    return vel;
+}
+
+Velocity ZombieController::uwb_velocity_()
+{
+    Velocity vel;
+
+    // FIXME!!!!
+    double robot_current_heading = 0.0;
+    // Bearing from the robot to the docking station (at the origin)
+    double pozyx_theta = fast_atan2(-float(uwb_fix_.y), -float(uwb_fix_.x));
+    double pozyx_delta_theta = robot_current_heading + pozyx_theta;
+
+    // Use Proportional Controller? Add gyro + encoders?
+    vel.linear = constrain(1.0 * uwb_dist_to_dock_, -max_speed_, max_speed_);
+    vel.angular = 0.3 * pozyx_delta_theta; // rad/s
+    return vel;
+}
+
+Velocity ZombieController::ir_velocity_()
+{
+    Velocity vel;
+
+    // Once the LIDAR has found the dock, we know how far off its axis we are, so we can come in square
+    if (dock_pose_.valid && (millis() - dock_pose_.stamp) <= ZOMBIE_DOCK_POSE_TIMEOUT)
+    {
+        // Contacts in the robot frame, and the dock axis pointing out of the dock towards us
+        float sin_b, cos_b, sin_a, cos_a;
+        fast_sincos(dock_pose_.bearing, sin_b, cos_b);
+        fast_sincos(dock_pose_.orientation + FAST_PI, sin_a, cos_a);
+        float contacts_x = dock_pose_.range * cos_b;
+        float contacts_y = dock_pose_.range * sin_b;
+
+        // Aim at the point on the axis ZOMBIE_DOCK_LOOKAHEAD closer in than we are (the contacts, once that close)
+        float out_along_axis = -(contacts_x * cos_a + contacts_y * sin_a);
+        float aim = max(out_along_axis - float(ZOMBIE_DOCK_LOOKAHEAD), 0.0f);
+        float aim_bearing = fast_atan2(contacts_y + aim * sin_a, contacts_x + aim * cos_a);
+
+        // Slow down as we get closer, only moving forward when roughly pointing at the aim point
+        vel.linear = (fabs(aim_bearing) < (PI / 8.0)) ? constrain(0.5 * dock_pose_.range, 0.1, ZOMBIE_DOCKING_SPEED) : 0.0;
+        vel.angular = 0.6 * aim_bearing; // rad/s
+        return vel;
+    }
 
-        // case ZOMBIE_MODE_POZYX_STATE:
-        // {
-        //     // Automatically attempt to change from DW1000 RADAR to IR state when we get within 3m of the target
-        //     if (pozyx_dist_to_dock <= RADAR_DIST_THRESHOLD_MIN)
-        //     {
-        //         set_current_state(ZOMBIE_MODE_IR_STATE);
-        //     }
-
-        //     // FIXME!!!!
-        //     double robot_current_heading = 0.0;
-        //     double pozyx_theta = atan2(double(robot_location.y), double(robot_location.x));
-        //     double pozyx_delta_theta = robot_current_heading + pozyx_theta;
-
-        //     // Use Proportional Controller? Add gyro + encoders?
-        //     vel.linear = constrain(1.0 * pozyx_dist_to_dock, -ZOMBIE_MAX_SPEED, ZOMBIE_MAX_SPEED);
-        //     vel.angular = 0.3 * pozyx_delta_theta; // rad/s
-        // }
-
-        case ZOMBIE_MODE_IR_STATE:
+    // Otherwise on the IR bearing alone
+    // Use PID Controller? Add gyro + encoders?
+    // Use EKF?
+    double ir_delta_theta = ir_estimate_.bearing;
+
+    // Do not move forward until we are sufficiently aligned with the dock
+    if (ir_estimate_.valid && fabs(ir_delta_theta) < (PI / 8.0))
+    {
+        vel.linear = constrain(0.1, -ZOMBIE_DOCKING_SPEED, ZOMBIE_DOCKING_SPEED);
+    }
+    else
+    {
+        vel.linear = 0.0;
+    }
+
+    // Bearing is anticlockwise positive, so turn towards it
+    vel.angular = ir_estimate_.valid ? 0.3 * ir_delta_theta : 0.0; // rad/s
+    return vel;
+}
+
+/**
+ * @brief Stops the robot closing on a geofence boundary faster than its clearance allows
+ *
+ * With a heading, only the part of the velocity towards the boundary is limited, and the robot turns to slide
+ * along the boundary (or, on the wrong side of it, turns back across it, and may only move that way).
+ * Without one any direction might be towards it, so the speed is limited whichever way it goes.
+ * Without a recent fix it fails closed: the robot may be next to a boundary, so it is held to a crawl.
+ */
+Velocity ZombieController::apply_geofence_(Velocity vel)
+{
+    unsigned long now = millis();
+
+    // No recent fix to tell where the boundaries are
+    if (!fence_status_.valid || (now - fence_stamp_) > GEOFENCE_FIX_TIMEOUT)
+    {
+        if (fabs(vel.linear) > GEOFENCE_BLIND_SPEED)
         {
-            // Use PID Controller? Add gyro + encoders?
-            // Get Distance from LIDAR or Ultrasonics?
-            // Use EKF?
-            double ir_delta_theta = compute_docking_station_angle_IR();
+            vel.linear = constrain(vel.linear, -GEOFENCE_BLIND_SPEED, GEOFENCE_BLIND_SPEED);
+            fence_limited_++;
+        }
 
-            // Do not move forward until we are sufficiently aligned with the dock
-            if (ir_delta_theta < (PI / 8.0))
-            {
-                vel.linear = constrain(0.1, -ZOMBIE_DOCKING_SPEED, ZOMBIE_DOCKING_SPEED);
-            }
-            else
-            {
-                vel.linear = 0.0;
-            }
+        return vel;
+    }
+
+    // Clear of every boundary
+    if (fence_status_.zone == GEOFENCE_NO_ZONE)
+    {
+        return vel;
+    }
 
-            vel.angular = 0.3 * -ir_delta_theta; // rad/s
+    double closing_limit = fence_status_.violation ? 0.0 : max(GEOFENCE_APPROACH_GAIN * (fence_status_.clearance - GEOFENCE_STANDOFF), 0.0);
+    bool limited = false;
 
-            // If we have arrived at the docking station
-            if (digitalRead(HOMING_SENSOR_PIN))
+    if ((now - fence_heading_stamp_) <= GEOFENCE_COURSE_TIMEOUT)
+    {
+        float sin_h, cos_h;
+        fast_sincos(fence_heading_, sin_h, cos_h);
+        float direction = (vel.linear < 0.0) ? -1.0f : 1.0f;
+
+        // Of each m/s forwards, how much is towards the boundary
+        float towards = -(cos_h * fence_status_.normal_x + sin_h * fence_status_.normal_y);
+        if (vel.linear * towards > closing_limit)
+        {
+            vel.linear = closing_limit / towards;
+            limited = true;
+        }
+
+        if (limited || fence_status_.violation)
+        {
+            // Off the boundary, or along it whichever way is nearer the way we were going
+            float aim_x = fence_status_.normal_x, aim_y = fence_status_.normal_y;
+            if (!fence_status_.violation)
             {
-                set_current_state(ZOMBIE_MODE_HOMED_STATE);
+                aim_x = -fence_status_.normal_y;
+                aim_y = fence_status_.normal_x;
+                if ((cos_h * aim_x + sin_h * aim_y) * direction < 0.0f)
+                {
+                    aim_x = -aim_x;
+                    aim_y = -aim_y;
+                }
             }
+
+            // Turn the way we are driving (the back, when reversing) towards it
+            aim_x *= direction;
+            aim_y *= direction;
+            vel.angular = GEOFENCE_TURN_GAIN * fast_atan2(cos_h * aim_y - sin_h * aim_x, cos_h * aim_x + sin_h * aim_y);
+            limited = true;
         }
     }
+    else if (fabs(vel.linear) > closing_limit)
+    {
+        vel.linear = constrain(vel.linear, -closing_limit, closing_limit);
+        limited = true;
+    }
 
+    fence_limited_ += limited ? 1 : 0;
     return vel;
 }
 
+/**************** SENSOR UPDATES *****************/
 
-void ZombieController::stop()
+/**
+ * @brief Call this from the DW1000 ranging driver each time a full set of anchor ranges is available
+ * Positioning is done locally, so a fix is produced at the full ranging rate
+ *
+ * @param ranges in mm, ordered as anchors[] (0 marks a missing range)
+ */
+void ZombieController::update_uwb_ranges(const uint32_t ranges[])
 {
-    set_current_state(ZOMBIE_MODE_DISABLED_STATE);
+    UWBFix fix = uwb_.update(ranges, millis());
+
+    // Rejected fixes are still published, so the RADAR state can notice when it has lost its fix
+    publish_(ZOMBIE_TOPIC_UWB);
+
+    if (!fix.valid)
+    {
+        Serial.print("DW1000 fix rejected, residual (mm): ");
+        Serial.println(fix.residual);
+        return;
+    }
+
+    uwb_fix_ = fix;
+
+    // Converted to metres
+    uwb_dist_to_dock_ = fast_hypot(float(uwb_fix_.x), float(uwb_fix_.y)) / 1000.0;
 }
 
-bool ZombieController::set_current_state(uint8_t new_state_id)
+/**
+ * @brief Returns true if we have a recent RADAR fix that passed gating
+ */
+bool ZombieController::uwb_fix_ok()
 {
-    Serial.print("Changing ZombieController state from ");
-    Serial.print(current_state_id_);
-    Serial.print(" to ");
-    Serial.println(new_state_id);
-    set_current_state(new_state_id);
-    return true;
+    return uwb_fix_.valid && ((millis() - uwb_fix_.stamp) < UWB_FIX_TIMEOUT);
 }
 
-// void ZombieController::init_pozyx_()
-// {
-//     // init the Pozyx DW1000 ToF RADAR localisation here
-//     Serial.println("Initialising POZYX");
-//     pozyx_ok_ = false;
-
-//     if (Pozyx.begin() == POZYX_FAILURE)
-//     {
-//         Serial.println(F("ERROR: Unable to connect to POZYX shield"));
-//         Serial.println(F("Reset required"));
-//         delay(100);
-//     }
-
-//     // sets the anchor manually
-//     setAnchorsManual();
-//     // sets the positioning algorithm
-//     Pozyx.setPositionAlgorithm(POSITIONING_ALGORITHM, POZYX_DIMENSIONS, NULL);
-// }
-
-// coordinates_t ZombieController::get_pozyx_position()
-// {
-//     coordinates_t position;
-//     int status = Pozyx.doPositioning(&position, POZYX_DIMENSIONS, POZYX_HEIGHT, POSITIONING_ALGORITHM);
-
-//     if (status != POZYX_SUCCESS)
-//     {
-//         uint8_t error_code;
-//         Pozyx.getErrorCode(&error_code);
-//         Serial.print("Pozyx Positioning Error: ");
-//         Serial.println(error_code, HEX);
-//         pozyx_ok_ = false;
-//     }
-
-//     pozyx_ok_ = true;
-
-//     return position;
-// }
+/**
+ * @brief Returns true if we have had a GPS fix within GPS_FIX_TIMEOUT
+ */
+bool ZombieController::gps_fix_ok()
+{
+    return gps_fix_seen_ && ((millis() - gps_fix_stamp_) < GPS_FIX_TIMEOUT);
+}
 
 /**
- * @brief Call this in a loop when conducting waypoint navigation
+ * @brief Call this each time a new GPS fix has been parsed
  * Modified from: https://github.com/kolosy/ArduSailor/blob/master/firmware/pilot.ino 
  * 
  */
@@ -347,22 +920,39 @@ void ZombieController::get_gps_update()
 
     // get update from the GPS reciever here
     Serial.print("GPS: Lat: ");
-    Serial.print(gps_->lat);
+    Serial.print(gps_->latitudeDegrees);
     Serial.print(", Lon: ");
-    Serial.print(gps_->lon);
+    Serial.print(gps_->longitudeDegrees);
     Serial.print(", Cur Heading: ");
     Serial.print(gps_->angle);
     Serial.print(", Satellites: ");
     Serial.print(gps_->satellites);
 
     // check if we've hit the waypoint
-    dist_to_wp_ = compute_distance(RAD(gps_->lat), RAD(gps_->lon), RAD(cur_wp_.lat), RAD(cur_wp_.lon));
-    heading_to_wp_ = to_circle(compute_bearing(RAD(gps_->lat), RAD(gps_->lon), RAD(cur_wp_.lat), RAD(cur_wp_.lon)));
+    dist_to_wp_ = compute_distance(RAD(gps_->latitudeDegrees), RAD(gps_->longitudeDegrees), RAD(cur_wp_.lat), RAD(cur_wp_.lon));
+    heading_to_wp_ = to_circle(compute_bearing(RAD(gps_->latitudeDegrees), RAD(gps_->longitudeDegrees), RAD(cur_wp_.lat), RAD(cur_wp_.lon)));
+    dist_to_dock_ = compute_distance(RAD(gps_->latitudeDegrees), RAD(gps_->longitudeDegrees), RAD(dock_.lat), RAD(dock_.lon));
+    gps_fix_seen_ = true;
+    gps_fix_stamp_ = millis();
 
     Serial.print(", WP Dist: ");
     Serial.print(dist_to_wp_);
     Serial.print(", WP Bearing (RAD): ");
-    Serial.println(heading_to_wp_);
+    Serial.print(heading_to_wp_);
+    Serial.print(", Dock Dist: ");
+    Serial.println(dist_to_dock_);
+
+    float x, y;
+    geofence_.to_local(gps_->latitudeDegrees, gps_->longitudeDegrees, x, y);
+    fence_status_ = geofence_.check(x, y);
+    fence_stamp_ = millis();
+
+    // FIXME: the course over ground is only a heading while moving forwards, use the IMU once it is wired up
+    if (gps_->speed * 0.514444 >= GEOFENCE_MIN_COURSE_SPEED) // knots
+    {
+        fence_heading_ = FAST_HALF_PI - float(RAD(gps_->angle));
+        fence_heading_stamp_ = fence_stamp_;
+    }
 
     // TODO: add better logic here?
     // See discussion: https://groups.google.com/forum/?fromgroups#!folder/Other$20Groups/diyrovers/WMJBP8p03XI
@@ -401,16 +991,26 @@ bool ZombieController::set_next_waypoint()
     }
 
     // wp changed, need to recompute
-    dist_to_wp_ = compute_distance(RAD(gps_->lat), RAD(gps_->lon), RAD(cur_wp_.lat), RAD(cur_wp_.lon));
-    heading_to_wp_ = to_circle(compute_bearing(RAD(gps_->lat), RAD(gps_->lon), RAD(cur_wp_.lat), RAD(cur_wp_.lon)));
+    dist_to_wp_ = compute_distance(RAD(gps_->latitudeDegrees), RAD(gps_->longitudeDegrees), RAD(cur_wp_.lat), RAD(cur_wp_.lon));
+    heading_to_wp_ = to_circle(compute_bearing(RAD(gps_->latitudeDegrees), RAD(gps_->longitudeDegrees), RAD(cur_wp_.lat), RAD(cur_wp_.lon)));
 }
 
-// FIXME
+/**
+ * @brief Decodes the latest IR receiver edges (captured by interrupt, see ir_beacon_decoder.h)
+ *
+ * @return double, bearing to the docking station relative to the robot heading (rad, anticlockwise positive)
+ * Only meaningful when get_ir_estimate().valid is true
+ */
 double ZombieController::compute_docking_station_angle_IR()
 {
-    // use an interupt pin for each IR reciever (FRONT_LEFT, FRONT_CENTRE FRONT_RIGHT, REAR_CENTRE)
-    // pulsein is slow: https://arduino.stackexchange.com/questions/318/how-precise-is-the-timing-of-pulsein
-    // TIMING DIAGRAM: https://photos.app.goo.gl/DKFhUayQKq2sYl8x1
+    ir_estimate_ = ir_decoder_.process(micros());
+    return ir_estimate_.bearing; //rad
+}
 
-    return 0.0; //rad
+/**
+ * @brief Latest IR estimate, including which beacons/receivers were seen and the confidence
+ */
+IRDockEstimate ZombieController::get_ir_estimate()
+{
+    return ir_estimate_;
 }